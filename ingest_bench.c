@@ -0,0 +1,112 @@
+#include "ra_ingest.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// ingest_bench <socket> [count] [insert|signal|text] sends count records of "bench" with fields
+// Seq (integer), Value (real) and Name (string) and reports the rate at which they were written.
+
+#define BUFFER_SIZE 65536
+
+static char Buffer[BUFFER_SIZE];
+static size_t Length = 0;
+
+static void flush(int Fd) {
+	const char *P = Buffer;
+	while (Length) {
+		ssize_t Actual = write(Fd, P, Length);
+		if (Actual < 0) {
+			if (errno == EINTR) continue;
+			perror("write");
+			exit(1);
+		}
+		P += Actual;
+		Length -= Actual;
+	}
+}
+
+static char *put_name(char *P, const char *Name) {
+	int NameLength = strlen(Name);
+	*P++ = NameLength;
+	memcpy(P, Name, NameLength);
+	return P + NameLength;
+}
+
+static size_t binary_record(char *Record, int Op, long Seq) {
+	char *P = Record + 4;
+	*P++ = Op;
+	P = put_name(P, "bench");
+	*P++ = 0;
+	*P++ = 3;
+	P = put_name(P, "Seq");
+	*P++ = RA_INGEST_INTEGER;
+	int64_t Integer = Seq;
+	memcpy(P, &Integer, 8);
+	P += 8;
+	P = put_name(P, "Value");
+	*P++ = RA_INGEST_REAL;
+	double Real = Seq * 0.5;
+	memcpy(P, &Real, 8);
+	P += 8;
+	P = put_name(P, "Name");
+	*P++ = RA_INGEST_STRING;
+	uint32_t StringLength = 6;
+	memcpy(P, &StringLength, 4);
+	P += 4;
+	memcpy(P, "sample", 6);
+	P += 6;
+	uint32_t RecordLength = P - Record - 4;
+	memcpy(Record, &RecordLength, 4);
+	return P - Record;
+}
+
+int main(int Argc, const char **Argv) {
+	if (Argc < 2) {
+		fprintf(stderr, "usage: %s <socket> [count] [insert|signal|text]\n", Argv[0]);
+		return 1;
+	}
+	long Count = Argc > 2 ? atol(Argv[2]) : 1000000;
+	const char *Mode = Argc > 3 ? Argv[3] : "signal";
+	int Op = RA_INGEST_SIGNAL, Text = 0;
+	if (!strcmp(Mode, "insert")) {
+		Op = RA_INGEST_INSERT;
+	} else if (!strcmp(Mode, "text")) {
+		Text = 1;
+	} else if (strcmp(Mode, "signal")) {
+		fprintf(stderr, "unknown mode %s\n", Mode);
+		return 1;
+	}
+	struct sockaddr_un Address[1] = {{0,}};
+	Address->sun_family = AF_UNIX;
+	strncpy(Address->sun_path, Argv[1], sizeof(Address->sun_path) - 1);
+	int Fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (Fd < 0 || connect(Fd, (struct sockaddr *)Address, sizeof(Address))) {
+		perror("connect");
+		return 1;
+	}
+	struct timespec Start[1], End[1];
+	clock_gettime(CLOCK_MONOTONIC, Start);
+	char Record[256];
+	for (long Seq = 0; Seq < Count; ++Seq) {
+		size_t RecordLength;
+		if (Text) {
+			RecordLength = sprintf(Record, "signal bench Seq=%ld Value=%g Name=sample\n", Seq, Seq * 0.5);
+		} else {
+			RecordLength = binary_record(Record, Op, Seq);
+		}
+		if (Length + RecordLength > BUFFER_SIZE) flush(Fd);
+		memcpy(Buffer + Length, Record, RecordLength);
+		Length += RecordLength;
+	}
+	flush(Fd);
+	clock_gettime(CLOCK_MONOTONIC, End);
+	double Elapsed = (End->tv_sec - Start->tv_sec) + (End->tv_nsec - Start->tv_nsec) / 1e9;
+	printf("%ld records in %.3fs: %.0f records/s\n", Count, Elapsed, Count / Elapsed);
+	close(Fd);
+	return 0;
+}
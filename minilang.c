@@ -10,6 +10,14 @@
 #include <setjmp.h>
 #include <ctype.h>
 #include <regex.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <pthread.h>
 #include "linenoise.h"
 #include "stringmap.h"
 
@@ -34,9 +42,6 @@ typedef struct ml_error_t ml_error_t;
 typedef struct ml_frame_t ml_frame_t;
 typedef struct ml_inst_t ml_inst_t;
 
-typedef struct ml_list_node_t ml_list_node_t;
-typedef struct ml_tree_node_t ml_tree_node_t;
-
 typedef struct ml_source_t ml_source_t;
 
 struct ml_source_t {
@@ -53,7 +58,7 @@ struct ml_t {
 
 long ml_default_hash(ml_value_t *Value) {
 	long Hash = 5381;
-	for (const char *P = Value->Type->Name; P[0]; ++P) Hash = ((Hash << 5) + Hash) + P[0];
+	for (const char *P = ml_typeof(Value)->Name; P[0]; ++P) Hash = ((Hash << 5) + Hash) + P[0];
 	return Hash;
 }
 
@@ -70,7 +75,7 @@ ml_value_t *ml_default_assign(ml_value_t *Ref, ml_value_t *Value) {
 }
 
 ml_value_t *ml_default_next(ml_value_t *Iter) {
-	return ml_error("TypeError", "%s is not iterable", Iter->Type->Name);
+	return ml_error("TypeError", "%s is not iterable", ml_typeof(Iter)->Name);
 }
 
 ml_value_t *ml_default_key(ml_value_t *Iter) {
@@ -123,12 +128,12 @@ ml_type_t MLSomeT[1] = {{
 ml_value_t MLSome[1] = {{MLSomeT}};
 
 long ml_hash(ml_value_t *Value) {
-	Value = Value->Type->deref(Value);
-	return Value->Type->hash(Value);
+	Value = ml_typeof(Value)->deref(Value);
+	return ml_typeof(Value)->hash(Value);
 }
 
 ml_value_t *ml_call(ml_value_t *Value, int Count, ml_value_t **Args) {
-	return Value->Type->call(Value, Count, Args);
+	return ml_typeof(Value)->call(Value, Count, Args);
 }
 
 ml_value_t *ml_inline(ml_value_t *Value, int Count, ...) {
@@ -137,7 +142,7 @@ ml_value_t *ml_inline(ml_value_t *Value, int Count, ...) {
 	va_start(List, Count);
 	for (int I = 0; I < Count; ++I) Args[I] = va_arg(List, ml_value_t *);
 	va_end(List);
-	return Value->Type->call(Value, Count, Args);
+	return ml_typeof(Value)->call(Value, Count, Args);
 }
 
 static ml_value_t *ml_function_call(ml_value_t *Value, int Count, ml_value_t **Args) {
@@ -187,12 +192,12 @@ struct ml_real_t {
 struct ml_string_t {
 	const ml_type_t *Type;
 	const char *Value;
-	int Length;
+	int Length, Interned;
+	long Hash;
 };
 
 static long ml_integer_hash(ml_value_t *Value) {
-	ml_integer_t *Integer = (ml_integer_t *)Value;
-	return Integer->Value;
+	return ml_integer_value(Value);
 }
 
 ml_type_t MLIntegerT[1] = {{
@@ -206,6 +211,7 @@ ml_type_t MLIntegerT[1] = {{
 }};
 
 ml_value_t *ml_integer(long Value) {
+	if (Value >= ML_SMALL_INTEGER_MIN && Value <= ML_SMALL_INTEGER_MAX) return ml_small_integer(Value);
 	ml_integer_t *Integer = fnew(ml_integer_t);
 	Integer->Type = MLIntegerT;
 	Integer->Value = Value;
@@ -214,10 +220,11 @@ ml_value_t *ml_integer(long Value) {
 }
 
 int ml_is_integer(ml_value_t *Value) {
-	return Value->Type == MLIntegerT;
+	return ml_typeof(Value) == MLIntegerT;
 }
 
 long ml_integer_value(ml_value_t *Value) {
+	if (ml_is_small_integer(Value)) return ml_small_integer_value(Value);
 	return ((ml_integer_t *)Value)->Value;
 }
 
@@ -245,23 +252,33 @@ ml_value_t *ml_real(double Value) {
 }
 
 int ml_is_real(ml_value_t *Value) {
-	return Value->Type == MLRealT;
+	return ml_typeof(Value) == MLRealT;
 }
 
 double ml_real_value(ml_value_t *Value) {
 	return ((ml_real_t *)Value)->Value;
 }
 
+static long ml_string_hash_chars(const char *Value, int Length) {
+	long Hash = 5381;
+	for (int I = 0; I < Length; ++I) Hash = ((Hash << 5) + Hash) + Value[I];
+	return Hash;
+}
+
 static long ml_string_hash(ml_value_t *Value) {
+	// Strings are immutable so the hash is computed on first use and kept; 0 just means not yet computed.
 	ml_string_t *String = (ml_string_t *)Value;
-	long Hash = 5381;
-	for (int I = 0; I < String->Length; ++I) Hash = ((Hash << 5) + Hash) + String->Value[I];
+	long Hash = __atomic_load_n(&String->Hash, __ATOMIC_RELAXED);
+	if (!Hash) {
+		Hash = ml_string_hash_chars(String->Value, String->Length);
+		__atomic_store_n(&String->Hash, Hash, __ATOMIC_RELAXED);
+	}
 	return Hash;
 }
 
 static ml_value_t *ml_string_index(void *Data, int Count, ml_value_t **Args) {
 	ml_string_t *String = (ml_string_t *)Args[0];
-	int Index = ((ml_integer_t *)Args[1])->Value;
+	int Index = ml_integer_value(Args[1]);
 	if (Index <= 0) Index += String->Length + 1;
 	if (Index <= 0) return MLNil;
 	if (Index > String->Length) return MLNil;
@@ -273,8 +290,8 @@ static ml_value_t *ml_string_index(void *Data, int Count, ml_value_t **Args) {
 
 static ml_value_t *ml_string_slice(void *Data, int Count, ml_value_t **Args) {
 	ml_string_t *String = (ml_string_t *)Args[0];
-	int Lo = ((ml_integer_t *)Args[1])->Value;
-	int Hi = ((ml_integer_t *)Args[2])->Value;
+	int Lo = ml_integer_value(Args[1]);
+	int Hi = ml_integer_value(Args[2]);
 	if (Lo <= 0) Lo += String->Length + 1;
 	if (Hi <= 0) Hi += String->Length + 1;
 	if (Lo <= 0) return MLNil;
@@ -349,92 +366,194 @@ static ml_value_t *ml_string_find(void *Data, int Count, ml_value_t **Args) {
 	}
 }
 
-ml_value_t *ml_string_match(void *Data, int Count, ml_value_t **Args) {
-	const char *Subject = ml_string_value(Args[0]);
-	const char *Pattern = ml_string_value(Args[1]);
-	regex_t Regex[1];
-	int Error = regcomp(Regex, Pattern, REG_EXTENDED);
+// Regexes are compiled once and kept as values. Patterns given as strings go through a small cache of
+// recently used regexes, most recent first, so a rule matching every line against the same pattern
+// compiles it once. String literals used as the pattern of % or replace are compiled with the script.
+
+#define ML_REGEX_CACHE_SIZE 64
+
+typedef struct ml_regex_t {
+	const ml_type_t *Type;
+	ml_value_t *Pattern;
+	regex_t Value[1];
+} ml_regex_t;
+
+static long ml_regex_hash(ml_value_t *Value) {
+	return ml_string_hash(((ml_regex_t *)Value)->Pattern);
+}
+
+ml_type_t MLRegexT[1] = {{
+	MLAnyT, "regex",
+	ml_regex_hash,
+	ml_default_call,
+	ml_default_deref,
+	ml_default_assign,
+	ml_default_next,
+	ml_default_key
+}};
+
+static void ml_regex_finalize(ml_regex_t *Regex, void *Data) {
+	regfree(Regex->Value);
+}
+
+static ml_value_t *ml_regex_compile(ml_value_t *Pattern) {
+	ml_regex_t *Regex = new(ml_regex_t);
+	Regex->Type = MLRegexT;
+	Regex->Pattern = Pattern;
+	int Error = regcomp(Regex->Value, ml_string_value(Pattern), REG_EXTENDED);
 	if (Error) {
-		size_t ErrorSize = regerror(Error, Regex, NULL, 0);
+		size_t ErrorSize = regerror(Error, Regex->Value, NULL, 0);
 		char *ErrorMessage = snew(ErrorSize + 1);
-		regerror(Error, Regex, ErrorMessage, ErrorSize);
-		return ml_error("RegexError", ErrorMessage);
+		regerror(Error, Regex->Value, ErrorMessage, ErrorSize);
+		return ml_error("RegexError", "%s", ErrorMessage);
 	}
-	regmatch_t Matches[Regex->re_nsub];
-	switch (regexec(Regex, Subject, Regex->re_nsub, Matches, 0)) {
-	case REG_NOMATCH:
-		regfree(Regex);
-		return MLNil;
-	case REG_ESPACE: {
-		regfree(Regex);
-		size_t ErrorSize = regerror(REG_ESPACE, Regex, NULL, 0);
-		char *ErrorMessage = snew(ErrorSize + 1);
-		regerror(Error, Regex, ErrorMessage, ErrorSize);
-		return ml_error("RegexError", ErrorMessage);
-	}
-	default: {
-		ml_value_t *Results = ml_list();
-		for (int I = 0; I < Regex->re_nsub; ++I) {
-			regoff_t Start = Matches[I].rm_so;
-			if (Start >= 0) {
-				size_t Length = Matches[I].rm_eo - Start;
-				char *Chars = snew(Length + 1);
-				memcpy(Chars, Subject + Start, Length);
-				Chars[Length] = 0;
-				ml_list_append(Results, ml_string(Chars, Length));
-			} else {
-				ml_list_append(Results, MLNil);
-			}
+	GC_register_finalizer(Regex, (void *)ml_regex_finalize, 0, 0, 0);
+	return (ml_value_t *)Regex;
+}
+
+typedef struct ml_regex_entry_t ml_regex_entry_t;
+
+struct ml_regex_entry_t {
+	ml_regex_entry_t *Next;
+	ml_regex_t *Regex;
+};
+
+static ml_regex_entry_t RegexEntries[ML_REGEX_CACHE_SIZE];
+static ml_regex_entry_t *RegexCache = 0;
+static int RegexCacheCount = 0;
+static pthread_mutex_t RegexLock[1] = {PTHREAD_MUTEX_INITIALIZER};
+
+static ml_value_t *ml_regex_cached(ml_value_t *Pattern) {
+	ml_string_t *String = (ml_string_t *)Pattern;
+	long Hash = ml_string_hash(Pattern);
+	pthread_mutex_lock(RegexLock);
+	for (ml_regex_entry_t **Slot = &RegexCache; Slot[0]; Slot = &Slot[0]->Next) {
+		ml_regex_entry_t *Entry = Slot[0];
+		ml_string_t *Cached = (ml_string_t *)Entry->Regex->Pattern;
+		if (Cached == String || (Cached->Hash == Hash && Cached->Length == String->Length && !memcmp(Cached->Value, String->Value, String->Length))) {
+			Slot[0] = Entry->Next;
+			Entry->Next = RegexCache;
+			RegexCache = Entry;
+			pthread_mutex_unlock(RegexLock);
+			return (ml_value_t *)Entry->Regex;
 		}
-		regfree(Regex);
-		return Results;
 	}
+	pthread_mutex_unlock(RegexLock);
+	ml_value_t *Regex = ml_regex_compile(Pattern);
+	if (ml_typeof(Regex) == MLErrorT) return Regex;
+	pthread_mutex_lock(RegexLock);
+	ml_regex_entry_t *Entry;
+	if (RegexCacheCount < ML_REGEX_CACHE_SIZE) {
+		Entry = RegexEntries + RegexCacheCount++;
+	} else {
+		ml_regex_entry_t **Slot = &RegexCache;
+		while (Slot[0]->Next) Slot = &Slot[0]->Next;
+		Entry = Slot[0];
+		Slot[0] = 0;
+	}
+	Entry->Regex = (ml_regex_t *)Regex;
+	Entry->Next = RegexCache;
+	RegexCache = Entry;
+	pthread_mutex_unlock(RegexLock);
+	return Regex;
+}
+
+ml_value_t *ml_regex(void *Data, int Count, ml_value_t **Args) {
+	ML_CHECK_ARG_COUNT(1);
+	if (ml_typeof(Args[0]) == MLRegexT) return Args[0];
+	ML_CHECK_ARG_TYPE(0, MLStringT);
+	return ml_regex_compile(Args[0]);
+}
+
+static ml_value_t *ml_regex_error(ml_regex_t *Regex, int Error) {
+	size_t ErrorSize = regerror(Error, Regex->Value, NULL, 0);
+	char *ErrorMessage = snew(ErrorSize + 1);
+	regerror(Error, Regex->Value, ErrorMessage, ErrorSize);
+	return ml_error("RegexError", "%s", ErrorMessage);
+}
+
+static ml_value_t *ml_regex_match(ml_regex_t *Regex, const char *Subject) {
+	// Returns the whole match followed by each subexpression, with nil for those that did not take part.
+	int NumMatches = Regex->Value->re_nsub + 1;
+	regmatch_t Matches[NumMatches];
+	int Error = regexec(Regex->Value, Subject, NumMatches, Matches, 0);
+	if (Error == REG_NOMATCH) return MLNil;
+	if (Error) return ml_regex_error(Regex, Error);
+	ml_value_t *Results = ml_list();
+	for (int I = 0; I < NumMatches; ++I) {
+		regoff_t Start = Matches[I].rm_so;
+		if (Start >= 0) {
+			size_t Length = Matches[I].rm_eo - Start;
+			char *Chars = snew(Length + 1);
+			memcpy(Chars, Subject + Start, Length);
+			Chars[Length] = 0;
+			ml_list_append(Results, ml_string(Chars, Length));
+		} else {
+			ml_list_append(Results, MLNil);
+		}
 	}
+	return Results;
 }
 
-ml_value_t *ml_string_string_replace(void *Data, int Count, ml_value_t **Args) {
-	const char *Subject = ml_string_value(Args[0]);
-	int SubjectLength = ml_string_length(Args[0]);
-	const char *Pattern = ml_string_value(Args[1]);
-	const char *Replace = ml_string_value(Args[2]);
-	int ReplaceLength = ml_string_length(Args[2]);
-	regex_t Regex[1];
-	int Error = regcomp(Regex, Pattern, REG_EXTENDED);
-	if (Error) {
-		size_t ErrorSize = regerror(Error, Regex, NULL, 0);
-		char *ErrorMessage = snew(ErrorSize + 1);
-		regerror(Error, Regex, ErrorMessage, ErrorSize);
-		return ml_error("RegexError", ErrorMessage);
-	}
+static ml_value_t *ml_regex_replace(ml_regex_t *Regex, ml_value_t *SubjectValue, ml_value_t *ReplaceValue) {
+	const char *Subject = ml_string_value(SubjectValue);
+	int SubjectLength = ml_string_length(SubjectValue);
+	const char *Replace = ml_string_value(ReplaceValue);
+	int ReplaceLength = ml_string_length(ReplaceValue);
 	regmatch_t Matches[1];
 	ml_stringbuffer_t Buffer[1] = {ML_STRINGBUFFER_INIT};
+	int Flags = 0;
 	for (;;) {
-		switch (regexec(Regex, Subject, 1, Matches, 0)) {
-		case REG_NOMATCH:
-			if (SubjectLength) ml_stringbuffer_add(Buffer, Subject, SubjectLength);
-			ml_string_t *String = fnew(ml_string_t);
-			String->Type = MLStringT;
-			String->Length = Buffer->Length;
-			String->Value = ml_stringbuffer_get(Buffer);
-			GC_end_stubborn_change(String);
-			return (ml_value_t *)String;
-		case REG_ESPACE: {
-			regfree(Regex);
-			size_t ErrorSize = regerror(REG_ESPACE, Regex, NULL, 0);
-			char *ErrorMessage = snew(ErrorSize + 1);
-			regerror(Error, Regex, ErrorMessage, ErrorSize);
-			return ml_error("RegexError", ErrorMessage);
-		}
-		default: {
-			regoff_t Start = Matches[0].rm_so;
-			if (Start > 0) ml_stringbuffer_add(Buffer, Subject, Start);
-			ml_stringbuffer_add(Buffer, Replace, ReplaceLength);
-			Subject += Matches[0].rm_eo;
-			SubjectLength -= Matches[0].rm_eo;
-		}
+		int Error = regexec(Regex->Value, Subject, 1, Matches, Flags);
+		if (Error == REG_NOMATCH) break;
+		if (Error) return ml_regex_error(Regex, Error);
+		regoff_t Start = Matches[0].rm_so, End = Matches[0].rm_eo;
+		if (Start > 0) ml_stringbuffer_add(Buffer, Subject, Start);
+		ml_stringbuffer_add(Buffer, Replace, ReplaceLength);
+		if (End == Start) {
+			// An empty match would be found again at the same place, so step over one character.
+			if (End == SubjectLength) {
+				SubjectLength = 0;
+				break;
+			}
+			ml_stringbuffer_add(Buffer, Subject + End, 1);
+			++End;
 		}
+		Subject += End;
+		SubjectLength -= End;
+		Flags = REG_NOTBOL;
 	}
-	return 0;
+	if (SubjectLength) ml_stringbuffer_add(Buffer, Subject, SubjectLength);
+	ml_string_t *String = fnew(ml_string_t);
+	String->Type = MLStringT;
+	String->Length = Buffer->Length;
+	String->Value = ml_stringbuffer_get(Buffer);
+	GC_end_stubborn_change(String);
+	return (ml_value_t *)String;
+}
+
+ml_value_t *ml_string_match(void *Data, int Count, ml_value_t **Args) {
+	ml_value_t *Regex = ml_regex_cached(Args[1]);
+	if (ml_typeof(Regex) == MLErrorT) return Regex;
+	return ml_regex_match((ml_regex_t *)Regex, ml_string_value(Args[0]));
+}
+
+static ml_value_t *ml_string_regex_match(void *Data, int Count, ml_value_t **Args) {
+	return ml_regex_match((ml_regex_t *)Args[1], ml_string_value(Args[0]));
+}
+
+ml_value_t *ml_string_string_replace(void *Data, int Count, ml_value_t **Args) {
+	ml_value_t *Regex = ml_regex_cached(Args[1]);
+	if (ml_typeof(Regex) == MLErrorT) return Regex;
+	return ml_regex_replace((ml_regex_t *)Regex, Args[0], Args[2]);
+}
+
+static ml_value_t *ml_string_regex_replace(void *Data, int Count, ml_value_t **Args) {
+	return ml_regex_replace((ml_regex_t *)Args[1], Args[0], Args[2]);
+}
+
+static ml_value_t *ml_regex_pattern(void *Data, int Count, ml_value_t **Args) {
+	return ((ml_regex_t *)Args[0])->Pattern;
 }
 
 ml_type_t MLStringT[1] = {{
@@ -456,8 +575,71 @@ ml_value_t *ml_string(const char *Value, int Length) {
 	return (ml_value_t *)String;
 }
 
+// Interned strings are kept in a single table so that equal interned strings are the same value and
+// compare by pointer. String literals are interned when a script is compiled, and ingest paths intern
+// short field values. The table is never pruned, so it stops accepting new strings once it holds
+// ML_STRING_INTERN_MAX of them and ml_string_intern() falls back to returning a plain copy.
+
+#define ML_STRING_INTERN_MAX 65536
+
+static ml_string_t **InternStrings = 0;
+static int InternSize = 0, InternCount = 0;
+static pthread_mutex_t InternLock[1] = {PTHREAD_MUTEX_INITIALIZER};
+
+static void ml_string_intern_place(ml_string_t **Strings, int Size, ml_string_t *String) {
+	unsigned long Index = String->Hash;
+	while (Strings[Index & (Size - 1)]) ++Index;
+	Strings[Index & (Size - 1)] = String;
+}
+
+ml_value_t *ml_string_intern(const char *Value, int Length) {
+	if (Length < 0) Length = strlen(Value);
+	long Hash = ml_string_hash_chars(Value, Length);
+	pthread_mutex_lock(InternLock);
+	if (InternSize) {
+		for (unsigned long Index = Hash;; ++Index) {
+			ml_string_t *String = InternStrings[Index & (InternSize - 1)];
+			if (!String) break;
+			if (String->Hash == Hash && String->Length == Length && !memcmp(String->Value, Value, Length)) {
+				pthread_mutex_unlock(InternLock);
+				return (ml_value_t *)String;
+			}
+		}
+	}
+	char *Chars = snew(Length + 1);
+	memcpy(Chars, Value, Length);
+	Chars[Length] = 0;
+	ml_string_t *String = new(ml_string_t);
+	String->Type = MLStringT;
+	String->Value = Chars;
+	String->Length = Length;
+	String->Hash = Hash;
+	if (InternCount < ML_STRING_INTERN_MAX) {
+		if (2 * (InternCount + 1) > InternSize) {
+			int Size = InternSize ? 2 * InternSize : 256;
+			ml_string_t **Strings = anew(ml_string_t *, Size);
+			for (int I = 0; I < InternSize; ++I) {
+				if (InternStrings[I]) ml_string_intern_place(Strings, Size, InternStrings[I]);
+			}
+			InternStrings = Strings;
+			InternSize = Size;
+		}
+		String->Interned = 1;
+		ml_string_intern_place(InternStrings, InternSize, String);
+		++InternCount;
+	}
+	pthread_mutex_unlock(InternLock);
+	return (ml_value_t *)String;
+}
+
+static ml_value_t *ml_string_intern_method(void *Data, int Count, ml_value_t **Args) {
+	ml_string_t *String = (ml_string_t *)Args[0];
+	if (String->Interned) return Args[0];
+	return ml_string_intern(String->Value, String->Length);
+}
+
 int ml_is_string(ml_value_t *Value) {
-	return Value->Type == MLStringT;
+	return ml_typeof(Value) == MLStringT;
 }
 
 static ml_value_t *ml_string_new(void *Data, int Count, ml_value_t **Args) {
@@ -491,7 +673,7 @@ struct ml_method_t {
 
 static ml_method_node_t *ml_method_find(ml_method_node_t *Node, int Count, ml_value_t **Args) {
 	if (Count == 0) return Node;
-	for (const ml_type_t *Type = Args[0]->Type; Type; Type = Type->Parent) {
+	for (const ml_type_t *Type = ml_typeof(Args[0]); Type; Type = Type->Parent) {
 		for (ml_method_node_t *Test = Node->Child; Test; Test = Test->Next) {
 			if (Test->Type == Type) {
 				ml_method_node_t *Result = ml_method_find(Test, Count - 1, Args + 1);
@@ -516,15 +698,69 @@ ml_value_t *ml_method_call(ml_value_t *Value, int Count, ml_value_t **Args) {
 		return (Node->Callback)(Node->Data, Count, Args);
 	} else {
 		int Length = 4;
-		for (int I = 0; I < Count; ++I) Length += strlen(Args[I]->Type->Name) + 2;
+		for (int I = 0; I < Count; ++I) Length += strlen(ml_typeof(Args[I])->Name) + 2;
 		char *Types = snew(Length);
 		char *P = Types;
-		for (int I = 0; I < Count; ++I) P = stpcpy(stpcpy(P, Args[I]->Type->Name), ", ");
+		for (int I = 0; I < Count; ++I) P = stpcpy(stpcpy(P, ml_typeof(Args[I])->Name), ", ");
 		P[-2] = 0;
 		return ml_error("MethodError", "no matching method found for %s(%s)", Method->Name, Types);
 	}
 }
 
+#define ML_METHOD_CACHE_ENTRIES 4
+#define ML_METHOD_CACHE_ARGS 4
+
+typedef struct ml_method_cache_t ml_method_cache_t;
+
+struct ml_method_cache_t {
+	ml_method_t *Method;
+	long Generation;
+	int Count, Size;
+	struct {
+		const ml_type_t *Types[ML_METHOD_CACHE_ARGS];
+		ml_method_node_t *Node;
+	} Entries[ML_METHOD_CACHE_ENTRIES];
+};
+
+static long MethodGeneration = 0;
+
+static ml_value_t *ml_method_cache_call(ml_method_cache_t **Slot, ml_value_t *Value, int Count, ml_value_t **Args) {
+	if (Count > ML_METHOD_CACHE_ARGS) return ml_method_call(Value, Count, Args);
+	ml_method_t *Method = (ml_method_t *)Value;
+	ml_method_cache_t *Cache = __atomic_load_n(Slot, __ATOMIC_ACQUIRE);
+	long Generation = __atomic_load_n(&MethodGeneration, __ATOMIC_ACQUIRE);
+	if (Cache && (Cache->Method != Method || Cache->Count != Count || Cache->Generation != Generation)) Cache = 0;
+	if (Cache) for (int I = 0; I < Cache->Size; ++I) {
+		const ml_type_t **Types = Cache->Entries[I].Types;
+		int J = 0;
+		while (J < Count && Types[J] == ml_typeof(Args[J])) ++J;
+		if (J == Count) {
+			ml_method_node_t *Node = Cache->Entries[I].Node;
+			return (Node->Callback)(Node->Data, Count, Args);
+		}
+	}
+	ml_method_node_t *Node = ml_method_find(Method->Root, Count, Args);
+	if (!Node->Callback) return ml_method_call(Value, Count, Args);
+	// Caches are never modified once published, a miss installs an extended copy instead.
+	ml_method_cache_t *Extended = new(ml_method_cache_t);
+	if (Cache) {
+		*Extended = *Cache;
+		if (Extended->Size == ML_METHOD_CACHE_ENTRIES) {
+			memmove(Extended->Entries, Extended->Entries + 1, (ML_METHOD_CACHE_ENTRIES - 1) * sizeof(Extended->Entries[0]));
+			--Extended->Size;
+		}
+	} else {
+		Extended->Method = Method;
+		Extended->Count = Count;
+		Extended->Generation = Generation;
+	}
+	int Index = Extended->Size++;
+	for (int I = 0; I < Count; ++I) Extended->Entries[Index].Types[I] = ml_typeof(Args[I]);
+	Extended->Entries[Index].Node = Node;
+	__atomic_store_n(Slot, Extended, __ATOMIC_RELEASE);
+	return (Node->Callback)(Node->Data, Count, Args);
+}
+
 ml_type_t MLMethodT[1] = {{
 	MLFunctionT, "method",
 	ml_method_hash,
@@ -593,6 +829,7 @@ void ml_method_by_name(const char *Name, void *Data, ml_callback_t Callback, ...
 	va_end(Args);
 	Node->Data = Data;
 	Node->Callback = Callback;
+	__atomic_add_fetch(&MethodGeneration, 1, __ATOMIC_RELEASE);
 }
 
 void ml_method_by_value(ml_value_t *Value, void *Data, ml_callback_t Callback, ...) {
@@ -615,6 +852,7 @@ void ml_method_by_value(ml_value_t *Value, void *Data, ml_callback_t Callback, .
 	va_end(Args);
 	Node->Data = Data;
 	Node->Callback = Callback;
+	__atomic_add_fetch(&MethodGeneration, 1, __ATOMIC_RELEASE);
 }
 
 struct ml_reference_t {
@@ -659,14 +897,42 @@ ml_value_t *ml_reference(ml_value_t **Address) {
 
 struct ml_list_t {
 	const ml_type_t *Type;
-	ml_list_node_t *Head, *Tail;
-	int Length;
+	ml_value_t **Values;
+	int Offset, Length, Size;
+	ml_value_t *Inline[];
 };
 
-struct ml_list_node_t {
-	ml_list_node_t *Next, *Prev;
-	ml_value_t *Value;
-};
+// Lists keep their values contiguous in Values[Offset .. Offset + Length), with spare slots at
+// both ends. ml_list_reserve() recentres the values in a buffer at least twice the needed size
+// whenever one end runs out, so pushing and popping at either end is amortized O(1).
+
+static void ml_list_reserve(ml_list_t *List, int Front, int Back) {
+	if (List->Offset >= Front && List->Size - List->Offset - List->Length >= Back) return;
+	int Needed = List->Length + Front + Back;
+	ml_value_t **Values = List->Values;
+	int Size = List->Size;
+	if (Size < 2 * Needed) {
+		Size = Needed < 4 ? 8 : 2 * Needed;
+		Values = anew(ml_value_t *, Size);
+	}
+	int Offset = Front + (Size - Needed) / 2;
+	if (List->Length) memmove(Values + Offset, List->Values + List->Offset, List->Length * sizeof(ml_value_t *));
+	if (Values == List->Values) {
+		memset(Values, 0, Offset * sizeof(ml_value_t *));
+		memset(Values + Offset + List->Length, 0, (Size - Offset - List->Length) * sizeof(ml_value_t *));
+	}
+	List->Values = Values;
+	List->Offset = Offset;
+	List->Size = Size;
+}
+
+static ml_list_t *ml_list_sized(int Length) {
+	ml_list_t *List = xnew(ml_list_t, Length, ml_value_t *);
+	List->Type = MLListT;
+	List->Values = List->Inline;
+	List->Length = List->Size = Length;
+	return List;
+}
 
 int ml_list_length(ml_value_t *Value) {
 	return ((ml_list_t *)Value)->Length;
@@ -674,7 +940,7 @@ int ml_list_length(ml_value_t *Value) {
 
 void ml_list_to_array(ml_value_t *Value, ml_value_t **Array) {
 	ml_list_t *List = (ml_list_t *)Value;
-	for (ml_list_node_t *Node = List->Head; Node; Node = Node->Next) *Array++ = Node->Value;
+	memcpy(Array, List->Values + List->Offset, List->Length * sizeof(ml_value_t *));
 }
 
 static ml_value_t *ml_list_length_value(void *Data, int Count, ml_value_t **Args) {
@@ -682,62 +948,63 @@ static ml_value_t *ml_list_length_value(void *Data, int Count, ml_value_t **Args
 	return ml_integer(List->Length);
 }
 
+typedef struct ml_list_ref_t {
+	const ml_type_t *Type;
+	ml_list_t *List;
+	long Index;
+} ml_list_ref_t;
+
+static ml_value_t *ml_list_ref_deref(ml_value_t *Ref) {
+	ml_list_ref_t *Reference = (ml_list_ref_t *)Ref;
+	ml_list_t *List = Reference->List;
+	if (Reference->Index >= List->Length) return MLNil;
+	return List->Values[List->Offset + Reference->Index];
+}
+
+static ml_value_t *ml_list_ref_assign(ml_value_t *Ref, ml_value_t *Value) {
+	ml_list_ref_t *Reference = (ml_list_ref_t *)Ref;
+	ml_list_t *List = Reference->List;
+	if (Reference->Index >= List->Length) return ml_error("IndexError", "list index out of range");
+	return List->Values[List->Offset + Reference->Index] = Value;
+}
+
+ml_type_t MLListRefT[1] = {{
+	MLAnyT, "list-reference",
+	ml_default_hash,
+	ml_default_call,
+	ml_list_ref_deref,
+	ml_list_ref_assign,
+	ml_default_next,
+	ml_default_key
+}};
+
 static ml_value_t *ml_list_index(void *Data, int Count, ml_value_t **Args) {
 	ml_list_t *List = (ml_list_t *)Args[0];
-	long Index = ((ml_integer_t *)Args[1])->Value;
+	long Index = ml_integer_value(Args[1]);
 	if (Index > 0) {
-		for (ml_list_node_t *Node = List->Head; Node; Node = Node->Next) {
-			if (--Index == 0) return ml_reference(&Node->Value);
-		}
-		return MLNil;
+		if (Index > List->Length) return MLNil;
+		--Index;
 	} else {
-		Index = -Index;
-		for (ml_list_node_t *Node = List->Tail; Node; Node = Node->Prev) {
-			if (--Index == 0) return ml_reference(&Node->Value);
-		}
-		return MLNil;
+		if (-Index > List->Length || !Index) return MLNil;
+		Index += List->Length;
 	}
+	ml_list_ref_t *Reference = new(ml_list_ref_t);
+	Reference->Type = MLListRefT;
+	Reference->List = List;
+	Reference->Index = Index;
+	return (ml_value_t *)Reference;
 }
 
 static ml_value_t *ml_list_slice(void *Data, int Count, ml_value_t **Args) {
 	ml_list_t *List = (ml_list_t *)Args[0];
-	long Index = ((ml_integer_t *)Args[1])->Value;
-	long End = ((ml_integer_t *)Args[2])->Value;
-	long Start = Index;
+	long Start = ml_integer_value(Args[1]);
+	long End = ml_integer_value(Args[2]);
 	if (Start <= 0) Start += List->Length + 1;
 	if (End <= 0) End += List->Length + 1;
 	if (Start <= 0 || End < Start || End > List->Length + 1) return MLNil;
 	long Length = End - Start;
-	ml_list_node_t *Source = 0;
-	if (Index > 0) {
-		for (ml_list_node_t *Node = List->Head; Node; Node = Node->Next) {
-			if (--Index == 0) {
-				Source = Node;
-				break;
-			}
-		}
-	} else {
-		Index = -Index;
-		for (ml_list_node_t *Node = List->Tail; Node; Node = Node->Prev) {
-			if (--Index == 0) {
-				Source = Node;
-				break;
-			}
-		}
-	}
-	ml_list_t *Slice = (ml_list_t *)ml_list();
-	Slice->Type = MLListT;
-	Slice->Length = Length;
-	ml_list_node_t **Slot = &Slice->Head, *Prev = 0, *Node = 0;
-	while (--Length >= 0) {
-		Node = Slot[0] = new(ml_list_node_t);
-		Node->Prev = Prev;
-		Node->Value = Source->Value;
-		Slot = &Node->Next;
-		Source = Source->Next;
-		Prev = Node;
-	}
-	Slice->Tail = Node;
+	ml_list_t *Slice = ml_list_sized(Length);
+	memcpy(Slice->Values, List->Values + List->Offset + Start - 1, Length * sizeof(ml_value_t *));
 	return (ml_value_t *)Slice;
 }
 
@@ -758,249 +1025,259 @@ ml_value_t *ml_list() {
 }
 
 int ml_is_list(ml_value_t *Value) {
-	return Value->Type == MLListT;
+	return ml_typeof(Value) == MLListT;
 }
 
 void ml_list_append(ml_value_t *List0, ml_value_t *Value) {
 	ml_list_t *List = (ml_list_t *)List0;
-	ml_list_node_t *Node = new(ml_list_node_t);
-	Node->Value = Value;
-	Node->Prev = List->Tail;
-	if (List->Tail) {
-		List->Tail->Next = Node;
-	} else {
-		List->Head = Node;
-	}
-	List->Tail = Node;
-	List->Length += 1;
+	ml_list_reserve(List, 0, 1);
+	List->Values[List->Offset + List->Length++] = Value;
 }
 
 int ml_list_foreach(ml_value_t *Value, void *Data, int (*callback)(ml_value_t *, void *)) {
 	ml_list_t *List = (ml_list_t *)Value;
-	for (ml_list_node_t *Node = List->Head; Node; Node = Node->Next) {
-		if (callback(Node->Value, Data)) return 1;
+	for (int I = 0; I < List->Length; ++I) {
+		if (callback(List->Values[List->Offset + I], Data)) return 1;
 	}
 	return 0;
 }
 
 static ml_value_t *ml_list_new(void *Data, int Count, ml_value_t **Args) {
-	ml_list_t *List = new(ml_list_t);
-	List->Type = MLListT;
-	ml_list_node_t **Slot = &List->Head;
-	ml_list_node_t *Prev = NULL;
-	for (int I = 0; I < Count; ++I) {
-		ml_list_node_t *Node = Slot[0] = new(ml_list_node_t);
-		Node->Value = Args[I];
-		Node->Prev = Prev;
-		Prev = Node;
-		Slot = &Node->Next;
-	}
-	List->Tail = Prev;
-	List->Length = Count;
+	ml_list_t *List = ml_list_sized(Count);
+	memcpy(List->Values, Args, Count * sizeof(ml_value_t *));
 	return (ml_value_t *)List;
 }
 
 static ml_function_t ListNew[1] = {{MLFunctionT, ml_list_new, NULL}};
 
-struct ml_tree_t {
-	const ml_type_t *Type;
-	ml_tree_node_t *Root;
-	int Size;
-};
+// Trees are open addressing hash tables in the style of SwissTable. Entries are stored densely in
+// insertion order (removed entries leave a hole with a null key until the next rehash), and an index
+// of control bytes maps hashes to entries. Each control byte is either EMPTY, DELETED or the low 7 bits
+// of the hash of a present entry; the index is probed 8 control bytes at a time so that most misses
+// and hits touch a single word before comparing any keys.
+
+#define ML_TREE_GROUP 8
+#define ML_TREE_EMPTY 0x80
+#define ML_TREE_DELETED 0xFE
+#define ML_TREE_LSBS 0x0101010101010101UL
+#define ML_TREE_MSBS 0x8080808080808080UL
 
-struct ml_tree_node_t {
-	ml_tree_node_t *Left, *Right;
+typedef struct ml_tree_entry_t {
 	ml_value_t *Key;
 	ml_value_t *Value;
 	long Hash;
-	int Depth;
+} ml_tree_entry_t;
+
+struct ml_tree_t {
+	const ml_type_t *Type;
+	ml_tree_entry_t *Entries;
+	unsigned char *Control;
+	int *Slots;
+	int Size, Used, Capacity;
 };
 
-ml_value_t *ml_tree_search(ml_tree_t *Tree, ml_value_t *Key) {
-	ml_tree_node_t *Node = Tree->Root;
-	long Hash = ml_hash(Key);
-	while (Node) {
-		int Compare;
-		if (Hash < Node->Hash) {
-			Compare = -1;
-		} else if (Hash > Node->Hash) {
-			Compare = 1;
-		} else {
-			ml_value_t *Args[2] = {Key, Node->Key};
-			ml_value_t *Result = ml_method_call(CompareMethod, 2, Args);
-			if (Result->Type == MLIntegerT) {
-				Compare = ((ml_integer_t *)Result)->Value;
-			} else if (Result->Type == MLRealT) {
-				Compare = ((ml_real_t *)Result)->Value;
-			} else {
-				return ml_error("CompareError", "comparison must return number");
-			}
-		}
-		if (!Compare) {
-			return Node->Value;
-		} else {
-			Node = Compare < 0 ? Node->Left : Node->Right;
-		}
-	}
-	return MLNil;
+static long ml_tree_hash(ml_value_t *Key) {
+	// Types without a hash of their own (lists, instances, functions, ...) compare by identity through
+	// ml_compare_any_any, but ml_default_hash only hashes their type name, which would put every such key
+	// in one probe chain. They are hashed by address instead.
+	Key = ml_typeof(Key)->deref(Key);
+	const ml_type_t *Type = ml_typeof(Key);
+	if (Type->hash == ml_default_hash) return (long)((uintptr_t)Key >> 4);
+	return Type->hash(Key);
 }
 
-static int ml_tree_balance(ml_tree_node_t *Node) {
-	int Delta = 0;
-	if (Node->Left) Delta = Node->Left->Depth;
-	if (Node->Right) Delta -= Node->Right->Depth;
-	return Delta;
+static inline unsigned long ml_tree_mix(long Hash) {
+	return (unsigned long)Hash * 0x9E3779B97F4A7C15UL;
 }
 
-static void ml_tree_update_depth(ml_tree_node_t *Node) {
-	int Depth = 0;
-	if (Node->Left) Depth = Node->Left->Depth;
-	if (Node->Right && Depth < Node->Right->Depth) Depth = Node->Right->Depth;
-	Node->Depth = Depth + 1;
-}
-
-static void ml_tree_rotate_left(ml_tree_node_t **Slot) {
-	ml_tree_node_t *Ch = Slot[0]->Right;
-	Slot[0]->Right = Slot[0]->Right->Left;
-	Ch->Left = Slot[0];
-	ml_tree_update_depth(Slot[0]);
-	Slot[0] = Ch;
-	ml_tree_update_depth(Slot[0]);
-}
-
-static void ml_tree_rotate_right(ml_tree_node_t **Slot) {
-	ml_tree_node_t *Ch = Slot[0]->Left;
-	Slot[0]->Left = Slot[0]->Left->Right;
-	Ch->Right = Slot[0];
-	ml_tree_update_depth(Slot[0]);
-	Slot[0] = Ch;
-	ml_tree_update_depth(Slot[0]);
-}
-
-static void ml_tree_rebalance(ml_tree_node_t **Slot) {
-	int Delta = ml_tree_balance(Slot[0]);
-	if (Delta == 2) {
-		if (ml_tree_balance(Slot[0]->Left) < 0) ml_tree_rotate_left(&Slot[0]->Left);
-		ml_tree_rotate_right(Slot);
-	} else if (Delta == -2) {
-		if (ml_tree_balance(Slot[0]->Right) > 0) ml_tree_rotate_right(&Slot[0]->Right);
-		ml_tree_rotate_left(Slot);
-	}
-}
-
-static ml_value_t *ml_tree_insert_internal(ml_tree_t *Tree, ml_tree_node_t **Slot, long Hash, ml_value_t *Key, ml_value_t *Value) {
-	if (!Slot[0]) {
-		++Tree->Size;
-		ml_tree_node_t *Node = Slot[0] = new(ml_tree_node_t);
-		Node->Depth = 1;
-		Node->Hash = Hash;
-		Node->Key = Key;
-		Node->Value = Value;
-		return NULL;
+static inline unsigned long ml_tree_group(const unsigned char *Control) {
+	unsigned long Group;
+	memcpy(&Group, Control, sizeof(Group));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	Group = __builtin_bswap64(Group);
+#endif
+	return Group;
+}
+
+static inline unsigned long ml_tree_group_match(unsigned long Group, unsigned char Tag) {
+	unsigned long X = Group ^ (ML_TREE_LSBS * Tag);
+	return (X - ML_TREE_LSBS) & ~X & ML_TREE_MSBS;
+}
+
+static inline unsigned long ml_tree_group_empty(unsigned long Group) {
+	return Group & ~(Group << 6) & ML_TREE_MSBS;
+}
+
+static inline unsigned long ml_tree_group_free(unsigned long Group) {
+	return Group & ~(Group << 7) & ML_TREE_MSBS;
+}
+
+static int ml_tree_equal(ml_value_t *A, ml_value_t *B, ml_value_t **Error) {
+	if (A == B) return 1;
+	const ml_type_t *TypeA = ml_typeof(A), *TypeB = ml_typeof(B);
+	if (TypeA == MLIntegerT && TypeB == MLIntegerT) {
+		return ml_integer_value(A) == ml_integer_value(B);
 	}
-	int Compare;
-	if (Hash < Slot[0]->Hash) {
-		Compare = -1;
-	} else if (Hash > Slot[0]->Hash) {
-		Compare = 1;
-	} else {
-		ml_value_t *Args[2] = {Key, Slot[0]->Key};
-		ml_value_t *Result = ml_method_call(CompareMethod, 2, Args);
-		if (Result->Type == MLIntegerT) {
-			Compare = ((ml_integer_t *)Result)->Value;
-		} else if (Result->Type == MLRealT) {
-			Compare = ((ml_real_t *)Result)->Value;
-		} else {
-			return ml_error("CompareError", "comparison must return number");
-		}
+	if (TypeA == MLStringT && TypeB == MLStringT) {
+		ml_string_t *StringA = (ml_string_t *)A, *StringB = (ml_string_t *)B;
+		if (StringA->Interned && StringB->Interned) return 0;
+		return StringA->Length == StringB->Length && !memcmp(StringA->Value, StringB->Value, StringA->Length);
 	}
-	if (!Compare) {
-		ml_value_t *Old = Slot[0]->Value;
-		Slot[0]->Value = Value;
-		return Old;
+	ml_value_t *Args[2] = {A, B};
+	ml_value_t *Result = ml_method_call(CompareMethod, 2, Args);
+	if (ml_typeof(Result) == MLIntegerT) {
+		return !ml_integer_value(Result);
+	} else if (ml_typeof(Result) == MLRealT) {
+		return !(long)((ml_real_t *)Result)->Value;
 	} else {
-		ml_value_t *Old = ml_tree_insert_internal(Tree, Compare < 0 ? &Slot[0]->Left : &Slot[0]->Right, Hash, Key, Value);
-		ml_tree_rebalance(Slot);
-		ml_tree_update_depth(Slot[0]);
-		return Old;
+		Error[0] = ml_error("CompareError", "comparison must return number");
+		return 0;
 	}
 }
 
-ml_value_t *ml_tree_insert(ml_tree_t *Tree, ml_value_t *Key, ml_value_t *Value) {
-	return ml_tree_insert_internal(Tree, &Tree->Root, ml_hash(Key), Key, Value);
+static int ml_tree_find(ml_tree_t *Tree, long Hash, ml_value_t *Key, ml_value_t **Error) {
+	if (!Tree->Capacity) return -1;
+	unsigned long Mixed = ml_tree_mix(Hash);
+	unsigned char Tag = Mixed >> 57;
+	int Mask = Tree->Capacity / ML_TREE_GROUP - 1;
+	int Group = Mixed & Mask;
+	for (int Probe = 1;; ++Probe) {
+		unsigned long Control = ml_tree_group(Tree->Control + Group * ML_TREE_GROUP);
+		for (unsigned long Match = ml_tree_group_match(Control, Tag); Match; Match &= Match - 1) {
+			int Slot = Group * ML_TREE_GROUP + (__builtin_ctzl(Match) >> 3);
+			ml_tree_entry_t *Entry = Tree->Entries + Tree->Slots[Slot];
+			if (Entry->Hash == Hash && ml_tree_equal(Key, Entry->Key, Error)) return Slot;
+			if (Error[0]) return -1;
+		}
+		if (ml_tree_group_empty(Control)) return -1;
+		Group = (Group + Probe) & Mask;
+	}
+}
+
+static void ml_tree_place(ml_tree_t *Tree, long Hash, int Index) {
+	unsigned long Mixed = ml_tree_mix(Hash);
+	int Mask = Tree->Capacity / ML_TREE_GROUP - 1;
+	int Group = Mixed & Mask;
+	for (int Probe = 1;; ++Probe) {
+		unsigned long Free = ml_tree_group_free(ml_tree_group(Tree->Control + Group * ML_TREE_GROUP));
+		if (Free) {
+			int Slot = Group * ML_TREE_GROUP + (__builtin_ctzl(Free) >> 3);
+			Tree->Control[Slot] = Mixed >> 57;
+			Tree->Slots[Slot] = Index;
+			return;
+		}
+		Group = (Group + Probe) & Mask;
+	}
 }
 
-static void ml_tree_remove_depth_helper(ml_tree_node_t *Node) {
-	if (Node) {
-		ml_tree_remove_depth_helper(Node->Right);
-		ml_tree_update_depth(Node);
+static void ml_tree_rehash(ml_tree_t *Tree, int Size) {
+	// Resizes the index to hold at least Size entries at 7/8 load, dropping removed entries.
+	int Capacity = 0;
+	if (Size) {
+		Capacity = ML_TREE_GROUP;
+		while (Capacity - Capacity / 8 < Size) Capacity *= 2;
+	}
+	ml_tree_entry_t *Entries = Tree->Entries;
+	int Used = Tree->Used;
+	Tree->Capacity = Capacity;
+	Tree->Used = 0;
+	if (!Capacity) {
+		Tree->Entries = 0;
+		Tree->Control = 0;
+		Tree->Slots = 0;
+		return;
+	}
+	Tree->Entries = anew(ml_tree_entry_t, Capacity - Capacity / 8);
+	Tree->Control = (unsigned char *)snew(Capacity * (1 + sizeof(int)));
+	Tree->Slots = (int *)(Tree->Control + Capacity);
+	memset(Tree->Control, ML_TREE_EMPTY, Capacity);
+	for (int I = 0; I < Used; ++I) {
+		if (!Entries[I].Key) continue;
+		Tree->Entries[Tree->Used] = Entries[I];
+		ml_tree_place(Tree, Entries[I].Hash, Tree->Used++);
 	}
 }
 
-static ml_value_t *ml_tree_remove_internal(ml_tree_t *Tree, ml_tree_node_t **Slot, long Hash, ml_value_t *Key) {
-	if (!Slot[0]) return MLNil;
-	int Compare;
-	if (Hash < Slot[0]->Hash) {
-		Compare = -1;
-	} else if (Hash > Slot[0]->Hash) {
-		Compare = 1;
-	} else {
-		ml_value_t *Args[2] = {Key, Slot[0]->Key};
-		ml_value_t *Result = ml_method_call(CompareMethod, 2, Args);
-		if (Result->Type == MLIntegerT) {
-			Compare = ((ml_integer_t *)Result)->Value;
-		} else if (Result->Type == MLRealT) {
-			Compare = ((ml_real_t *)Result)->Value;
-		} else {
-			return ml_error("CompareError", "comparison must return number");
-		}
-	}
-	ml_value_t *Removed = MLNil;
-	if (!Compare) {
-		--Tree->Size;
-		Removed = Slot[0]->Value;
-		if (Slot[0]->Left && Slot[0]->Right) {
-			ml_tree_node_t **Y = &Slot[0]->Left;
-			while (Y[0]->Right) Y = &Y[0]->Right;
-			Slot[0]->Key = Y[0]->Key;
-			Slot[0]->Hash = Y[0]->Hash;
-			Slot[0]->Value = Y[0]->Value;
-			Y[0] = Y[0]->Left;
-			ml_tree_remove_depth_helper(Slot[0]->Left);
-		} else if (Slot[0]->Left) {
-			Slot[0] = Slot[0]->Left;
-		} else if (Slot[0]->Right) {
-			Slot[0] = Slot[0]->Right;
-		} else {
-			Slot[0] = 0;
-		}
-	} else {
-		Removed = ml_tree_remove_internal(Tree, Compare < 0 ? &Slot[0]->Left : &Slot[0]->Right, Hash, Key);
+static void ml_tree_reserve(ml_tree_t *Tree, int Size) {
+	if (Size > Tree->Capacity - Tree->Capacity / 8) ml_tree_rehash(Tree, Size);
+}
+
+static void ml_tree_shrink(ml_tree_t *Tree) {
+	ml_tree_rehash(Tree, Tree->Size);
+}
+
+ml_value_t *ml_tree_search(ml_tree_t *Tree, ml_value_t *Key) {
+	ml_value_t *Error = 0;
+	int Slot = ml_tree_find(Tree, ml_tree_hash(Key), Key, &Error);
+	if (Error) return Error;
+	return Slot < 0 ? MLNil : Tree->Entries[Tree->Slots[Slot]].Value;
+}
+
+ml_value_t *ml_tree_insert(ml_tree_t *Tree, ml_value_t *Key, ml_value_t *Value) {
+	ml_value_t *Error = 0;
+	long Hash = ml_tree_hash(Key);
+	int Slot = ml_tree_find(Tree, Hash, Key, &Error);
+	if (Error) return Error;
+	if (Slot >= 0) {
+		ml_tree_entry_t *Entry = Tree->Entries + Tree->Slots[Slot];
+		ml_value_t *Old = Entry->Value;
+		Entry->Value = Value;
+		return Old;
 	}
-	if (Slot[0]) {
-		ml_tree_update_depth(Slot[0]);
-		ml_tree_rebalance(Slot);
+	if (Tree->Used == Tree->Capacity - Tree->Capacity / 8) {
+		// Compact in place when enough entries have been removed, otherwise double the index.
+		ml_tree_rehash(Tree, Tree->Size < Tree->Used / 2 ? Tree->Used : 2 * Tree->Used + 1);
 	}
-	return Removed;
+	ml_tree_entry_t *Entry = Tree->Entries + Tree->Used;
+	Entry->Key = Key;
+	Entry->Value = Value;
+	Entry->Hash = Hash;
+	ml_tree_place(Tree, Hash, Tree->Used++);
+	++Tree->Size;
+	return NULL;
 }
 
 ml_value_t *ml_tree_remove(ml_tree_t *Tree, ml_value_t *Key) {
-	return ml_tree_remove_internal(Tree, &Tree->Root, ml_hash(Key), Key);
+	ml_value_t *Error = 0;
+	int Slot = ml_tree_find(Tree, ml_tree_hash(Key), Key, &Error);
+	if (Error) return Error;
+	if (Slot < 0) return MLNil;
+	ml_tree_entry_t *Entry = Tree->Entries + Tree->Slots[Slot];
+	ml_value_t *Removed = Entry->Value;
+	Entry->Key = Entry->Value = 0;
+	Tree->Control[Slot] = ML_TREE_DELETED;
+	if (!--Tree->Size) ml_tree_rehash(Tree, 0);
+	return Removed;
 }
 
-static ml_value_t *ml_tree_index_get(void *Data, const char *Name) {
-	ml_tree_t *Tree = (ml_tree_t *)Data;
-	ml_value_t *Key = (ml_value_t *)Name;
-	return ml_tree_search(Tree, Key);
+typedef struct ml_tree_ref_t {
+	const ml_type_t *Type;
+	ml_tree_t *Tree;
+	ml_value_t *Key;
+} ml_tree_ref_t;
+
+static ml_value_t *ml_tree_ref_deref(ml_value_t *Ref) {
+	ml_tree_ref_t *Reference = (ml_tree_ref_t *)Ref;
+	return ml_tree_search(Reference->Tree, Reference->Key);
 }
 
-static ml_value_t *ml_tree_index_set(void *Data, const char *Name, ml_value_t *Value) {
-	ml_tree_t *Tree = (ml_tree_t *)Data;
-	ml_value_t *Key = (ml_value_t *)Name;
-	ml_tree_insert(Tree, Key, Value);
+static ml_value_t *ml_tree_ref_assign(ml_value_t *Ref, ml_value_t *Value) {
+	ml_tree_ref_t *Reference = (ml_tree_ref_t *)Ref;
+	ml_value_t *Old = ml_tree_insert(Reference->Tree, Reference->Key, Value);
+	if (Old && ml_typeof(Old) == MLErrorT) return Old;
 	return Value;
 }
 
+ml_type_t MLTreeRefT[1] = {{
+	MLAnyT, "tree-reference",
+	ml_default_hash,
+	ml_default_call,
+	ml_tree_ref_deref,
+	ml_tree_ref_assign,
+	ml_default_next,
+	ml_default_key
+}};
+
 static ml_value_t *ml_tree_size(void *Data, int Count, ml_value_t **Args) {
 	ml_tree_t *Tree = (ml_tree_t *)Args[0];
 	return ml_integer(Tree->Size);
@@ -1009,8 +1286,11 @@ static ml_value_t *ml_tree_size(void *Data, int Count, ml_value_t **Args) {
 static ml_value_t *ml_tree_index(void *Data, int Count, ml_value_t **Args) {
 	ml_tree_t *Tree = (ml_tree_t *)Args[0];
 	if (Count < 1) return MLNil;
-	ml_value_t *Key = Args[1];
-	return ml_property(Tree, (const char *)Key, ml_tree_index_get, ml_tree_index_set, NULL, NULL);
+	ml_tree_ref_t *Reference = new(ml_tree_ref_t);
+	Reference->Type = MLTreeRefT;
+	Reference->Tree = Tree;
+	Reference->Key = Args[1];
+	return (ml_value_t *)Reference;
 }
 
 static ml_value_t *ml_tree_delete(void *Data, int Count, ml_value_t **Args) {
@@ -1020,6 +1300,19 @@ static ml_value_t *ml_tree_delete(void *Data, int Count, ml_value_t **Args) {
 	return ml_tree_remove(Tree, Key);
 }
 
+static ml_value_t *ml_tree_reserve_method(void *Data, int Count, ml_value_t **Args) {
+	ml_tree_t *Tree = (ml_tree_t *)Args[0];
+	long Size = ml_integer_value(Args[1]);
+	if (Size < 0 || Size > INT_MAX / 2) return ml_error("RangeError", "invalid tree size %ld", Size);
+	ml_tree_reserve(Tree, Size);
+	return Args[0];
+}
+
+static ml_value_t *ml_tree_shrink_method(void *Data, int Count, ml_value_t **Args) {
+	ml_tree_shrink((ml_tree_t *)Args[0]);
+	return Args[0];
+}
+
 ml_type_t MLTreeT[1] = {{
 	MLAnyT, "tree",
 	ml_default_hash,
@@ -1037,24 +1330,22 @@ ml_value_t *ml_tree() {
 }
 
 int ml_is_tree(ml_value_t *Value) {
-	return Value->Type == MLTreeT;
-}
-
-static int ml_tree_node_foreach(ml_tree_node_t *Node, void *Data, int (*callback)(ml_value_t *, ml_value_t *, void *)) {
-	if (callback(Node->Key, Node->Value, Data)) return 1;
-	if (Node->Left && ml_tree_node_foreach(Node->Left, Data, callback)) return 1;
-	if (Node->Right && ml_tree_node_foreach(Node->Right, Data, callback)) return 1;
-	return 0;
+	return ml_typeof(Value) == MLTreeT;
 }
 
 int ml_tree_foreach(ml_value_t *Value, void *Data, int (*callback)(ml_value_t *, ml_value_t *, void *)) {
 	ml_tree_t *Tree = (ml_tree_t *)Value;
-	return Tree->Root ? ml_tree_node_foreach(Tree->Root, Data, callback) : 0;
+	for (int I = 0; I < Tree->Used; ++I) {
+		ml_tree_entry_t *Entry = Tree->Entries + I;
+		if (Entry->Key && callback(Entry->Key, Entry->Value, Data)) return 1;
+	}
+	return 0;
 }
 
 static ml_value_t *ml_tree_new(void *Data, int Count, ml_value_t **Args) {
 	ml_tree_t *Tree = new(ml_tree_t);
 	Tree->Type = MLTreeT;
+	ml_tree_reserve(Tree, Count / 2);
 	for (int I = 0; I < Count; I += 2) ml_tree_insert(Tree, Args[I], Args[I + 1]);
 	return (ml_value_t *)Tree;
 }
@@ -1127,6 +1418,7 @@ ml_value_t *ml_property(void *Data, const char *Name, ml_getter_t Get, ml_setter
 
 typedef struct ml_closure_info_t {
 	ml_inst_t *Entry;
+	unsigned char *Boxed;
 	int FrameSize;
 	int NumParams, NumUpValues;
 	unsigned char Hash[SHA256_BLOCK_SIZE];
@@ -1143,13 +1435,101 @@ void ml_closure_hash(ml_value_t *Value, unsigned char Hash[SHA256_BLOCK_SIZE]) {
 	memcpy(Hash, Closure->Info->Hash, SHA256_BLOCK_SIZE);
 }
 
+ml_value_t **ml_closure_upvalues(ml_value_t *Value, int *Count) {
+	ml_closure_t *Closure = (ml_closure_t *)Value;
+	Count[0] = Closure->Info->NumUpValues;
+	return Closure->UpValues;
+}
+
 struct ml_frame_t {
 	ml_inst_t *OnError;
 	ml_value_t **UpValues;
 	ml_value_t **Top;
+	ml_frame_t *Caller, *Up;
+	ml_inst_t *Resume, *Inst;
+	ml_value_t *Generator;
+	int Suspendable, Pool;
 	ml_value_t *Stack[];
 };
 
+#define ML_FRAME_POOLS 5
+#define ML_FRAME_POOL_LIMIT 64
+
+static __thread struct {
+	ml_frame_t *Frames;
+	int Count;
+} FramePools[ML_FRAME_POOLS];
+
+static ml_frame_t *ml_frame_alloc(int Size) {
+	int Pool = 0, PoolSize = 8;
+	while (PoolSize < Size && Pool < ML_FRAME_POOLS) PoolSize <<= 1, ++Pool;
+	if (Pool == ML_FRAME_POOLS) return xnew(ml_frame_t, Size, ml_value_t *);
+	ml_frame_t *Frame = FramePools[Pool].Frames;
+	if (Frame) {
+		FramePools[Pool].Frames = Frame->Caller;
+		--FramePools[Pool].Count;
+		Frame->Caller = 0;
+	} else {
+		Frame = (ml_frame_t *)GC_MALLOC_UNCOLLECTABLE(sizeof(ml_frame_t) + PoolSize * sizeof(ml_value_t *));
+		Frame->Pool = Pool + 1;
+	}
+	return Frame;
+}
+
+static void ml_frame_release(ml_frame_t *Frame) {
+	int Pool = Frame->Pool - 1;
+	if (Pool < 0) return;
+	memset(Frame, 0, sizeof(ml_frame_t) + (8 << Pool) * sizeof(ml_value_t *));
+	if (FramePools[Pool].Count == ML_FRAME_POOL_LIMIT) {
+		GC_FREE(Frame);
+		return;
+	}
+	Frame->Pool = Pool + 1;
+	Frame->Caller = FramePools[Pool].Frames;
+	FramePools[Pool].Frames = Frame;
+	++FramePools[Pool].Count;
+}
+
+static ml_frame_t *ml_frame_promote(ml_frame_t *Frame) {
+	if (!Frame->Pool) return Frame;
+	int Size = 8 << (Frame->Pool - 1);
+	ml_frame_t *Heap = xnew(ml_frame_t, Size, ml_value_t *);
+	memcpy(Heap, Frame, sizeof(ml_frame_t) + Size * sizeof(ml_value_t *));
+	Heap->Top = Heap->Stack + (Frame->Top - Frame->Stack);
+	Heap->Pool = 0;
+	return Heap;
+}
+
+typedef struct ml_suspension_t {
+	const ml_type_t *Type;
+	ml_frame_t *Frame, *Outer;
+	ml_value_t *Cancel;
+} ml_suspension_t;
+
+ml_type_t MLSuspensionT[1] = {{
+	MLAnyT, "suspension",
+	ml_default_hash,
+	ml_default_call,
+	ml_default_deref,
+	ml_default_assign,
+	ml_default_next,
+	ml_default_key
+}};
+
+ml_value_t *ml_suspend() {
+	ml_suspension_t *Suspension = new(ml_suspension_t);
+	Suspension->Type = MLSuspensionT;
+	return (ml_value_t *)Suspension;
+}
+
+ml_value_t *ml_suspend_cancellable(ml_value_t *Cancel) {
+	// Cancel is called with no arguments if the suspension is returned to a frame that can not suspend.
+	ml_suspension_t *Suspension = new(ml_suspension_t);
+	Suspension->Type = MLSuspensionT;
+	Suspension->Cancel = Cancel;
+	return (ml_value_t *)Suspension;
+}
+
 typedef union {
 	ml_inst_t *Inst;
 	int Index;
@@ -1158,34 +1538,471 @@ typedef union {
 	const char *Name;
 	ml_closure_info_t *ClosureInfo;
 	ra_schema_field_t *RaField;
+	unsigned char *Boxed;
+	ml_method_cache_t *MethodCache;
+	ml_value_t *(*Fast)(ml_value_t *, ml_value_t *);
+	ml_frame_t *Frame;
 } ml_param_t;
 
+#define ML_OPCODES \
+	ML_OPCODE(PUSH, push) \
+	ML_OPCODE(POP, pop) \
+	ML_OPCODE(POP2, pop2) \
+	ML_OPCODE(ENTER, enter) \
+	ML_OPCODE(VAR, var) \
+	ML_OPCODE(VAR_UNBOXED, var_unboxed) \
+	ML_OPCODE(DEF, def) \
+	ML_OPCODE(EXIT, exit) \
+	ML_OPCODE(TRY, try) \
+	ML_OPCODE(CATCH, catch) \
+	ML_OPCODE(CALL, call) \
+	ML_OPCODE(CONST_CALL, const_call) \
+	ML_OPCODE(ASSIGN, assign) \
+	ML_OPCODE(ASSIGN_UNBOXED, assign_unboxed) \
+	ML_OPCODE(JUMP, jump) \
+	ML_OPCODE(IF, if) \
+	ML_OPCODE(UNTIL, until) \
+	ML_OPCODE(WHILE, while) \
+	ML_OPCODE(AND, and) \
+	ML_OPCODE(OR, or) \
+	ML_OPCODE(EXISTS, exists) \
+	ML_OPCODE(LOOP, loop) \
+	ML_OPCODE(NEXT, next) \
+	ML_OPCODE(KEY, key) \
+	ML_OPCODE(SUSP, susp) \
+	ML_OPCODE(LOCAL, local) \
+	ML_OPCODE(LIST, list) \
+	ML_OPCODE(APPEND, append) \
+	ML_OPCODE(CLOSURE, closure) \
+	ML_OPCODE(RA_FIELDS, ra_fields) \
+	ML_OPCODE(ADD, add) \
+	ML_OPCODE(ADD_CONST, add_const) \
+	ML_OPCODE(SUB, sub) \
+	ML_OPCODE(SUB_CONST, sub_const) \
+	ML_OPCODE(MUL, mul) \
+	ML_OPCODE(MUL_CONST, mul_const) \
+	ML_OPCODE(DIV, div) \
+	ML_OPCODE(DIV_CONST, div_const) \
+	ML_OPCODE(MOD, mod) \
+	ML_OPCODE(MOD_CONST, mod_const) \
+	ML_OPCODE(EQ, eq) \
+	ML_OPCODE(EQ_CONST, eq_const) \
+	ML_OPCODE(NEQ, neq) \
+	ML_OPCODE(NEQ_CONST, neq_const) \
+	ML_OPCODE(LES, les) \
+	ML_OPCODE(LES_CONST, les_const) \
+	ML_OPCODE(GRE, gre) \
+	ML_OPCODE(GRE_CONST, gre_const) \
+	ML_OPCODE(LEQ, leq) \
+	ML_OPCODE(LEQ_CONST, leq_const) \
+	ML_OPCODE(GEQ, geq) \
+	ML_OPCODE(GEQ_CONST, geq_const) \
+	ML_OPCODE(LOCAL_NUMBER_CONST, local_number_const) \
+	ML_OPCODE(LOCAL_CALL, local_call) \
+	ML_OPCODE(LOCAL_CONST_CALL, local_const_call) \
+	ML_OPCODE(EQ_IF, eq_if) \
+	ML_OPCODE(EQ_CONST_IF, eq_const_if) \
+	ML_OPCODE(NEQ_IF, neq_if) \
+	ML_OPCODE(NEQ_CONST_IF, neq_const_if) \
+	ML_OPCODE(LES_IF, les_if) \
+	ML_OPCODE(LES_CONST_IF, les_const_if) \
+	ML_OPCODE(GRE_IF, gre_if) \
+	ML_OPCODE(GRE_CONST_IF, gre_const_if) \
+	ML_OPCODE(LEQ_IF, leq_if) \
+	ML_OPCODE(LEQ_CONST_IF, leq_const_if) \
+	ML_OPCODE(GEQ_IF, geq_if) \
+	ML_OPCODE(GEQ_CONST_IF, geq_const_if) \
+	ML_OPCODE(NEXT_RESUME, next_resume)
+
+typedef enum {
+#define ML_OPCODE(OP, NAME) MLI_ ## OP,
+	ML_OPCODES
+#undef ML_OPCODE
+	MLI_COUNT
+} ml_opcode_t;
+
 struct ml_inst_t {
-	ml_inst_t *(*run)(ml_inst_t *Inst, ml_frame_t *Frame);
+	ml_opcode_t Opcode;
+	int NumParams;
 	ml_source_t Source;
 	ml_param_t Params[];
 };
 
-static ml_value_t *ml_closure_call(ml_value_t *Value, int Count, ml_value_t **Args) {
+#define ML_OPCODE(OP, NAME) static ml_inst_t *mli_ ## NAME ## _run(ml_inst_t *Inst, ml_frame_t *Frame);
+ML_OPCODES
+#undef ML_OPCODE
+
+#define ML_FUEL_INTERVAL 1024
+
+static __thread long FuelTicks = LONG_MAX, FuelBudget = -1;
+static __thread long *FuelShared = NULL;
+static __thread struct timespec FuelDeadline[1];
+static __thread int FuelTimed = 0;
+static __thread volatile sig_atomic_t ProfilePending = 0;
+static __thread long ProfileTicks;
+
+static void ml_fuel_refill() {
+	long Ticks = FuelTimed ? ML_FUEL_INTERVAL : LONG_MAX;
+	if (FuelShared) {
+		// Threads sharing a budget take it a slice at a time, so together they overrun it by less than
+		// a slice each.
+		if (Ticks > ML_FUEL_INTERVAL) Ticks = ML_FUEL_INTERVAL;
+		long Budget = __atomic_load_n(FuelShared, __ATOMIC_RELAXED), Take;
+		do Take = Budget < Ticks ? Budget : Ticks;
+		while (!__atomic_compare_exchange_n(FuelShared, &Budget, Budget - Take, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+		if (Take < Ticks) FuelBudget = 0;
+		Ticks = Take;
+	} else if (FuelBudget >= 0) {
+		if (FuelBudget < Ticks) Ticks = FuelBudget;
+		FuelBudget -= Ticks;
+	}
+	FuelTicks = Ticks;
+}
+
+void ml_fuel_set(long Ticks, long Nanoseconds) {
+	FuelBudget = Ticks > 0 ? Ticks : -1;
+	if ((FuelTimed = Nanoseconds > 0)) {
+		clock_gettime(CLOCK_MONOTONIC, FuelDeadline);
+		FuelDeadline->tv_sec += Nanoseconds / 1000000000;
+		FuelDeadline->tv_nsec += Nanoseconds % 1000000000;
+		if (FuelDeadline->tv_nsec >= 1000000000) {
+			FuelDeadline->tv_sec += 1;
+			FuelDeadline->tv_nsec -= 1000000000;
+		}
+	}
+	ml_fuel_refill();
+	if (ProfilePending) {
+		ProfileTicks = FuelTicks;
+		FuelTicks = 0;
+	}
+}
+
+void ml_fuel_clear() {
+	FuelTicks = LONG_MAX;
+	FuelBudget = -1;
+	FuelShared = NULL;
+	FuelTimed = 0;
+	if (ProfilePending) {
+		ProfileTicks = FuelTicks;
+		FuelTicks = 0;
+	}
+}
+
+// Work handed to other threads runs on the fuel left to the thread handing it out: ml_fuel_save()
+// moves that fuel into a shared pool, every thread running the work (including this one) calls
+// ml_fuel_share() on it and ml_fuel_restore() takes back what is left once the work is done.
+
+void ml_fuel_save(ml_fuel_t *Fuel) {
+	long Ticks = ProfilePending ? ProfileTicks : FuelTicks;
+	if (Ticks < 0) Ticks = 0;
+	Fuel->Budget = FuelBudget < 0 ? -1 : FuelBudget + Ticks;
+	Fuel->Timed = FuelTimed;
+	Fuel->Deadline = FuelDeadline[0];
+}
+
+void ml_fuel_share(ml_fuel_t *Fuel) {
+	FuelBudget = -1;
+	FuelShared = Fuel->Budget >= 0 ? &Fuel->Budget : NULL;
+	FuelTimed = Fuel->Timed;
+	FuelDeadline[0] = Fuel->Deadline;
+	ml_fuel_refill();
+	if (ProfilePending) {
+		ProfileTicks = FuelTicks;
+		FuelTicks = 0;
+	}
+}
+
+void ml_fuel_restore(ml_fuel_t *Fuel) {
+	FuelShared = NULL;
+	FuelBudget = Fuel->Budget;
+	ml_fuel_refill();
+	if (ProfilePending) {
+		ProfileTicks = FuelTicks;
+		FuelTicks = 0;
+	}
+}
+
+// The profiler samples on SIGPROF from a CPU time timer per interpreting thread, armed when the
+// thread next enters the interpreter and deleted when it enters after profiling stops or when the
+// thread exits. The handler zeroes the thread's fuel ticks so the next fuel
+// check (at every call, loop and iteration) records the running frames and then carries on with
+// the ticks it had left.
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+#define ML_PROFILE_MAX_DEPTH 64
+
+static __thread ml_frame_t *CurrentFrame = NULL;
+static __thread int ThreadProfileEpoch = 0, ThreadProfileTimed = 0;
+static __thread timer_t ThreadProfileTimer;
+static pthread_mutex_t ProfileLock[1] = {PTHREAD_MUTEX_INITIALIZER};
+static stringmap_t ProfileStacks[1] = {STRINGMAP_INIT};
+static stringmap_t ProfileLines[1] = {STRINGMAP_INIT};
+static long ProfileSamples = 0, ProfileNumLines = 0, ProfileInterval = 0;
+static volatile int ProfileEpoch = 0, ProfileActive = 0;
+static int ProfileInstalled = 0;
+static pthread_once_t ProfileKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t ProfileKey;
+
+static void ml_profile_timer_delete() {
+	if (!ThreadProfileTimed) return;
+	timer_delete(ThreadProfileTimer);
+	ThreadProfileTimed = 0;
+}
+
+static void ml_profile_thread_exit(void *Data) {
+	ml_profile_timer_delete();
+}
+
+static void ml_profile_key_create() {
+	pthread_key_create(&ProfileKey, ml_profile_thread_exit);
+}
+
+static void ml_profile_thread() {
+	ThreadProfileEpoch = ProfileEpoch;
+	if (!ProfileActive) {
+		ml_profile_timer_delete();
+		return;
+	}
+	if (!ThreadProfileTimed) {
+		struct sigevent Event[1];
+		memset(Event, 0, sizeof(struct sigevent));
+		Event->sigev_notify = SIGEV_THREAD_ID;
+		Event->sigev_signo = SIGPROF;
+		Event->sigev_notify_thread_id = syscall(SYS_gettid);
+		if (timer_create(CLOCK_THREAD_CPUTIME_ID, Event, &ThreadProfileTimer)) return;
+		ThreadProfileTimed = 1;
+		// The key's value is only there so that its destructor runs when the thread exits.
+		pthread_once(&ProfileKeyOnce, ml_profile_key_create);
+		pthread_setspecific(ProfileKey, &ThreadProfileTimer);
+	}
+	struct itimerspec Timer[1];
+	memset(Timer, 0, sizeof(struct itimerspec));
+	Timer->it_interval.tv_sec = ProfileInterval / 1000000000;
+	Timer->it_interval.tv_nsec = ProfileInterval % 1000000000;
+	Timer->it_value = Timer->it_interval;
+	timer_settime(ThreadProfileTimer, 0, Timer, NULL);
+}
+
+static void ml_profile_signal(int Signal) {
+	if (!ProfileActive || ProfilePending) return;
+	ProfileTicks = FuelTicks;
+	FuelTicks = 0;
+	ProfilePending = 1;
+}
+
+static int ml_profile_count(stringmap_t *Counts, const char *Key, int Length) {
+	long Count = (long)stringmap_search(Counts, Key);
+	if (!Count) {
+		char *Copy = snew(Length + 1);
+		memcpy(Copy, Key, Length + 1);
+		Key = Copy;
+	}
+	stringmap_insert(Counts, Key, (void *)(Count + 1));
+	return !Count;
+}
+
+static void ml_profile_sample(ml_frame_t *Frame) {
+	ml_frame_t *Frames[ML_PROFILE_MAX_DEPTH];
+	int Depth = 0;
+	for (; Frame && Depth < ML_PROFILE_MAX_DEPTH; Frame = Frame->Up) if (Frame->Inst) Frames[Depth++] = Frame;
+	if (!Depth) return;
+	char Stack[ML_PROFILE_MAX_DEPTH * 64], *End = Stack + sizeof(Stack), *P = Stack;
+	for (int I = Depth; --I >= 0 && P < End;) {
+		ml_source_t Source = Frames[I]->Inst->Source;
+		P += snprintf(P, End - P, "%s%s:%d", P == Stack ? "" : ";", Source.Name ?: "?", Source.Line);
+	}
+	if (P >= End) P = End - 1;
+	P[0] = 0;
+	ml_source_t Source = Frames[0]->Inst->Source;
+	char Line[256];
+	int LineLength = snprintf(Line, sizeof(Line), "%s:%d", Source.Name ?: "?", Source.Line);
+	if (LineLength >= sizeof(Line)) LineLength = sizeof(Line) - 1;
+	pthread_mutex_lock(ProfileLock);
+	ml_profile_count(ProfileStacks, Stack, P - Stack);
+	ProfileNumLines += ml_profile_count(ProfileLines, Line, LineLength);
+	++ProfileSamples;
+	pthread_mutex_unlock(ProfileLock);
+}
+
+static int ml_fuel_exhausted() {
+	if (ProfilePending) {
+		ProfilePending = 0;
+		ml_profile_sample(CurrentFrame);
+		if (ProfileTicks > 0) {
+			FuelTicks = ProfileTicks;
+			return 0;
+		}
+	}
+	if (FuelBudget == 0) return 1;
+	if (FuelTimed) {
+		struct timespec Now[1];
+		clock_gettime(CLOCK_MONOTONIC, Now);
+		if (Now->tv_sec > FuelDeadline->tv_sec || (Now->tv_sec == FuelDeadline->tv_sec && Now->tv_nsec >= FuelDeadline->tv_nsec)) {
+			FuelBudget = 0;
+			return 1;
+		}
+	}
+	ml_fuel_refill();
+	return 0;
+}
+
+ml_value_t *ml_profile_start(void *Data, int Count, ml_value_t **Args) {
+	long Frequency = 997;
+	if (Count > 0) {
+		ML_CHECK_ARG_TYPE(0, MLIntegerT);
+		Frequency = ml_integer_value(Args[0]);
+		if (Frequency <= 0 || Frequency > 10000) return ml_error("ValueError", "profile frequency must be between 1 and 10000");
+	}
+	pthread_mutex_lock(ProfileLock);
+	ProfileStacks[0] = STRINGMAP_INIT;
+	ProfileLines[0] = STRINGMAP_INIT;
+	ProfileSamples = ProfileNumLines = 0;
+	pthread_mutex_unlock(ProfileLock);
+	if (!ProfileInstalled) {
+		struct sigaction Action[1];
+		memset(Action, 0, sizeof(struct sigaction));
+		Action->sa_handler = ml_profile_signal;
+		Action->sa_flags = SA_RESTART;
+		sigemptyset(&Action->sa_mask);
+		sigaction(SIGPROF, Action, NULL);
+		ProfileInstalled = 1;
+	}
+	ProfileInterval = 1000000000L / Frequency;
+	ProfileActive = 1;
+	++ProfileEpoch;
+	ml_profile_thread();
+	return MLNil;
+}
+
+ml_value_t *ml_profile_stop(void *Data, int Count, ml_value_t **Args) {
+	ProfileActive = 0;
+	++ProfileEpoch;
+	ml_profile_thread();
+	return ml_integer(ProfileSamples);
+}
+
+static int ml_profile_write(const char *Stack, void *Count, FILE *File) {
+	fprintf(File, "%s %ld\n", Stack, (long)Count);
+	return 0;
+}
+
+ml_value_t *ml_profile_dump(void *Data, int Count, ml_value_t **Args) {
+	FILE *File = stdout;
+	if (Count > 0) {
+		ML_CHECK_ARG_TYPE(0, MLStringT);
+		File = fopen(ml_string_value(Args[0]), "w");
+		if (!File) return ml_error("IOError", "failed to open %s", ml_string_value(Args[0]));
+	}
+	pthread_mutex_lock(ProfileLock);
+	stringmap_foreach(ProfileStacks, File, (void *)ml_profile_write);
+	pthread_mutex_unlock(ProfileLock);
+	if (File != stdout) fclose(File); else fflush(File);
+	return MLNil;
+}
+
+typedef struct {
+	const char *Line;
+	long Count;
+} ml_profile_line_t;
+
+static int ml_profile_collect(const char *Line, void *Count, ml_profile_line_t **Slot) {
+	Slot[0]->Line = Line;
+	Slot[0]->Count = (long)Count;
+	++Slot[0];
+	return 0;
+}
+
+static int ml_profile_compare(const ml_profile_line_t *A, const ml_profile_line_t *B) {
+	if (A->Count != B->Count) return A->Count < B->Count ? 1 : -1;
+	return strcmp(A->Line, B->Line);
+}
+
+ml_value_t *ml_profile_top(void *Data, int Count, ml_value_t **Args) {
+	long Limit = 20;
+	if (Count > 0) {
+		ML_CHECK_ARG_TYPE(0, MLIntegerT);
+		Limit = ml_integer_value(Args[0]);
+	}
+	pthread_mutex_lock(ProfileLock);
+	int NumLines = ProfileNumLines;
+	long Samples = ProfileSamples;
+	ml_profile_line_t *Lines = anew(ml_profile_line_t, NumLines + 1), *Slot = Lines;
+	stringmap_foreach(ProfileLines, &Slot, (void *)ml_profile_collect);
+	pthread_mutex_unlock(ProfileLock);
+	qsort(Lines, NumLines, sizeof(ml_profile_line_t), (void *)ml_profile_compare);
+	if (Limit > NumLines) Limit = NumLines;
+	printf("%8s %7s  %s\n", "Samples", "Percent", "Line");
+	for (int I = 0; I < Limit; ++I) {
+		printf("%8ld %6.1f%%  %s\n", Lines[I].Count, 100.0 * Lines[I].Count / Samples, Lines[I].Line);
+	}
+	fflush(stdout);
+	return MLNil;
+}
+
+#define ML_FUEL_CHECK(INST, FRAME) \
+	FRAME->Inst = INST; \
+	if (__builtin_expect(--FuelTicks < 0, 0) && ml_fuel_exhausted()) { \
+		ml_value_t *Error = ml_error("TimeoutError", "handler exceeded its time or instruction limit"); \
+		ml_error_trace_add(Error, INST->Source); \
+		(FRAME->Top++)[0] = Error; \
+		return FRAME->OnError; \
+	}
+
+static ml_value_t *ml_frame_run(ml_frame_t *Frame, ml_inst_t *Inst) {
+	static void *Labels[] = {
+#define ML_OPCODE(OP, NAME) &&DO_ ## OP,
+		ML_OPCODES
+#undef ML_OPCODE
+	};
+#define ML_DISPATCH if (!Inst) goto done; goto *Labels[Inst->Opcode]
+	Frame->Up = CurrentFrame;
+	if (!CurrentFrame && ThreadProfileEpoch != ProfileEpoch) ml_profile_thread();
+	CurrentFrame = Frame;
+	ML_DISPATCH;
+#define ML_OPCODE(OP, NAME) DO_ ## OP: Inst = mli_ ## NAME ## _run(Inst, Frame); ML_DISPATCH;
+	ML_OPCODES
+#undef ML_OPCODE
+#undef ML_DISPATCH
+done:;
+	CurrentFrame = Frame->Up;
+	ml_value_t *Result = Frame->Top[-1];
+	return ml_typeof(Result)->deref(Result);
+}
+
+static ml_value_t *ml_closure_call_internal(ml_value_t *Value, int Count, ml_value_t **Args, int Suspendable) {
 	ml_closure_t *Closure = (ml_closure_t *)Value;
 	ml_closure_info_t *Info = Closure->Info;
-	ml_frame_t *Frame = xnew(ml_frame_t, Info->FrameSize, ml_value_t *);
+	ml_frame_t *Frame = ml_frame_alloc(Info->FrameSize);
 	int NumParams = Info->NumParams;
 	int VarArgs = 0;
 	if (NumParams < 0) {
 		VarArgs = 1;
-		NumParams = ~NumParams;
+		NumParams = ~NumParams - 1;
 	}
+	int NumArgs = Count;
 	if (Count > NumParams) Count = NumParams;
+	unsigned char *Boxed = Info->Boxed;
 	for (int I = 0; I < Count; ++I) {
+		ml_value_t *Value = Args[I];
+		Value = ml_typeof(Value)->deref(Value);
+		if (Boxed && !Boxed[I]) {
+			Frame->Stack[I] = Value;
+			continue;
+		}
 		ml_reference_t *Local = xnew(ml_reference_t, 1, ml_value_t *);
 		Local->Type = MLReferenceT;
 		Local->Address = Local->Value;
-		ml_value_t *Value = Args[I];
-		Local->Value[0] = Value->Type->deref(Value);
+		Local->Value[0] = Value;
 		Frame->Stack[I] = (ml_value_t *)Local;
 	}
 	for (int I = Count; I < NumParams; ++I) {
+		if (Boxed && !Boxed[I]) {
+			Frame->Stack[I] = MLNil;
+			continue;
+		}
 		ml_reference_t *Local = xnew(ml_reference_t, 1, ml_value_t *);
 		Local->Type = MLReferenceT;
 		Local->Address = Local->Value;
@@ -1196,29 +2013,125 @@ static ml_value_t *ml_closure_call(ml_value_t *Value, int Count, ml_value_t **Ar
 		ml_reference_t *Local = xnew(ml_reference_t, 1, ml_value_t *);
 		Local->Type = MLReferenceT;
 		Local->Address = Local->Value;
-		ml_list_t *Rest = new(ml_list_t);
-		int Length = 0;
-		ml_list_node_t **Next = &Rest->Head;
-		ml_list_node_t *Prev = Next[0] = 0;
-		for (int I = NumParams; I < Count; ++I) {
-			ml_list_node_t *Node = new(ml_list_node_t);
-			Node->Prev = Prev;
-			Next[0] = Prev = Node;
-			Next = &Node->Next;
-			++Length;
+		int Length = NumArgs > NumParams ? NumArgs - NumParams : 0;
+		ml_list_t *Rest = ml_list_sized(Length);
+		for (int I = 0; I < Length; ++I) {
+			ml_value_t *Value = Args[NumParams + I];
+			Rest->Values[I] = ml_typeof(Value)->deref(Value);
 		}
-		Rest->Tail = Prev;
-		Rest->Length = Length;
 		Local->Value[0] = (ml_value_t *)Rest;
-		Frame->Stack[NumParams] = (ml_value_t *)Local;
+		Frame->Stack[NumParams] = (Boxed && !Boxed[NumParams]) ? (ml_value_t *)Rest : (ml_value_t *)Local;
+	}
+	Frame->Top = Frame->Stack + NumParams + VarArgs;
+	Frame->OnError = NULL;
+	Frame->UpValues = Closure->UpValues;
+	Frame->Suspendable = Suspendable;
+	ml_value_t *Result = ml_frame_run(Frame, Closure->Info->Entry);
+	ml_frame_release(Frame);
+	return Result;
+}
+
+static ml_value_t *ml_closure_call(ml_value_t *Value, int Count, ml_value_t **Args) {
+	return ml_closure_call_internal(Value, Count, Args, 0);
+}
+
+ml_value_t *ml_coroutine_call(ml_value_t *Value, int Count, ml_value_t **Args) {
+	if (ml_typeof(Value) == MLClosureT) return ml_closure_call_internal(Value, Count, Args, 1);
+	return ml_call(Value, Count, Args);
+}
+
+ml_value_t *ml_resume(ml_value_t *Value, ml_value_t *Result) {
+	ml_suspension_t *Suspension = (ml_suspension_t *)Value;
+	ml_frame_t *Frame = Suspension->Frame;
+	if (!Frame) return Result;
+	Suspension->Frame = 0;
+	for (;;) {
+		ml_frame_t *Caller = Frame->Caller;
+		Frame->Caller = 0;
+		Frame->Top[-1] = Result;
+		Result = ml_frame_run(Frame, ml_typeof(Result) == MLErrorT ? Frame->OnError : Frame->Resume);
+		if (ml_typeof(Result) == MLSuspensionT) {
+			ml_suspension_t *Next = (ml_suspension_t *)Result;
+			if (Caller) {
+				Next->Outer->Caller = Caller;
+				Next->Outer = Suspension->Outer;
+			}
+			return Result;
+		}
+		if (!Caller) return Result;
+		Frame = Caller;
+	}
+}
+
+// A closure that executes susp returns a generator holding its suspended frame. The generator is
+// an ordinary value so it can be passed around; values() gives the iterator that resumes it.
+
+typedef struct ml_generator_t {
+	const ml_type_t *Type;
+	ml_frame_t *Frame;
+	ml_value_t *Value, *Iter;
+	long Index;
+} ml_generator_t;
+
+ml_type_t MLGeneratorT[1] = {{
+	MLAnyT, "generator",
+	ml_default_hash,
+	ml_default_call,
+	ml_default_deref,
+	ml_default_assign,
+	ml_default_next,
+	ml_default_key
+}};
+
+typedef struct ml_generator_iter_t {
+	const ml_type_t *Type;
+	ml_generator_t *Generator;
+} ml_generator_iter_t;
+
+static ml_value_t *ml_generator_iter_deref(ml_value_t *Ref) {
+	ml_generator_iter_t *Iter = (ml_generator_iter_t *)Ref;
+	return Iter->Generator->Value;
+}
+
+static ml_value_t *ml_generator_iter_next(ml_value_t *Ref) {
+	ml_generator_iter_t *Iter = (ml_generator_iter_t *)Ref;
+	ml_generator_t *Generator = Iter->Generator;
+	ml_frame_t *Frame = Generator->Frame;
+	if (!Frame) return MLNil;
+	Frame->Top[-1] = MLNil;
+	Frame->Suspendable = 0;
+	ml_value_t *Result = ml_frame_run(Frame, Frame->Resume);
+	if (Result == (ml_value_t *)Generator) return Ref;
+	Generator->Frame = 0;
+	Generator->Value = MLNil;
+	return ml_typeof(Result) == MLErrorT ? Result : MLNil;
+}
+
+static ml_value_t *ml_generator_iter_key(ml_value_t *Ref) {
+	ml_generator_iter_t *Iter = (ml_generator_iter_t *)Ref;
+	return ml_integer(Iter->Generator->Index);
+}
+
+ml_type_t MLGeneratorIterT[1] = {{
+	MLAnyT, "generator-iter",
+	ml_default_hash,
+	ml_default_call,
+	ml_generator_iter_deref,
+	ml_default_assign,
+	ml_generator_iter_next,
+	ml_generator_iter_key
+}};
+
+static ml_value_t *ml_generator_values(void *Data, int Count, ml_value_t **Args) {
+	ml_generator_t *Generator = (ml_generator_t *)Args[0];
+	if (!Generator->Frame) return MLNil;
+	if (!Generator->Iter) {
+		ml_generator_iter_t *Iter = new(ml_generator_iter_t);
+		Iter->Type = MLGeneratorIterT;
+		Iter->Generator = Generator;
+		Generator->Iter = (ml_value_t *)Iter;
 	}
-	Frame->Top = Frame->Stack + NumParams + VarArgs;
-	Frame->OnError = NULL;
-	Frame->UpValues = Closure->UpValues;
-	ml_inst_t *Inst = Closure->Info->Entry;
-	while (Inst) Inst = Inst->run(Inst, Frame);
-	ml_value_t *Result = Frame->Top[-1];
-	return Result->Type->deref(Result);
+	return Generator->Iter;
 }
 
 
@@ -1283,7 +2196,7 @@ static void ml_error_trace_add(ml_value_t *Value, ml_source_t Source) {
 }
 
 int ml_is_error(ml_value_t *Value) {
-	return Value->Type == MLErrorT;
+	return ml_typeof(Value) == MLErrorT;
 }
 
 const char *ml_error_type(ml_value_t *Value) {
@@ -1414,7 +2327,7 @@ ml_value_t *stringify_nil(void *Data, int Count, ml_value_t **Args) {
 
 ml_value_t *stringify_integer(void *Data, int Count, ml_value_t **Args) {
 	ml_stringbuffer_t *Buffer = (ml_stringbuffer_t *)Args[0];
-	ml_stringbuffer_addf(Buffer, "%d", ml_integer_value(Args[1]));
+	ml_stringbuffer_addf(Buffer, "%ld", ml_integer_value(Args[1]));
 	return MLSome;
 }
 
@@ -1430,6 +2343,11 @@ ml_value_t *stringify_string(void *Data, int Count, ml_value_t **Args) {
 	return ml_string_length(Args[1]) ? MLSome : MLNil;
 }
 
+ml_value_t *stringify_regex(void *Data, int Count, ml_value_t **Args) {
+	Args[1] = ((ml_regex_t *)Args[1])->Pattern;
+	return stringify_string(Data, Count, Args);
+}
+
 ml_value_t *stringify_method(void *Data, int Count, ml_value_t **Args) {
 	ml_stringbuffer_t *Buffer = (ml_stringbuffer_t *)Args[0];
 	ml_method_t *Method = (ml_method_t *)Args[1];
@@ -1439,12 +2357,13 @@ ml_value_t *stringify_method(void *Data, int Count, ml_value_t **Args) {
 
 ml_value_t *stringify_list(void *Data, int Count, ml_value_t **Args) {
 	ml_stringbuffer_t *Buffer = (ml_stringbuffer_t *)Args[0];
-	ml_list_node_t *Node = ((ml_list_t *)Args[1])->Head;
-	if (Node) {
-		ml_inline(AppendMethod, 2, Buffer, Node->Value);
-		while ((Node = Node->Next)) {
+	ml_list_t *List = (ml_list_t *)Args[1];
+	if (List->Length) {
+		ml_value_t **Values = List->Values + List->Offset;
+		ml_inline(AppendMethod, 2, Buffer, Values[0]);
+		for (int I = 1; I < List->Length; ++I) {
 			ml_stringbuffer_add(Buffer, " ", 1);
-			ml_inline(AppendMethod, 2, Buffer, Node->Value);
+			ml_inline(AppendMethod, 2, Buffer, Values[I]);
 		}
 		return MLSome;
 	} else {
@@ -1474,15 +2393,15 @@ ml_value_t *stringify_tree(void *Data, int Count, ml_value_t **Args) {
 
 #define ml_arith_method_integer(NAME, SYMBOL) \
 	static ml_value_t *ml_ ## NAME ## _integer(void *Data, int Count, ml_value_t **Args) { \
-		ml_integer_t *IntegerA = (ml_integer_t *)Args[0]; \
-		return ml_integer(SYMBOL(IntegerA->Value)); \
+		long IntegerA = ml_integer_value(Args[0]); \
+		return ml_integer(SYMBOL(IntegerA)); \
 	}
 
 #define ml_arith_method_integer_integer(NAME, SYMBOL) \
 	static ml_value_t *ml_ ## NAME ## _integer_integer(void *Data, int Count, ml_value_t **Args) { \
-		ml_integer_t *IntegerA = (ml_integer_t *)Args[0]; \
-		ml_integer_t *IntegerB = (ml_integer_t *)Args[1]; \
-		return ml_integer(IntegerA->Value SYMBOL IntegerB->Value); \
+		long IntegerA = ml_integer_value(Args[0]); \
+		long IntegerB = ml_integer_value(Args[1]); \
+		return ml_integer(IntegerA SYMBOL IntegerB); \
 	}
 
 #define ml_arith_method_real(NAME, SYMBOL) \
@@ -1501,15 +2420,15 @@ ml_value_t *stringify_tree(void *Data, int Count, ml_value_t **Args) {
 #define ml_arith_method_real_integer(NAME, SYMBOL) \
 	static ml_value_t *ml_ ## NAME ## _real_integer(void *Data, int Count, ml_value_t **Args) { \
 		ml_real_t *RealA = (ml_real_t *)Args[0]; \
-		ml_integer_t *IntegerB = (ml_integer_t *)Args[1]; \
-		return ml_real(RealA->Value SYMBOL IntegerB->Value); \
+		long IntegerB = ml_integer_value(Args[1]); \
+		return ml_real(RealA->Value SYMBOL IntegerB); \
 	}
 
 #define ml_arith_method_integer_real(NAME, SYMBOL) \
 	static ml_value_t *ml_ ## NAME ## _integer_real(void *Data, int Count, ml_value_t **Args) { \
-		ml_integer_t *IntegerA = (ml_integer_t *)Args[0]; \
+		long IntegerA = ml_integer_value(Args[0]); \
 		ml_real_t *RealB = (ml_real_t *)Args[1]; \
-		return ml_real(IntegerA->Value SYMBOL RealB->Value); \
+		return ml_real(IntegerA SYMBOL RealB->Value); \
 	}
 
 #define ml_arith_method_number(NAME, SYMBOL) \
@@ -1532,9 +2451,9 @@ ml_arith_method_integer_integer(mod, %)
 
 #define ml_comp_method_integer_integer(NAME, SYMBOL) \
 	static ml_value_t *ml_ ## NAME ## _integer_integer(void *Data, int Count, ml_value_t **Args) { \
-		ml_integer_t *IntegerA = (ml_integer_t *)Args[0]; \
-		ml_integer_t *IntegerB = (ml_integer_t *)Args[1]; \
-		return IntegerA->Value SYMBOL IntegerB->Value ? Args[1] : MLNil; \
+		long IntegerA = ml_integer_value(Args[0]); \
+		long IntegerB = ml_integer_value(Args[1]); \
+		return IntegerA SYMBOL IntegerB ? Args[1] : MLNil; \
 	}
 
 #define ml_comp_method_real_real(NAME, SYMBOL) \
@@ -1547,15 +2466,15 @@ ml_arith_method_integer_integer(mod, %)
 #define ml_comp_method_real_integer(NAME, SYMBOL) \
 	static ml_value_t *ml_ ## NAME ## _real_integer(void *Data, int Count, ml_value_t **Args) { \
 		ml_real_t *RealA = (ml_real_t *)Args[0]; \
-		ml_integer_t *IntegerB = (ml_integer_t *)Args[1]; \
-		return RealA->Value SYMBOL IntegerB->Value ? Args[1] : MLNil; \
+		long IntegerB = ml_integer_value(Args[1]); \
+		return RealA->Value SYMBOL IntegerB ? Args[1] : MLNil; \
 	}
 
 #define ml_comp_method_integer_real(NAME, SYMBOL) \
 	static ml_value_t *ml_ ## NAME ## _integer_real(void *Data, int Count, ml_value_t **Args) { \
-		ml_integer_t *IntegerA = (ml_integer_t *)Args[0]; \
+		long IntegerA = ml_integer_value(Args[0]); \
 		ml_real_t *RealB = (ml_real_t *)Args[1]; \
-		return IntegerA->Value SYMBOL RealB->Value ? Args[1] : MLNil; \
+		return IntegerA SYMBOL RealB->Value ? Args[1] : MLNil; \
 	}
 
 #define ml_comp_method_number_number(NAME, SYMBOL) \
@@ -1576,26 +2495,26 @@ static ml_integer_t NegOne[1] = {{MLIntegerT, -1}};
 static ml_integer_t Zero[1] = {{MLIntegerT, 0}};
 
 static ml_value_t *ml_compare_integer_integer(void *Data, int Count, ml_value_t **Args) {
-	ml_integer_t *IntegerA = (ml_integer_t *)Args[0];
-	ml_integer_t *IntegerB = (ml_integer_t *)Args[1];
-	if (IntegerA->Value < IntegerB->Value) return (ml_value_t *)NegOne;
-	if (IntegerA->Value > IntegerB->Value) return (ml_value_t *)One;
+	long IntegerA = ml_integer_value(Args[0]);
+	long IntegerB = ml_integer_value(Args[1]);
+	if (IntegerA < IntegerB) return (ml_value_t *)NegOne;
+	if (IntegerA > IntegerB) return (ml_value_t *)One;
 	return (ml_value_t *)Zero;
 }
 
 static ml_value_t *ml_compare_real_integer(void *Data, int Count, ml_value_t **Args) {
 	ml_real_t *RealA = (ml_real_t *)Args[0];
-	ml_integer_t *IntegerB = (ml_integer_t *)Args[1];
-	if (RealA->Value < IntegerB->Value) return (ml_value_t *)NegOne;
-	if (RealA->Value > IntegerB->Value) return (ml_value_t *)One;
+	long IntegerB = ml_integer_value(Args[1]);
+	if (RealA->Value < IntegerB) return (ml_value_t *)NegOne;
+	if (RealA->Value > IntegerB) return (ml_value_t *)One;
 	return (ml_value_t *)Zero;
 }
 
 static ml_value_t *ml_compare_integer_real(void *Data, int Count, ml_value_t **Args) {
-	ml_integer_t *IntegerA = (ml_integer_t *)Args[0];
+	long IntegerA = ml_integer_value(Args[0]);
 	ml_real_t *RealB = (ml_real_t *)Args[1];
-	if (IntegerA->Value < RealB->Value) return (ml_value_t *)NegOne;
-	if (IntegerA->Value > RealB->Value) return (ml_value_t *)One;
+	if (IntegerA < RealB->Value) return (ml_value_t *)NegOne;
+	if (IntegerA > RealB->Value) return (ml_value_t *)One;
 	return (ml_value_t *)Zero;
 }
 
@@ -1609,21 +2528,22 @@ static ml_value_t *ml_compare_real_real(void *Data, int Count, ml_value_t **Args
 
 typedef struct ml_integer_range_t {
 	const ml_type_t *Type;
-	ml_integer_t *Current;
+	ml_value_t *Current;
 	long Step, Limit;
 } ml_integer_range_t;
 
 static ml_value_t *ml_integer_range_deref(ml_value_t *Ref) {
 	ml_integer_range_t *Range = (ml_integer_range_t *)Ref;
-	return (ml_value_t *)Range->Current;
+	return Range->Current;
 }
 
 static ml_value_t *ml_integer_range_next(ml_value_t *Ref) {
 	ml_integer_range_t *Range = (ml_integer_range_t *)Ref;
-	if (Range->Current->Value >= Range->Limit) {
+	long Current = ml_integer_value(Range->Current);
+	if (Current >= Range->Limit) {
 		return MLNil;
 	} else {
-		Range->Current = (ml_integer_t *)ml_integer(Range->Current->Value + Range->Step);
+		Range->Current = ml_integer(Current + Range->Step);
 		return Ref;
 	}
 }
@@ -1639,12 +2559,11 @@ ml_type_t MLIntegerIterT[1] = {{
 }};
 
 static ml_value_t *ml_range_integer_integer(void *Data, int Count, ml_value_t **Args) {
-	ml_integer_t *IntegerA = (ml_integer_t *)Args[0];
-	ml_integer_t *IntegerB = (ml_integer_t *)Args[1];
+	long IntegerB = ml_integer_value(Args[1]);
 	ml_integer_range_t *Range = new(ml_integer_range_t);
 	Range->Type = MLIntegerIterT;
-	Range->Current = IntegerA;
-	Range->Limit = IntegerB->Value;
+	Range->Current = Args[0];
+	Range->Limit = IntegerB;
 	Range->Step = 1;
 	return (ml_value_t *)Range;
 }
@@ -1656,10 +2575,10 @@ static ml_value_t *ml_range_integer_integer(void *Data, int Count, ml_value_t **
 	ml_method_by_name(#SYMBOL, NULL, ml_ ## NAME ## _integer_real, MLIntegerT, MLRealT, NULL)
 
 static ml_value_t *ml_integer_to_string(void *Data, int Count, ml_value_t **Args) {
-	ml_integer_t *Integer = (ml_integer_t *)Args[0];
+	long Integer = ml_integer_value(Args[0]);
 	ml_string_t *String = new(ml_string_t);
 	String->Type = MLStringT;
-	String->Length = asprintf((char **)&String->Value, "%ld", Integer->Value);
+	String->Length = asprintf((char **)&String->Value, "%ld", Integer);
 	return (ml_value_t *)String;
 }
 
@@ -1691,8 +2610,19 @@ static ml_value_t *ml_compare_string_string(void *Data, int Count, ml_value_t **
 		return strcmp(StringA->Value, StringB->Value) SYMBOL 0 ? Args[1] : MLNil; \
 	}
 
-ml_comp_method_string_string(eq, ==)
-ml_comp_method_string_string(neq, !=)
+static ml_value_t *ml_eq_string_string(void *Data, int Count, ml_value_t **Args) {
+	ml_string_t *StringA = (ml_string_t *)Args[0];
+	ml_string_t *StringB = (ml_string_t *)Args[1];
+	if (StringA == StringB) return Args[1];
+	if (StringA->Interned && StringB->Interned) return MLNil;
+	if (StringA->Length != StringB->Length) return MLNil;
+	return memcmp(StringA->Value, StringB->Value, StringA->Length) ? MLNil : Args[1];
+}
+
+static ml_value_t *ml_neq_string_string(void *Data, int Count, ml_value_t **Args) {
+	return ml_eq_string_string(Data, Count, Args) == MLNil ? Args[1] : MLNil;
+}
+
 ml_comp_method_string_string(les, <)
 ml_comp_method_string_string(gre, >)
 ml_comp_method_string_string(leq, <=)
@@ -1706,25 +2636,28 @@ static ml_value_t *ml_compare_any_any(void *Data, int Count, ml_value_t **Args)
 
 typedef struct ml_list_iter_t {
 	const ml_type_t *Type;
-	ml_list_node_t *Node;
+	ml_list_t *List;
 	long Index;
 } ml_list_iter_t;
 
 static ml_value_t *ml_list_iter_deref(ml_value_t *Ref) {
 	ml_list_iter_t *Iter = (ml_list_iter_t *)Ref;
-	return Iter->Node->Value;
+	ml_list_t *List = Iter->List;
+	if (Iter->Index > List->Length) return MLNil;
+	return List->Values[List->Offset + Iter->Index - 1];
 }
 
 static ml_value_t *ml_list_iter_assign(ml_value_t *Ref, ml_value_t *Value) {
 	ml_list_iter_t *Iter = (ml_list_iter_t *)Ref;
-	return Iter->Node->Value = Value;
+	ml_list_t *List = Iter->List;
+	if (Iter->Index > List->Length) return ml_error("IndexError", "list index out of range");
+	return List->Values[List->Offset + Iter->Index - 1] = Value;
 }
 
 static ml_value_t *ml_list_iter_next(ml_value_t *Ref) {
 	ml_list_iter_t *Iter = (ml_list_iter_t *)Ref;
-	if (Iter->Node->Next) {
+	if (Iter->Index < Iter->List->Length) {
 		++Iter->Index;
-		Iter->Node = Iter->Node->Next;
 		return Ref;
 	} else {
 		return MLNil;
@@ -1748,10 +2681,10 @@ ml_type_t MLListIterT[1] = {{
 
 static ml_value_t *ml_list_values(void *Data, int Count, ml_value_t **Args) {
 	ml_list_t *List = (ml_list_t *)Args[0];
-	if (List->Head) {
+	if (List->Length) {
 		ml_list_iter_t *Iter = new(ml_list_iter_t);
 		Iter->Type = MLListIterT;
-		Iter->Node = List->Head;
+		Iter->List = List;
 		Iter->Index = 1;
 		return (ml_value_t *)Iter;
 	} else {
@@ -1761,83 +2694,47 @@ static ml_value_t *ml_list_values(void *Data, int Count, ml_value_t **Args) {
 
 static ml_value_t *ml_list_push(void *Data, int Count, ml_value_t **Args) {
 	ml_list_t *List = (ml_list_t *)Args[0];
-	ml_list_node_t **Slot = List->Head ? &List->Head->Prev : &List->Tail;
-	ml_list_node_t *Next = List->Head;
-	for (int I = Count; --I >= 1;) {
-		ml_list_node_t *Node = Slot[0] = new(ml_list_node_t);
-		Node->Value = Args[I];
-		Node->Next = Next;
-		Next = Node;
-		Slot = &Node->Prev;
-	}
-	List->Head = Next;
+	ml_list_reserve(List, Count - 1, 0);
+	List->Offset -= Count - 1;
 	List->Length += Count - 1;
+	memcpy(List->Values + List->Offset, Args + 1, (Count - 1) * sizeof(ml_value_t *));
 	return (ml_value_t *)List;
 }
 
 static ml_value_t *ml_list_put(void *Data, int Count, ml_value_t **Args) {
 	ml_list_t *List = (ml_list_t *)Args[0];
-	ml_list_node_t **Slot = List->Tail ? &List->Tail->Next : &List->Head;
-	ml_list_node_t *Prev = List->Tail;
-	for (int I = 1; I < Count; ++I) {
-		ml_list_node_t *Node = Slot[0] = new(ml_list_node_t);
-		Node->Value = Args[I];
-		Node->Prev = Prev;
-		Prev = Node;
-		Slot = &Node->Next;
-	}
-	List->Tail = Prev;
+	ml_list_reserve(List, 0, Count - 1);
+	memcpy(List->Values + List->Offset + List->Length, Args + 1, (Count - 1) * sizeof(ml_value_t *));
 	List->Length += Count - 1;
 	return (ml_value_t *)List;
 }
 
 static ml_value_t *ml_list_pop(void *Data, int Count, ml_value_t **Args) {
 	ml_list_t *List = (ml_list_t *)Args[0];
-	ml_list_node_t *Node = List->Head;
-	if (Node) {
-		if (!(List->Head = Node->Next)) List->Tail = NULL;
-		--List->Length;
-		return Node->Value;
-	} else {
-		return MLNil;
-	}
+	if (!List->Length) return MLNil;
+	ml_value_t **Slot = List->Values + List->Offset;
+	ml_value_t *Value = Slot[0];
+	Slot[0] = 0;
+	++List->Offset;
+	--List->Length;
+	return Value;
 }
 
 static ml_value_t *ml_list_pull(void *Data, int Count, ml_value_t **Args) {
 	ml_list_t *List = (ml_list_t *)Args[0];
-	ml_list_node_t *Node = List->Tail;
-	if (Node) {
-		if (!(List->Tail = Node->Next)) List->Head = NULL;
-		--List->Length;
-		return Node->Value;
-	} else {
-		return MLNil;
-	}
+	if (!List->Length) return MLNil;
+	ml_value_t **Slot = List->Values + List->Offset + --List->Length;
+	ml_value_t *Value = Slot[0];
+	Slot[0] = 0;
+	return Value;
 }
 
 static ml_value_t *ml_list_add(void *Data, int Count, ml_value_t **Args) {
 	ml_list_t *List1 = (ml_list_t *)Args[0];
 	ml_list_t *List2 = (ml_list_t *)Args[1];
-	ml_list_t *List = new(ml_list_t);
-	List->Type = MLListT;
-	ml_list_node_t **Slot = &List->Head;
-	ml_list_node_t *Prev = NULL;
-	for (ml_list_node_t *Node1 = List1->Head; Node1; Node1 = Node1->Next) {
-		ml_list_node_t *Node = Slot[0] = new(ml_list_node_t);
-		Node->Value = Node1->Value;
-		Node->Prev = Prev;
-		Prev = Node;
-		Slot = &Node->Next;
-	}
-	for (ml_list_node_t *Node2 = List2->Head; Node2; Node2 = Node2->Next) {
-		ml_list_node_t *Node = Slot[0] = new(ml_list_node_t);
-		Node->Value = Node2->Value;
-		Node->Prev = Prev;
-		Prev = Node;
-		Slot = &Node->Next;
-	}
-	List->Tail = Prev;
-	List->Length = List1->Length + List2->Length;
+	ml_list_t *List = ml_list_sized(List1->Length + List2->Length);
+	ml_list_to_array((ml_value_t *)List1, List->Values);
+	ml_list_to_array((ml_value_t *)List2, List->Values + List1->Length);
 	return (ml_value_t *)List;
 }
 
@@ -1847,10 +2744,10 @@ static ml_value_t *ml_list_to_string(void *Data, int Count, ml_value_t **Args) {
 	ml_stringbuffer_t Buffer[1] = {ML_STRINGBUFFER_INIT};
 	const char *Seperator = "[";
 	int SeperatorLength = 1;
-	for (ml_list_node_t *Node = List->Head; Node; Node = Node->Next) {
+	for (int I = 0; I < List->Length; ++I) {
 		ml_stringbuffer_add(Buffer, Seperator, SeperatorLength);
-		ml_value_t *Result = ml_inline(AppendMethod, 2, Buffer, Node->Value);
-		if (Result->Type == MLErrorT) return Result;
+		ml_value_t *Result = ml_inline(AppendMethod, 2, Buffer, List->Values[List->Offset + I]);
+		if (ml_typeof(Result) == MLErrorT) return Result;
 		Seperator = ", ";
 		SeperatorLength = 2;
 	}
@@ -1858,46 +2755,50 @@ static ml_value_t *ml_list_to_string(void *Data, int Count, ml_value_t **Args) {
 	return ml_string(ml_stringbuffer_get(Buffer), -1);
 }
 
-#define ML_TREE_MAX_DEPTH 32
-
 typedef struct ml_tree_iter_t {
 	const ml_type_t *Type;
-	ml_tree_node_t *Node;
-	ml_tree_node_t *Stack[ML_TREE_MAX_DEPTH];
-	int Top;
+	ml_tree_t *Tree;
+	ml_value_t *Key, *Value;
+	int Index;
 } ml_tree_iter_t;
 
+static ml_tree_entry_t *ml_tree_iter_entry(ml_tree_iter_t *Iter) {
+	// The current entry may have been deleted during the loop, and emptying the tree frees its entries,
+	// so the iterator keeps its own copy of the key and the last value seen.
+	ml_tree_t *Tree = Iter->Tree;
+	if (Iter->Index >= Tree->Used || Tree->Entries[Iter->Index].Key != Iter->Key) return NULL;
+	return Tree->Entries + Iter->Index;
+}
+
 static ml_value_t *ml_tree_iter_deref(ml_value_t *Ref) {
 	ml_tree_iter_t *Iter = (ml_tree_iter_t *)Ref;
-	return Iter->Node->Value;
+	ml_tree_entry_t *Entry = ml_tree_iter_entry(Iter);
+	if (Entry) Iter->Value = Entry->Value;
+	return Iter->Value;
 }
 
 static ml_value_t *ml_tree_iter_assign(ml_value_t *Ref, ml_value_t *Value) {
-	ml_tree_iter_t *Iter = (ml_tree_iter_t *)Ref;
-	return Iter->Node->Value = Value;
+	ml_tree_entry_t *Entry = ml_tree_iter_entry((ml_tree_iter_t *)Ref);
+	if (!Entry) return ml_error("KeyError", "tree entry was deleted during iteration");
+	return ((ml_tree_iter_t *)Ref)->Value = Entry->Value = Value;
 }
 
 static ml_value_t *ml_tree_iter_next(ml_value_t *Ref) {
 	ml_tree_iter_t *Iter = (ml_tree_iter_t *)Ref;
-	ml_tree_node_t *Node = Iter->Node;
-	if (Node->Left) {
-		if (Node->Right) Iter->Stack[Iter->Top++] = Node->Right;
-		Iter->Node = Node->Left;
-		return Ref;
-	} else if (Node->Right) {
-		Iter->Node = Node->Right;
-		return Ref;
-	} else if (Iter->Top > 0) {
-		Iter->Node = Iter->Stack[--Iter->Top];
-		return Ref;
-	} else {
-		return MLNil;
+	ml_tree_t *Tree = Iter->Tree;
+	while (++Iter->Index < Tree->Used) {
+		ml_tree_entry_t *Entry = Tree->Entries + Iter->Index;
+		if (Entry->Key) {
+			Iter->Key = Entry->Key;
+			Iter->Value = Entry->Value;
+			return Ref;
+		}
 	}
+	return MLNil;
 }
 
 static ml_value_t *ml_tree_iter_key(ml_value_t *Ref) {
-	ml_tree_iter_t *Iter = (ml_tree_iter_t *)Ref;
-	return Iter->Node->Key;
+	return ((ml_tree_iter_t *)Ref)->Key;
 }
 
 ml_type_t MLTreeIterT[1] = {{
@@ -1912,12 +2813,12 @@ ml_type_t MLTreeIterT[1] = {{
 
 static ml_value_t *ml_tree_values(void *Data, int Count, ml_value_t **Args) {
 	ml_tree_t *Tree = (ml_tree_t *)Args[0];
-	if (Tree->Root) {
+	if (Tree->Size) {
 		ml_tree_iter_t *Iter = new(ml_tree_iter_t);
 		Iter->Type = MLTreeIterT;
-		Iter->Node = Tree->Root;
-		Iter->Top = 0;
-		return (ml_value_t *)Iter;
+		Iter->Tree = Tree;
+		Iter->Index = -1;
+		return ml_tree_iter_next((ml_value_t *)Iter);
 	} else {
 		return MLNil;
 	}
@@ -1931,6 +2832,7 @@ static int ml_tree_add_insert(ml_value_t *Key, ml_value_t *Value, ml_tree_t *Tre
 static ml_value_t *ml_tree_add(void *Data, int Count, ml_value_t **Args) {
 	ml_tree_t *Tree = new(ml_tree_t);
 	Tree->Type = MLTreeT;
+	ml_tree_reserve(Tree, ((ml_tree_t *)Args[0])->Size + ((ml_tree_t *)Args[1])->Size);
 	ml_tree_foreach(Args[0], Tree, (void *)ml_tree_add_insert);
 	ml_tree_foreach(Args[1], Tree, (void *)ml_tree_add_insert);
 	return (ml_value_t *)Tree;
@@ -1946,10 +2848,10 @@ typedef struct ml_tree_stringer_t {
 static int ml_tree_stringer(ml_value_t *Key, ml_value_t *Value, ml_tree_stringer_t *Stringer) {
 	ml_stringbuffer_add(Stringer->Buffer, Stringer->Seperator, Stringer->SeperatorLength);
 	Stringer->Error = ml_inline(AppendMethod, 2, Stringer->Buffer, Key);
-	if (Stringer->Error->Type == MLErrorT) return 1;
+	if (ml_typeof(Stringer->Error) == MLErrorT) return 1;
 	ml_stringbuffer_add(Stringer->Buffer, " is ", 4);
 	Stringer->Error = ml_inline(AppendMethod, 2, Stringer->Buffer, Value);
-	if (Stringer->Error->Type == MLErrorT) return 1;
+	if (ml_typeof(Stringer->Error) == MLErrorT) return 1;
 	Stringer->Seperator = ", ";
 	Stringer->SeperatorLength = 2;
 	return 0;
@@ -1966,9 +2868,243 @@ static ml_value_t *ml_tree_to_string(void *Data, int Count, ml_value_t **Args) {
 	return ml_string(ml_stringbuffer_get(Stringer->Buffer), -1);
 }
 
+typedef struct ml_range_t {
+	const ml_type_t *Type;
+	long Start, Limit, Step;
+} ml_range_t;
+
+ml_type_t MLRangeT[1] = {{
+	MLAnyT, "range",
+	ml_default_hash,
+	ml_default_call,
+	ml_default_deref,
+	ml_default_assign,
+	ml_default_next,
+	ml_default_key
+}};
+
+ml_value_t *ml_range(void *Data, int Count, ml_value_t **Args) {
+	ML_CHECK_ARG_COUNT(2);
+	ML_CHECK_ARG_TYPE(0, MLIntegerT);
+	ML_CHECK_ARG_TYPE(1, MLIntegerT);
+	ml_range_t *Range = new(ml_range_t);
+	Range->Type = MLRangeT;
+	Range->Start = ml_integer_value(Args[0]);
+	Range->Limit = ml_integer_value(Args[1]);
+	Range->Step = 1;
+	if (Count > 2) {
+		ML_CHECK_ARG_TYPE(2, MLIntegerT);
+		Range->Step = ml_integer_value(Args[2]);
+		if (Range->Step <= 0) return ml_error("ValueError", "range step must be positive");
+	}
+	return (ml_value_t *)Range;
+}
+
+static ml_value_t *ml_range_values(void *Data, int Count, ml_value_t **Args) {
+	ml_range_t *Range = (ml_range_t *)Args[0];
+	if (Range->Start > Range->Limit) return MLNil;
+	ml_integer_range_t *Iter = new(ml_integer_range_t);
+	Iter->Type = MLIntegerIterT;
+	Iter->Current = ml_integer(Range->Start);
+	Iter->Limit = Range->Limit - Range->Step + 1;
+	Iter->Step = Range->Step;
+	return (ml_value_t *)Iter;
+}
+
+// Sequences are the lazy adapters returned by map, filter, take and chunk. Each records its source
+// value and only builds an iterator when values() is called, so a chain of adapters runs as a
+// single pass that pulls one element at a time through every stage.
+
+typedef enum {
+	ML_SEQUENCE_MAP,
+	ML_SEQUENCE_FILTER,
+	ML_SEQUENCE_TAKE,
+	ML_SEQUENCE_CHUNK
+} ml_sequence_kind_t;
+
+typedef struct ml_sequence_t {
+	const ml_type_t *Type;
+	ml_value_t *Source, *Function;
+	long Count;
+	ml_sequence_kind_t Kind;
+} ml_sequence_t;
+
+typedef struct ml_sequence_iter_t {
+	const ml_type_t *Type;
+	ml_sequence_t *Sequence;
+	ml_value_t *Iter, *Value;
+	long Index;
+} ml_sequence_iter_t;
+
+static ml_value_t *ValuesMethod;
+
+ml_type_t MLSequenceT[1] = {{
+	MLAnyT, "sequence",
+	ml_default_hash,
+	ml_default_call,
+	ml_default_deref,
+	ml_default_assign,
+	ml_default_next,
+	ml_default_key
+}};
+
+static ml_value_t *ml_sequence_iter_deref(ml_value_t *Ref) {
+	ml_sequence_iter_t *Iter = (ml_sequence_iter_t *)Ref;
+	return Iter->Value;
+}
+
+static ml_value_t *ml_sequence_iter_fill(ml_sequence_iter_t *Iter) {
+	// Moves Iter->Iter to the first source element at or after its current position that produces
+	// a value for this stage, leaving it on the last element consumed.
+	ml_sequence_t *Sequence = Iter->Sequence;
+	ml_value_t *Source = Iter->Iter;
+	switch (Sequence->Kind) {
+	case ML_SEQUENCE_MAP: {
+		if (Source == MLNil) return MLNil;
+		ml_value_t *Value = ml_typeof(Source)->deref(Source);
+		if (ml_typeof(Value) == MLErrorT) return Value;
+		Value = ml_call(Sequence->Function, 1, &Value);
+		if (ml_typeof(Value) == MLErrorT) return Value;
+		Iter->Value = Value;
+		break;
+	}
+	case ML_SEQUENCE_FILTER: {
+		for (;;) {
+			if (Source == MLNil) return MLNil;
+			if (ml_typeof(Source) == MLErrorT) return Source;
+			ml_value_t *Value = ml_typeof(Source)->deref(Source);
+			if (ml_typeof(Value) == MLErrorT) return Value;
+			ml_value_t *Result = ml_call(Sequence->Function, 1, &Value);
+			if (ml_typeof(Result) == MLErrorT) return Result;
+			if (Result != MLNil) {
+				Iter->Value = Value;
+				break;
+			}
+			Source = ml_typeof(Source)->next(Source);
+		}
+		Iter->Iter = Source;
+		break;
+	}
+	case ML_SEQUENCE_TAKE: {
+		if (Source == MLNil) return MLNil;
+		ml_value_t *Value = ml_typeof(Source)->deref(Source);
+		if (ml_typeof(Value) == MLErrorT) return Value;
+		Iter->Value = Value;
+		break;
+	}
+	case ML_SEQUENCE_CHUNK: {
+		if (Source == MLNil) return MLNil;
+		ml_value_t *Chunk = ml_list();
+		for (long I = Sequence->Count;;) {
+			ml_value_t *Value = ml_typeof(Source)->deref(Source);
+			if (ml_typeof(Value) == MLErrorT) return Value;
+			ml_list_append(Chunk, Value);
+			if (--I == 0) break;
+			ml_value_t *Next = ml_typeof(Source)->next(Source);
+			if (ml_typeof(Next) == MLErrorT) return Next;
+			if (Next == MLNil) break;
+			Source = Next;
+		}
+		Iter->Iter = Source;
+		Iter->Value = Chunk;
+		break;
+	}
+	}
+	++Iter->Index;
+	return (ml_value_t *)Iter;
+}
+
+static ml_value_t *ml_sequence_iter_next(ml_value_t *Ref) {
+	ml_sequence_iter_t *Iter = (ml_sequence_iter_t *)Ref;
+	ml_sequence_t *Sequence = Iter->Sequence;
+	if (Sequence->Kind == ML_SEQUENCE_TAKE && Iter->Index >= Sequence->Count) return MLNil;
+	ml_value_t *Source = Iter->Iter;
+	Source = Iter->Iter = ml_typeof(Source)->next(Source);
+	if (ml_typeof(Source) == MLErrorT) return Source;
+	return ml_sequence_iter_fill(Iter);
+}
+
+static ml_value_t *ml_sequence_iter_key(ml_value_t *Ref) {
+	ml_sequence_iter_t *Iter = (ml_sequence_iter_t *)Ref;
+	if (Iter->Sequence->Kind == ML_SEQUENCE_CHUNK) return ml_integer(Iter->Index);
+	return ml_typeof(Iter->Iter)->key(Iter->Iter);
+}
+
+ml_type_t MLSequenceIterT[1] = {{
+	MLAnyT, "sequence-iter",
+	ml_default_hash,
+	ml_default_call,
+	ml_sequence_iter_deref,
+	ml_default_assign,
+	ml_sequence_iter_next,
+	ml_sequence_iter_key
+}};
+
+static ml_value_t *ml_sequence_values(void *Data, int Count, ml_value_t **Args) {
+	ml_sequence_t *Sequence = (ml_sequence_t *)Args[0];
+	if (Sequence->Kind == ML_SEQUENCE_TAKE && Sequence->Count <= 0) return MLNil;
+	ml_value_t *Source = ml_call(ValuesMethod, 1, &Sequence->Source);
+	if (ml_typeof(Source) == MLErrorT) return Source;
+	ml_sequence_iter_t *Iter = new(ml_sequence_iter_t);
+	Iter->Type = MLSequenceIterT;
+	Iter->Sequence = Sequence;
+	Iter->Iter = Source;
+	return ml_sequence_iter_fill(Iter);
+}
+
+static ml_value_t *ml_sequence_new(ml_value_t *Source, ml_sequence_kind_t Kind, ml_value_t *Function, long Count) {
+	ml_sequence_t *Sequence = new(ml_sequence_t);
+	Sequence->Type = MLSequenceT;
+	Sequence->Source = Source;
+	Sequence->Kind = Kind;
+	Sequence->Function = Function;
+	Sequence->Count = Count;
+	return (ml_value_t *)Sequence;
+}
+
+static ml_value_t *ml_sequence_map(void *Data, int Count, ml_value_t **Args) {
+	return ml_sequence_new(Args[0], ML_SEQUENCE_MAP, Args[1], 0);
+}
+
+static ml_value_t *ml_sequence_filter(void *Data, int Count, ml_value_t **Args) {
+	return ml_sequence_new(Args[0], ML_SEQUENCE_FILTER, Args[1], 0);
+}
+
+static ml_value_t *ml_sequence_take(void *Data, int Count, ml_value_t **Args) {
+	return ml_sequence_new(Args[0], ML_SEQUENCE_TAKE, 0, ml_integer_value(Args[1]));
+}
+
+static ml_value_t *ml_sequence_chunk(void *Data, int Count, ml_value_t **Args) {
+	long Size = ml_integer_value(Args[1]);
+	if (Size <= 0) return ml_error("ValueError", "chunk size must be positive");
+	return ml_sequence_new(Args[0], ML_SEQUENCE_CHUNK, 0, Size);
+}
+
+static ml_value_t *ml_sequence_fold(void *Data, int Count, ml_value_t **Args) {
+	ml_value_t *Iter = ml_call(ValuesMethod, 1, Args);
+	ml_value_t *Function = Args[Count - 1];
+	ml_value_t *FoldArgs[2];
+	if (Count > 2) {
+		FoldArgs[0] = Args[1];
+	} else {
+		if (Iter == MLNil || ml_typeof(Iter) == MLErrorT) return Iter;
+		FoldArgs[0] = ml_typeof(Iter)->deref(Iter);
+		Iter = ml_typeof(Iter)->next(Iter);
+	}
+	while (Iter != MLNil) {
+		if (ml_typeof(Iter) == MLErrorT) return Iter;
+		FoldArgs[1] = ml_typeof(Iter)->deref(Iter);
+		if (ml_typeof(FoldArgs[1]) == MLErrorT) return FoldArgs[1];
+		FoldArgs[0] = ml_call(Function, 2, FoldArgs);
+		if (ml_typeof(FoldArgs[0]) == MLErrorT) return FoldArgs[0];
+		Iter = ml_typeof(Iter)->next(Iter);
+	}
+	return FoldArgs[0];
+}
+
 static ml_value_t *ml_hash_any(void *Data, int Count, ml_value_t **Args) {
 	ml_value_t *Value = Args[0];
-	return ml_integer(Value->Type->hash(Value));
+	return ml_integer(ml_typeof(Value)->hash(Value));
 }
 
 static ml_value_t *ml_return_nil(void *Data, int Count, ml_value_t **Args) {
@@ -1978,6 +3114,7 @@ static ml_value_t *ml_return_nil(void *Data, int Count, ml_value_t **Args) {
 void ml_init() {
 	Methods = anew(ml_method_t *, MaxMethods);
 	CompareMethod = ml_method("?");
+	ValuesMethod = ml_method("values");
 	ml_method_by_name("#", NULL, ml_hash_any, MLAnyT, NULL);
 	ml_method_by_name("?", NULL, ml_return_nil, MLNilT, MLAnyT, NULL);
 	ml_method_by_name("?", NULL, ml_return_nil, MLAnyT, MLNilT, NULL);
@@ -2013,6 +3150,7 @@ void ml_init() {
 	ml_method_by_name("%", NULL, ml_mod_integer_integer, MLIntegerT, MLIntegerT, NULL);
 	ml_method_by_name("..", NULL, ml_range_integer_integer, MLIntegerT, MLIntegerT, NULL);
 	ml_method_by_name("?", NULL, ml_compare_string_string, MLStringT, MLStringT, NULL);
+	ml_method_by_name("intern", NULL, ml_string_intern_method, MLStringT, NULL);
 	ml_method_by_name("=", NULL, ml_eq_string_string, MLStringT, MLStringT, NULL);
 	ml_method_by_name("!=", NULL, ml_neq_string_string, MLStringT, MLStringT, NULL);
 	ml_method_by_name("<", NULL, ml_les_string_string, MLStringT, MLStringT, NULL);
@@ -2032,7 +3170,18 @@ void ml_init() {
 	ml_method_by_name("size", NULL, ml_tree_size, MLTreeT, NULL);
 	ml_method_by_name("[]", NULL, ml_tree_index, MLTreeT, MLAnyT, NULL);
 	ml_method_by_name("values", NULL, ml_tree_values, MLTreeT, NULL);
+	ml_method_by_name("values", NULL, ml_range_values, MLRangeT, NULL);
+	ml_method_by_name("values", NULL, ml_generator_values, MLGeneratorT, NULL);
+	ml_method_by_name("values", NULL, ml_sequence_values, MLSequenceT, NULL);
+	ml_method_by_name("map", NULL, ml_sequence_map, MLAnyT, MLAnyT, NULL);
+	ml_method_by_name("filter", NULL, ml_sequence_filter, MLAnyT, MLAnyT, NULL);
+	ml_method_by_name("take", NULL, ml_sequence_take, MLAnyT, MLIntegerT, NULL);
+	ml_method_by_name("chunk", NULL, ml_sequence_chunk, MLAnyT, MLIntegerT, NULL);
+	ml_method_by_name("fold", NULL, ml_sequence_fold, MLAnyT, MLAnyT, NULL);
+	ml_method_by_name("fold", NULL, ml_sequence_fold, MLAnyT, MLAnyT, MLAnyT, NULL);
 	ml_method_by_name("delete", NULL, ml_tree_delete, MLTreeT, NULL);
+	ml_method_by_name("reserve", NULL, ml_tree_reserve_method, MLTreeT, MLIntegerT, NULL);
+	ml_method_by_name("shrink", NULL, ml_tree_shrink_method, MLTreeT, NULL);
 	ml_method_by_name("+", NULL, ml_tree_add, MLTreeT, MLTreeT, NULL);
 	ml_method_by_name("string", NULL, ml_nil_to_string, MLNilT, NULL);
 	ml_method_by_name("string", NULL, ml_some_to_string, MLSomeT, NULL);
@@ -2043,8 +3192,11 @@ void ml_init() {
 	ml_method_by_name("string", 0, ml_tree_to_string, MLTreeT, 0);
 	ml_method_by_name("/", NULL, ml_string_string_split, MLStringT, MLStringT, NULL);
 	ml_method_by_name("%", NULL, ml_string_match, MLStringT, MLStringT, NULL);
+	ml_method_by_name("%", NULL, ml_string_regex_match, MLStringT, MLRegexT, NULL);
 	ml_method_by_name("find", 0, ml_string_find, MLStringT, MLStringT, 0);
 	ml_method_by_name("replace", NULL, ml_string_string_replace, MLStringT, MLStringT, MLStringT, NULL);
+	ml_method_by_name("replace", NULL, ml_string_regex_replace, MLStringT, MLRegexT, MLStringT, NULL);
+	ml_method_by_name("pattern", NULL, ml_regex_pattern, MLRegexT, NULL);
 	ml_method_by_name("type", NULL, ml_error_type_value, MLErrorT, NULL);
 	ml_method_by_name("message", NULL, ml_error_message_value, MLErrorT, NULL);
 
@@ -2053,6 +3205,7 @@ void ml_init() {
 	ml_method_by_value(AppendMethod, NULL, stringify_integer, MLStringBufferT, MLIntegerT, NULL);
 	ml_method_by_value(AppendMethod, NULL, stringify_real, MLStringBufferT, MLRealT, NULL);
 	ml_method_by_value(AppendMethod, NULL, stringify_string, MLStringBufferT, MLStringT, NULL);
+	ml_method_by_value(AppendMethod, NULL, stringify_regex, MLStringBufferT, MLRegexT, NULL);
 	ml_method_by_value(AppendMethod, NULL, stringify_method, MLStringBufferT, MLMethodT, NULL);
 	ml_method_by_value(AppendMethod, NULL, stringify_list, MLStringBufferT, MLListT, NULL);
 	ml_method_by_value(AppendMethod, NULL, stringify_tree, MLStringBufferT, MLTreeT, NULL);
@@ -2061,24 +3214,29 @@ void ml_init() {
 	StringBufferDesc = GC_make_descriptor(StringBufferLayout, 1);
 }
 
-ml_inst_t *mli_push_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+static ml_inst_t *mli_push_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	(++Frame->Top)[-1] = Inst->Params[1].Value;
 	return Inst->Params[0].Inst;
 }
 
-ml_inst_t *mli_pop_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+static ml_inst_t *mli_pop_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	(--Frame->Top)[0] = 0;
 	return Inst->Params[0].Inst;
 }
 
-ml_inst_t *mli_pop2_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+static ml_inst_t *mli_pop2_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	(--Frame->Top)[0] = 0;
 	(--Frame->Top)[0] = 0;
 	return Inst->Params[0].Inst;
 }
 
-ml_inst_t *mli_enter_run(ml_inst_t *Inst, ml_frame_t *Frame) {
-	for (int I = Inst->Params[1].Count; --I >= 0;) {
+static ml_inst_t *mli_enter_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+	unsigned char *Boxed = Inst->Params[2].Boxed;
+	for (int I = 0; I < Inst->Params[1].Count; ++I) {
+		if (Boxed && !Boxed[I]) {
+			(++Frame->Top)[-1] = MLNil;
+			continue;
+		}
 		ml_reference_t *Local = xnew(ml_reference_t, 1, ml_value_t *);
 		Local->Type = MLReferenceT;
 		Local->Address = Local->Value;
@@ -2088,11 +3246,11 @@ ml_inst_t *mli_enter_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	return Inst->Params[0].Inst;
 }
 
-ml_inst_t *mli_var_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+static ml_inst_t *mli_var_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	ml_reference_t *Local = (ml_reference_t *)Frame->Stack[Inst->Params[1].Index];
 	ml_value_t *Value = Frame->Top[-1];
-	Value = Value->Type->deref(Value);
-	if (Value->Type == MLErrorT) {
+	Value = ml_typeof(Value)->deref(Value);
+	if (ml_typeof(Value) == MLErrorT) {
 		ml_error_trace_add(Value, Inst->Source);
 		(Frame->Top++)[0] = Value;
 		return Frame->OnError;
@@ -2101,28 +3259,40 @@ ml_inst_t *mli_var_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	return Inst->Params[0].Inst;
 }
 
-ml_inst_t *mli_def_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+static ml_inst_t *mli_var_unboxed_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+	ml_value_t *Value = Frame->Top[-1];
+	Value = ml_typeof(Value)->deref(Value);
+	if (ml_typeof(Value) == MLErrorT) {
+		ml_error_trace_add(Value, Inst->Source);
+		(Frame->Top++)[0] = Value;
+		return Frame->OnError;
+	}
+	Frame->Stack[Inst->Params[1].Index] = Value;
+	return Inst->Params[0].Inst;
+}
+
+static ml_inst_t *mli_def_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	ml_value_t *Value = Frame->Top[-1];
-	Frame->Top[-1] = Value->Type->deref(Value);
+	Frame->Top[-1] = ml_typeof(Value)->deref(Value);
 	return Inst->Params[0].Inst;
 }
 
-ml_inst_t *mli_exit_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+static ml_inst_t *mli_exit_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	ml_value_t *Value = Frame->Top[-1];
 	for (int I = Inst->Params[1].Count; --I >= 0;) (--Frame->Top)[0] = 0;
 	Frame->Top[-1] = Value;
 	return Inst->Params[0].Inst;
 }
 
-ml_inst_t *mli_try_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+static ml_inst_t *mli_try_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	Frame->OnError = Inst->Params[1].Inst;
 	return Inst->Params[0].Inst;
 }
 
-ml_inst_t *mli_catch_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+static ml_inst_t *mli_catch_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	ml_value_t *Error= Frame->Top[-1];
-	if (Error->Type != MLErrorT) {
-		Frame->Top[-1] = ml_error("InternalError", "expected error value, not %s", Error->Type->Name);
+	if (ml_typeof(Error) != MLErrorT) {
+		Frame->Top[-1] = ml_error("InternalError", "expected error value, not %s", ml_typeof(Error)->Name);
 		return Frame->OnError;
 	}
 	ml_value_t *Value = (ml_value_t *)new(ml_error_t);
@@ -2134,74 +3304,297 @@ ml_inst_t *mli_catch_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	return Inst->Params[0].Inst;
 }
 
-ml_inst_t *mli_call_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+static ml_inst_t *ml_frame_suspend(ml_inst_t *Inst, ml_inst_t *Resume, ml_frame_t *Frame, ml_value_t *Result) {
+	ml_suspension_t *Suspension = (ml_suspension_t *)Result;
+	if (!Frame->Suspendable) {
+		if (Suspension->Cancel) ml_call(Suspension->Cancel, 0, NULL);
+		if (Frame->Generator) {
+			Result = Frame->Top[-1] = ml_error("SuspendError", "can not wait in a generator unless an event handler iterates it directly");
+		} else {
+			Result = Frame->Top[-1] = ml_error("SuspendError", "can not wait outside of an event handler");
+		}
+		ml_error_trace_add(Result, Inst->Source);
+		return Frame->OnError;
+	}
+	Frame->Resume = Resume;
+	Frame = ml_frame_promote(Frame);
+	if (Suspension->Frame) {
+		Suspension->Outer->Caller = Frame;
+	} else {
+		Suspension->Frame = Frame;
+	}
+	Suspension->Outer = Frame;
+	return NULL;
+}
+
+static ml_inst_t *mli_call_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+	ML_FUEL_CHECK(Inst, Frame);
 	int Count = Inst->Params[1].Count;
 	ml_value_t *Function = Frame->Top[~Count];
-	Function = Function->Type->deref(Function);
-	if (Function->Type == MLErrorT) {
+	Function = ml_typeof(Function)->deref(Function);
+	if (ml_typeof(Function) == MLErrorT) {
 		ml_error_trace_add(Function, Inst->Source);
 		(Frame->Top++)[0] = Function;
 		return Frame->OnError;
 	}
 	ml_value_t **Args = Frame->Top - Count;
 	for (int I = 0; I < Count; ++I) {
-		Args[I] = Args[I]->Type->deref(Args[I]);
-		if (Args[I]->Type == MLErrorT) {
+		Args[I] = ml_typeof(Args[I])->deref(Args[I]);
+		if (ml_typeof(Args[I]) == MLErrorT) {
 			ml_error_trace_add(Args[I], Inst->Source);
 			(Frame->Top++)[0] = Args[I];
 			return Frame->OnError;
 		}
 	}
-	ml_value_t *Result = ml_call(Function, Count, Args);
+	ml_value_t *Result;
+	if (Frame->Suspendable && ml_typeof(Function) == MLClosureT) {
+		Result = ml_closure_call_internal(Function, Count, Args, 1);
+	} else if (ml_typeof(Function) == MLMethodT) {
+		Result = ml_method_cache_call(&Inst->Params[2].MethodCache, Function, Count, Args);
+	} else {
+		Result = ml_call(Function, Count, Args);
+	}
 	for (int I = Count; --I >= 0;) (--Frame->Top)[0] = 0;
 	Frame->Top[-1] = Result;
-	if (Result->Type == MLErrorT) {
+	if (ml_typeof(Result) == MLErrorT) {
 		ml_error_trace_add(Result, Inst->Source);
 		return Frame->OnError;
+	} else if (ml_typeof(Result) == MLSuspensionT) {
+		return ml_frame_suspend(Inst, Inst->Params[0].Inst, Frame, Result);
 	} else {
 		return Inst->Params[0].Inst;
 	}
 }
 
-ml_inst_t *mli_const_call_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+static ml_inst_t *mli_const_call_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+	ML_FUEL_CHECK(Inst, Frame);
 	int Count = Inst->Params[1].Count;
 	ml_value_t *Function = Inst->Params[2].Value;
 	ml_value_t **Args = Frame->Top - Count;
 	for (int I = 0; I < Count; ++I) {
-		Args[I] = Args[I]->Type->deref(Args[I]);
-		if (Args[I]->Type == MLErrorT) {
+		Args[I] = ml_typeof(Args[I])->deref(Args[I]);
+		if (ml_typeof(Args[I]) == MLErrorT) {
 			ml_error_trace_add(Args[I], Inst->Source);
 			(Frame->Top++)[0] = Args[I];
 			return Frame->OnError;
 		}
 	}
-	ml_value_t *Result = ml_call(Function, Count, Args);
+	ml_value_t *Result;
+	if (Frame->Suspendable && ml_typeof(Function) == MLClosureT) {
+		Result = ml_closure_call_internal(Function, Count, Args, 1);
+	} else if (ml_typeof(Function) == MLMethodT) {
+		Result = ml_method_cache_call(&Inst->Params[3].MethodCache, Function, Count, Args);
+	} else {
+		Result = ml_call(Function, Count, Args);
+	}
 	if (Count == 0) {
 		++Frame->Top;
 	} else {
 		for (int I = Count - 1; --I >= 0;) (--Frame->Top)[0] = 0;
 	}
 	Frame->Top[-1] = Result;
-	if (Result->Type == MLErrorT) {
+	if (ml_typeof(Result) == MLErrorT) {
 		ml_error_trace_add(Result, Inst->Source);
 		return Frame->OnError;
+	} else if (ml_typeof(Result) == MLSuspensionT) {
+		return ml_frame_suspend(Inst, Inst->Params[0].Inst, Frame, Result);
 	} else {
 		return Inst->Params[0].Inst;
 	}
 }
 
-ml_inst_t *mli_assign_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+#define ml_arith_fast_number(NAME, SYMBOL, GUARD) \
+	static inline ml_value_t *ml_ ## NAME ## _fast(ml_value_t *A, ml_value_t *B) { \
+		if (ml_typeof(A) == MLIntegerT) { \
+			if (ml_typeof(B) == MLIntegerT) { \
+				if (GUARD && !ml_integer_value(B)) return NULL; \
+				return ml_integer(ml_integer_value(A) SYMBOL ml_integer_value(B)); \
+			} \
+			if (ml_typeof(B) == MLRealT) return ml_real(ml_integer_value(A) SYMBOL ((ml_real_t *)B)->Value); \
+		} else if (ml_typeof(A) == MLRealT) { \
+			if (ml_typeof(B) == MLRealT) return ml_real(((ml_real_t *)A)->Value SYMBOL ((ml_real_t *)B)->Value); \
+			if (ml_typeof(B) == MLIntegerT) return ml_real(((ml_real_t *)A)->Value SYMBOL ml_integer_value(B)); \
+		} \
+		return NULL; \
+	}
+
+#define ml_comp_fast_number(NAME, SYMBOL) \
+	static inline ml_value_t *ml_ ## NAME ## _fast(ml_value_t *A, ml_value_t *B) { \
+		if (ml_typeof(A) == MLIntegerT) { \
+			if (ml_typeof(B) == MLIntegerT) return ml_integer_value(A) SYMBOL ml_integer_value(B) ? B : MLNil; \
+			if (ml_typeof(B) == MLRealT) return ml_integer_value(A) SYMBOL ((ml_real_t *)B)->Value ? B : MLNil; \
+		} else if (ml_typeof(A) == MLRealT) { \
+			if (ml_typeof(B) == MLRealT) return ((ml_real_t *)A)->Value SYMBOL ((ml_real_t *)B)->Value ? B : MLNil; \
+			if (ml_typeof(B) == MLIntegerT) return ((ml_real_t *)A)->Value SYMBOL ml_integer_value(B) ? B : MLNil; \
+		} \
+		return NULL; \
+	}
+
+ml_arith_fast_number(add, +, 0)
+ml_arith_fast_number(sub, -, 0)
+ml_arith_fast_number(mul, *, 0)
+ml_arith_fast_number(div, /, 1)
+
+static inline ml_value_t *ml_mod_fast(ml_value_t *A, ml_value_t *B) {
+	if (ml_typeof(A) != MLIntegerT || ml_typeof(B) != MLIntegerT || !ml_integer_value(B)) return NULL;
+	return ml_integer(ml_integer_value(A) % ml_integer_value(B));
+}
+
+ml_comp_fast_number(eq, ==)
+ml_comp_fast_number(neq, !=)
+ml_comp_fast_number(les, <)
+ml_comp_fast_number(gre, >)
+ml_comp_fast_number(leq, <=)
+ml_comp_fast_number(geq, >=)
+
+// Specialized instructions share the const_call layout: <next> <count> <method> <cache> [<constant>].
+// Anything other than integer or real operands falls back to the method call.
+#define mli_number_run(NAME) \
+	static ml_inst_t *mli_ ## NAME ## _run(ml_inst_t *Inst, ml_frame_t *Frame) { \
+		ml_value_t *A = Frame->Top[-2], *B = Frame->Top[-1]; \
+		ml_value_t *Result = ml_ ## NAME ## _fast(ml_typeof(A)->deref(A), ml_typeof(B)->deref(B)); \
+		if (!Result) return mli_const_call_run(Inst, Frame); \
+		(--Frame->Top)[0] = 0; \
+		Frame->Top[-1] = Result; \
+		return Inst->Params[0].Inst; \
+	} \
+	\
+	static ml_inst_t *mli_ ## NAME ## _const_run(ml_inst_t *Inst, ml_frame_t *Frame) { \
+		ml_value_t *A = Frame->Top[-1]; \
+		ml_value_t *Result = ml_ ## NAME ## _fast(ml_typeof(A)->deref(A), Inst->Params[4].Value); \
+		if (!Result) { \
+			(++Frame->Top)[-1] = Inst->Params[4].Value; \
+			return mli_const_call_run(Inst, Frame); \
+		} \
+		Frame->Top[-1] = Result; \
+		return Inst->Params[0].Inst; \
+	}
+
+mli_number_run(add)
+mli_number_run(sub)
+mli_number_run(mul)
+mli_number_run(div)
+mli_number_run(mod)
+mli_number_run(eq)
+mli_number_run(neq)
+mli_number_run(les)
+mli_number_run(gre)
+mli_number_run(leq)
+mli_number_run(geq)
+
+static struct {
+	const char *Name;
+	ml_opcode_t Opcode, ConstOpcode, IfOpcode, ConstIfOpcode;
+	ml_value_t *(*Fast)(ml_value_t *, ml_value_t *);
+} MLCNumberOps[] = {
+	{"+", MLI_ADD, MLI_ADD_CONST, 0, 0, ml_add_fast},
+	{"-", MLI_SUB, MLI_SUB_CONST, 0, 0, ml_sub_fast},
+	{"*", MLI_MUL, MLI_MUL_CONST, 0, 0, ml_mul_fast},
+	{"/", MLI_DIV, MLI_DIV_CONST, 0, 0, ml_div_fast},
+	{"%", MLI_MOD, MLI_MOD_CONST, 0, 0, ml_mod_fast},
+	{"=", MLI_EQ, MLI_EQ_CONST, MLI_EQ_IF, MLI_EQ_CONST_IF, ml_eq_fast},
+	{"!=", MLI_NEQ, MLI_NEQ_CONST, MLI_NEQ_IF, MLI_NEQ_CONST_IF, ml_neq_fast},
+	{"<", MLI_LES, MLI_LES_CONST, MLI_LES_IF, MLI_LES_CONST_IF, ml_les_fast},
+	{">", MLI_GRE, MLI_GRE_CONST, MLI_GRE_IF, MLI_GRE_CONST_IF, ml_gre_fast},
+	{"<=", MLI_LEQ, MLI_LEQ_CONST, MLI_LEQ_IF, MLI_LEQ_CONST_IF, ml_leq_fast},
+	{">=", MLI_GEQ, MLI_GEQ_CONST, MLI_GEQ_IF, MLI_GEQ_CONST_IF, ml_geq_fast},
+	{NULL,}
+};
+
+// Fused instructions built by mlc_optimize extend the same layout with <fast> at Params[5] and either the
+// local index or the taken branch at Params[6].
+
+static ml_inst_t *mli_local_number_const_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+	int Index = Inst->Params[6].Index;
+	ml_value_t *A = Index < 0 ? Frame->UpValues[~Index] : Frame->Stack[Index];
+	ml_value_t *Result = Inst->Params[5].Fast(ml_typeof(A)->deref(A), Inst->Params[4].Value);
+	if (!Result) {
+		(++Frame->Top)[-1] = A;
+		(++Frame->Top)[-1] = Inst->Params[4].Value;
+		return mli_const_call_run(Inst, Frame);
+	}
+	(++Frame->Top)[-1] = Result;
+	return Inst->Params[0].Inst;
+}
+
+// LOCAL_CALL and LOCAL_CONST_CALL push a local as the last argument and then call, with the local
+// index in the parameter after those of the call.
+
+static ml_inst_t *mli_local_call_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+	int Index = Inst->Params[3].Index;
+	(++Frame->Top)[-1] = Index < 0 ? Frame->UpValues[~Index] : Frame->Stack[Index];
+	return mli_call_run(Inst, Frame);
+}
+
+static ml_inst_t *mli_local_const_call_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+	int Index = Inst->Params[5].Index;
+	(++Frame->Top)[-1] = Index < 0 ? Frame->UpValues[~Index] : Frame->Stack[Index];
+	return mli_const_call_run(Inst, Frame);
+}
+
+static ml_value_t *mli_number_test(ml_inst_t *Inst, ml_value_t **Args) {
+	for (int I = 0; I < 2; ++I) {
+		Args[I] = ml_typeof(Args[I])->deref(Args[I]);
+		if (ml_typeof(Args[I]) == MLErrorT) return Args[I];
+	}
+	ml_value_t *Result = Inst->Params[5].Fast(Args[0], Args[1]);
+	if (Result) return Result;
+	Result = ml_method_cache_call(&Inst->Params[3].MethodCache, Inst->Params[2].Value, 2, Args);
+	return ml_typeof(Result)->deref(Result);
+}
+
+#define mli_compare_if_run(NAME) \
+	static ml_inst_t *mli_ ## NAME ## _if_run(ml_inst_t *Inst, ml_frame_t *Frame) { \
+		ml_value_t *A = Frame->Top[-2], *B = Frame->Top[-1]; \
+		ml_value_t *Result = ml_ ## NAME ## _fast(ml_typeof(A)->deref(A), ml_typeof(B)->deref(B)); \
+		if (!Result) { \
+			Result = mli_number_test(Inst, Frame->Top - 2); \
+			if (ml_typeof(Result) == MLErrorT) { \
+				ml_error_trace_add(Result, Inst->Source); \
+				(Frame->Top++)[0] = Result; \
+				return Frame->OnError; \
+			} \
+		} \
+		(--Frame->Top)[0] = 0; \
+		(--Frame->Top)[0] = 0; \
+		return Result == MLNil ? Inst->Params[0].Inst : Inst->Params[6].Inst; \
+	} \
+	\
+	static ml_inst_t *mli_ ## NAME ## _const_if_run(ml_inst_t *Inst, ml_frame_t *Frame) { \
+		ml_value_t *A = Frame->Top[-1]; \
+		ml_value_t *Result = ml_ ## NAME ## _fast(ml_typeof(A)->deref(A), Inst->Params[4].Value); \
+		if (!Result) { \
+			ml_value_t *Args[2] = {A, Inst->Params[4].Value}; \
+			Result = mli_number_test(Inst, Args); \
+			if (ml_typeof(Result) == MLErrorT) { \
+				ml_error_trace_add(Result, Inst->Source); \
+				(Frame->Top++)[0] = Result; \
+				return Frame->OnError; \
+			} \
+		} \
+		(--Frame->Top)[0] = 0; \
+		return Result == MLNil ? Inst->Params[0].Inst : Inst->Params[6].Inst; \
+	}
+
+mli_compare_if_run(eq)
+mli_compare_if_run(neq)
+mli_compare_if_run(les)
+mli_compare_if_run(gre)
+mli_compare_if_run(leq)
+mli_compare_if_run(geq)
+
+static ml_inst_t *mli_assign_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	ml_value_t *Value = Frame->Top[-1];
 	(--Frame->Top)[0] = 0;
-	Value = Value->Type->deref(Value);
-	if (Value->Type == MLErrorT) {
+	Value = ml_typeof(Value)->deref(Value);
+	if (ml_typeof(Value) == MLErrorT) {
 		ml_error_trace_add(Value, Inst->Source);
 		(Frame->Top++)[0] = Value;
 		return Frame->OnError;
 	}
 	ml_value_t *Ref = Frame->Top[-1];
-	ml_value_t *Result = Frame->Top[-1] = Ref->Type->assign(Ref, Value);
-	if (Result->Type == MLErrorT) {
+	ml_value_t *Result = Frame->Top[-1] = ml_typeof(Ref)->assign(Ref, Value);
+	if (ml_typeof(Result) == MLErrorT) {
 		ml_error_trace_add(Result, Inst->Source);
 		return Frame->OnError;
 	} else {
@@ -2209,14 +3602,27 @@ ml_inst_t *mli_assign_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	}
 }
 
-ml_inst_t *mli_jump_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+static ml_inst_t *mli_assign_unboxed_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+	ml_value_t *Value = Frame->Top[-1];
+	(--Frame->Top)[0] = 0;
+	Value = ml_typeof(Value)->deref(Value);
+	if (ml_typeof(Value) == MLErrorT) {
+		ml_error_trace_add(Value, Inst->Source);
+		(Frame->Top++)[0] = Value;
+		return Frame->OnError;
+	}
+	Frame->Stack[Inst->Params[1].Index] = Frame->Top[-1] = Value;
+	return Inst->Params[0].Inst;
+}
+
+static ml_inst_t *mli_jump_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	return Inst->Params[0].Inst;
 }
 
-ml_inst_t *mli_if_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+static ml_inst_t *mli_if_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	ml_value_t *Value = Frame->Top[-1];
-	Value = Value->Type->deref(Value);
-	if (Value->Type == MLErrorT) {
+	Value = ml_typeof(Value)->deref(Value);
+	if (ml_typeof(Value) == MLErrorT) {
 		ml_error_trace_add(Value, Inst->Source);
 		Frame->Top[-1] = Value;
 		return Frame->OnError;
@@ -2229,7 +3635,7 @@ ml_inst_t *mli_if_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	}
 }
 
-ml_inst_t *mli_until_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+static ml_inst_t *mli_until_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	ml_value_t *Value = Frame->Top[-1];
 	if (Value == MLNil) {
 		return Inst->Params[0].Inst;
@@ -2238,7 +3644,7 @@ ml_inst_t *mli_until_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	}
 }
 
-ml_inst_t *mli_while_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+static ml_inst_t *mli_while_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	ml_value_t *Value = Frame->Top[-1];
 	if (Value != MLNil) {
 		return Inst->Params[0].Inst;
@@ -2247,10 +3653,10 @@ ml_inst_t *mli_while_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	}
 }
 
-ml_inst_t *mli_and_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+static ml_inst_t *mli_and_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	ml_value_t *Value = Frame->Top[-1];
-	Value = Value->Type->deref(Value);
-	if (Value->Type == MLErrorT) {
+	Value = ml_typeof(Value)->deref(Value);
+	if (ml_typeof(Value) == MLErrorT) {
 		ml_error_trace_add(Value, Inst->Source);
 		Frame->Top[-1] = Value;
 		return Frame->OnError;
@@ -2262,10 +3668,10 @@ ml_inst_t *mli_and_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	}
 }
 
-ml_inst_t *mli_or_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+static ml_inst_t *mli_or_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	ml_value_t *Value = Frame->Top[-1];
-	Value = Value->Type->deref(Value);
-	if (Value->Type == MLErrorT) {
+	Value = ml_typeof(Value)->deref(Value);
+	if (ml_typeof(Value) == MLErrorT) {
 		ml_error_trace_add(Value, Inst->Source);
 		Frame->Top[-1] = Value;
 		return Frame->OnError;
@@ -2277,7 +3683,7 @@ ml_inst_t *mli_or_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	}
 }
 
-ml_inst_t *mli_exists_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+static ml_inst_t *mli_exists_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	ml_value_t *Value = Frame->Top[-1];
 	if (Value == MLNil) {
 		(--Frame->Top)[0] = 0;
@@ -2287,10 +3693,72 @@ ml_inst_t *mli_exists_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	}
 }
 
-ml_inst_t *mli_next_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+static ml_inst_t *mli_loop_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+	(--Frame->Top)[0] = 0;
+	ML_FUEL_CHECK(Inst, Frame);
+	return Inst->Params[0].Inst;
+}
+
+static ml_inst_t *ml_generator_resume(ml_inst_t *Inst, ml_frame_t *Frame, ml_generator_iter_t *Iter) {
+	// The generator runs with the iterating frame's suspendability so it may wait between values. If
+	// it does, the iterating frame suspends on next_resume until the generator reaches its next susp;
+	// the generator is detached meanwhile so it can not be resumed twice.
+	ml_generator_t *Generator = Iter->Generator;
+	ml_frame_t *Heap = Generator->Frame;
+	if (!Heap) {
+		Frame->Top[-1] = MLNil;
+		return Inst->Params[0].Inst;
+	}
+	Heap->Top[-1] = MLNil;
+	Heap->Suspendable = 1;
+	ml_value_t *Result = ml_frame_run(Heap, Heap->Resume);
+	if (Result == (ml_value_t *)Generator) {
+		Frame->Top[-1] = (ml_value_t *)Iter;
+		return Inst->Params[1].Inst;
+	}
+	if (ml_typeof(Result) == MLSuspensionT) {
+		ml_inst_t *Resume = xnew(ml_inst_t, 4, ml_param_t);
+		Resume->Opcode = MLI_NEXT_RESUME;
+		Resume->NumParams = 4;
+		Resume->Source = Inst->Source;
+		Resume->Params[0].Inst = Inst->Params[0].Inst;
+		Resume->Params[1].Inst = Inst->Params[1].Inst;
+		Resume->Params[2].Value = (ml_value_t *)Iter;
+		Resume->Params[3].Frame = Heap;
+		Generator->Frame = 0;
+		Frame->Top[-1] = Result;
+		return ml_frame_suspend(Inst, Resume, Frame, Result);
+	}
+	Generator->Frame = 0;
+	Generator->Value = MLNil;
+	if (ml_typeof(Result) == MLErrorT) {
+		ml_error_trace_add(Result, Inst->Source);
+		Frame->Top[-1] = Result;
+		return Frame->OnError;
+	}
+	Frame->Top[-1] = MLNil;
+	return Inst->Params[0].Inst;
+}
+
+static ml_inst_t *mli_next_resume_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+	ml_generator_iter_t *Iter = (ml_generator_iter_t *)Inst->Params[2].Value;
+	ml_generator_t *Generator = Iter->Generator;
+	if (Frame->Top[-1] == (ml_value_t *)Generator) {
+		Generator->Frame = Inst->Params[3].Frame;
+		Frame->Top[-1] = (ml_value_t *)Iter;
+		return Inst->Params[1].Inst;
+	}
+	Generator->Value = MLNil;
+	Frame->Top[-1] = MLNil;
+	return Inst->Params[0].Inst;
+}
+
+static ml_inst_t *mli_next_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+	ML_FUEL_CHECK(Inst, Frame);
 	ml_value_t *Iter = Frame->Top[-1];
-	Frame->Top[-1] = Iter = Iter->Type->next(Iter);
-	if (Iter->Type == MLErrorT) {
+	if (Frame->Suspendable && ml_typeof(Iter) == MLGeneratorIterT) return ml_generator_resume(Inst, Frame, (ml_generator_iter_t *)Iter);
+	Frame->Top[-1] = Iter = ml_typeof(Iter)->next(Iter);
+	if (ml_typeof(Iter) == MLErrorT) {
 		ml_error_trace_add(Iter, Inst->Source);
 		return Frame->OnError;
 	} else if (Iter == MLNil) {
@@ -2300,10 +3768,10 @@ ml_inst_t *mli_next_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	}
 }
 
-ml_inst_t *mli_key_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+static ml_inst_t *mli_key_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	ml_value_t *Iter = Frame->Top[-1];
-	ml_value_t *Key = (++Frame->Top)[-1] = Iter->Type->key(Iter);
-	if (Key->Type == MLErrorT) {
+	ml_value_t *Key = (++Frame->Top)[-1] = ml_typeof(Iter)->key(Iter);
+	if (ml_typeof(Key) == MLErrorT) {
 		ml_error_trace_add(Key, Inst->Source);
 		return Frame->OnError;
 	} else {
@@ -2311,7 +3779,32 @@ ml_inst_t *mli_key_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	}
 }
 
-ml_inst_t *mli_local_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+static ml_inst_t *mli_susp_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+	ml_value_t *Value = Frame->Top[-1];
+	Value = ml_typeof(Value)->deref(Value);
+	if (ml_typeof(Value) == MLErrorT) {
+		ml_error_trace_add(Value, Inst->Source);
+		Frame->Top[-1] = Value;
+		return Frame->OnError;
+	}
+	ml_generator_t *Generator = (ml_generator_t *)Frame->Generator;
+	Frame->Resume = Inst->Params[0].Inst;
+	if (!Generator) {
+		Generator = new(ml_generator_t);
+		Generator->Type = MLGeneratorT;
+		Frame->Top[-1] = (ml_value_t *)Generator;
+		ml_frame_t *Heap = Generator->Frame = ml_frame_promote(Frame);
+		Heap->Generator = (ml_value_t *)Generator;
+		Heap->Suspendable = 0;
+	} else {
+		Frame->Top[-1] = (ml_value_t *)Generator;
+	}
+	Generator->Value = Value;
+	++Generator->Index;
+	return NULL;
+}
+
+static ml_inst_t *mli_local_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	int Index = Inst->Params[1].Index;
 	if (Index < 0) {
 		(++Frame->Top)[-1] = Frame->UpValues[~Index];
@@ -2321,15 +3814,15 @@ ml_inst_t *mli_local_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	return Inst->Params[0].Inst;
 }
 
-ml_inst_t *mli_list_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+static ml_inst_t *mli_list_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	(++Frame->Top)[-1] = ml_list();
 	return Inst->Params[0].Inst;
 }
 
-ml_inst_t *mli_append_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+static ml_inst_t *mli_append_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	ml_value_t *Value = Frame->Top[-1];
-	Value = Value->Type->deref(Value);
-	if (Value->Type == MLErrorT) {
+	Value = ml_typeof(Value)->deref(Value);
+	if (ml_typeof(Value) == MLErrorT) {
 		Frame->Top[-1] = Value;
 		return Frame->OnError;
 	}
@@ -2338,7 +3831,7 @@ ml_inst_t *mli_append_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	return Inst->Params[0].Inst;
 }
 
-ml_inst_t *mli_closure_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+static ml_inst_t *mli_closure_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	// closure <entry> <frame_size> <num_params> <num_upvalues> <upvalue_1> ...
 	ml_closure_info_t *Info = Inst->Params[1].ClosureInfo;
 	ml_closure_t *Closure = xnew(ml_closure_t, Info->NumUpValues, ml_value_t *);
@@ -2356,12 +3849,12 @@ ml_inst_t *mli_closure_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	return Inst->Params[0].Inst;
 }
 
-ml_inst_t *mli_ra_fields_run(ml_inst_t *Inst, ml_frame_t *Frame) {
+static ml_inst_t *mli_ra_fields_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	// params = <next> <num_fields> <field_1> <field_2> ...
 	ml_value_t *Instance = Frame->Top[-1];
-	Instance = Instance->Type->deref(Instance);
+	Instance = ml_typeof(Instance)->deref(Instance);
 	(--Frame->Top)[0] = 0;
-	if (Instance->Type != RaInstanceT) {
+	if (ml_typeof(Instance) != RaInstanceT) {
 		ml_value_t *Error = ml_error("InternalError", "invalid instance");
 		ml_error_trace_add(Error, Inst->Source);
 		(++Frame->Top)[-1] = Error;
@@ -2369,7 +3862,7 @@ ml_inst_t *mli_ra_fields_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 	}
 	for (int I = 0; I < Inst->Params[1].Count; ++I) {
 		ml_value_t *Value = (++Frame->Top)[-1] = ra_instance_field_by_field((ra_instance_t *)Instance, Inst->Params[2 + I].RaField);
-		if (Value->Type == MLErrorT) {
+		if (ml_typeof(Value) == MLErrorT) {
 			ml_error_trace_add(Value, Inst->Source);
 			return Frame->OnError;
 		}
@@ -2379,11 +3872,13 @@ ml_inst_t *mli_ra_fields_run(ml_inst_t *Inst, ml_frame_t *Frame) {
 
 typedef struct mlc_expr_t mlc_expr_t;
 typedef struct mlc_scanner_t mlc_scanner_t;
+typedef struct mlc_schema_entry_t mlc_schema_entry_t;
 typedef struct mlc_function_t mlc_function_t;
 typedef struct mlc_decl_t mlc_decl_t;
 typedef struct mlc_loop_t mlc_loop_t;
 typedef struct mlc_try_t mlc_try_t;
 typedef struct mlc_upvalue_t mlc_upvalue_t;
+typedef struct mlc_store_t mlc_store_t;
 
 typedef struct { ml_inst_t *Start, *Exits; } mlc_compiled_t;
 
@@ -2401,7 +3896,14 @@ struct mlc_function_t {
 struct mlc_decl_t {
 	mlc_decl_t *Next;
 	const char *Ident;
-	int Index;
+	mlc_store_t *Stores;
+	ml_inst_t *Constant;
+	int Index, Boxable, Captured;
+};
+
+struct mlc_store_t {
+	mlc_store_t *Next;
+	ml_inst_t *Inst;
 };
 
 struct mlc_loop_t {
@@ -2417,30 +3919,246 @@ struct mlc_try_t {
 	int CatchTop;
 };
 
-struct mlc_upvalue_t {
-	mlc_upvalue_t *Next;
-	mlc_decl_t *Decl;
-	int Index;
-};
+struct mlc_upvalue_t {
+	mlc_upvalue_t *Next;
+	mlc_decl_t *Decl;
+	int Index;
+};
+
+#define MLC_EXPR_FIELDS(TYPE) \
+	mlc_compiled_t (*compile)(mlc_function_t *, mlc_ ## TYPE ## _expr_t *, SHA256_CTX *HashContext); \
+	mlc_expr_t *Next; \
+	ml_source_t Source
+
+struct mlc_expr_t {
+	mlc_compiled_t (*compile)(mlc_function_t *, mlc_expr_t *, SHA256_CTX *HashContext);
+	mlc_expr_t *Next;
+	ml_source_t Source;
+};
+
+static inline ml_inst_t *ml_inst_new(int N, ml_source_t Source, ml_opcode_t Opcode) {
+	ml_inst_t *Inst = xnew(ml_inst_t, N, ml_param_t);
+	Inst->Source = Source;
+	Inst->Opcode = Opcode;
+	Inst->NumParams = N;
+	return Inst;
+}
+
+static void mlc_decl_store(mlc_decl_t *Decl, ml_inst_t *Inst) {
+	mlc_store_t *Store = new(mlc_store_t);
+	Store->Inst = Inst;
+	Store->Next = Decl->Stores;
+	Decl->Stores = Store;
+}
+
+static unsigned char mlc_decl_boxed(mlc_decl_t *Decl) {
+	if (Decl->Captured) return 1;
+	for (mlc_store_t *Store = Decl->Stores; Store; Store = Store->Next) {
+		ml_inst_t *Inst = Store->Inst;
+		Inst->Opcode = Inst->Opcode == MLI_VAR ? MLI_VAR_UNBOXED : MLI_ASSIGN_UNBOXED;
+		Inst->Params[1].Index = Decl->Index;
+	}
+	return 0;
+}
+
+static inline int mlc_const_if(ml_inst_t *Inst) {
+	switch (Inst->Opcode) {
+	case MLI_EQ_CONST_IF: case MLI_NEQ_CONST_IF: case MLI_LES_CONST_IF: case MLI_GRE_CONST_IF: case MLI_LEQ_CONST_IF: case MLI_GEQ_CONST_IF:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static inline int mlc_inst_branch(ml_inst_t *Inst) {
+	switch (Inst->Opcode) {
+	case MLI_TRY: case MLI_IF: case MLI_UNTIL: case MLI_WHILE:
+	case MLI_AND: case MLI_OR: case MLI_EXISTS: case MLI_NEXT:
+		return 1;
+	case MLI_EQ_IF: case MLI_NEQ_IF: case MLI_LES_IF: case MLI_GRE_IF: case MLI_LEQ_IF: case MLI_GEQ_IF:
+	case MLI_EQ_CONST_IF: case MLI_NEQ_CONST_IF: case MLI_LES_CONST_IF: case MLI_GRE_CONST_IF: case MLI_LEQ_CONST_IF: case MLI_GEQ_CONST_IF:
+		return 6;
+	default:
+		return 0;
+	}
+}
+
+static ml_inst_t **mlc_collect(ml_inst_t *Entry, int *Count) {
+	// Returns the instructions reachable from Entry with each fall-through chain in order. Visited
+	// instructions are marked by complementing NumParams until the walk is complete.
+	int NumInsts = 0, MaxInsts = 64, NumPending = 0, MaxPending = 16;
+	ml_inst_t **Insts = anew(ml_inst_t *, MaxInsts);
+	ml_inst_t **Pending = anew(ml_inst_t *, MaxPending);
+	Pending[NumPending++] = Entry;
+	while (NumPending) {
+		ml_inst_t *Inst = Pending[--NumPending];
+		while (Inst && Inst->NumParams > 0) {
+			if (NumInsts == MaxInsts) {
+				ml_inst_t **Old = Insts;
+				Insts = anew(ml_inst_t *, MaxInsts *= 2);
+				memcpy(Insts, Old, NumInsts * sizeof(ml_inst_t *));
+			}
+			Insts[NumInsts++] = Inst;
+			Inst->NumParams = ~Inst->NumParams;
+			int Branch = mlc_inst_branch(Inst);
+			if (Branch && Inst->Params[Branch].Inst) {
+				if (NumPending == MaxPending) {
+					ml_inst_t **Old = Pending;
+					Pending = anew(ml_inst_t *, MaxPending *= 2);
+					memcpy(Pending, Old, NumPending * sizeof(ml_inst_t *));
+				}
+				Pending[NumPending++] = Inst->Params[Branch].Inst;
+			}
+			Inst = Inst->Params[0].Inst;
+		}
+	}
+	for (int I = 0; I < NumInsts; ++I) Insts[I]->NumParams = ~Insts[I]->NumParams;
+	*Count = NumInsts;
+	return Insts;
+}
 
-#define MLC_EXPR_FIELDS(TYPE) \
-	mlc_compiled_t (*compile)(mlc_function_t *, mlc_ ## TYPE ## _expr_t *, SHA256_CTX *HashContext); \
-	mlc_expr_t *Next; \
-	ml_source_t Source
+static ml_inst_t *mlc_linearize(ml_inst_t *Entry) {
+	// Copies the instruction graph reachable from Entry into a single contiguous block. Each original
+	// instruction is forwarded to its copy through Params[0] once everything has been copied.
+	if (!Entry) return NULL;
+	int NumInsts;
+	ml_inst_t **Insts = mlc_collect(Entry, &NumInsts);
+	size_t Size = 0;
+	for (int I = 0; I < NumInsts; ++I) Size += sizeof(ml_inst_t) + Insts[I]->NumParams * sizeof(ml_param_t);
+	char *Code = (char *)GC_MALLOC(Size);
+	ml_inst_t **Copies = anew(ml_inst_t *, NumInsts);
+	for (int I = 0; I < NumInsts; ++I) {
+		ml_inst_t *Inst = Insts[I];
+		size_t InstSize = sizeof(ml_inst_t) + Inst->NumParams * sizeof(ml_param_t);
+		Copies[I] = (ml_inst_t *)memcpy(Code, Inst, InstSize);
+		Code += InstSize;
+	}
+	for (int I = 0; I < NumInsts; ++I) Insts[I]->Params[0].Inst = Copies[I];
+	for (int I = 0; I < NumInsts; ++I) {
+		ml_inst_t *Copy = Copies[I];
+		if (Copy->Params[0].Inst) Copy->Params[0].Inst = Copy->Params[0].Inst->Params[0].Inst;
+		int Branch = mlc_inst_branch(Copy);
+		if (Branch && Copy->Params[Branch].Inst) Copy->Params[Branch].Inst = Copy->Params[Branch].Inst->Params[0].Inst;
+	}
+	return Copies[0];
+}
 
-struct mlc_expr_t {
-	mlc_compiled_t (*compile)(mlc_function_t *, mlc_expr_t *, SHA256_CTX *HashContext);
-	mlc_expr_t *Next;
-	ml_source_t Source;
-};
+static int Optimize = 1;
 
-static inline ml_inst_t *ml_inst_new(int N, ml_source_t Source, ml_inst_t *(*run)(ml_inst_t *Inst, ml_frame_t *Frame)) {
-	ml_inst_t *Inst = xnew(ml_inst_t, N, ml_param_t);
-	Inst->Source = Source;
-	Inst->run = run;
+void ml_optimize_set(int Enabled) {
+	Optimize = Enabled;
+}
+
+static inline ml_inst_t *mlc_thread(ml_inst_t *Inst) {
+	for (int I = 0; Inst && Inst->Opcode == MLI_JUMP && I < 64; ++I) Inst = Inst->Params[0].Inst;
 	return Inst;
 }
 
+static int mlc_number_op(ml_inst_t *Inst, int Const) {
+	for (int I = 0; MLCNumberOps[I].Name; ++I) {
+		if (Inst->Opcode == (Const ? MLCNumberOps[I].ConstOpcode : MLCNumberOps[I].Opcode)) return I;
+	}
+	return -1;
+}
+
+static ml_inst_t *mlc_fuse_number(ml_inst_t *Inst, ml_opcode_t Opcode, int Op) {
+	ml_inst_t *Fused = ml_inst_new(7, Inst->Source, Opcode);
+	memcpy(Fused->Params, Inst->Params, Inst->NumParams * sizeof(ml_param_t));
+	Fused->Params[3].MethodCache = NULL;
+	Fused->Params[5].Fast = MLCNumberOps[Op].Fast;
+	return Fused;
+}
+
+static void mlc_replace(ml_inst_t *Inst, ml_inst_t *Target) {
+	Inst->Opcode = MLI_JUMP;
+	Inst->Params[0].Inst = Target;
+}
+
+static ml_inst_t *mlc_optimize(ml_inst_t *Entry) {
+	// Peephole pass over a finished closure body: folds number operations on constants, drops values
+	// that are pushed only to be popped, resolves branches on constants, fuses local loads and
+	// comparisons with the instructions that consume them and finally threads jumps. Replaced
+	// instructions become jumps so that every predecessor follows the rewrite. Code left unreachable,
+	// such as the untaken side of a constant branch, is dropped by mlc_linearize which only copies
+	// what can be reached from the entry. Uses of defs bound to constants are already pushes, see
+	// ml_def_expr_compile.
+	if (!Optimize || !Entry) return Entry;
+	int NumInsts;
+	ml_inst_t **Insts = mlc_collect(Entry, &NumInsts);
+	for (int I = 0; I < NumInsts; ++I) {
+		ml_inst_t *Inst = Insts[I], *Next = Inst->Params[0].Inst;
+		if (!Next || Next->Opcode != MLI_IF) continue;
+		int Op, Const = 0;
+		if ((Op = mlc_number_op(Inst, 0)) < 0 && (Op = mlc_number_op(Inst, Const = 1)) < 0) continue;
+		if (!MLCNumberOps[Op].IfOpcode) continue;
+		ml_inst_t *Fused = mlc_fuse_number(Inst, Const ? MLCNumberOps[Op].ConstIfOpcode : MLCNumberOps[Op].IfOpcode, Op);
+		Fused->Params[0].Inst = Next->Params[0].Inst;
+		Fused->Params[6].Inst = Next->Params[1].Inst;
+		mlc_replace(Inst, Fused);
+	}
+	for (int I = 0; I < NumInsts; ++I) {
+		ml_inst_t *Inst = Insts[I];
+		ml_inst_t *Next;
+		int Op;
+		switch (Inst->Opcode) {
+		case MLI_PUSH: {
+			ml_value_t *Value = Inst->Params[1].Value;
+			while ((Next = mlc_thread(Inst->Params[0].Inst)) && (Op = mlc_number_op(Next, 1)) >= 0) {
+				ml_value_t *Result = MLCNumberOps[Op].Fast(Value, Next->Params[4].Value);
+				if (!Result) break;
+				Inst->Params[1].Value = Value = Result;
+				if (Inst->NumParams > 2) Inst->Params[2].Name = NULL;
+				Inst->Params[0].Inst = Next->Params[0].Inst;
+			}
+			if (!Next) break;
+			if (Next->Opcode == MLI_POP) {
+				mlc_replace(Inst, Next->Params[0].Inst);
+			} else if (Next->Opcode == MLI_IF) {
+				mlc_replace(Inst, Next->Params[Value == MLNil ? 0 : 1].Inst);
+			} else if (mlc_const_if(Next)) {
+				ml_value_t *Result = Next->Params[5].Fast(Value, Next->Params[4].Value);
+				if (Result) mlc_replace(Inst, Next->Params[Result == MLNil ? 0 : 6].Inst);
+			}
+			break;
+		}
+		case MLI_LOCAL: {
+			if (!(Next = mlc_thread(Inst->Params[0].Inst))) break;
+			if (Next->Opcode == MLI_POP) {
+				mlc_replace(Inst, Next->Params[0].Inst);
+			} else if ((Op = mlc_number_op(Next, 1)) >= 0) {
+				ml_inst_t *Fused = mlc_fuse_number(Next, MLI_LOCAL_NUMBER_CONST, Op);
+				Fused->Params[6].Index = Inst->Params[1].Index;
+				mlc_replace(Inst, Fused);
+			} else if (Next->Opcode == MLI_CALL) {
+				ml_inst_t *Fused = ml_inst_new(4, Next->Source, MLI_LOCAL_CALL);
+				Fused->Params[0] = Next->Params[0];
+				Fused->Params[1] = Next->Params[1];
+				Fused->Params[3].Index = Inst->Params[1].Index;
+				mlc_replace(Inst, Fused);
+			} else if (Next->Opcode == MLI_CONST_CALL) {
+				ml_inst_t *Fused = ml_inst_new(6, Next->Source, MLI_LOCAL_CONST_CALL);
+				memcpy(Fused->Params, Next->Params, Next->NumParams * sizeof(ml_param_t));
+				Fused->Params[3].MethodCache = NULL;
+				Fused->Params[5].Index = Inst->Params[1].Index;
+				mlc_replace(Inst, Fused);
+			}
+			break;
+		}
+		default:
+			break;
+		}
+	}
+	Entry = mlc_thread(Entry);
+	Insts = mlc_collect(Entry, &NumInsts);
+	for (int I = 0; I < NumInsts; ++I) {
+		ml_inst_t *Inst = Insts[I];
+		Inst->Params[0].Inst = mlc_thread(Inst->Params[0].Inst);
+		int Branch = mlc_inst_branch(Inst);
+		if (Branch) Inst->Params[Branch].Inst = mlc_thread(Inst->Params[Branch].Inst);
+	}
+	return Entry;
+}
+
 #define STRINGIFY(x) #x
 #define TOSTRING(x) STRINGIFY(x)
 #define ML_COMPILE_HASH sha256_update(HashContext, (BYTE *)__FILE__ TOSTRING(__LINE__), strlen(__FILE__ TOSTRING(__LINE__)));
@@ -2461,7 +4179,7 @@ static inline mlc_compiled_t ml_compile(mlc_function_t *Function, mlc_expr_t *Ex
 		return Compiled;
 	} else {
 		ML_COMPILE_HASH
-		ml_inst_t *NilInst = ml_inst_new(2, (ml_source_t){"<internal>", 0}, mli_push_run);
+		ml_inst_t *NilInst = ml_inst_new(2, (ml_source_t){"<internal>", 0}, MLI_PUSH);
 		NilInst->Params[1].Value = MLNil;
 		++Function->Top;
 		return (mlc_compiled_t){NilInst, NilInst};
@@ -2507,7 +4225,7 @@ static mlc_compiled_t ml_if_expr_compile(mlc_function_t *Function, mlc_if_expr_t
 	--Function->Top;
 	mlc_compiled_t BodyCompiled = ml_compile(Function, Case->Body, HashContext);
 	ML_COMPILE_HASH
-	ml_inst_t *IfInst = ml_inst_new(2, Expr->Source, mli_and_run);
+	ml_inst_t *IfInst = ml_inst_new(2, Expr->Source, MLI_AND);
 	IfInst->Params[0].Inst = BodyCompiled.Exits;
 	IfInst->Params[1].Inst = BodyCompiled.Start;
 	mlc_connect(Compiled.Exits, IfInst);
@@ -2516,7 +4234,7 @@ static mlc_compiled_t ml_if_expr_compile(mlc_function_t *Function, mlc_if_expr_t
 		Function->Top = OldTop;
 		Compiled.Exits = IfInst->Params[0].Inst;
 		mlc_compiled_t ConditionCompiled = ml_compile(Function, Case->Condition, HashContext);
-		IfInst->run = mli_if_run;
+		IfInst->Opcode = MLI_IF;
 		IfInst->Params[0].Inst = ConditionCompiled.Start;
 		--Function->Top;
 		BodyCompiled = ml_compile(Function, Case->Body, HashContext);
@@ -2524,7 +4242,7 @@ static mlc_compiled_t ml_if_expr_compile(mlc_function_t *Function, mlc_if_expr_t
 		while (Slot[0]) Slot = &Slot[0]->Params[0].Inst;
 		Slot[0] = BodyCompiled.Exits;
 		ML_COMPILE_HASH
-		IfInst = ml_inst_new(2, Case->Source, mli_and_run);
+		IfInst = ml_inst_new(2, Case->Source, MLI_AND);
 		IfInst->Params[0].Inst = Compiled.Exits;
 		IfInst->Params[1].Inst = BodyCompiled.Start;
 		mlc_connect(ConditionCompiled.Exits, IfInst);
@@ -2534,7 +4252,7 @@ static mlc_compiled_t ml_if_expr_compile(mlc_function_t *Function, mlc_if_expr_t
 	if (Expr->Else) {
 		Compiled.Exits = IfInst->Params[0].Inst;
 		mlc_compiled_t BodyCompiled = ml_compile(Function, Expr->Else, HashContext);
-		IfInst->run = mli_if_run;
+		IfInst->Opcode = MLI_IF;
 		IfInst->Params[0].Inst = BodyCompiled.Start;
 		ml_inst_t **Slot = &Compiled.Exits;
 		while (Slot[0]) Slot = &Slot[0]->Params[0].Inst;
@@ -2555,7 +4273,7 @@ static mlc_compiled_t ml_or_expr_compile(mlc_function_t *Function, mlc_parent_ex
 	mlc_expr_t *Child = Expr->Child;
 	mlc_compiled_t Compiled = ml_compile(Function, Child, HashContext);
 	ML_COMPILE_HASH
-	ml_inst_t *OrInst = ml_inst_new(2, Expr->Source, mli_or_run);
+	ml_inst_t *OrInst = ml_inst_new(2, Expr->Source, MLI_OR);
 	mlc_connect(Compiled.Exits, OrInst);
 	Compiled.Exits = OrInst;
 	for (Child = Child->Next; Child->Next; Child = Child->Next) {
@@ -2563,7 +4281,7 @@ static mlc_compiled_t ml_or_expr_compile(mlc_function_t *Function, mlc_parent_ex
 		mlc_compiled_t ChildCompiled = ml_compile(Function, Child, HashContext);
 		OrInst->Params[1].Inst = ChildCompiled.Start;
 		ML_COMPILE_HASH
-		OrInst = ml_inst_new(2, Expr->Source, mli_or_run);
+		OrInst = ml_inst_new(2, Expr->Source, MLI_OR);
 		mlc_connect(ChildCompiled.Exits, OrInst);
 		OrInst->Params[0].Inst = Compiled.Exits;
 		Compiled.Exits = OrInst;
@@ -2583,7 +4301,7 @@ static mlc_compiled_t ml_and_expr_compile(mlc_function_t *Function, mlc_parent_e
 	mlc_expr_t *Child = Expr->Child;
 	mlc_compiled_t Compiled = ml_compile(Function, Child, HashContext);
 	ML_COMPILE_HASH
-	ml_inst_t *IfInst = ml_inst_new(2, Expr->Source, mli_and_run);
+	ml_inst_t *IfInst = ml_inst_new(2, Expr->Source, MLI_AND);
 	mlc_connect(Compiled.Exits, IfInst);
 	Compiled.Exits = IfInst;
 	for (Child = Child->Next; Child->Next; Child = Child->Next) {
@@ -2591,7 +4309,7 @@ static mlc_compiled_t ml_and_expr_compile(mlc_function_t *Function, mlc_parent_e
 		mlc_compiled_t ChildCompiled = ml_compile(Function, Child, HashContext);
 		IfInst->Params[1].Inst = ChildCompiled.Start;
 		ML_COMPILE_HASH
-		IfInst = ml_inst_new(2, Expr->Source, mli_and_run);
+		IfInst = ml_inst_new(2, Expr->Source, MLI_AND);
 		mlc_connect(ChildCompiled.Exits, IfInst);
 		IfInst->Params[0].Inst = Compiled.Exits;
 		Compiled.Exits = IfInst;
@@ -2608,7 +4326,7 @@ static mlc_compiled_t ml_and_expr_compile(mlc_function_t *Function, mlc_parent_e
 static mlc_compiled_t ml_loop_expr_compile(mlc_function_t *Function, mlc_parent_expr_t *Expr, SHA256_CTX *HashContext) {
 	int OldTop = Function->Top;
 	ML_COMPILE_HASH
-	ml_inst_t *LoopInst = ml_inst_new(1, Expr->Source, mli_pop_run);
+	ml_inst_t *LoopInst = ml_inst_new(1, Expr->Source, MLI_LOOP);
 	mlc_loop_t Loop = {
 		Function->Loop, Function->Try,
 		LoopInst, NULL,
@@ -2625,20 +4343,20 @@ static mlc_compiled_t ml_loop_expr_compile(mlc_function_t *Function, mlc_parent_
 }
 
 static mlc_compiled_t ml_next_expr_compile(mlc_function_t *Function, mlc_expr_t *Expr, SHA256_CTX *HashContext) {
-	ml_inst_t *NilInst = ml_inst_new(2, (ml_source_t){"<internal>", 0}, mli_push_run);
+	ml_inst_t *NilInst = ml_inst_new(2, (ml_source_t){"<internal>", 0}, MLI_PUSH);
 	NilInst->Params[1].Value = MLNil;
 	ml_inst_t *NextInst = Function->Loop->Next;
 	Function->Top++;
 	if (Function->Try != Function->Loop->Try) {
 		ML_COMPILE_HASH
-		ml_inst_t *TryInst = ml_inst_new(2, Expr->Source, mli_try_run);
+		ml_inst_t *TryInst = ml_inst_new(2, Expr->Source, MLI_TRY);
 		TryInst->Params[1].Inst = Function->Try ? Function->Try->CatchInst : NULL;
 		TryInst->Params[0].Inst = Function->Loop->Next;
 		NextInst = TryInst;
 	}
 	if (Function->Top > Function->Loop->NextTop) {
 		ML_COMPILE_HASH
-		ml_inst_t *ExitInst = ml_inst_new(2, Expr->Source, mli_exit_run);
+		ml_inst_t *ExitInst = ml_inst_new(2, Expr->Source, MLI_EXIT);
 		ExitInst->Params[0].Inst = NextInst;
 		ExitInst->Params[1].Count = Function->Top - Function->Loop->NextTop;
 		NilInst->Params[0].Inst = ExitInst;
@@ -2659,7 +4377,7 @@ static mlc_compiled_t ml_exit_expr_compile(mlc_function_t *Function, mlc_parent_
 	mlc_compiled_t Compiled = ml_compile(Function, Expr->Child, HashContext);
 	if (Function->Try != Try) {
 		ML_COMPILE_HASH
-		ml_inst_t *TryInst = ml_inst_new(2, Expr->Source, mli_try_run);
+		ml_inst_t *TryInst = ml_inst_new(2, Expr->Source, MLI_TRY);
 		TryInst->Params[1].Inst = Function->Try ? Function->Try->CatchInst : NULL;
 		TryInst->Params[0].Inst = Compiled.Start;
 		Compiled.Start = TryInst;
@@ -2668,7 +4386,7 @@ static mlc_compiled_t ml_exit_expr_compile(mlc_function_t *Function, mlc_parent_
 	Function->Try = Try;
 	if (Function->Top > Function->Loop->ExitTop) {
 		ML_COMPILE_HASH
-		ml_inst_t *ExitInst = ml_inst_new(2, Expr->Source, mli_exit_run);
+		ml_inst_t *ExitInst = ml_inst_new(2, Expr->Source, MLI_EXIT);
 		ExitInst->Params[1].Count = Function->Top - Function->Loop->ExitTop;
 		mlc_connect(Compiled.Exits, ExitInst);
 		Compiled.Exits = ExitInst;
@@ -2684,11 +4402,11 @@ static mlc_compiled_t ml_exit_expr_compile(mlc_function_t *Function, mlc_parent_
 static mlc_compiled_t ml_not_expr_compile(mlc_function_t *Function, mlc_parent_expr_t *Expr, SHA256_CTX *HashContext) {
 	mlc_compiled_t Compiled = ml_compile(Function, Expr->Child, HashContext);
 	ML_COMPILE_HASH
-	ml_inst_t *NotInst = ml_inst_new(2, Expr->Source, mli_if_run);
+	ml_inst_t *NotInst = ml_inst_new(2, Expr->Source, MLI_IF);
 	mlc_connect(Compiled.Exits, NotInst);
-	ml_inst_t *NilInst = ml_inst_new(2, Expr->Source, mli_push_run);
+	ml_inst_t *NilInst = ml_inst_new(2, Expr->Source, MLI_PUSH);
 	NilInst->Params[1].Value = MLNil;
-	ml_inst_t *SomeInst = ml_inst_new(2, Expr->Source, mli_push_run);
+	ml_inst_t *SomeInst = ml_inst_new(2, Expr->Source, MLI_PUSH);
 	SomeInst->Params[1].Value = MLSome;
 	NotInst->Params[0].Inst = SomeInst;
 	NotInst->Params[1].Inst = NilInst;
@@ -2700,18 +4418,18 @@ static mlc_compiled_t ml_not_expr_compile(mlc_function_t *Function, mlc_parent_e
 static mlc_compiled_t ml_while_expr_compile(mlc_function_t *Function, mlc_parent_expr_t *Expr, SHA256_CTX *HashContext) {
 	mlc_compiled_t Compiled = ml_compile(Function, Expr->Child, HashContext);
 	ML_COMPILE_HASH
-	ml_inst_t *ExitInst = ml_inst_new(2, Expr->Source, mli_exit_run);
+	ml_inst_t *ExitInst = ml_inst_new(2, Expr->Source, MLI_EXIT);
 	ExitInst->Params[1].Count = Function->Top - Function->Loop->ExitTop;
 	mlc_loop_t *Loop = Function->Loop;
 	if (Function->Try != Loop->Try) {
 		ML_COMPILE_HASH
-		ml_inst_t *TryInst = ml_inst_new(2, Expr->Source, mli_try_run);
+		ml_inst_t *TryInst = ml_inst_new(2, Expr->Source, MLI_TRY);
 		TryInst->Params[1].Inst = Loop->Try ? Loop->Try->CatchInst : NULL;
 		TryInst->Params[0].Inst = ExitInst;
 		ExitInst = TryInst;
 	}
 	ML_COMPILE_HASH
-	ml_inst_t *WhileInst = ml_inst_new(2, Expr->Source, mli_while_run);
+	ml_inst_t *WhileInst = ml_inst_new(2, Expr->Source, MLI_WHILE);
 	mlc_connect(Compiled.Exits, WhileInst);
 	Compiled.Exits = WhileInst;
 	WhileInst->Params[1].Inst = ExitInst;
@@ -2723,18 +4441,18 @@ static mlc_compiled_t ml_while_expr_compile(mlc_function_t *Function, mlc_parent
 static mlc_compiled_t ml_until_expr_compile(mlc_function_t *Function, mlc_parent_expr_t *Expr, SHA256_CTX *HashContext) {
 	mlc_compiled_t Compiled = ml_compile(Function, Expr->Child, HashContext);
 	ML_COMPILE_HASH
-	ml_inst_t *ExitInst = ml_inst_new(2, Expr->Source, mli_exit_run);
+	ml_inst_t *ExitInst = ml_inst_new(2, Expr->Source, MLI_EXIT);
 	ExitInst->Params[1].Count = Function->Top - Function->Loop->ExitTop;
 	mlc_loop_t *Loop = Function->Loop;
 	if (Function->Try != Loop->Try) {
 		ML_COMPILE_HASH
-		ml_inst_t *TryInst = ml_inst_new(2, Expr->Source, mli_try_run);
+		ml_inst_t *TryInst = ml_inst_new(2, Expr->Source, MLI_TRY);
 		TryInst->Params[1].Inst = Loop->Try ? Loop->Try->CatchInst : NULL;
 		TryInst->Params[0].Inst = ExitInst;
 		ExitInst = TryInst;
 	}
 	ML_COMPILE_HASH
-	ml_inst_t *UntilInst = ml_inst_new(2, Expr->Source, mli_until_run);
+	ml_inst_t *UntilInst = ml_inst_new(2, Expr->Source, MLI_UNTIL);
 	mlc_connect(Compiled.Exits, UntilInst);
 	Compiled.Exits = UntilInst;
 	UntilInst->Params[1].Inst = ExitInst;
@@ -2750,6 +4468,15 @@ static mlc_compiled_t ml_return_expr_compile(mlc_function_t *Function, mlc_paren
 	return Compiled;
 }
 
+static mlc_compiled_t ml_susp_expr_compile(mlc_function_t *Function, mlc_parent_expr_t *Expr, SHA256_CTX *HashContext) {
+	mlc_compiled_t Compiled = ml_compile(Function, Expr->Child, HashContext);
+	ML_COMPILE_HASH
+	ml_inst_t *SuspInst = ml_inst_new(1, Expr->Source, MLI_SUSP);
+	mlc_connect(Compiled.Exits, SuspInst);
+	Compiled.Exits = SuspInst;
+	return Compiled;
+}
+
 struct mlc_decl_expr_t {
 	MLC_EXPR_FIELDS(decl);
 	mlc_decl_t *Decl;
@@ -2759,8 +4486,9 @@ struct mlc_decl_expr_t {
 static mlc_compiled_t ml_var_expr_compile(mlc_function_t *Function, mlc_decl_expr_t *Expr, SHA256_CTX *HashContext) {
 	mlc_compiled_t Compiled = ml_compile(Function, Expr->Child, HashContext);
 	ML_COMPILE_HASH
-	ml_inst_t *VarInst = ml_inst_new(2, Expr->Source, mli_var_run);
+	ml_inst_t *VarInst = ml_inst_new(2, Expr->Source, MLI_VAR);
 	VarInst->Params[1].Index = Expr->Decl->Index;
+	mlc_decl_store(Expr->Decl, VarInst);
 	mlc_connect(Compiled.Exits, VarInst);
 	Compiled.Exits = VarInst;
 	return Compiled;
@@ -2769,9 +4497,11 @@ static mlc_compiled_t ml_var_expr_compile(mlc_function_t *Function, mlc_decl_exp
 static mlc_compiled_t ml_def_expr_compile(mlc_function_t *Function, mlc_decl_expr_t *Expr, SHA256_CTX *HashContext) {
 	mlc_compiled_t Compiled = ml_compile(Function, Expr->Child, HashContext);
 	ML_COMPILE_HASH
-	ml_inst_t *DefInst = ml_inst_new(1, Expr->Source, mli_def_run);
+	ml_inst_t *DefInst = ml_inst_new(1, Expr->Source, MLI_DEF);
 	mlc_decl_t *Decl = Expr->Decl;
 	Decl->Index = Function->Top - 1;
+	// A def of a single constant is folded into its uses, which then push the constant directly.
+	if (Optimize && Compiled.Start == Compiled.Exits && Compiled.Start->Opcode == MLI_PUSH) Decl->Constant = Compiled.Start;
 	Decl->Next = Function->Decls;
 	Function->Decls = Decl;
 	mlc_connect(Compiled.Exits, DefInst);
@@ -2804,7 +4534,7 @@ static mlc_compiled_t ml_with_expr_compile(mlc_function_t *Function, mlc_decl_ex
 	mlc_compiled_t ChildCompiled = ml_compile(Function, Child, HashContext);
 	mlc_connect(Compiled.Exits, ChildCompiled.Start);
 	ML_COMPILE_HASH
-	ml_inst_t *ExitInst = ml_inst_new(2, Expr->Source, mli_exit_run);
+	ml_inst_t *ExitInst = ml_inst_new(2, Expr->Source, MLI_EXIT);
 	ExitInst->Params[1].Count = Function->Top - OldTop;
 	mlc_connect(ChildCompiled.Exits, ExitInst);
 	Compiled.Exits = ExitInst;
@@ -2818,7 +4548,7 @@ static mlc_compiled_t ml_for_expr_compile(mlc_function_t *Function, mlc_decl_exp
 	mlc_decl_t *OldScope = Function->Decls;
 	mlc_expr_t *Child = Expr->Child;
 	mlc_compiled_t Compiled = ml_compile(Function, Child, HashContext);
-	ml_inst_t *StartInst = ml_inst_new(2, Expr->Source, mli_until_run);
+	ml_inst_t *StartInst = ml_inst_new(2, Expr->Source, MLI_UNTIL);
 	mlc_connect(Compiled.Exits, StartInst);
 	mlc_decl_t *Decl = Expr->Decl;
 	Decl->Index = Function->Top - 1;
@@ -2832,9 +4562,9 @@ static mlc_compiled_t ml_for_expr_compile(mlc_function_t *Function, mlc_decl_exp
 	}
 	Function->Decls = Decl;
 	ML_COMPILE_HASH
-	ml_inst_t *NextInst = ml_inst_new(2, Expr->Source, mli_next_run);
+	ml_inst_t *NextInst = ml_inst_new(2, Expr->Source, MLI_NEXT);
 	ML_COMPILE_HASH
-	ml_inst_t *PopInst = ml_inst_new(1, Expr->Source, mli_pop_run);
+	ml_inst_t *PopInst = ml_inst_new(1, Expr->Source, MLI_POP);
 	PopInst->Params[0].Inst = NextInst;
 	mlc_loop_t Loop = {
 		Function->Loop, Function->Try,
@@ -2846,11 +4576,11 @@ static mlc_compiled_t ml_for_expr_compile(mlc_function_t *Function, mlc_decl_exp
 	mlc_connect(BodyCompiled.Exits, PopInst);
 	if (KeyDecl) {
 		ML_COMPILE_HASH
-		ml_inst_t *KeyInst = ml_inst_new(1, Expr->Source, mli_key_run);
+		ml_inst_t *KeyInst = ml_inst_new(1, Expr->Source, MLI_KEY);
 		KeyInst->Params[0].Inst = BodyCompiled.Start;
 		NextInst->Params[1].Inst = KeyInst;
 		StartInst->Params[1].Inst = KeyInst;
-		PopInst->run = mli_pop2_run;
+		PopInst->Opcode = MLI_POP2;
 	} else {
 		NextInst->Params[1].Inst = BodyCompiled.Start;
 		StartInst->Params[1].Inst = BodyCompiled.Start;
@@ -2861,7 +4591,7 @@ static mlc_compiled_t ml_for_expr_compile(mlc_function_t *Function, mlc_decl_exp
 	if (Child->Next->Next) {
 		mlc_compiled_t ElseCompiled = ml_compile(Function, Child->Next->Next, HashContext);
 		ML_COMPILE_HASH
-		ml_inst_t *PopInst = ml_inst_new(1, Expr->Source, mli_pop_run);
+		ml_inst_t *PopInst = ml_inst_new(1, Expr->Source, MLI_POP);
 		PopInst->Params[0].Inst = ElseCompiled.Start;
 		StartInst->Params[0].Inst = PopInst;
 		NextInst->Params[0].Inst = PopInst;
@@ -2880,16 +4610,16 @@ static mlc_compiled_t ml_for_expr_compile(mlc_function_t *Function, mlc_decl_exp
 
 static mlc_compiled_t ml_all_expr_compile(mlc_function_t *Function, mlc_parent_expr_t *Expr, SHA256_CTX *HashContext) {
 	ML_COMPILE_HASH
-	ml_inst_t *ListInst = ml_inst_new(1, Expr->Source, mli_list_run);
+	ml_inst_t *ListInst = ml_inst_new(1, Expr->Source, MLI_LIST);
 	++Function->Top;
 	mlc_compiled_t Compiled = ml_compile(Function, Expr->Child, HashContext);
 	ListInst->Params[0].Inst = Compiled.Start;
-	ml_inst_t *UntilInst = ml_inst_new(2, Expr->Source, mli_until_run);
+	ml_inst_t *UntilInst = ml_inst_new(2, Expr->Source, MLI_UNTIL);
 	mlc_connect(Compiled.Exits, UntilInst);
-	ml_inst_t *AppendInst = ml_inst_new(1, Expr->Source, mli_append_run);
+	ml_inst_t *AppendInst = ml_inst_new(1, Expr->Source, MLI_APPEND);
 	UntilInst->Params[1].Inst = AppendInst;
-	ml_inst_t *NextInst = ml_inst_new(2, Expr->Source, mli_next_run);
-	ml_inst_t *PopInst = ml_inst_new(1, Expr->Source, mli_pop_run);
+	ml_inst_t *NextInst = ml_inst_new(2, Expr->Source, MLI_NEXT);
+	ml_inst_t *PopInst = ml_inst_new(1, Expr->Source, MLI_POP);
 	AppendInst->Params[0].Inst = NextInst;
 	UntilInst->Params[0].Inst = PopInst;
 	NextInst->Params[0].Inst = PopInst;
@@ -2916,8 +4646,8 @@ static mlc_compiled_t ml_block_expr_compile(mlc_function_t *Function, mlc_block_
 		Expr->CatchDecl->Next = Function->Decls;
 		Function->Decls = Expr->CatchDecl;
 		mlc_compiled_t TryCompiled = ml_compile(Function, Expr->Catch, HashContext);
-		ml_inst_t *TryInst = ml_inst_new(2, Expr->Source, mli_try_run);
-		ml_inst_t *CatchInst = ml_inst_new(2, Expr->Source, mli_catch_run);
+		ml_inst_t *TryInst = ml_inst_new(2, Expr->Source, MLI_TRY);
+		ml_inst_t *CatchInst = ml_inst_new(2, Expr->Source, MLI_CATCH);
 		TryInst->Params[0].Inst = CatchInst;
 		TryInst->Params[1].Inst = Function->Try ? Function->Try->CatchInst : NULL;
 		CatchInst->Params[0].Inst = TryCompiled.Start;
@@ -2927,13 +4657,15 @@ static mlc_compiled_t ml_block_expr_compile(mlc_function_t *Function, mlc_block_
 		Try.Up = Function->Try;
 		Try.CatchInst = TryInst;
 		Try.CatchTop = OldTop;
-		CatchExitInst = ml_inst_new(2, Expr->Source, mli_exit_run);
+		CatchExitInst = ml_inst_new(2, Expr->Source, MLI_EXIT);
 		CatchExitInst->Params[1].Count = 1;
 		mlc_connect(TryCompiled.Exits, CatchExitInst);
 		Function->Try = &Try;
 	}
+	int FirstVar = Function->Top;
 	for (mlc_decl_t *Decl = Expr->Decl; Decl;) {
 		Decl->Index = Function->Top++;
+		Decl->Boxable = 1;
 		mlc_decl_t *NextDecl = Decl->Next;
 		Decl->Next = Function->Decls;
 		Function->Decls = Decl;
@@ -2943,36 +4675,48 @@ static mlc_compiled_t ml_block_expr_compile(mlc_function_t *Function, mlc_block_
 	if (Function->Top >= Function->Size) Function->Size = Function->Top + 1;
 	mlc_expr_t *Child = Expr->Child;
 	mlc_compiled_t Compiled = ml_compile(Function, Child, HashContext);
-	if (Child) while ((Child = Child->Next)) {
+	if (Child) for (mlc_expr_t *Next; (Next = Child->Next); Child = Next) {
 		ML_COMPILE_HASH
-		ml_inst_t *PopInst = ml_inst_new(1, Expr->Source, mli_pop_run);
+		if (Child->compile == (void *)ml_def_expr_compile) {
+			// The value of a def stays on the stack as its slot until the block exits.
+			++NumDefs;
+			mlc_compiled_t ChildCompiled = ml_compile(Function, Next, HashContext);
+			mlc_connect(Compiled.Exits, ChildCompiled.Start);
+			Compiled.Exits = ChildCompiled.Exits;
+			continue;
+		}
+		ml_inst_t *PopInst = ml_inst_new(1, Expr->Source, MLI_POP);
 		mlc_connect(Compiled.Exits, PopInst);
 		--Function->Top;
-		mlc_compiled_t ChildCompiled = ml_compile(Function, Child, HashContext);
+		mlc_compiled_t ChildCompiled = ml_compile(Function, Next, HashContext);
 		PopInst->Params[0].Inst = ChildCompiled.Start;
 		Compiled.Exits = ChildCompiled.Exits;
 	}
 	if (NumVars > 0) {
 		ML_COMPILE_HASH
-		ml_inst_t *EnterInst = ml_inst_new(2, Expr->Source, mli_enter_run);
+		ml_inst_t *EnterInst = ml_inst_new(3, Expr->Source, MLI_ENTER);
 		EnterInst->Params[0].Inst = Compiled.Start;
 		EnterInst->Params[1].Count = NumVars;
+		unsigned char *Boxed = EnterInst->Params[2].Boxed = (unsigned char *)snew(NumVars);
+		for (mlc_decl_t *Decl = Function->Decls; Decl != OldScope; Decl = Decl->Next) {
+			if (Decl->Boxable) Boxed[Decl->Index - FirstVar] = mlc_decl_boxed(Decl);
+		}
 		Compiled.Start = EnterInst;
 	}
 	if (NumVars + NumDefs > 0) {
 		ML_COMPILE_HASH
-		ml_inst_t *ExitInst = ml_inst_new(2, Expr->Source, mli_exit_run);
+		ml_inst_t *ExitInst = ml_inst_new(2, Expr->Source, MLI_EXIT);
 		ExitInst->Params[1].Count = NumVars + NumDefs;
 		mlc_connect(Compiled.Exits, ExitInst);
 		Compiled.Exits = ExitInst;
 	}
 	if (Expr->Catch) {
-		ml_inst_t *TryInst = ml_inst_new(2, Expr->Source, mli_try_run);
+		ml_inst_t *TryInst = ml_inst_new(2, Expr->Source, MLI_TRY);
 		TryInst->Params[0].Inst = Compiled.Start;
 		TryInst->Params[1].Inst = Try.CatchInst;
 		Compiled.Start = TryInst;
 		Function->Try = Try.Up;
-		TryInst = ml_inst_new(2, Expr->Source, mli_try_run);
+		TryInst = ml_inst_new(2, Expr->Source, MLI_TRY);
 		TryInst->Params[1].Inst = Function->Try ? Function->Try->CatchInst : NULL;
 		TryInst->Params[0].Inst = CatchExitInst;
 		mlc_connect(Compiled.Exits, TryInst);
@@ -2994,7 +4738,7 @@ static mlc_compiled_t ml_call_expr_compile(mlc_function_t *Function, mlc_parent_
 		Compiled.Exits = ChildCompiled.Exits;
 	}
 	ML_COMPILE_HASH
-	ml_inst_t *CallInst = ml_inst_new(2, Expr->Source, mli_call_run);
+	ml_inst_t *CallInst = ml_inst_new(3, Expr->Source, MLI_CALL);
 	CallInst->Params[1].Count = NumArgs;
 	mlc_connect(Compiled.Exits, CallInst);
 	Compiled.Exits = CallInst;
@@ -3002,6 +4746,13 @@ static mlc_compiled_t ml_call_expr_compile(mlc_function_t *Function, mlc_parent_
 	return Compiled;
 }
 
+struct mlc_ident_expr_t {
+	MLC_EXPR_FIELDS(ident);
+	const char *Ident;
+};
+
+static mlc_compiled_t ml_ident_expr_compile(mlc_function_t *Function, mlc_ident_expr_t *Expr, SHA256_CTX *HashContext);
+
 static mlc_compiled_t ml_assign_expr_compile(mlc_function_t *Function, mlc_parent_expr_t *Expr, SHA256_CTX *HashContext) {
 	int OldSelf = Function->Self;
 	mlc_compiled_t Compiled = ml_compile(Function, Expr->Child, HashContext);
@@ -3009,7 +4760,13 @@ static mlc_compiled_t ml_assign_expr_compile(mlc_function_t *Function, mlc_paren
 	mlc_compiled_t ValueCompiled = ml_compile(Function, Expr->Child->Next, HashContext);
 	mlc_connect(Compiled.Exits, ValueCompiled.Start);
 	ML_COMPILE_HASH
-	ml_inst_t *AssignInst = ml_inst_new(1, Expr->Source, mli_assign_run);
+	ml_inst_t *AssignInst = ml_inst_new(2, Expr->Source, MLI_ASSIGN);
+	if (Expr->Child->compile == (void *)ml_ident_expr_compile) {
+		mlc_decl_t *Decl = Function->Decls;
+		const char *Ident = ((mlc_ident_expr_t *)Expr->Child)->Ident;
+		while (Decl && strcmp(Decl->Ident, Ident)) Decl = Decl->Next;
+		if (Decl && Decl->Boxable) mlc_decl_store(Decl, AssignInst);
+	}
 	mlc_connect(ValueCompiled.Exits, AssignInst);
 	Compiled.Exits = AssignInst;
 	Function->Top -= 1;
@@ -3019,30 +4776,75 @@ static mlc_compiled_t ml_assign_expr_compile(mlc_function_t *Function, mlc_paren
 
 static mlc_compiled_t ml_old_expr_compile(mlc_function_t *Function, mlc_expr_t *Expr, SHA256_CTX *HashContext) {
 	ML_COMPILE_HASH
-	ml_inst_t *OldInst = ml_inst_new(2, Expr->Source, mli_local_run);
+	ml_inst_t *OldInst = ml_inst_new(2, Expr->Source, MLI_LOCAL);
 	OldInst->Params[1].Index = Function->Self;
 	if (++Function->Top >= Function->Size) Function->Size = Function->Top + 1;
 	return (mlc_compiled_t){OldInst, OldInst};
 }
 
+struct mlc_value_expr_t {
+	MLC_EXPR_FIELDS(value);
+	ml_value_t *Value;
+};
+
+static mlc_compiled_t ml_value_expr_compile(mlc_function_t *Function, mlc_value_expr_t *Expr, SHA256_CTX *HashContext);
+
 struct mlc_const_call_expr_t {
 	MLC_EXPR_FIELDS(const_call);
 	mlc_expr_t *Child;
 	ml_value_t *Value;
 };
 
+static long mlc_value_hash(ml_value_t *Value) {
+	if (ml_typeof(Value) == MLFunctionT) return ra_template_hash(Value);
+	return ml_hash(Value);
+}
+
+static void mlc_regex_literal(mlc_expr_t *Expr) {
+	// Replaces a string literal used as a pattern with the compiled regex. Regexes hash like their
+	// pattern, so the closure hash is unchanged; invalid patterns are left to fail when matched.
+	if (Expr->compile != (void *)ml_value_expr_compile) return;
+	mlc_value_expr_t *ValueExpr = (mlc_value_expr_t *)Expr;
+	if (ml_typeof(ValueExpr->Value) != MLStringT) return;
+	ml_value_t *Regex = ml_regex_compile(ValueExpr->Value);
+	if (ml_typeof(Regex) == MLRegexT) ValueExpr->Value = Regex;
+}
+
 static mlc_compiled_t ml_const_call_expr_compile(mlc_function_t *Function, mlc_const_call_expr_t *Expr, SHA256_CTX *HashContext) {
 	int OldTop = Function->Top + 1;
 	if (OldTop >= Function->Size) Function->Size = Function->Top + 1;
-	long ValueHash = ml_hash(Expr->Value);
+	long ValueHash = mlc_value_hash(Expr->Value);
 	sha256_update(HashContext, (void *)&ValueHash, sizeof(ValueHash));
 	ML_COMPILE_HASH
-	ml_inst_t *CallInst = ml_inst_new(3, Expr->Source, mli_const_call_run);
+	ml_inst_t *CallInst = ml_inst_new(5, Expr->Source, MLI_CONST_CALL);
 	CallInst->Params[2].Value = Expr->Value;
+	if (Expr->Child && Expr->Child->Next && ml_typeof(Expr->Value) == MLMethodT) {
+		const char *Name = ((ml_method_t *)Expr->Value)->Name;
+		if (!strcmp(Name, "%") || !strcmp(Name, "replace")) mlc_regex_literal(Expr->Child->Next);
+	}
 	if (Expr->Child) {
 		int NumArgs = 1;
 		mlc_compiled_t Compiled = ml_compile(Function, Expr->Child, HashContext);
-		for (mlc_expr_t *Child = Expr->Child->Next; Child; Child = Child->Next) {
+		mlc_expr_t *Child = Expr->Child->Next;
+		if (Child && !Child->Next && ml_typeof(Expr->Value) == MLMethodT) {
+			const char *Name = ((ml_method_t *)Expr->Value)->Name;
+			for (int I = 0; MLCNumberOps[I].Name; ++I) if (!strcmp(Name, MLCNumberOps[I].Name)) {
+				ml_value_t *Value = Child->compile == (void *)ml_value_expr_compile ? ((mlc_value_expr_t *)Child)->Value : MLNil;
+				if (ml_typeof(Value) == MLIntegerT || ml_typeof(Value) == MLRealT) {
+					CallInst->Opcode = MLCNumberOps[I].ConstOpcode;
+					CallInst->Params[4].Value = Value;
+					long ValueHash = ml_hash(Value);
+					sha256_update(HashContext, (void *)&ValueHash, sizeof(ValueHash));
+					if (Function->Top + 1 >= Function->Size) Function->Size = Function->Top + 2;
+					Child = NULL;
+					++NumArgs;
+				} else {
+					CallInst->Opcode = MLCNumberOps[I].Opcode;
+				}
+				break;
+			}
+		}
+		for (; Child; Child = Child->Next) {
 			++NumArgs;
 			mlc_compiled_t ChildCompiled = ml_compile(Function, Child, HashContext);
 			mlc_connect(Compiled.Exits, ChildCompiled.Start);
@@ -3077,10 +4879,12 @@ static mlc_compiled_t ml_fun_expr_compile(mlc_function_t *Function, mlc_fun_expr
 		++NumParams;
 		if (Param->Index) NumParams = ~NumParams;
 		Param->Index = SubFunction->Top++;
+		Param->Boxable = 1;
 		ParamSlot[0] = Param;
 		ParamSlot = &Param->Next;
 		Param = NextParam;
 	}
+	int NumSlots = SubFunction->Top;
 	SubFunction->Size = SubFunction->Top + 1;
 	SHA256_CTX SubHashContext[1];
 	sha256_init(SubHashContext);
@@ -3089,10 +4893,17 @@ static mlc_compiled_t ml_fun_expr_compile(mlc_function_t *Function, mlc_fun_expr
 	int NumUpValues = 0;
 	for (mlc_upvalue_t *UpValue = SubFunction->UpValues; UpValue; UpValue = UpValue->Next) ++NumUpValues;
 	ML_COMPILE_HASH
-	ml_inst_t *ClosureInst = ml_inst_new(2 + NumUpValues, Expr->Source, mli_closure_run);
+	ml_inst_t *ClosureInst = ml_inst_new(2 + NumUpValues, Expr->Source, MLI_CLOSURE);
 	ml_param_t *Params = ClosureInst->Params;
 	ml_closure_info_t *Info = new(ml_closure_info_t);
-	Info->Entry = Compiled.Start;
+	// mlc_decl_boxed rewrites the stores to unboxed parameters, so it must run before the body is
+	// optimized and copied out by mlc_linearize.
+	if (NumSlots) {
+		unsigned char *Boxed = Info->Boxed = (unsigned char *)snew(NumSlots);
+		mlc_decl_t *Param = Expr->Params;
+		for (int I = 0; I < NumSlots; ++I, Param = Param->Next) Boxed[I] = mlc_decl_boxed(Param);
+	}
+	Info->Entry = mlc_linearize(mlc_optimize(Compiled.Start));
 	Info->FrameSize = SubFunction->Size;
 	Info->NumParams = NumParams;
 	Info->NumUpValues = NumUpValues;
@@ -3104,11 +4915,6 @@ static mlc_compiled_t ml_fun_expr_compile(mlc_function_t *Function, mlc_fun_expr
 	return (mlc_compiled_t){ClosureInst, ClosureInst};
 }
 
-struct mlc_ident_expr_t {
-	MLC_EXPR_FIELDS(ident);
-	const char *Ident;
-};
-
 static int ml_upvalue_find(mlc_function_t *Function, mlc_decl_t *Decl, mlc_function_t *Origin) {
 	if (Function == Origin) return Decl->Index;
 	mlc_upvalue_t **UpValueSlot = &Function->UpValues;
@@ -3129,10 +4935,21 @@ static mlc_compiled_t ml_ident_expr_compile(mlc_function_t *Function, mlc_ident_
 	for (mlc_function_t *UpFunction = Function; UpFunction; UpFunction = UpFunction->Up) {
 		for (mlc_decl_t *Decl = UpFunction->Decls; Decl; Decl = Decl->Next) {
 			if (!strcmp(Decl->Ident, Expr->Ident)) {
+				if (Decl->Constant) {
+					ml_inst_t *Constant = Decl->Constant;
+					long ValueHash = mlc_value_hash(Constant->Params[1].Value);
+					sha256_update(HashContext, (void *)&ValueHash, sizeof(ValueHash));
+					ML_COMPILE_HASH
+					ml_inst_t *ValueInst = ml_inst_new(Constant->NumParams, Expr->Source, MLI_PUSH);
+					memcpy(ValueInst->Params + 1, Constant->Params + 1, (Constant->NumParams - 1) * sizeof(ml_param_t));
+					if (++Function->Top >= Function->Size) Function->Size = Function->Top + 1;
+					return (mlc_compiled_t){ValueInst, ValueInst};
+				}
+				if (UpFunction != Function) Decl->Captured = 1;
 				int Index = ml_upvalue_find(Function, Decl, UpFunction);
 				sha256_update(HashContext, (void *)&Index, sizeof(Index));
 				ML_COMPILE_HASH
-				ml_inst_t *LocalInst = ml_inst_new(2, Expr->Source, mli_local_run);
+				ml_inst_t *LocalInst = ml_inst_new(2, Expr->Source, MLI_LOCAL);
 				LocalInst->Params[1].Index = Index;
 				if (++Function->Top >= Function->Size) Function->Size = Function->Top + 1;
 				return (mlc_compiled_t){LocalInst, LocalInst};
@@ -3141,22 +4958,18 @@ static mlc_compiled_t ml_ident_expr_compile(mlc_function_t *Function, mlc_ident_
 	}
 	sha256_update(HashContext, (BYTE *)Expr->Ident, strlen(Expr->Ident));
 	ML_COMPILE_HASH
-	ml_inst_t *ValueInst = ml_inst_new(2, Expr->Source, mli_push_run);
+	ml_inst_t *ValueInst = ml_inst_new(3, Expr->Source, MLI_PUSH);
 	ValueInst->Params[1].Value = (Function->GlobalGet)(Function->Globals, Expr->Ident);
+	ValueInst->Params[2].Name = Expr->Ident;
 	if (++Function->Top >= Function->Size) Function->Size = Function->Top + 1;
 	return (mlc_compiled_t){ValueInst, ValueInst};
 }
 
-struct mlc_value_expr_t {
-	MLC_EXPR_FIELDS(value);
-	ml_value_t *Value;
-};
-
 static mlc_compiled_t ml_value_expr_compile(mlc_function_t *Function, mlc_value_expr_t *Expr, SHA256_CTX *HashContext) {
-	long ValueHash = ml_hash(Expr->Value);
+	long ValueHash = mlc_value_hash(Expr->Value);
 	sha256_update(HashContext, (void *)&ValueHash, sizeof(ValueHash));
 	ML_COMPILE_HASH
-	ml_inst_t *ValueInst = ml_inst_new(2, Expr->Source, mli_push_run);
+	ml_inst_t *ValueInst = ml_inst_new(2, Expr->Source, MLI_PUSH);
 	ValueInst->Params[1].Value = Expr->Value;
 	if (++Function->Top >= Function->Size) Function->Size = Function->Top + 1;
 	return (mlc_compiled_t){ValueInst, ValueInst};
@@ -3176,7 +4989,7 @@ static mlc_compiled_t ml_ra_exists_expr_compile(mlc_function_t *Function, mlc_ra
 	int OldTop = Function->Top;
 	mlc_compiled_t Compiled = ml_compile(Function, Expr->Exists, HashContext);
 	ML_COMPILE_HASH
-	ml_inst_t *FieldsInst = ml_inst_new(2 + Expr->NumFields, Expr->Source, mli_ra_fields_run);
+	ml_inst_t *FieldsInst = ml_inst_new(2 + Expr->NumFields, Expr->Source, MLI_RA_FIELDS);
 	--Function->Top;
 	mlc_decl_t *OldScope = Function->Decls;
 	mlc_decl_t *Decl = Expr->Decl;
@@ -3193,11 +5006,11 @@ static mlc_compiled_t ml_ra_exists_expr_compile(mlc_function_t *Function, mlc_ra
 	mlc_compiled_t BodyCompiled = ml_compile(Function, Expr->Then, HashContext);
 	FieldsInst->Params[0].Inst = BodyCompiled.Start;
 	ML_COMPILE_HASH
-	ml_inst_t *ExitInst = ml_inst_new(2, Expr->Source, mli_exit_run);
+	ml_inst_t *ExitInst = ml_inst_new(2, Expr->Source, MLI_EXIT);
 	ExitInst->Params[1].Count = Expr->NumFields;
 	mlc_connect(BodyCompiled.Exits, ExitInst);
 	ML_COMPILE_HASH
-	ml_inst_t *IfInst = ml_inst_new(2, Expr->Source, mli_until_run);
+	ml_inst_t *IfInst = ml_inst_new(2, Expr->Source, MLI_UNTIL);
 	IfInst->Params[0].Inst = ExitInst;
 	IfInst->Params[1].Inst = FieldsInst;
 	mlc_connect(Compiled.Exits, IfInst);
@@ -3207,7 +5020,7 @@ static mlc_compiled_t ml_ra_exists_expr_compile(mlc_function_t *Function, mlc_ra
 	if (Expr->Else) {
 		Compiled.Exits = ExitInst;
 		mlc_compiled_t BodyCompiled = ml_compile(Function, Expr->Else, HashContext);
-		IfInst->run = mli_exists_run;
+		IfInst->Opcode = MLI_EXISTS;
 		IfInst->Params[0].Inst = BodyCompiled.Start;
 		ExitInst->Params[0].Inst = BodyCompiled.Exits;
 	} else {
@@ -3236,6 +5049,7 @@ typedef enum ml_token_t {
 	MLT_IS,
 	MLT_FUN,
 	MLT_RETURN,
+	MLT_SUSP,
 	MLT_WITH,
 	MLT_DO,
 	MLT_ON,
@@ -3253,6 +5067,7 @@ typedef enum ml_token_t {
 	MLT_SIGNAL,
 	MLT_UPDATE,
 	MLT_DELETE,
+	MLT_WAIT,
 	MLT_VAR,
 	MLT_IDENT,
 	MLT_LEFT_PAREN,
@@ -3292,6 +5107,7 @@ const char *MLTokens[] = {
 	"is", // MLT_IS,
 	"fun", // MLT_FUN,
 	"return", // MLT_RETURN,
+	"susp", // MLT_SUSP,
 	"with", // MLT_WITH,
 	"do", // MLT_DO,
 	"on", // MLT_ON,
@@ -3309,6 +5125,7 @@ const char *MLTokens[] = {
 	"signal", // MLT_SIGNAL,
 	"update", // MLT_UPDATE,
 	"delete", // MLT_DELETE,
+	"wait", // MLT_WAIT,
 	"var", // MLT_VAR,
 	"<identifier>", // MLT_IDENT,
 	"(", // MLT_LEFT_PAREN,
@@ -3339,6 +5156,7 @@ struct mlc_scanner_t {
 	const char *(*read)(void *);
 	jmp_buf OnError;
 	ml_value_t *Error;
+	mlc_schema_entry_t *SchemaLog, **SchemaLogSlot;
 } *ml_scanner(const char *SourceName, void *Data, const char *(*read)(void *)) {
 	mlc_scanner_t *Scanner = new(mlc_scanner_t);
 	Scanner->Token = MLT_NONE;
@@ -3347,6 +5165,7 @@ struct mlc_scanner_t {
 	Scanner->Source.Line = 0;
 	Scanner->Data = Data;
 	Scanner->read = read;
+	Scanner->SchemaLogSlot = &Scanner->SchemaLog;
 	return Scanner;
 }
 
@@ -3402,7 +5221,7 @@ static mlc_expr_t *ml_accept_string(mlc_scanner_t *Scanner) {
 		ValueExpr->compile = ml_value_expr_compile;
 		ValueExpr->Source = Scanner->Source;
 		ValueExpr->Source = Scanner->Source;
-		ValueExpr->Value = ml_string(String, Length);
+		ValueExpr->Value = Length <= ML_STRING_INTERN_LENGTH ? ml_string_intern(String, Length) : ml_string(String, Length);
 		Expr = (mlc_expr_t *)ValueExpr;
 	}
 	Scanner->Next = End + 1;
@@ -3519,7 +5338,7 @@ static int ml_parse(mlc_scanner_t *Scanner, ml_token_t Token) {
 			if (!Child) {
 				Scanner->Token = MLT_VALUE;
 				Scanner->Value = ml_string("", 0);
-			} else if (!Child->Next && Child->compile == (void *)ml_value_expr_compile && ((mlc_value_expr_t *)Child)->Value->Type == MLStringT) {
+			} else if (!Child->Next && Child->compile == (void *)ml_value_expr_compile && ml_typeof(((mlc_value_expr_t *)Child)->Value) == MLStringT) {
 				Scanner->Token = MLT_VALUE;
 				Scanner->Value = ((mlc_value_expr_t *)Child)->Value;
 			} else {
@@ -3565,7 +5384,7 @@ static int ml_parse(mlc_scanner_t *Scanner, ml_token_t Token) {
 				}
 			}
 			*D = 0;
-			Scanner->Value = ml_string(String, Length);
+			Scanner->Value = Length <= ML_STRING_INTERN_LENGTH ? ml_string_intern(String, Length) : ml_string(String, Length);
 			Scanner->Token = MLT_VALUE;
 			Scanner->Next = End + 1;
 			goto done;
@@ -3643,6 +5462,68 @@ static void ml_accept(mlc_scanner_t *Scanner, ml_token_t Token) {
 	longjmp(Scanner->OnError, 1);
 }
 
+struct mlc_schema_entry_t {
+	// Schemas, fields and indices are created while parsing, so each one the parser touches is logged in
+	// order to be recreated when a compiled script is restored from its cache.
+	mlc_schema_entry_t *Next, *Schema;
+	enum {MLC_SCHEMA, MLC_SCHEMA_FIELD, MLC_SCHEMA_COMPUTED_FIELD, MLC_SCHEMA_INDEX} Kind;
+	void *Object;
+	const char *Name;
+	const char **FieldNames;
+	ml_value_t *Function;
+};
+
+static mlc_schema_entry_t *mlc_schema_entry(mlc_schema_entry_t *Entry, void *Object) {
+	while (Entry && Entry->Object != Object) Entry = Entry->Next;
+	return Entry;
+}
+
+static mlc_schema_entry_t *mlc_schema_log(mlc_scanner_t *Scanner, int Kind, void *Object, ra_schema_t *Schema, const char *Name) {
+	mlc_schema_entry_t *Entry = new(mlc_schema_entry_t);
+	Entry->Kind = Kind;
+	Entry->Object = Object;
+	Entry->Schema = Schema ? mlc_schema_entry(Scanner->SchemaLog, Schema) : NULL;
+	Entry->Name = Name;
+	Scanner->SchemaLogSlot[0] = Entry;
+	Scanner->SchemaLogSlot = &Entry->Next;
+	return Entry;
+}
+
+static ra_schema_t *mlc_schema(mlc_scanner_t *Scanner, const char *Name, ra_schema_t *Parent) {
+	ra_schema_t *Schema = ra_schema_by_name(Name) ?: ra_schema_create(Name, Parent);
+	if (!mlc_schema_entry(Scanner->SchemaLog, Schema)) mlc_schema_log(Scanner, MLC_SCHEMA, Schema, Parent, Name);
+	return Schema;
+}
+
+static ra_schema_field_t *mlc_schema_field(mlc_scanner_t *Scanner, ra_schema_t *Schema, const char *Name) {
+	ra_schema_field_t *Field = ra_schema_field_by_name(Schema, Name) ?: ra_schema_value_field_create(Schema, Name);
+	if (!Field) {
+		Scanner->Error = ml_error("SchemaError", "can not add field %s to a schema that already has instances", Name);
+		ml_error_trace_add(Scanner->Error, Scanner->Source);
+		longjmp(Scanner->OnError, 1);
+	}
+	if (!mlc_schema_entry(Scanner->SchemaLog, Field)) mlc_schema_log(Scanner, MLC_SCHEMA_FIELD, Field, Schema, Name);
+	return Field;
+}
+
+static void mlc_schema_computed_field(mlc_scanner_t *Scanner, ra_schema_t *Schema, const char *Name, ml_value_t *Function, const char **FieldNames) {
+	ra_schema_field_t *Field = ra_schema_computed_field_create(Schema, Name, Function, FieldNames);
+	mlc_schema_entry_t *Entry = mlc_schema_log(Scanner, MLC_SCHEMA_COMPUTED_FIELD, Field, Schema, Name);
+	Entry->FieldNames = FieldNames;
+	Entry->Function = Function;
+}
+
+static ra_schema_index_t *mlc_schema_index(mlc_scanner_t *Scanner, ra_schema_t *Schema, const char **FieldNames) {
+	ra_schema_index_t *Index = ra_schema_index_by_names(Schema, FieldNames) ?: ra_schema_index_create(Schema, FieldNames);
+	if (!Index) {
+		Scanner->Error = ml_error("SchemaError", "can not add index fields to a schema that already has instances");
+		ml_error_trace_add(Scanner->Error, Scanner->Source);
+		longjmp(Scanner->OnError, 1);
+	}
+	if (!mlc_schema_entry(Scanner->SchemaLog, Index)) mlc_schema_log(Scanner, MLC_SCHEMA_INDEX, Index, Schema, NULL)->FieldNames = FieldNames;
+	return Index;
+}
+
 static const char **ml_ra_accept_schema_filter(mlc_scanner_t *Scanner, int Index, mlc_expr_t **ExprSlot) {
 	mlc_expr_t *Expr = ml_accept_expression(Scanner, EXPR_DEFAULT);
 	mlc_expr_t *NameExpr, *ValueExpr;
@@ -3686,7 +5567,7 @@ static ra_schema_field_t **ml_ra_accept_schema_updates(mlc_scanner_t *Scanner, r
 		longjmp(Scanner->OnError, 1);
 	}
 	const char *FieldName = ((mlc_ident_expr_t *)NameExpr)->Ident;
-	ra_schema_field_t *Field = ra_schema_field_by_name(Schema, FieldName) ?: ra_schema_value_field_create(Schema, FieldName);
+	ra_schema_field_t *Field = mlc_schema_field(Scanner, Schema, FieldName);
 	ExprSlot[0] = ValueExpr;
 	ExprSlot = &ValueExpr->Next;
 	if (ml_parse(Scanner, MLT_COMMA)) {
@@ -3721,7 +5602,7 @@ static ra_schema_field_t **ml_ra_accept_schema_fields(mlc_scanner_t *Scanner, ra
 		Field = InstanceField;
 	} else if (FieldExpr->compile == (void *)ml_ident_expr_compile) {
 		const char *FieldName = ((mlc_ident_expr_t *)FieldExpr)->Ident;
-		Field = ra_schema_field_by_name(Schema, FieldName) ?: ra_schema_value_field_create(Schema, FieldName);
+		Field = mlc_schema_field(Scanner, Schema, FieldName);
 	} else {
 		Scanner->Error = ml_error("ParseError", "expected valid field");
 		ml_error_trace_add(Scanner->Error, Scanner->Source);
@@ -3742,7 +5623,7 @@ static ra_schema_field_t **ml_ra_accept_schema_fields(mlc_scanner_t *Scanner, ra
 static ra_listener_template_t *ml_ra_accept_listener_template(mlc_scanner_t *Scanner, int Index, mlc_decl_t **ParamsSlot, mlc_expr_t **ExprSlot) {
 	int Negated = ml_parse(Scanner, MLT_NOT);
 	ml_accept(Scanner, MLT_IDENT);
-	ra_schema_t *Schema = ra_schema_by_name(Scanner->Ident) ?: ra_schema_create(Scanner->Ident, 0);
+	ra_schema_t *Schema = mlc_schema(Scanner, Scanner->Ident, 0);
 	ml_accept(Scanner, MLT_LEFT_SQUARE);
 	mlc_fun_expr_t *IndexFunctionExpr = new(mlc_fun_expr_t);
 	IndexFunctionExpr->Source = Scanner->Source;
@@ -3761,7 +5642,7 @@ static ra_listener_template_t *ml_ra_accept_listener_template(mlc_scanner_t *Sca
 	ml_accept(Scanner, MLT_RIGHT_SQUARE);
 	ExprSlot[0] = (mlc_expr_t *)IndexFunctionExpr;
 	ExprSlot = &IndexFunctionExpr->Next;
-	ra_schema_index_t *SchemaIndex = ra_schema_index_by_names(Schema, FieldNames) ?: ra_schema_index_create(Schema, FieldNames);
+	ra_schema_index_t *SchemaIndex = mlc_schema_index(Scanner, Schema, FieldNames);
 	ra_schema_field_t **Fields = 0;
 	int NumFields = 0;
 	mlc_decl_t *NewParams = 0, **NewParamSlot = &NewParams;
@@ -3799,11 +5680,11 @@ static mlc_expr_t *ml_ra_accept_when_expr(mlc_scanner_t *Scanner) {
 	CallExpr->compile = ml_const_call_expr_compile;
 	CallExpr->Source = Scanner->Source;
 	ml_accept(Scanner, MLT_IDENT);
-	ra_schema_t *Schema = ra_schema_by_name(Scanner->Ident) ?: ra_schema_create(Scanner->Ident, 0);
+	ra_schema_t *Schema = mlc_schema(Scanner, Scanner->Ident, 0);
 	ra_schema_index_t *SchemaIndex = 0;
 	if (ml_parse(Scanner, MLT_LEFT_SQUARE)) {
 		const char **FieldNames = ml_ra_accept_schema_filter(Scanner, 0, &CallExpr->Child);
-		SchemaIndex = ra_schema_index_by_names(Schema, FieldNames) ?: ra_schema_index_create(Schema, FieldNames);
+		SchemaIndex = mlc_schema_index(Scanner, Schema, FieldNames);
 		ml_accept(Scanner, MLT_RIGHT_SQUARE);
 	}
 	mlc_decl_t *Params = 0;
@@ -3845,14 +5726,14 @@ static mlc_expr_t *ml_ra_accept_when_expr(mlc_scanner_t *Scanner) {
 static mlc_expr_t *ml_ra_accept_exists_expr(mlc_scanner_t *Scanner) {
 	int Negated = ml_parse(Scanner, MLT_NOT);
 	ml_accept(Scanner, MLT_IDENT);
-	ra_schema_t *Schema = ra_schema_by_name(Scanner->Ident) ?: ra_schema_create(Scanner->Ident, 0);
+	ra_schema_t *Schema = mlc_schema(Scanner, Scanner->Ident, 0);
 	ml_accept(Scanner, MLT_LEFT_SQUARE);
 	mlc_const_call_expr_t *ExistsCallExpr = new(mlc_const_call_expr_t);
 	ExistsCallExpr->compile = ml_const_call_expr_compile;
 	ExistsCallExpr->Source = Scanner->Source;
 	const char **FieldNames = ml_ra_accept_schema_filter(Scanner, 0, &ExistsCallExpr->Child);
 	ml_accept(Scanner, MLT_RIGHT_SQUARE);
-	ra_schema_index_t *SchemaIndex = ra_schema_index_by_names(Schema, FieldNames) ?: ra_schema_index_create(Schema, FieldNames);
+	ra_schema_index_t *SchemaIndex = mlc_schema_index(Scanner, Schema, FieldNames);
 	ExistsCallExpr->Value = ml_function(SchemaIndex, (void *)ra_index_instance_exists_callback);
 	mlc_ra_exists_expr_t *ExistsExpr = new(mlc_ra_exists_expr_t);
 	ExistsExpr->compile = ml_ra_exists_expr_compile;
@@ -3876,7 +5757,7 @@ static mlc_expr_t *ml_ra_accept_exists_expr(mlc_scanner_t *Scanner) {
 
 static mlc_expr_t *ml_ra_accept_insert_expr(mlc_scanner_t *Scanner) {
 	ml_accept(Scanner, MLT_IDENT);
-	ra_schema_t *Schema = ra_schema_by_name(Scanner->Ident) ?: ra_schema_create(Scanner->Ident, 0);
+	ra_schema_t *Schema = mlc_schema(Scanner, Scanner->Ident, 0);
 	ml_accept(Scanner, MLT_LEFT_PAREN);
 	mlc_const_call_expr_t *CallExpr = new(mlc_const_call_expr_t);
 	CallExpr->compile = ml_const_call_expr_compile;
@@ -3892,7 +5773,7 @@ static mlc_expr_t *ml_ra_accept_insert_expr(mlc_scanner_t *Scanner) {
 
 static mlc_expr_t *ml_ra_accept_signal_expr(mlc_scanner_t *Scanner) {
 	ml_accept(Scanner, MLT_IDENT);
-	ra_schema_t *Schema = ra_schema_by_name(Scanner->Ident) ?: ra_schema_create(Scanner->Ident, 0);
+	ra_schema_t *Schema = mlc_schema(Scanner, Scanner->Ident, 0);
 	ml_accept(Scanner, MLT_LEFT_PAREN);
 	mlc_const_call_expr_t *CallExpr = new(mlc_const_call_expr_t);
 	CallExpr->compile = ml_const_call_expr_compile;
@@ -3908,14 +5789,14 @@ static mlc_expr_t *ml_ra_accept_signal_expr(mlc_scanner_t *Scanner) {
 
 static mlc_expr_t *ml_ra_accept_update_expr(mlc_scanner_t *Scanner) {
 	ml_accept(Scanner, MLT_IDENT);
-	ra_schema_t *Schema = ra_schema_by_name(Scanner->Ident) ?: ra_schema_create(Scanner->Ident, 0);
+	ra_schema_t *Schema = mlc_schema(Scanner, Scanner->Ident, 0);
 	ml_accept(Scanner, MLT_LEFT_SQUARE);
 	mlc_const_call_expr_t *ExistsCallExpr = new(mlc_const_call_expr_t);
 	ExistsCallExpr->compile = ml_const_call_expr_compile;
 	ExistsCallExpr->Source = Scanner->Source;
 	const char **FieldNames = ml_ra_accept_schema_filter(Scanner, 0, &ExistsCallExpr->Child);
 	ml_accept(Scanner, MLT_RIGHT_SQUARE);
-	ra_schema_index_t *SchemaIndex = ra_schema_index_by_names(Schema, FieldNames) ?: ra_schema_index_create(Schema, FieldNames);
+	ra_schema_index_t *SchemaIndex = mlc_schema_index(Scanner, Schema, FieldNames);
 	ExistsCallExpr->Value = ml_function(SchemaIndex, (void *)ra_index_instance_exists_callback);
 	ml_accept(Scanner, MLT_LEFT_PAREN);
 	ra_schema_field_t **Fields = ml_ra_accept_schema_updates(Scanner, Schema, 0, &ExistsCallExpr->Next);
@@ -3930,18 +5811,37 @@ static mlc_expr_t *ml_ra_accept_update_expr(mlc_scanner_t *Scanner) {
 
 static mlc_expr_t *ml_ra_accept_delete_expr(mlc_scanner_t *Scanner) {
 	ml_accept(Scanner, MLT_IDENT);
-	ra_schema_t *Schema = ra_schema_by_name(Scanner->Ident) ?: ra_schema_create(Scanner->Ident, 0);
+	ra_schema_t *Schema = mlc_schema(Scanner, Scanner->Ident, 0);
 	ml_accept(Scanner, MLT_LEFT_SQUARE);
 	mlc_const_call_expr_t *CallExpr = new(mlc_const_call_expr_t);
 	CallExpr->compile = ml_const_call_expr_compile;
 	CallExpr->Source = Scanner->Source;
 	const char **FieldNames = ml_ra_accept_schema_filter(Scanner, 0, &CallExpr->Child);
 	ml_accept(Scanner, MLT_RIGHT_SQUARE);
-	ra_schema_index_t *SchemaIndex = ra_schema_index_by_names(Schema, FieldNames) ?: ra_schema_index_create(Schema, FieldNames);
+	ra_schema_index_t *SchemaIndex = mlc_schema_index(Scanner, Schema, FieldNames);
 	CallExpr->Value = ml_function(SchemaIndex, (void *)ra_index_instance_delete_callback);
 	return (mlc_expr_t *)CallExpr;
 }
 
+static mlc_expr_t *ml_ra_accept_wait_expr(mlc_scanner_t *Scanner) {
+	ml_accept(Scanner, MLT_IDENT);
+	ra_schema_t *Schema = mlc_schema(Scanner, Scanner->Ident, 0);
+	ml_accept(Scanner, MLT_LEFT_SQUARE);
+	mlc_const_call_expr_t *CallExpr = new(mlc_const_call_expr_t);
+	CallExpr->compile = ml_const_call_expr_compile;
+	CallExpr->Source = Scanner->Source;
+	const char **FieldNames = ml_ra_accept_schema_filter(Scanner, 0, &CallExpr->Child);
+	ml_accept(Scanner, MLT_RIGHT_SQUARE);
+	ra_listener_template_t *Template = xnew(ra_listener_template_t, 1, ra_schema_listener_template_t);
+	Template->NumSchemas = 1;
+	Template->Schemas[0].Schema = Schema;
+	Template->Schemas[0].Index = mlc_schema_index(Scanner, Schema, FieldNames);
+	Template->Schemas[0].SelectedFields = &InstanceField;
+	Template->Schemas[0].NumSelectedFields = 1;
+	CallExpr->Value = ml_function(Template, (void *)ra_index_instance_wait_callback);
+	return (mlc_expr_t *)CallExpr;
+}
+
 static mlc_expr_t *ml_parse_term(mlc_scanner_t *Scanner) {
 	if (ml_parse(Scanner, MLT_DO)) {
 		mlc_expr_t *Expr = ml_accept_block(Scanner);
@@ -4123,6 +6023,12 @@ static mlc_expr_t *ml_parse_term(mlc_scanner_t *Scanner) {
 		ReturnExpr->Source = Scanner->Source;
 		ReturnExpr->Child = ml_parse_expression(Scanner, EXPR_DEFAULT);
 		return (mlc_expr_t *)ReturnExpr;
+	} else if (ml_parse(Scanner, MLT_SUSP)) {
+		mlc_parent_expr_t *SuspExpr = new(mlc_parent_expr_t);
+		SuspExpr->compile = ml_susp_expr_compile;
+		SuspExpr->Source = Scanner->Source;
+		SuspExpr->Child = ml_accept_expression(Scanner, EXPR_DEFAULT);
+		return (mlc_expr_t *)SuspExpr;
 	} else if (ml_parse(Scanner, MLT_WITH)) {
 		mlc_decl_expr_t *WithExpr = new(mlc_decl_expr_t);
 		WithExpr->compile = ml_with_expr_compile;
@@ -4227,6 +6133,8 @@ static mlc_expr_t *ml_parse_term(mlc_scanner_t *Scanner) {
 		return ml_ra_accept_when_expr(Scanner);
 	} else if (ml_parse(Scanner, MLT_EXISTS)) {
 		return ml_ra_accept_exists_expr(Scanner);
+	} else if (ml_parse(Scanner, MLT_WAIT)) {
+		return ml_ra_accept_wait_expr(Scanner);
 	} else if (ml_parse(Scanner, MLT_INSERT)) {
 		return ml_ra_accept_insert_expr(Scanner);
 	} else if (ml_parse(Scanner, MLT_SIGNAL)) {
@@ -4444,19 +6352,19 @@ static mlc_expr_t *ml_accept_block(mlc_scanner_t *Scanner) {
 			ra_schema_t *Parent = 0;
 			if (ml_parse(Scanner, MLT_LEFT_PAREN)) {
 				ml_accept(Scanner, MLT_IDENT);
-				Parent = ra_schema_by_name(Scanner->Ident) ?: ra_schema_create(Scanner->Ident, 0);
+				Parent = mlc_schema(Scanner, Scanner->Ident, 0);
 				ml_accept(Scanner, MLT_RIGHT_PAREN);
 			}
-			ra_schema_t *Schema = ra_schema_by_name(SchemaName) ?: ra_schema_create(SchemaName, Parent);
+			ra_schema_t *Schema = mlc_schema(Scanner, SchemaName, Parent);
 			ml_accept(Scanner, MLT_IS);
 			for (;;) {
 				while (ml_parse(Scanner, MLT_EOL));
 				if (ml_parse(Scanner, MLT_VAR)) {
 					ml_accept(Scanner, MLT_IDENT);
-					if (!ra_schema_field_by_name(Schema, Scanner->Ident)) ra_schema_value_field_create(Schema, Scanner->Ident);
+					mlc_schema_field(Scanner, Schema, Scanner->Ident);
 					while (ml_parse(Scanner, MLT_COMMA)) {
 						ml_accept(Scanner, MLT_IDENT);
-						if (!ra_schema_field_by_name(Schema, Scanner->Ident)) ra_schema_value_field_create(Schema, Scanner->Ident);
+						mlc_schema_field(Scanner, Schema, Scanner->Ident);
 					}
 				} else if (ml_parse(Scanner, MLT_FUN)) {
 					ml_accept(Scanner, MLT_IDENT);
@@ -4487,13 +6395,13 @@ static mlc_expr_t *ml_accept_block(mlc_scanner_t *Scanner) {
 					ml_closure_t *Closure = new(ml_closure_t);
 					ml_closure_info_t *Info = Closure->Info = new(ml_closure_info_t);
 					Closure->Type = MLClosureT;
-					Info->Entry = Compiled.Start;
+					Info->Entry = mlc_linearize(mlc_optimize(Compiled.Start));
 					Info->FrameSize = TempFunction->Size;
-					ra_schema_computed_field_create(Schema, FieldName, (ml_value_t *)Closure, FieldNames);
+					mlc_schema_computed_field(Scanner, Schema, FieldName, (ml_value_t *)Closure, FieldNames);
 				} else if (ml_parse(Scanner, MLT_INDEX)) {
 					ml_accept(Scanner, MLT_IDENT);
 					const char **FieldNames = ml_accept_ident_list(Scanner, 0);
-					ra_schema_index_create(Schema, FieldNames);
+					mlc_schema_index(Scanner, Schema, FieldNames);
 				} else {
 					ml_accept(Scanner, MLT_END);
 					break;
@@ -4559,6 +6467,581 @@ ml_type_t *ml_class(ml_type_t *Parent, const char *Name) {
 	return Type;
 }
 
+static int Caching = 1;
+
+void ml_cache_set(int Enabled) {
+	Caching = Enabled;
+}
+
+// A cache file holds a header, the schema log of the parse and the compiled top level closure. Everything
+// that refers to memory is written by reference: instructions by their position within their closure,
+// schema objects by their position in the log, methods and globals by name. Anything else makes the
+// script uncachable and it is simply compiled on every load.
+
+#define ML_CACHE_MAGIC "MLCACHE5"
+
+typedef enum {
+	MLC_CACHE_NULL, MLC_CACHE_NIL, MLC_CACHE_SOME,
+	MLC_CACHE_INTEGER, MLC_CACHE_REAL, MLC_CACHE_STRING,
+	MLC_CACHE_METHOD, MLC_CACHE_GLOBAL, MLC_CACHE_BUILTIN,
+	MLC_CACHE_LISTENER, MLC_CACHE_WAIT, MLC_CACHE_CREATE, MLC_CACHE_SIGNAL,
+	MLC_CACHE_EXISTS, MLC_CACHE_DELETE, MLC_CACHE_UPDATE, MLC_CACHE_REGEX
+} mlc_cache_tag_t;
+
+typedef enum {
+	MLC_PARAM_INST, MLC_PARAM_INT, MLC_PARAM_VALUE, MLC_PARAM_NAME, MLC_PARAM_CLOSURE,
+	MLC_PARAM_FIELD, MLC_PARAM_BOXED, MLC_PARAM_CACHE, MLC_PARAM_FAST
+} mlc_param_kind_t;
+
+static ml_value_t *MLCBuiltins[] = {(ml_value_t *)StringNew, (ml_value_t *)ListNew, (ml_value_t *)TreeNew, NULL};
+
+static mlc_param_kind_t mlc_param_kind(ml_inst_t *Inst, int I) {
+	if (I == 0) return MLC_PARAM_INST;
+	switch (Inst->Opcode) {
+	case MLI_PUSH: return I == 1 ? MLC_PARAM_VALUE : MLC_PARAM_NAME;
+	case MLI_ENTER: return I == 1 ? MLC_PARAM_INT : MLC_PARAM_BOXED;
+	case MLI_CALL: return I == 1 ? MLC_PARAM_INT : MLC_PARAM_CACHE;
+	case MLI_CLOSURE: return I == 1 ? MLC_PARAM_CLOSURE : MLC_PARAM_INT;
+	case MLI_RA_FIELDS: return I == 1 ? MLC_PARAM_INT : MLC_PARAM_FIELD;
+	case MLI_LOCAL_CALL: return I == 2 ? MLC_PARAM_CACHE : MLC_PARAM_INT;
+	case MLI_LOCAL_CONST_CALL: return I == 1 || I == 5 ? MLC_PARAM_INT : I == 3 ? MLC_PARAM_CACHE : MLC_PARAM_VALUE;
+	default: break;
+	}
+	if (I == mlc_inst_branch(Inst)) return MLC_PARAM_INST;
+	if (Inst->NumParams < 5) return MLC_PARAM_INT;
+	// const_call and the number instructions derived from it
+	switch (I) {
+	case 2: case 4: return MLC_PARAM_VALUE;
+	case 3: return MLC_PARAM_CACHE;
+	case 5: return MLC_PARAM_FAST;
+	default: return MLC_PARAM_INT;
+	}
+}
+
+typedef struct {
+	char *Data;
+	size_t Length, Size;
+	mlc_schema_entry_t *SchemaLog;
+	const char *SourceName;
+	int Failed;
+} mlc_cache_writer_t;
+
+static void mlc_cache_write(mlc_cache_writer_t *Writer, const void *Data, size_t Length) {
+	if (Writer->Length + Length > Writer->Size) {
+		while (Writer->Length + Length > Writer->Size) Writer->Size = Writer->Size ? 2 * Writer->Size : 4096;
+		Writer->Data = realloc(Writer->Data, Writer->Size);
+	}
+	memcpy(Writer->Data + Writer->Length, Data, Length);
+	Writer->Length += Length;
+}
+
+static void mlc_cache_write_int(mlc_cache_writer_t *Writer, int64_t Value) {
+	mlc_cache_write(Writer, &Value, sizeof(Value));
+}
+
+static void mlc_cache_write_string(mlc_cache_writer_t *Writer, const char *String, int Length) {
+	if (String) {
+		mlc_cache_write_int(Writer, Length);
+		mlc_cache_write(Writer, String, Length);
+	} else {
+		mlc_cache_write_int(Writer, -1);
+	}
+}
+
+static void mlc_cache_write_name(mlc_cache_writer_t *Writer, const char *Name) {
+	mlc_cache_write_string(Writer, Name, Name ? strlen(Name) : 0);
+}
+
+static void mlc_cache_write_names(mlc_cache_writer_t *Writer, const char **Names) {
+	int Count = 0;
+	while (Names[Count]) ++Count;
+	mlc_cache_write_int(Writer, Count);
+	for (int I = 0; I < Count; ++I) mlc_cache_write_name(Writer, Names[I]);
+}
+
+static void mlc_cache_write_object(mlc_cache_writer_t *Writer, void *Object) {
+	int Index = 0;
+	if (!Object) {
+		Index = -1;
+	} else if (Object == InstanceField) {
+		Index = -2;
+	} else {
+		mlc_schema_entry_t *Entry = Writer->SchemaLog;
+		while (Entry && Entry->Object != Object) Entry = Entry->Next, ++Index;
+		if (!Entry) Writer->Failed = 1;
+	}
+	mlc_cache_write_int(Writer, Index);
+}
+
+static void mlc_cache_write_fields(mlc_cache_writer_t *Writer, ra_schema_field_t **Fields, int Count) {
+	mlc_cache_write_int(Writer, Count);
+	for (int I = 0; I < Count; ++I) mlc_cache_write_object(Writer, Fields[I]);
+}
+
+static void mlc_cache_write_listener(mlc_cache_writer_t *Writer, ra_listener_template_t *Template) {
+	mlc_cache_write_int(Writer, Template->NumSchemas);
+	for (int I = 0; I < Template->NumSchemas; ++I) {
+		ra_schema_listener_template_t *Schema = Template->Schemas + I;
+		mlc_cache_write_object(Writer, Schema->Schema);
+		mlc_cache_write_object(Writer, Schema->Index);
+		mlc_cache_write_fields(Writer, Schema->SelectedFields, Schema->NumSelectedFields);
+		mlc_cache_write_int(Writer, Schema->Negated);
+		mlc_cache_write_int(Writer, Schema->Created);
+	}
+}
+
+static void mlc_cache_write_value(mlc_cache_writer_t *Writer, ml_value_t *Value) {
+	const ml_type_t *Type = Value ? ml_typeof(Value) : NULL;
+	if (!Value) {
+		mlc_cache_write_int(Writer, MLC_CACHE_NULL);
+	} else if (Value == MLNil) {
+		mlc_cache_write_int(Writer, MLC_CACHE_NIL);
+	} else if (Value == MLSome) {
+		mlc_cache_write_int(Writer, MLC_CACHE_SOME);
+	} else if (Type == MLIntegerT) {
+		mlc_cache_write_int(Writer, MLC_CACHE_INTEGER);
+		mlc_cache_write_int(Writer, ml_integer_value(Value));
+	} else if (Type == MLRealT) {
+		double Real = ml_real_value(Value);
+		mlc_cache_write_int(Writer, MLC_CACHE_REAL);
+		mlc_cache_write(Writer, &Real, sizeof(Real));
+	} else if (Type == MLStringT) {
+		mlc_cache_write_int(Writer, MLC_CACHE_STRING);
+		mlc_cache_write_string(Writer, ml_string_value(Value), ml_string_length(Value));
+	} else if (Type == MLRegexT) {
+		ml_value_t *Pattern = ((ml_regex_t *)Value)->Pattern;
+		mlc_cache_write_int(Writer, MLC_CACHE_REGEX);
+		mlc_cache_write_string(Writer, ml_string_value(Pattern), ml_string_length(Pattern));
+	} else if (Type == MLMethodT) {
+		const char *Name = ((ml_method_t *)Value)->Name;
+		mlc_cache_write_int(Writer, MLC_CACHE_METHOD);
+		mlc_cache_write_name(Writer, Name);
+	} else if (Type == MLFunctionT) {
+		ml_function_t *Function = (ml_function_t *)Value;
+		for (int I = 0; MLCBuiltins[I]; ++I) if (Value == MLCBuiltins[I]) {
+			mlc_cache_write_int(Writer, MLC_CACHE_BUILTIN);
+			mlc_cache_write_int(Writer, I);
+			return;
+		}
+		if (Function->Callback == (ml_callback_t)ra_listener_create_callback) {
+			mlc_cache_write_int(Writer, MLC_CACHE_LISTENER);
+			mlc_cache_write_listener(Writer, Function->Data);
+		} else if (Function->Callback == (ml_callback_t)ra_index_instance_wait_callback) {
+			mlc_cache_write_int(Writer, MLC_CACHE_WAIT);
+			mlc_cache_write_listener(Writer, Function->Data);
+		} else if (Function->Callback == (ml_callback_t)ra_instance_create_callback || Function->Callback == (ml_callback_t)ra_instance_signal_callback) {
+			ra_instance_template_t *Template = Function->Data;
+			mlc_cache_write_int(Writer, Function->Callback == (ml_callback_t)ra_instance_create_callback ? MLC_CACHE_CREATE : MLC_CACHE_SIGNAL);
+			mlc_cache_write_object(Writer, Template->Schema);
+			mlc_cache_write_fields(Writer, Template->Fields, Template->NumFields);
+		} else if (Function->Callback == (ml_callback_t)ra_index_instance_exists_callback || Function->Callback == (ml_callback_t)ra_index_instance_delete_callback) {
+			mlc_cache_write_int(Writer, Function->Callback == (ml_callback_t)ra_index_instance_exists_callback ? MLC_CACHE_EXISTS : MLC_CACHE_DELETE);
+			mlc_cache_write_object(Writer, Function->Data);
+		} else if (Function->Callback == (ml_callback_t)ra_index_instance_update_callback) {
+			ra_schema_field_t **Fields = Function->Data;
+			int NumFields = 0;
+			while (Fields[NumFields]) ++NumFields;
+			mlc_cache_write_int(Writer, MLC_CACHE_UPDATE);
+			mlc_cache_write_fields(Writer, Fields, NumFields);
+		} else {
+			Writer->Failed = 1;
+		}
+	} else {
+		Writer->Failed = 1;
+	}
+}
+
+static int mlc_inst_compare(const void *A, const void *B) {
+	ml_inst_t *InstA = *(ml_inst_t **)A, *InstB = *(ml_inst_t **)B;
+	return (InstA > InstB) - (InstA < InstB);
+}
+
+static void mlc_cache_write_info(mlc_cache_writer_t *Writer, ml_closure_info_t *Info) {
+	mlc_cache_write_int(Writer, Info->FrameSize);
+	mlc_cache_write_int(Writer, Info->NumParams);
+	mlc_cache_write_int(Writer, Info->NumUpValues);
+	mlc_cache_write(Writer, Info->Hash, SHA256_BLOCK_SIZE);
+	int NumSlots = Info->NumParams < 0 ? ~Info->NumParams : Info->NumParams;
+	mlc_cache_write_string(Writer, (char *)Info->Boxed, NumSlots);
+	int NumInsts = 0;
+	ml_inst_t **Insts = Info->Entry ? mlc_collect(Info->Entry, &NumInsts) : NULL;
+	qsort(Insts, NumInsts, sizeof(ml_inst_t *), mlc_inst_compare);
+	mlc_cache_write_int(Writer, NumInsts);
+	if (NumInsts) mlc_cache_write_int(Writer, ((ml_inst_t **)bsearch(&Info->Entry, Insts, NumInsts, sizeof(ml_inst_t *), mlc_inst_compare)) - Insts);
+	for (int I = 0; I < NumInsts; ++I) mlc_cache_write_int(Writer, Insts[I]->NumParams);
+	for (int I = 0; I < NumInsts; ++I) {
+		ml_inst_t *Inst = Insts[I];
+		mlc_cache_write_int(Writer, Inst->Opcode);
+		mlc_cache_write_int(Writer, Inst->Source.Line);
+		// Source names are almost always shared, so one is only written when it changes.
+		mlc_cache_write_int(Writer, Inst->Source.Name != Writer->SourceName);
+		if (Inst->Source.Name != Writer->SourceName) {
+			mlc_cache_write_name(Writer, Inst->Source.Name);
+			Writer->SourceName = Inst->Source.Name;
+		}
+		for (int J = 0; J < Inst->NumParams; ++J) {
+			ml_param_t *Param = Inst->Params + J;
+			switch (mlc_param_kind(Inst, J)) {
+			case MLC_PARAM_INST: {
+				ml_inst_t **Found = Param->Inst ? bsearch(&Param->Inst, Insts, NumInsts, sizeof(ml_inst_t *), mlc_inst_compare) : NULL;
+				if (Param->Inst && !Found) Writer->Failed = 1;
+				mlc_cache_write_int(Writer, Found ? Found - Insts : -1);
+				break;
+			}
+			case MLC_PARAM_INT:
+				mlc_cache_write_int(Writer, Param->Index);
+				break;
+			case MLC_PARAM_VALUE:
+				// Globals are looked up again by name when the cache is loaded.
+				if (Inst->Opcode == MLI_PUSH && Inst->NumParams > 2 && Inst->Params[2].Name) {
+					mlc_cache_write_value(Writer, NULL);
+				} else {
+					mlc_cache_write_value(Writer, Param->Value);
+				}
+				break;
+			case MLC_PARAM_NAME:
+				mlc_cache_write_name(Writer, Param->Name);
+				break;
+			case MLC_PARAM_CLOSURE:
+				mlc_cache_write_info(Writer, Param->ClosureInfo);
+				break;
+			case MLC_PARAM_FIELD:
+				mlc_cache_write_object(Writer, Param->RaField);
+				break;
+			case MLC_PARAM_BOXED:
+				mlc_cache_write_string(Writer, (char *)Param->Boxed, Inst->Params[1].Count);
+				break;
+			case MLC_PARAM_CACHE:
+				break;
+			case MLC_PARAM_FAST: {
+				int Op = 0;
+				while (MLCNumberOps[Op].Name && MLCNumberOps[Op].Fast != Param->Fast) ++Op;
+				if (!MLCNumberOps[Op].Name) Writer->Failed = 1;
+				mlc_cache_write_int(Writer, Op);
+				break;
+			}
+			}
+		}
+	}
+}
+
+static void mlc_cache_save(const char *CacheName, unsigned char SourceHash[SHA256_BLOCK_SIZE], mlc_schema_entry_t *SchemaLog, ml_closure_info_t *Info) {
+	mlc_cache_writer_t Writer[1] = {{NULL, 0, 0, SchemaLog, NULL, 0}};
+	mlc_cache_write(Writer, ML_CACHE_MAGIC, 8);
+	mlc_cache_write_int(Writer, MLI_COUNT);
+	mlc_cache_write_int(Writer, Optimize);
+	mlc_cache_write(Writer, SourceHash, SHA256_BLOCK_SIZE);
+	int NumEntries = 0;
+	for (mlc_schema_entry_t *Entry = SchemaLog; Entry; Entry = Entry->Next) ++NumEntries;
+	mlc_cache_write_int(Writer, NumEntries);
+	for (mlc_schema_entry_t *Entry = SchemaLog; Entry; Entry = Entry->Next) {
+		mlc_cache_write_int(Writer, Entry->Kind);
+		mlc_cache_write_object(Writer, Entry->Schema ? Entry->Schema->Object : NULL);
+		mlc_cache_write_name(Writer, Entry->Name);
+		if (Entry->Kind == MLC_SCHEMA_INDEX || Entry->Kind == MLC_SCHEMA_COMPUTED_FIELD) mlc_cache_write_names(Writer, Entry->FieldNames);
+		if (Entry->Kind == MLC_SCHEMA_COMPUTED_FIELD) mlc_cache_write_info(Writer, ((ml_closure_t *)Entry->Function)->Info);
+	}
+	mlc_cache_write_info(Writer, Info);
+	if (!Writer->Failed) {
+		char TempName[strlen(CacheName) + 16];
+		sprintf(TempName, "%s.%d", CacheName, getpid());
+		FILE *File = fopen(TempName, "wb");
+		if (File) {
+			int Written = fwrite(Writer->Data, 1, Writer->Length, File) == Writer->Length;
+			if (fclose(File) || !Written || rename(TempName, CacheName)) unlink(TempName);
+		}
+	}
+	free(Writer->Data);
+}
+
+typedef struct {
+	const char *Next, *Limit;
+	void **Objects;
+	int NumObjects, Failed;
+	ml_getter_t GlobalGet;
+	void *Globals;
+	const char *SourceName;
+} mlc_cache_reader_t;
+
+static const void *mlc_cache_read(mlc_cache_reader_t *Reader, size_t Length) {
+	static const char Zeros[SHA256_BLOCK_SIZE];
+	if (Reader->Failed || Length > Reader->Limit - Reader->Next) {
+		Reader->Failed = 1;
+		return Zeros;
+	}
+	const char *Data = Reader->Next;
+	Reader->Next += Length;
+	return Data;
+}
+
+static int64_t mlc_cache_read_int(mlc_cache_reader_t *Reader) {
+	int64_t Value;
+	memcpy(&Value, mlc_cache_read(Reader, sizeof(Value)), sizeof(Value));
+	return Value;
+}
+
+static int mlc_cache_read_range(mlc_cache_reader_t *Reader, int64_t Min, int64_t Max) {
+	int64_t Value = mlc_cache_read_int(Reader);
+	if (Value < Min || Value > Max) {
+		Reader->Failed = 1;
+		return Min;
+	}
+	return Value;
+}
+
+static char *mlc_cache_read_string(mlc_cache_reader_t *Reader, int *Length) {
+	int64_t Count = mlc_cache_read_range(Reader, -1, INT_MAX - 1);
+	if (Length) Length[0] = Count;
+	if (Count < 0) return NULL;
+	char *String = snew(Count + 1);
+	memcpy(String, mlc_cache_read(Reader, Count), Reader->Failed ? 0 : Count);
+	String[Count] = 0;
+	return String;
+}
+
+static const char **mlc_cache_read_names(mlc_cache_reader_t *Reader) {
+	int Count = mlc_cache_read_range(Reader, 0, Reader->Limit - Reader->Next);
+	const char **Names = anew(const char *, Count + 1);
+	for (int I = 0; I < Count; ++I) Names[I] = mlc_cache_read_string(Reader, NULL) ?: "";
+	return Names;
+}
+
+static void *mlc_cache_read_object(mlc_cache_reader_t *Reader) {
+	int Index = mlc_cache_read_range(Reader, -2, Reader->NumObjects - 1);
+	if (Index == -2) return InstanceField;
+	if (Index == -1) return NULL;
+	return Reader->Objects[Index];
+}
+
+static ra_schema_field_t **mlc_cache_read_fields(mlc_cache_reader_t *Reader, int *Count) {
+	int NumFields = Count[0] = mlc_cache_read_range(Reader, 0, Reader->Limit - Reader->Next);
+	if (!NumFields) return NULL;
+	ra_schema_field_t **Fields = anew(ra_schema_field_t *, NumFields + 1);
+	for (int I = 0; I < NumFields; ++I) Fields[I] = mlc_cache_read_object(Reader);
+	return Fields;
+}
+
+static ra_listener_template_t *mlc_cache_read_listener(mlc_cache_reader_t *Reader) {
+	int NumSchemas = mlc_cache_read_range(Reader, 1, Reader->Limit - Reader->Next);
+	ra_listener_template_t *Template = xnew(ra_listener_template_t, NumSchemas, ra_schema_listener_template_t);
+	Template->NumSchemas = NumSchemas;
+	for (int I = 0; I < NumSchemas; ++I) {
+		ra_schema_listener_template_t *Schema = Template->Schemas + I;
+		Schema->Schema = mlc_cache_read_object(Reader);
+		Schema->Index = mlc_cache_read_object(Reader);
+		Schema->SelectedFields = mlc_cache_read_fields(Reader, &Schema->NumSelectedFields);
+		Schema->Negated = mlc_cache_read_int(Reader);
+		Schema->Created = mlc_cache_read_int(Reader);
+	}
+	return Template;
+}
+
+static ml_value_t *mlc_cache_read_value(mlc_cache_reader_t *Reader) {
+	int64_t Tag = mlc_cache_read_int(Reader);
+	switch (Tag) {
+	case MLC_CACHE_NULL: return NULL;
+	case MLC_CACHE_NIL: return MLNil;
+	case MLC_CACHE_SOME: return MLSome;
+	case MLC_CACHE_INTEGER: return ml_integer(mlc_cache_read_int(Reader));
+	case MLC_CACHE_REAL: {
+		double Real;
+		memcpy(&Real, mlc_cache_read(Reader, sizeof(Real)), sizeof(Real));
+		return ml_real(Real);
+	}
+	case MLC_CACHE_STRING: {
+		int Length;
+		const char *String = mlc_cache_read_string(Reader, &Length);
+		if (!String) return MLNil;
+		return Length <= ML_STRING_INTERN_LENGTH ? ml_string_intern(String, Length) : ml_string(String, Length);
+	}
+	case MLC_CACHE_REGEX: {
+		int Length;
+		const char *String = mlc_cache_read_string(Reader, &Length);
+		ml_value_t *Regex = String ? ml_regex_compile(ml_string(String, Length)) : MLNil;
+		if (ml_typeof(Regex) != MLRegexT) Reader->Failed = 1;
+		return Regex;
+	}
+	case MLC_CACHE_METHOD: return ml_method(mlc_cache_read_string(Reader, NULL) ?: "");
+	case MLC_CACHE_BUILTIN: return MLCBuiltins[mlc_cache_read_range(Reader, 0, sizeof(MLCBuiltins) / sizeof(ml_value_t *) - 2)];
+	case MLC_CACHE_LISTENER: return ml_function(mlc_cache_read_listener(Reader), (void *)ra_listener_create_callback);
+	case MLC_CACHE_WAIT: return ml_function(mlc_cache_read_listener(Reader), (void *)ra_index_instance_wait_callback);
+	case MLC_CACHE_CREATE: case MLC_CACHE_SIGNAL: {
+		ra_instance_template_t *Template = new(ra_instance_template_t);
+		Template->Schema = mlc_cache_read_object(Reader);
+		Template->Fields = mlc_cache_read_fields(Reader, &Template->NumFields) ?: anew(ra_schema_field_t *, 1);
+		return ml_function(Template, Tag == MLC_CACHE_SIGNAL ? (void *)ra_instance_signal_callback : (void *)ra_instance_create_callback);
+	}
+	case MLC_CACHE_EXISTS: return ml_function(mlc_cache_read_object(Reader), (void *)ra_index_instance_exists_callback);
+	case MLC_CACHE_DELETE: return ml_function(mlc_cache_read_object(Reader), (void *)ra_index_instance_delete_callback);
+	case MLC_CACHE_UPDATE: {
+		int NumFields;
+		ra_schema_field_t **Fields = mlc_cache_read_fields(Reader, &NumFields) ?: anew(ra_schema_field_t *, 1);
+		return ml_function(Fields, (void *)ra_index_instance_update_callback);
+	}
+	default:
+		Reader->Failed = 1;
+		return MLNil;
+	}
+}
+
+static ml_closure_info_t *mlc_cache_read_info(mlc_cache_reader_t *Reader) {
+	ml_closure_info_t *Info = new(ml_closure_info_t);
+	Info->FrameSize = mlc_cache_read_range(Reader, 0, INT_MAX);
+	Info->NumParams = mlc_cache_read_range(Reader, INT_MIN, INT_MAX);
+	Info->NumUpValues = mlc_cache_read_range(Reader, 0, INT_MAX);
+	memcpy(Info->Hash, mlc_cache_read(Reader, SHA256_BLOCK_SIZE), SHA256_BLOCK_SIZE);
+	Info->Boxed = (unsigned char *)mlc_cache_read_string(Reader, NULL);
+	int NumInsts = mlc_cache_read_range(Reader, 0, (Reader->Limit - Reader->Next) / 8);
+	if (!NumInsts || Reader->Failed) return Info;
+	int Entry = mlc_cache_read_range(Reader, 0, NumInsts - 1);
+	int NumParams[NumInsts];
+	size_t Size = 0;
+	for (int I = 0; I < NumInsts; ++I) {
+		NumParams[I] = mlc_cache_read_range(Reader, 1, 65536);
+		Size += sizeof(ml_inst_t) + NumParams[I] * sizeof(ml_param_t);
+	}
+	if (Reader->Failed) return Info;
+	char *Code = (char *)GC_MALLOC(Size);
+	ml_inst_t **Insts = anew(ml_inst_t *, NumInsts);
+	for (int I = 0; I < NumInsts; ++I) {
+		Insts[I] = (ml_inst_t *)Code;
+		Insts[I]->NumParams = NumParams[I];
+		Code += sizeof(ml_inst_t) + NumParams[I] * sizeof(ml_param_t);
+	}
+	for (int I = 0; I < NumInsts && !Reader->Failed; ++I) {
+		ml_inst_t *Inst = Insts[I];
+		Inst->Opcode = mlc_cache_read_range(Reader, 0, MLI_COUNT - 1);
+		Inst->Source.Line = mlc_cache_read_int(Reader);
+		if (mlc_cache_read_int(Reader)) Reader->SourceName = mlc_cache_read_string(Reader, NULL);
+		Inst->Source.Name = Reader->SourceName;
+		for (int J = 0; J < Inst->NumParams; ++J) {
+			ml_param_t *Param = Inst->Params + J;
+			switch (mlc_param_kind(Inst, J)) {
+			case MLC_PARAM_INST: {
+				int Index = mlc_cache_read_range(Reader, -1, NumInsts - 1);
+				Param->Inst = Index < 0 ? NULL : Insts[Index];
+				break;
+			}
+			case MLC_PARAM_INT:
+				Param->Index = mlc_cache_read_range(Reader, INT_MIN, INT_MAX);
+				break;
+			case MLC_PARAM_VALUE:
+				Param->Value = mlc_cache_read_value(Reader);
+				break;
+			case MLC_PARAM_NAME:
+				Param->Name = mlc_cache_read_string(Reader, NULL);
+				if (Param->Name) Inst->Params[1].Value = (Reader->GlobalGet)(Reader->Globals, Param->Name);
+				break;
+			case MLC_PARAM_CLOSURE:
+				Param->ClosureInfo = mlc_cache_read_info(Reader);
+				break;
+			case MLC_PARAM_FIELD:
+				Param->RaField = mlc_cache_read_object(Reader);
+				break;
+			case MLC_PARAM_BOXED:
+				Param->Boxed = (unsigned char *)mlc_cache_read_string(Reader, NULL);
+				break;
+			case MLC_PARAM_CACHE:
+				break;
+			case MLC_PARAM_FAST:
+				Param->Fast = MLCNumberOps[mlc_cache_read_range(Reader, 0, sizeof(MLCNumberOps) / sizeof(MLCNumberOps[0]) - 2)].Fast;
+				break;
+			}
+		}
+	}
+	Info->Entry = Insts[Entry];
+	return Info;
+}
+
+static int mlc_cache_check_field(mlc_cache_reader_t *Reader, ra_schema_t *Schema, const char *Name) {
+	// Existing schemas are looked up during the check, so a field that could not be added to one is caught before replaying.
+	return Schema == (void *)Reader || ra_schema_field_by_name(Schema, Name) || !ra_schema_sealed(Schema);
+}
+
+static void mlc_cache_read_schema_entry(mlc_cache_reader_t *Reader, int I, int Replay) {
+	// Without Replay, each entry is only checked and stands in for its object with a placeholder.
+	int Kind = mlc_cache_read_int(Reader);
+	ra_schema_t *Schema = mlc_cache_read_object(Reader);
+	const char *Name = mlc_cache_read_string(Reader, NULL);
+	switch (Kind) {
+	case MLC_SCHEMA:
+		if (Name) Reader->Objects[I] = ra_schema_by_name(Name) ?: !Replay ? (void *)Reader : ra_schema_create(Name, Schema);
+		break;
+	case MLC_SCHEMA_FIELD:
+		if (Schema && Name) {
+			if (!Replay) {
+				if (mlc_cache_check_field(Reader, Schema, Name)) Reader->Objects[I] = Reader;
+			} else {
+				Reader->Objects[I] = ra_schema_field_by_name(Schema, Name) ?: ra_schema_value_field_create(Schema, Name);
+			}
+		}
+		break;
+	case MLC_SCHEMA_INDEX: {
+		const char **FieldNames = mlc_cache_read_names(Reader);
+		if (Schema && FieldNames[0]) {
+			if (!Replay) {
+				Reader->Objects[I] = Reader;
+				for (const char **FieldName = FieldNames; FieldName[0]; ++FieldName) {
+					if (!mlc_cache_check_field(Reader, Schema, FieldName[0])) Reader->Objects[I] = NULL;
+				}
+			} else {
+				Reader->Objects[I] = ra_schema_index_by_names(Schema, FieldNames) ?: ra_schema_index_create(Schema, FieldNames);
+			}
+		}
+		break;
+	}
+	case MLC_SCHEMA_COMPUTED_FIELD: {
+		const char **FieldNames = mlc_cache_read_names(Reader);
+		ml_closure_t *Closure = new(ml_closure_t);
+		Closure->Type = MLClosureT;
+		Closure->Info = mlc_cache_read_info(Reader);
+		if (Schema && Name && !Reader->Failed) Reader->Objects[I] = !Replay ? (void *)Reader : ra_schema_computed_field_create(Schema, Name, (ml_value_t *)Closure, FieldNames);
+		break;
+	}
+	}
+	if (!Reader->Objects[I]) Reader->Failed = 1;
+	Reader->NumObjects = I + 1;
+}
+
+static ml_value_t *mlc_cache_load(const char *CacheName, unsigned char SourceHash[SHA256_BLOCK_SIZE], ml_getter_t GlobalGet, void *Globals) {
+	int Fd = open(CacheName, O_RDONLY | O_CLOEXEC);
+	if (Fd < 0) return NULL;
+	struct stat Stat[1];
+	if (fstat(Fd, Stat) || Stat->st_size < 8 + 16 + SHA256_BLOCK_SIZE) {
+		close(Fd);
+		return NULL;
+	}
+	const char *Data = mmap(NULL, Stat->st_size, PROT_READ, MAP_PRIVATE, Fd, 0);
+	close(Fd);
+	if (Data == MAP_FAILED) return NULL;
+	mlc_cache_reader_t Reader[1] = {{Data, Data + Stat->st_size, NULL, 0, 0, GlobalGet, Globals, NULL}};
+	ml_value_t *Result = NULL;
+	if (memcmp(mlc_cache_read(Reader, 8), ML_CACHE_MAGIC, 8)) goto done;
+	if (mlc_cache_read_int(Reader) != MLI_COUNT || mlc_cache_read_int(Reader) != Optimize) goto done;
+	if (memcmp(mlc_cache_read(Reader, SHA256_BLOCK_SIZE), SourceHash, SHA256_BLOCK_SIZE)) goto done;
+	// The source matches. The rest of the cache is read twice: first without touching any schema to
+	// check that all of it can be read, then for real with the schema log replayed before anything
+	// else, exactly as the parser would have done. A cache that fails part way through the second pass
+	// would leave schema changes behind that the fallback compile would then repeat.
+	const char *Start = Reader->Next;
+	for (int Replay = 0; Replay < 2; ++Replay) {
+		Reader->Next = Start;
+		Reader->NumObjects = 0;
+		Reader->SourceName = NULL;
+		int NumObjects = mlc_cache_read_range(Reader, 0, Stat->st_size);
+		Reader->Objects = anew(void *, NumObjects + 1);
+		for (int I = 0; I < NumObjects && !Reader->Failed; ++I) mlc_cache_read_schema_entry(Reader, I, Replay);
+		ml_closure_t *Closure = new(ml_closure_t);
+		Closure->Type = MLClosureT;
+		Closure->Info = mlc_cache_read_info(Reader);
+		if (Reader->Failed || Reader->Next != Reader->Limit) break;
+		if (Replay) Result = (ml_value_t *)Closure;
+	}
+done:
+	munmap((void *)Data, Stat->st_size);
+	return Result;
+}
+
 static const char *ml_file_read(void *Data) {
 	FILE *File = (FILE *)Data;
 	char *Line = NULL;
@@ -4570,6 +7053,24 @@ static const char *ml_file_read(void *Data) {
 ml_value_t *ml_load(ml_getter_t GlobalGet, void *Globals, const char *FileName) {
 	FILE *File = fopen(FileName, "r");
 	if (!File) return ml_error("LoadError", "error opening %s", FileName);
+	unsigned char SourceHash[SHA256_BLOCK_SIZE];
+	char *CacheName = NULL;
+	if (Caching) {
+		SHA256_CTX SourceContext[1];
+		sha256_init(SourceContext);
+		char Buffer[4096];
+		size_t Length;
+		while ((Length = fread(Buffer, 1, sizeof(Buffer), File))) sha256_update(SourceContext, (BYTE *)Buffer, Length);
+		sha256_final(SourceContext, SourceHash);
+		rewind(File);
+		CacheName = snew(strlen(FileName) + 7);
+		sprintf(CacheName, "%s.cache", FileName);
+		ml_value_t *Cached = mlc_cache_load(CacheName, SourceHash, GlobalGet, Globals);
+		if (Cached) {
+			fclose(File);
+			return Cached;
+		}
+	}
 	mlc_scanner_t *Scanner = ml_scanner(FileName, File, ml_file_read);
 	if (setjmp(Scanner->OnError)) return Scanner->Error;
 	mlc_expr_t *Expr = ml_accept_block(Scanner);
@@ -4583,9 +7084,10 @@ ml_value_t *ml_load(ml_getter_t GlobalGet, void *Globals, const char *FileName)
 	ml_closure_t *Closure = new(ml_closure_t);
 	ml_closure_info_t *Info = Closure->Info = new(ml_closure_info_t);
 	Closure->Type = MLClosureT;
-	Info->Entry = Compiled.Start;
+	Info->Entry = mlc_linearize(mlc_optimize(Compiled.Start));
 	Info->FrameSize = Function->Size;
 	sha256_final(HashContext, Info->Hash);
+	if (CacheName) mlc_cache_save(CacheName, SourceHash, Scanner->SchemaLog, Info);
 	return (ml_value_t *)Closure;
 }
 
@@ -4638,27 +7140,27 @@ void ml_console(ml_getter_t GlobalGet, void *Globals) {
 		ml_closure_t *Closure = new(ml_closure_t);
 		ml_closure_info_t *Info = Closure->Info = new(ml_closure_info_t);
 		Closure->Type = MLClosureT;
-		Info->Entry = Compiled.Start;
+		Info->Entry = mlc_linearize(mlc_optimize(Compiled.Start));
 		Info->FrameSize = Function->Size;
 		ml_value_t *Result = ml_closure_call((ml_value_t *)Closure, 0, NULL);
-		if (Result->Type == MLErrorT) {
+		if (ml_typeof(Result) == MLErrorT) {
 			printf("Error: %s\n", ml_error_message(Result));
 			const char *Source;
 			int Line;
 			for (int I = 0; ml_error_trace(Result, I, &Source, &Line); ++I) printf("\t%s:%d\n", Source, Line);
 		} else {
 			ml_value_t *String = ml_call(StringMethod, 1, &Result);
-			if (String->Type == MLStringT) {
+			if (ml_typeof(String) == MLStringT) {
 				printf("%s\n", ml_string_value(String));
 			} else {
-				printf("<%s>\n", Result->Type->Name);
+				printf("<%s>\n", ml_typeof(Result)->Name);
 			}
 		}
 	}
 }
 
 int ml_is(ml_value_t *Value, ml_type_t *Expected) {
-	const ml_type_t *Type = Value->Type;
+	const ml_type_t *Type = ml_typeof(Value);
 	while (Type) {
 		if (Type == Expected) return 1;
 		Type = Type->Parent;
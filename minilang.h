@@ -3,7 +3,9 @@
 
 #include "sha256.h"
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <time.h>
 
 typedef struct ml_type_t ml_type_t;
 typedef struct ml_value_t ml_value_t;
@@ -26,10 +28,39 @@ ml_value_t *ml_call(ml_value_t *Value, int Count, ml_value_t **Args);
 
 ml_value_t *ml_inline(ml_value_t *Value, int Count, ...);
 
+ml_value_t *ml_coroutine_call(ml_value_t *Value, int Count, ml_value_t **Args);
+ml_value_t *ml_suspend();
+ml_value_t *ml_suspend_cancellable(ml_value_t *Cancel);
+ml_value_t *ml_resume(ml_value_t *Suspension, ml_value_t *Result);
+
+typedef struct ml_fuel_t {
+	long Budget;
+	struct timespec Deadline;
+	int Timed;
+} ml_fuel_t;
+
+void ml_fuel_set(long Ticks, long Nanoseconds);
+void ml_fuel_clear();
+void ml_fuel_save(ml_fuel_t *Fuel);
+void ml_fuel_share(ml_fuel_t *Fuel);
+void ml_fuel_restore(ml_fuel_t *Fuel);
+
+ml_value_t *ml_profile_start(void *Data, int Count, ml_value_t **Args);
+ml_value_t *ml_profile_stop(void *Data, int Count, ml_value_t **Args);
+ml_value_t *ml_profile_dump(void *Data, int Count, ml_value_t **Args);
+ml_value_t *ml_profile_top(void *Data, int Count, ml_value_t **Args);
+
+ml_value_t *ml_range(void *Data, int Count, ml_value_t **Args);
+ml_value_t *ml_regex(void *Data, int Count, ml_value_t **Args);
+
+void ml_optimize_set(int Enabled);
+void ml_cache_set(int Enabled);
+
 void ml_method_by_name(const char *Method, void *Data, ml_callback_t Function, ...);
 void ml_method_by_value(ml_value_t *Method, void *Data, ml_callback_t Function, ...);
 
 ml_value_t *ml_string(const char *Value, int Length);
+ml_value_t *ml_string_intern(const char *Value, int Length);
 ml_value_t *ml_integer(long Value);
 ml_value_t *ml_real(double Value);
 ml_value_t *ml_list();
@@ -50,6 +81,7 @@ const char *ml_error_message(ml_value_t *Value);
 int ml_error_trace(ml_value_t *Value, int Level, const char **Source, int *Line);
 
 void ml_closure_hash(ml_value_t *Closure, unsigned char Hash[SHA256_BLOCK_SIZE]);
+ml_value_t **ml_closure_upvalues(ml_value_t *Closure, int *Count);
 
 void ml_list_append(ml_value_t *List, ml_value_t *Value);
 int ml_list_length(ml_value_t *List);
@@ -89,11 +121,42 @@ extern ml_type_t MLTreeT[];
 extern ml_type_t MLPropertyT[];
 extern ml_type_t MLClosureT[];
 extern ml_type_t MLErrorT[];
+extern ml_type_t MLSuspensionT[];
+extern ml_type_t MLRangeT[];
+extern ml_type_t MLGeneratorT[];
+extern ml_type_t MLSequenceT[];
+extern ml_type_t MLRegexT[];
 
 struct ml_value_t {
 	const ml_type_t *Type;
 };
 
+// Integers that fit in 63 bits are stored in the value pointer itself, shifted left with the low bit set,
+// so values must be inspected with ml_typeof() rather than ->Type.
+
+#define ML_SMALL_INTEGER_MIN (-(1L << 62))
+#define ML_SMALL_INTEGER_MAX ((1L << 62) - 1)
+
+static inline int ml_is_small_integer(ml_value_t *Value) {
+	return (uintptr_t)Value & 1;
+}
+
+static inline ml_value_t *ml_small_integer(long Value) {
+	return (ml_value_t *)(((uintptr_t)Value << 1) | 1);
+}
+
+static inline long ml_small_integer_value(ml_value_t *Value) {
+	return (intptr_t)Value >> 1;
+}
+
+static inline const ml_type_t *ml_typeof(ml_value_t *Value) {
+	return ml_is_small_integer(Value) ? MLIntegerT : Value->Type;
+}
+
+// Strings up to this length are interned when they appear as literals or arrive through ingest.
+
+#define ML_STRING_INTERN_LENGTH 64
+
 extern ml_value_t MLNil[];
 extern ml_value_t MLSome[];
 
@@ -154,7 +217,7 @@ int ml_stringbuffer_foreach(ml_stringbuffer_t *Buffer, void *Data, int (*callbac
 
 
 #define ML_CHECK_ARG_TYPE(N, TYPE) \
-	if (Args[N]->Type != TYPE) return ml_error("TypeError", "%s required", TYPE->Name);
+	if (ml_typeof(Args[N]) != TYPE) return ml_error("TypeError", "%s required", TYPE->Name);
 
 #define ML_CHECK_ARG_COUNT(N) \
 	if (Count < N) return ml_error("CallError", "%d arguments required", N);
@@ -83,6 +83,50 @@ static ml_value_t *ml_file_eof(void *Data, int Count, ml_value_t **Args) {
 	return MLNil;
 }
 
+typedef struct ml_file_lines_t {
+	const ml_type_t *Type;
+	ml_file_t *File;
+	ml_value_t *Line;
+	long Index;
+} ml_file_lines_t;
+
+static ml_value_t *ml_file_lines_deref(ml_value_t *Ref) {
+	ml_file_lines_t *Lines = (ml_file_lines_t *)Ref;
+	return Lines->Line;
+}
+
+static ml_value_t *ml_file_lines_next(ml_value_t *Ref) {
+	ml_file_lines_t *Lines = (ml_file_lines_t *)Ref;
+	if (!Lines->File->Handle) return MLNil;
+	ml_value_t *Line = ml_file_read_line(0, 1, (ml_value_t **)&Lines->File);
+	if (Line == MLNil || ml_typeof(Line) == MLErrorT) return Line;
+	Lines->Line = Line;
+	++Lines->Index;
+	return Ref;
+}
+
+static ml_value_t *ml_file_lines_key(ml_value_t *Ref) {
+	ml_file_lines_t *Lines = (ml_file_lines_t *)Ref;
+	return ml_integer(Lines->Index);
+}
+
+ml_type_t MLFileLinesT[1] = {{
+	MLAnyT, "file-lines",
+	ml_default_hash,
+	ml_default_call,
+	ml_file_lines_deref,
+	ml_default_assign,
+	ml_file_lines_next,
+	ml_file_lines_key
+}};
+
+static ml_value_t *ml_file_values(void *Data, int Count, ml_value_t **Args) {
+	ml_file_lines_t *Lines = new(ml_file_lines_t);
+	Lines->Type = MLFileLinesT;
+	Lines->File = (ml_file_t *)Args[0];
+	return ml_file_lines_next((ml_value_t *)Lines);
+}
+
 static ml_value_t *ml_file_close(void *Data, int Count, ml_value_t **Args) {
 	ml_file_t *File = (ml_file_t *)Args[0];
 	if (File->Handle) {
@@ -107,6 +151,10 @@ ml_value_t *ml_file_new(FILE *Handle) {
 	return (ml_value_t *)File;
 }
 
+FILE *ml_file_handle(ml_value_t *Value) {
+	return ((ml_file_t *)Value)->Handle;
+}
+
 ml_value_t *ml_file_open(void *Data, int Count, ml_value_t **Args) {
 	ML_CHECK_ARG_COUNT(2);
 	ML_CHECK_ARG_TYPE(0, MLStringT);
@@ -128,5 +176,6 @@ void ml_file_init() {
 	ml_method_by_name("write", 0, ml_file_write_string, MLFileT, MLStringT, NULL);
 	ml_method_by_name("write", 0, ml_file_write_buffer, MLFileT, MLStringBufferT, NULL);
 	ml_method_by_name("eof", 0, ml_file_eof, MLFileT, NULL);
+	ml_method_by_name("values", 0, ml_file_values, MLFileT, NULL);
 	ml_method_by_name("close", 0, ml_file_close, MLFileT, NULL);
 }
@@ -8,5 +8,8 @@ void ml_file_init();
 
 ml_value_t *ml_file_new(FILE *File);
 ml_value_t *ml_file_open(void *Data, int Count, ml_value_t **Args);
+FILE *ml_file_handle(ml_value_t *Value);
+
+extern ml_type_t MLFileT[];
 
 #endif
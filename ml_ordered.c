@@ -0,0 +1,710 @@
+#include <stdlib.h>
+#include <string.h>
+#include <gc.h>
+#include <ml_ordered.h>
+
+#define new(T) ((T *)GC_MALLOC(sizeof(T)))
+#define anew(T, N) ((T *)GC_MALLOC((N) * sizeof(T)))
+
+// Ordered maps are B+ trees with wide nodes. Every key and value lives in a leaf, leaves are linked
+// in key order for range iteration, and internal nodes hold separator keys where each separator is
+// greater than every key to its left and no greater than any key to its right. A node splits when it
+// reaches ML_ORDERED_MAX keys and is refilled from a sibling or merged with one when it drops below
+// ML_ORDERED_MIN, so the tree stays within a few levels even for millions of keys.
+
+#define ML_ORDERED_MAX 32
+#define ML_ORDERED_MIN (ML_ORDERED_MAX / 2 - 1)
+
+typedef struct ml_ordered_t ml_ordered_t;
+typedef struct ml_ordered_node_t ml_ordered_node_t;
+
+struct ml_ordered_node_t {
+	ml_ordered_node_t *Prev, *Next;
+	int Count, Leaf;
+	ml_value_t *Keys[ML_ORDERED_MAX];
+	union {
+		ml_value_t *Values[ML_ORDERED_MAX];
+		ml_ordered_node_t *Children[ML_ORDERED_MAX + 1];
+	};
+};
+
+struct ml_ordered_t {
+	const ml_type_t *Type;
+	ml_ordered_node_t *Root;
+	int Size, Version;
+};
+
+static ml_value_t *CompareMethod;
+static ml_value_t *AppendMethod;
+
+ml_type_t MLOrderedT[1] = {{
+	MLAnyT, "ordered",
+	ml_default_hash,
+	ml_default_call,
+	ml_default_deref,
+	ml_default_assign,
+	ml_default_next,
+	ml_default_key
+}};
+
+static int ml_ordered_compare(ml_value_t *A, ml_value_t *B, ml_value_t **Error) {
+	const ml_type_t *TypeA = ml_typeof(A), *TypeB = ml_typeof(B);
+	if (TypeA == MLIntegerT && TypeB == MLIntegerT) {
+		long IntegerA = ml_integer_value(A), IntegerB = ml_integer_value(B);
+		return (IntegerA > IntegerB) - (IntegerA < IntegerB);
+	}
+	if (TypeA == MLStringT && TypeB == MLStringT) {
+		return strcmp(ml_string_value(A), ml_string_value(B));
+	}
+	ml_value_t *Args[2] = {A, B};
+	ml_value_t *Result = ml_call(CompareMethod, 2, Args);
+	if (ml_typeof(Result) == MLIntegerT) {
+		long Compare = ml_integer_value(Result);
+		return (Compare > 0) - (Compare < 0);
+	} else if (ml_typeof(Result) == MLRealT) {
+		double Compare = ml_real_value(Result);
+		return (Compare > 0) - (Compare < 0);
+	} else if (ml_typeof(Result) == MLErrorT) {
+		Error[0] = Result;
+		return 0;
+	} else {
+		Error[0] = ml_error("CompareError", "comparison must return number");
+		return 0;
+	}
+}
+
+static int ml_ordered_search_node(ml_ordered_node_t *Node, ml_value_t *Key, int *Found, ml_value_t **Error) {
+	// Returns the index of the first key in Node that is not less than Key.
+	int Lo = 0, Hi = Node->Count;
+	Found[0] = 0;
+	while (Lo < Hi) {
+		int Mid = (Lo + Hi) / 2;
+		int Compare = ml_ordered_compare(Node->Keys[Mid], Key, Error);
+		if (Error[0]) return -1;
+		if (Compare < 0) {
+			Lo = Mid + 1;
+		} else {
+			if (!Compare) Found[0] = 1;
+			Hi = Mid;
+		}
+	}
+	return Lo;
+}
+
+static ml_ordered_node_t *ml_ordered_leaf(ml_ordered_node_t *Node, ml_value_t *Key, int *Index, int *Found, ml_value_t **Error) {
+	while (!Node->Leaf) {
+		int Child = ml_ordered_search_node(Node, Key, Found, Error);
+		if (Error[0]) return 0;
+		Node = Node->Children[Child + Found[0]];
+	}
+	Index[0] = ml_ordered_search_node(Node, Key, Found, Error);
+	return Node;
+}
+
+static ml_ordered_node_t *ml_ordered_node(int Leaf) {
+	ml_ordered_node_t *Node = new(ml_ordered_node_t);
+	Node->Leaf = Leaf;
+	return Node;
+}
+
+static ml_ordered_node_t *ml_ordered_split(ml_ordered_node_t *Node, ml_value_t **Separator) {
+	ml_ordered_node_t *Right = ml_ordered_node(Node->Leaf);
+	int Half = Node->Count / 2;
+	if (Node->Leaf) {
+		Right->Count = Node->Count - Half;
+		memcpy(Right->Keys, Node->Keys + Half, Right->Count * sizeof(ml_value_t *));
+		memcpy(Right->Values, Node->Values + Half, Right->Count * sizeof(ml_value_t *));
+		memset(Node->Keys + Half, 0, Right->Count * sizeof(ml_value_t *));
+		memset(Node->Values + Half, 0, Right->Count * sizeof(ml_value_t *));
+		if ((Right->Next = Node->Next)) Right->Next->Prev = Right;
+		Right->Prev = Node;
+		Node->Next = Right;
+		Separator[0] = Right->Keys[0];
+	} else {
+		Separator[0] = Node->Keys[Half];
+		Right->Count = Node->Count - Half - 1;
+		memcpy(Right->Keys, Node->Keys + Half + 1, Right->Count * sizeof(ml_value_t *));
+		memcpy(Right->Children, Node->Children + Half + 1, (Right->Count + 1) * sizeof(ml_ordered_node_t *));
+		memset(Node->Keys + Half, 0, (Right->Count + 1) * sizeof(ml_value_t *));
+		memset(Node->Children + Half + 1, 0, (Right->Count + 1) * sizeof(ml_ordered_node_t *));
+	}
+	Node->Count = Half;
+	return Right;
+}
+
+static int ml_ordered_insert_node(ml_ordered_node_t *Node, ml_value_t *Key, ml_value_t *Value, ml_value_t **Old, ml_ordered_node_t **Split, ml_value_t **Separator) {
+	// Returns 1 if Key was already present, 0 if it was added and -1 on error, with Old set to the
+	// previous value or the error. Split is set when Node had to be split in two.
+	int Found;
+	ml_value_t *Error = 0;
+	int Index = ml_ordered_search_node(Node, Key, &Found, &Error);
+	if (Error) {
+		Old[0] = Error;
+		return -1;
+	}
+	if (Node->Leaf) {
+		if (Found) {
+			Old[0] = Node->Values[Index];
+			Node->Values[Index] = Value;
+			return 1;
+		}
+		int Move = Node->Count - Index;
+		memmove(Node->Keys + Index + 1, Node->Keys + Index, Move * sizeof(ml_value_t *));
+		memmove(Node->Values + Index + 1, Node->Values + Index, Move * sizeof(ml_value_t *));
+		Node->Keys[Index] = Key;
+		Node->Values[Index] = Value;
+		if (++Node->Count == ML_ORDERED_MAX) Split[0] = ml_ordered_split(Node, Separator);
+		return 0;
+	}
+	Index += Found;
+	ml_ordered_node_t *Child = 0;
+	ml_value_t *ChildSeparator;
+	int Result = ml_ordered_insert_node(Node->Children[Index], Key, Value, Old, &Child, &ChildSeparator);
+	if (Child) {
+		int Move = Node->Count - Index;
+		memmove(Node->Keys + Index + 1, Node->Keys + Index, Move * sizeof(ml_value_t *));
+		memmove(Node->Children + Index + 2, Node->Children + Index + 1, Move * sizeof(ml_ordered_node_t *));
+		Node->Keys[Index] = ChildSeparator;
+		Node->Children[Index + 1] = Child;
+		if (++Node->Count == ML_ORDERED_MAX) Split[0] = ml_ordered_split(Node, Separator);
+	}
+	return Result;
+}
+
+static void ml_ordered_borrow_left(ml_ordered_node_t *Parent, int Index) {
+	ml_ordered_node_t *Left = Parent->Children[Index - 1], *Child = Parent->Children[Index];
+	memmove(Child->Keys + 1, Child->Keys, Child->Count * sizeof(ml_value_t *));
+	if (Child->Leaf) {
+		memmove(Child->Values + 1, Child->Values, Child->Count * sizeof(ml_value_t *));
+		Child->Keys[0] = Left->Keys[Left->Count - 1];
+		Child->Values[0] = Left->Values[Left->Count - 1];
+		Left->Values[Left->Count - 1] = 0;
+		Parent->Keys[Index - 1] = Child->Keys[0];
+	} else {
+		memmove(Child->Children + 1, Child->Children, (Child->Count + 1) * sizeof(ml_ordered_node_t *));
+		Child->Keys[0] = Parent->Keys[Index - 1];
+		Child->Children[0] = Left->Children[Left->Count];
+		Left->Children[Left->Count] = 0;
+		Parent->Keys[Index - 1] = Left->Keys[Left->Count - 1];
+	}
+	Left->Keys[--Left->Count] = 0;
+	++Child->Count;
+}
+
+static void ml_ordered_borrow_right(ml_ordered_node_t *Parent, int Index) {
+	ml_ordered_node_t *Child = Parent->Children[Index], *Right = Parent->Children[Index + 1];
+	if (Child->Leaf) {
+		Child->Keys[Child->Count] = Right->Keys[0];
+		Child->Values[Child->Count] = Right->Values[0];
+		memmove(Right->Values, Right->Values + 1, (Right->Count - 1) * sizeof(ml_value_t *));
+		Right->Values[Right->Count - 1] = 0;
+		memmove(Right->Keys, Right->Keys + 1, (Right->Count - 1) * sizeof(ml_value_t *));
+		Parent->Keys[Index] = Right->Keys[0];
+	} else {
+		Child->Keys[Child->Count] = Parent->Keys[Index];
+		Child->Children[Child->Count + 1] = Right->Children[0];
+		Parent->Keys[Index] = Right->Keys[0];
+		memmove(Right->Keys, Right->Keys + 1, (Right->Count - 1) * sizeof(ml_value_t *));
+		memmove(Right->Children, Right->Children + 1, Right->Count * sizeof(ml_ordered_node_t *));
+		Right->Children[Right->Count] = 0;
+	}
+	Right->Keys[--Right->Count] = 0;
+	++Child->Count;
+}
+
+static void ml_ordered_merge(ml_ordered_node_t *Parent, int Index) {
+	ml_ordered_node_t *Left = Parent->Children[Index], *Right = Parent->Children[Index + 1];
+	if (Left->Leaf) {
+		memcpy(Left->Keys + Left->Count, Right->Keys, Right->Count * sizeof(ml_value_t *));
+		memcpy(Left->Values + Left->Count, Right->Values, Right->Count * sizeof(ml_value_t *));
+		Left->Count += Right->Count;
+		if ((Left->Next = Right->Next)) Left->Next->Prev = Left;
+	} else {
+		Left->Keys[Left->Count] = Parent->Keys[Index];
+		memcpy(Left->Keys + Left->Count + 1, Right->Keys, Right->Count * sizeof(ml_value_t *));
+		memcpy(Left->Children + Left->Count + 1, Right->Children, (Right->Count + 1) * sizeof(ml_ordered_node_t *));
+		Left->Count += Right->Count + 1;
+	}
+	int Move = Parent->Count - Index - 1;
+	memmove(Parent->Keys + Index, Parent->Keys + Index + 1, Move * sizeof(ml_value_t *));
+	memmove(Parent->Children + Index + 1, Parent->Children + Index + 2, Move * sizeof(ml_ordered_node_t *));
+	Parent->Children[Parent->Count] = 0;
+	Parent->Keys[--Parent->Count] = 0;
+}
+
+static int ml_ordered_remove_node(ml_ordered_node_t *Node, ml_value_t *Key, ml_value_t **Removed) {
+	// Returns 1 if Key was removed, 0 if it was not present and -1 on error.
+	int Found;
+	ml_value_t *Error = 0;
+	int Index = ml_ordered_search_node(Node, Key, &Found, &Error);
+	if (Error) {
+		Removed[0] = Error;
+		return -1;
+	}
+	if (Node->Leaf) {
+		if (!Found) return 0;
+		Removed[0] = Node->Values[Index];
+		int Move = Node->Count - Index - 1;
+		memmove(Node->Keys + Index, Node->Keys + Index + 1, Move * sizeof(ml_value_t *));
+		memmove(Node->Values + Index, Node->Values + Index + 1, Move * sizeof(ml_value_t *));
+		--Node->Count;
+		Node->Keys[Node->Count] = Node->Values[Node->Count] = 0;
+		return 1;
+	}
+	Index += Found;
+	int Result = ml_ordered_remove_node(Node->Children[Index], Key, Removed);
+	if (Result > 0 && Node->Children[Index]->Count < ML_ORDERED_MIN) {
+		if (Index > 0 && Node->Children[Index - 1]->Count > ML_ORDERED_MIN) {
+			ml_ordered_borrow_left(Node, Index);
+		} else if (Index < Node->Count && Node->Children[Index + 1]->Count > ML_ORDERED_MIN) {
+			ml_ordered_borrow_right(Node, Index);
+		} else {
+			ml_ordered_merge(Node, Index > 0 ? Index - 1 : Index);
+		}
+	}
+	return Result;
+}
+
+ml_value_t *ml_ordered_search(ml_value_t *Value, ml_value_t *Key) {
+	ml_ordered_t *Map = (ml_ordered_t *)Value;
+	if (!Map->Root) return MLNil;
+	int Index, Found;
+	ml_value_t *Error = 0;
+	ml_ordered_node_t *Leaf = ml_ordered_leaf(Map->Root, Key, &Index, &Found, &Error);
+	if (Error) return Error;
+	return Found ? Leaf->Values[Index] : MLNil;
+}
+
+ml_value_t *ml_ordered_insert(ml_value_t *Value, ml_value_t *Key, ml_value_t *NewValue) {
+	// Returns the previous value for Key, NULL if Key is new or an error if keys could not be compared.
+	ml_ordered_t *Map = (ml_ordered_t *)Value;
+	if (!Map->Root) Map->Root = ml_ordered_node(1);
+	ml_value_t *Old = 0, *Separator;
+	ml_ordered_node_t *Split = 0;
+	int Result = ml_ordered_insert_node(Map->Root, Key, NewValue, &Old, &Split, &Separator);
+	if (Split) {
+		ml_ordered_node_t *Root = ml_ordered_node(0);
+		Root->Count = 1;
+		Root->Keys[0] = Separator;
+		Root->Children[0] = Map->Root;
+		Root->Children[1] = Split;
+		Map->Root = Root;
+	}
+	if (!Result) {
+		++Map->Size;
+		++Map->Version;
+	}
+	return Old;
+}
+
+ml_value_t *ml_ordered_remove(ml_value_t *Value, ml_value_t *Key) {
+	ml_ordered_t *Map = (ml_ordered_t *)Value;
+	if (!Map->Root) return MLNil;
+	ml_value_t *Removed = MLNil;
+	if (ml_ordered_remove_node(Map->Root, Key, &Removed) > 0) {
+		--Map->Size;
+		++Map->Version;
+		if (!Map->Root->Leaf && !Map->Root->Count) Map->Root = Map->Root->Children[0];
+	}
+	return Removed;
+}
+
+int ml_ordered_foreach(ml_value_t *Value, void *Data, int (*callback)(ml_value_t *, ml_value_t *, void *)) {
+	ml_ordered_t *Map = (ml_ordered_t *)Value;
+	if (!Map->Root) return 0;
+	ml_ordered_node_t *Node = Map->Root;
+	while (!Node->Leaf) Node = Node->Children[0];
+	for (; Node; Node = Node->Next) {
+		for (int I = 0; I < Node->Count; ++I) {
+			if (callback(Node->Keys[I], Node->Values[I], Data)) return 1;
+		}
+	}
+	return 0;
+}
+
+typedef struct ml_ordered_pair_t {
+	ml_value_t *Key, *Value;
+} ml_ordered_pair_t;
+
+static ml_value_t *ml_ordered_sort(ml_ordered_pair_t *Pairs, int Count) {
+	// Stable bottom up merge sort, so that the last of several equal keys is the one kept.
+	ml_value_t *Error = 0;
+	int Sorted = 1;
+	for (int I = 1; I < Count && Sorted; ++I) {
+		if (ml_ordered_compare(Pairs[I - 1].Key, Pairs[I].Key, &Error) >= 0) Sorted = 0;
+		if (Error) return Error;
+	}
+	if (Sorted) return NULL;
+	ml_ordered_pair_t *Source = Pairs, *Target = anew(ml_ordered_pair_t, Count);
+	for (int Width = 1; Width < Count; Width *= 2) {
+		for (int Lo = 0; Lo < Count; Lo += 2 * Width) {
+			int Mid = Lo + Width < Count ? Lo + Width : Count;
+			int Hi = Mid + Width < Count ? Mid + Width : Count;
+			int I = Lo, J = Mid, K = Lo;
+			while (I < Mid && J < Hi) {
+				int Compare = ml_ordered_compare(Source[J].Key, Source[I].Key, &Error);
+				if (Error) return Error;
+				Target[K++] = Compare < 0 ? Source[J++] : Source[I++];
+			}
+			while (I < Mid) Target[K++] = Source[I++];
+			while (J < Hi) Target[K++] = Source[J++];
+		}
+		ml_ordered_pair_t *Swap = Source;
+		Source = Target;
+		Target = Swap;
+	}
+	if (Source != Pairs) memcpy(Pairs, Source, Count * sizeof(ml_ordered_pair_t));
+	return NULL;
+}
+
+static ml_value_t *ml_ordered_load(ml_ordered_t *Map, ml_ordered_pair_t *Pairs, int Count) {
+	// Builds the tree bottom up from sorted pairs, one level at a time. Nodes are filled evenly to
+	// just under ML_ORDERED_MAX so that later inserts do not immediately split them.
+	ml_value_t *Error = ml_ordered_sort(Pairs, Count);
+	if (Error) return Error;
+	int Unique = 0;
+	for (int I = 0; I < Count; ++I) {
+		if (Unique && !ml_ordered_compare(Pairs[Unique - 1].Key, Pairs[I].Key, &Error)) {
+			Pairs[Unique - 1] = Pairs[I];
+		} else {
+			Pairs[Unique++] = Pairs[I];
+		}
+		if (Error) return Error;
+	}
+	Count = Map->Size = Unique;
+	if (!Count) return NULL;
+	int Fill = ML_ORDERED_MAX - 1;
+	int NumNodes = (Count + Fill - 1) / Fill;
+	ml_ordered_node_t **Nodes = anew(ml_ordered_node_t *, NumNodes);
+	ml_value_t **Mins = anew(ml_value_t *, NumNodes);
+	ml_ordered_node_t *Prev = 0;
+	for (int I = 0; I < NumNodes; ++I) {
+		int Start = (long)I * Count / NumNodes, End = (long)(I + 1) * Count / NumNodes;
+		ml_ordered_node_t *Node = Nodes[I] = ml_ordered_node(1);
+		Node->Count = End - Start;
+		for (int J = Start; J < End; ++J) {
+			Node->Keys[J - Start] = Pairs[J].Key;
+			Node->Values[J - Start] = Pairs[J].Value;
+		}
+		if ((Node->Prev = Prev)) Prev->Next = Node;
+		Prev = Node;
+		Mins[I] = Pairs[Start].Key;
+	}
+	while (NumNodes > 1) {
+		int NumParents = (NumNodes + ML_ORDERED_MAX - 1) / ML_ORDERED_MAX;
+		for (int I = 0; I < NumParents; ++I) {
+			int Start = (long)I * NumNodes / NumParents, End = (long)(I + 1) * NumNodes / NumParents;
+			ml_ordered_node_t *Node = ml_ordered_node(0);
+			Node->Count = End - Start - 1;
+			for (int J = Start; J < End; ++J) {
+				Node->Children[J - Start] = Nodes[J];
+				if (J > Start) Node->Keys[J - Start - 1] = Mins[J];
+			}
+			ml_value_t *Min = Mins[Start];
+			Nodes[I] = Node;
+			Mins[I] = Min;
+		}
+		NumNodes = NumParents;
+	}
+	Map->Root = Nodes[0];
+	return NULL;
+}
+
+static int ml_ordered_count_pair(ml_value_t *Key, ml_value_t *Value, int *Length) {
+	++Length[0];
+	return 0;
+}
+
+static int ml_ordered_collect_pair(ml_value_t *Key, ml_value_t *Value, ml_ordered_pair_t **Slot) {
+	Slot[0]->Key = Key;
+	Slot[0]->Value = Value;
+	++Slot[0];
+	return 0;
+}
+
+ml_value_t *ml_ordered(void *Data, int Count, ml_value_t **Args) {
+	ml_ordered_t *Map = new(ml_ordered_t);
+	Map->Type = MLOrderedT;
+	if (!Count) return (ml_value_t *)Map;
+	ml_ordered_pair_t *Pairs;
+	int Length;
+	if (ml_typeof(Args[0]) == MLTreeT) {
+		Length = 0;
+		ml_tree_foreach(Args[0], &Length, (void *)ml_ordered_count_pair);
+		Pairs = anew(ml_ordered_pair_t, Length + 1);
+		ml_ordered_pair_t *Next = Pairs;
+		ml_tree_foreach(Args[0], &Next, (void *)ml_ordered_collect_pair);
+	} else if (ml_typeof(Args[0]) == MLListT) {
+		Length = ml_list_length(Args[0]);
+		ml_value_t **Keys = anew(ml_value_t *, Length + 1);
+		ml_list_to_array(Args[0], Keys);
+		ml_value_t **Values = 0;
+		if (Count > 1) {
+			ML_CHECK_ARG_TYPE(1, MLListT);
+			if (ml_list_length(Args[1]) != Length) return ml_error("ValueError", "keys and values must have the same length");
+			Values = anew(ml_value_t *, Length + 1);
+			ml_list_to_array(Args[1], Values);
+		}
+		Pairs = anew(ml_ordered_pair_t, Length + 1);
+		for (int I = 0; I < Length; ++I) {
+			Pairs[I].Key = Keys[I];
+			Pairs[I].Value = Values ? Values[I] : MLNil;
+		}
+	} else {
+		return ml_error("TypeError", "ordered requires a tree or a list of keys");
+	}
+	ml_value_t *Error = ml_ordered_load(Map, Pairs, Length);
+	if (Error) return Error;
+	return (ml_value_t *)Map;
+}
+
+typedef struct ml_ordered_ref_t {
+	const ml_type_t *Type;
+	ml_value_t *Map;
+	ml_value_t *Key;
+} ml_ordered_ref_t;
+
+static ml_value_t *ml_ordered_ref_deref(ml_value_t *Ref) {
+	ml_ordered_ref_t *Reference = (ml_ordered_ref_t *)Ref;
+	return ml_ordered_search(Reference->Map, Reference->Key);
+}
+
+static ml_value_t *ml_ordered_ref_assign(ml_value_t *Ref, ml_value_t *Value) {
+	ml_ordered_ref_t *Reference = (ml_ordered_ref_t *)Ref;
+	ml_value_t *Old = ml_ordered_insert(Reference->Map, Reference->Key, Value);
+	if (Old && ml_typeof(Old) == MLErrorT) return Old;
+	return Value;
+}
+
+ml_type_t MLOrderedRefT[1] = {{
+	MLAnyT, "ordered-reference",
+	ml_default_hash,
+	ml_default_call,
+	ml_ordered_ref_deref,
+	ml_ordered_ref_assign,
+	ml_default_next,
+	ml_default_key
+}};
+
+static ml_value_t *ml_ordered_index(void *Data, int Count, ml_value_t **Args) {
+	ml_ordered_ref_t *Reference = new(ml_ordered_ref_t);
+	Reference->Type = MLOrderedRefT;
+	Reference->Map = Args[0];
+	Reference->Key = Args[1];
+	return (ml_value_t *)Reference;
+}
+
+static ml_value_t *ml_ordered_size(void *Data, int Count, ml_value_t **Args) {
+	return ml_integer(((ml_ordered_t *)Args[0])->Size);
+}
+
+static ml_value_t *ml_ordered_delete(void *Data, int Count, ml_value_t **Args) {
+	return ml_ordered_remove(Args[0], Args[1]);
+}
+
+static ml_value_t *ml_ordered_first(void *Data, int Count, ml_value_t **Args) {
+	ml_ordered_t *Map = (ml_ordered_t *)Args[0];
+	if (!Map->Size) return MLNil;
+	ml_ordered_node_t *Node = Map->Root;
+	while (!Node->Leaf) Node = Node->Children[0];
+	return Node->Keys[0];
+}
+
+static ml_value_t *ml_ordered_last(void *Data, int Count, ml_value_t **Args) {
+	ml_ordered_t *Map = (ml_ordered_t *)Args[0];
+	if (!Map->Size) return MLNil;
+	ml_ordered_node_t *Node = Map->Root;
+	while (!Node->Leaf) Node = Node->Children[Node->Count];
+	return Node->Keys[Node->Count - 1];
+}
+
+static ml_value_t *ml_ordered_floor(void *Data, int Count, ml_value_t **Args) {
+	ml_ordered_t *Map = (ml_ordered_t *)Args[0];
+	if (!Map->Size) return MLNil;
+	int Index, Found;
+	ml_value_t *Error = 0;
+	ml_ordered_node_t *Leaf = ml_ordered_leaf(Map->Root, Args[1], &Index, &Found, &Error);
+	if (Error) return Error;
+	if (Found) return Leaf->Keys[Index];
+	if (Index > 0) return Leaf->Keys[Index - 1];
+	return Leaf->Prev ? Leaf->Prev->Keys[Leaf->Prev->Count - 1] : MLNil;
+}
+
+static ml_value_t *ml_ordered_ceiling(void *Data, int Count, ml_value_t **Args) {
+	ml_ordered_t *Map = (ml_ordered_t *)Args[0];
+	if (!Map->Size) return MLNil;
+	int Index, Found;
+	ml_value_t *Error = 0;
+	ml_ordered_node_t *Leaf = ml_ordered_leaf(Map->Root, Args[1], &Index, &Found, &Error);
+	if (Error) return Error;
+	if (Index < Leaf->Count) return Leaf->Keys[Index];
+	return Leaf->Next ? Leaf->Next->Keys[0] : MLNil;
+}
+
+// Iterators remember the map's version along with their position. Inserting or removing a key can
+// shift, split or merge leaves, so once the version changes the iterator finds its current key again
+// by searching from the root; keys can be deleted (including the current one) or added while
+// iterating and the iteration carries on from the next key still in the map.
+
+typedef struct ml_ordered_iter_t {
+	const ml_type_t *Type;
+	ml_ordered_t *Map;
+	ml_ordered_node_t *Leaf;
+	ml_value_t *Key, *Limit;
+	int Index, Version, Found;
+} ml_ordered_iter_t;
+
+static int ml_ordered_iter_current(ml_ordered_iter_t *Iter) {
+	// Returns 1 if the current key is still in the map, leaving Leaf and Index on it or else on the next key.
+	ml_ordered_t *Map = Iter->Map;
+	if (Iter->Version != Map->Version) {
+		ml_value_t *Error = 0;
+		Iter->Leaf = ml_ordered_leaf(Map->Root, Iter->Key, &Iter->Index, &Iter->Found, &Error);
+		if (Error) Iter->Found = 0;
+		Iter->Version = Map->Version;
+	}
+	return Iter->Found;
+}
+
+static ml_value_t *ml_ordered_iter_deref(ml_value_t *Ref) {
+	ml_ordered_iter_t *Iter = (ml_ordered_iter_t *)Ref;
+	if (!ml_ordered_iter_current(Iter)) return MLNil;
+	return Iter->Leaf->Values[Iter->Index];
+}
+
+static ml_value_t *ml_ordered_iter_assign(ml_value_t *Ref, ml_value_t *Value) {
+	ml_ordered_iter_t *Iter = (ml_ordered_iter_t *)Ref;
+	if (!ml_ordered_iter_current(Iter)) return ml_error("KeyError", "ordered map entry was deleted during iteration");
+	return Iter->Leaf->Values[Iter->Index] = Value;
+}
+
+static ml_value_t *ml_ordered_iter_check(ml_ordered_iter_t *Iter) {
+	while (Iter->Index >= Iter->Leaf->Count) {
+		if (!(Iter->Leaf = Iter->Leaf->Next)) return MLNil;
+		Iter->Index = 0;
+	}
+	Iter->Key = Iter->Leaf->Keys[Iter->Index];
+	Iter->Found = 1;
+	if (Iter->Limit) {
+		ml_value_t *Error = 0;
+		int Compare = ml_ordered_compare(Iter->Key, Iter->Limit, &Error);
+		if (Error) return Error;
+		if (Compare > 0) return MLNil;
+	}
+	return (ml_value_t *)Iter;
+}
+
+static ml_value_t *ml_ordered_iter_next(ml_value_t *Ref) {
+	ml_ordered_iter_t *Iter = (ml_ordered_iter_t *)Ref;
+	if (ml_ordered_iter_current(Iter)) ++Iter->Index;
+	return ml_ordered_iter_check(Iter);
+}
+
+static ml_value_t *ml_ordered_iter_key(ml_value_t *Ref) {
+	ml_ordered_iter_t *Iter = (ml_ordered_iter_t *)Ref;
+	return Iter->Key;
+}
+
+ml_type_t MLOrderedIterT[1] = {{
+	MLAnyT, "ordered-iterator",
+	ml_default_hash,
+	ml_default_call,
+	ml_ordered_iter_deref,
+	ml_ordered_iter_assign,
+	ml_ordered_iter_next,
+	ml_ordered_iter_key
+}};
+
+static ml_value_t *ml_ordered_iterate(ml_ordered_t *Map, ml_value_t *Start, ml_value_t *Limit) {
+	// Returns an iterator over the keys from Start to Limit inclusive, where nil means unbounded.
+	if (!Map->Size) return MLNil;
+	ml_ordered_iter_t *Iter = new(ml_ordered_iter_t);
+	Iter->Type = MLOrderedIterT;
+	Iter->Map = Map;
+	Iter->Version = Map->Version;
+	Iter->Limit = Limit != MLNil ? Limit : 0;
+	if (Start != MLNil) {
+		int Found;
+		ml_value_t *Error = 0;
+		Iter->Leaf = ml_ordered_leaf(Map->Root, Start, &Iter->Index, &Found, &Error);
+		if (Error) return Error;
+	} else {
+		ml_ordered_node_t *Node = Map->Root;
+		while (!Node->Leaf) Node = Node->Children[0];
+		Iter->Leaf = Node;
+		Iter->Index = 0;
+	}
+	return ml_ordered_iter_check(Iter);
+}
+
+static ml_value_t *ml_ordered_values(void *Data, int Count, ml_value_t **Args) {
+	return ml_ordered_iterate((ml_ordered_t *)Args[0], MLNil, MLNil);
+}
+
+typedef struct ml_ordered_range_t {
+	const ml_type_t *Type;
+	ml_ordered_t *Map;
+	ml_value_t *Start, *Limit;
+} ml_ordered_range_t;
+
+ml_type_t MLOrderedRangeT[1] = {{
+	MLAnyT, "ordered-range",
+	ml_default_hash,
+	ml_default_call,
+	ml_default_deref,
+	ml_default_assign,
+	ml_default_next,
+	ml_default_key
+}};
+
+static ml_value_t *ml_ordered_range(void *Data, int Count, ml_value_t **Args) {
+	ml_ordered_range_t *Range = new(ml_ordered_range_t);
+	Range->Type = MLOrderedRangeT;
+	Range->Map = (ml_ordered_t *)Args[0];
+	Range->Start = Args[1];
+	Range->Limit = Args[2];
+	return (ml_value_t *)Range;
+}
+
+static ml_value_t *ml_ordered_range_values(void *Data, int Count, ml_value_t **Args) {
+	ml_ordered_range_t *Range = (ml_ordered_range_t *)Args[0];
+	return ml_ordered_iterate(Range->Map, Range->Start, Range->Limit);
+}
+
+typedef struct ml_ordered_stringer_t {
+	ml_stringbuffer_t *Buffer;
+	int Space;
+} ml_ordered_stringer_t;
+
+static int ml_ordered_stringer(ml_value_t *Key, ml_value_t *Value, ml_ordered_stringer_t *Stringer) {
+	if (Stringer->Space) ml_stringbuffer_add(Stringer->Buffer, " ", 1);
+	ml_inline(AppendMethod, 2, Stringer->Buffer, Key);
+	if (Value != MLNil) {
+		ml_stringbuffer_add(Stringer->Buffer, "=", 1);
+		ml_inline(AppendMethod, 2, Stringer->Buffer, Value);
+	}
+	Stringer->Space = 1;
+	return 0;
+}
+
+static ml_value_t *ml_ordered_append(void *Data, int Count, ml_value_t **Args) {
+	ml_ordered_stringer_t Stringer[1] = {{(ml_stringbuffer_t *)Args[0], 0}};
+	ml_ordered_foreach(Args[1], Stringer, (void *)ml_ordered_stringer);
+	return ((ml_ordered_t *)Args[1])->Size ? MLSome : MLNil;
+}
+
+void ml_ordered_init() {
+	CompareMethod = ml_method("?");
+	AppendMethod = ml_method("append");
+	ml_method_by_name("size", 0, ml_ordered_size, MLOrderedT, NULL);
+	ml_method_by_name("[]", 0, ml_ordered_index, MLOrderedT, MLAnyT, NULL);
+	ml_method_by_name("delete", 0, ml_ordered_delete, MLOrderedT, MLAnyT, NULL);
+	ml_method_by_name("first", 0, ml_ordered_first, MLOrderedT, NULL);
+	ml_method_by_name("last", 0, ml_ordered_last, MLOrderedT, NULL);
+	ml_method_by_name("floor", 0, ml_ordered_floor, MLOrderedT, MLAnyT, NULL);
+	ml_method_by_name("ceiling", 0, ml_ordered_ceiling, MLOrderedT, MLAnyT, NULL);
+	ml_method_by_name("range", 0, ml_ordered_range, MLOrderedT, MLAnyT, MLAnyT, NULL);
+	ml_method_by_name("values", 0, ml_ordered_values, MLOrderedT, NULL);
+	ml_method_by_name("values", 0, ml_ordered_range_values, MLOrderedRangeT, NULL);
+	ml_method_by_value(AppendMethod, 0, ml_ordered_append, MLStringBufferT, MLOrderedT, NULL);
+}
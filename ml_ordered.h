@@ -0,0 +1,16 @@
+#ifndef ML_ORDERED_H
+#define ML_ORDERED_H
+
+#include "minilang.h"
+
+void ml_ordered_init();
+
+ml_value_t *ml_ordered(void *Data, int Count, ml_value_t **Args);
+ml_value_t *ml_ordered_search(ml_value_t *Map, ml_value_t *Key);
+ml_value_t *ml_ordered_insert(ml_value_t *Map, ml_value_t *Key, ml_value_t *Value);
+ml_value_t *ml_ordered_remove(ml_value_t *Map, ml_value_t *Key);
+int ml_ordered_foreach(ml_value_t *Map, void *Data, int (*callback)(ml_value_t *, ml_value_t *, void *));
+
+extern ml_type_t MLOrderedT[];
+
+#endif
@@ -3,6 +3,7 @@
 #include <gc.h>
 #include <stdio.h>
 #include <math.h>
+#include <string.h>
 
 #define new(T) ((T *)GC_MALLOC(sizeof(T)))
 #define anew(T, N) ((T *)GC_MALLOC((N) * sizeof(T)))
@@ -10,6 +11,7 @@
 #define xnew(T, N, U) ((T *)GC_MALLOC(sizeof(T) + (N) * sizeof(U)))
 
 #define TIME_GREATER(Time1, Time2) (Time1->tv_sec == Time2->tv_sec ? Time1->tv_nsec > Time2->tv_nsec : Time1->tv_sec > Time2->tv_sec)
+#define TIME_NSEC(Time) ((Time)->tv_sec * 1000000000L + (Time)->tv_nsec)
 
 struct ra_event_t {
 	const ml_type_t *Type;
@@ -37,10 +39,39 @@ ml_type_t RaEventT[1] = {{
 	ml_default_key
 }};
 
+static int VirtualClock = 0;
+static long VirtualTime = 0;
+
+void ra_clock_now(struct timespec *Time) {
+	if (VirtualClock) {
+		long Now = __atomic_load_n(&VirtualTime, __ATOMIC_ACQUIRE);
+		Time->tv_sec = Now / 1000000000L;
+		Time->tv_nsec = Now % 1000000000L;
+	} else {
+		clock_gettime(CLOCK_REALTIME, Time);
+	}
+}
+
+void ra_clock_virtual(struct timespec *Start) {
+	__atomic_store_n(&VirtualTime, TIME_NSEC(Start), __ATOMIC_RELEASE);
+	VirtualClock = 1;
+}
+
+ml_value_t *ra_clock_value(void *Data, int Count, ml_value_t **Args) {
+	struct timespec Time[1];
+	ra_clock_now(Time);
+	return ml_real(Time->tv_sec + Time->tv_nsec / 1000000000.0);
+}
+
 static ra_event_t *Events = 0;
 static ra_action_t *Actions = 0, **ActionSlot = &Actions, *ActionCache = 0;
 static int Running = 1;
 
+#define RA_LATENESS_BUCKETS 32
+
+static struct timespec SliceBudget[1] = {{0, 10000000}};
+static unsigned long Lateness[RA_LATENESS_BUCKETS] = {0,};
+
 static pthread_mutex_t EventsLock[1] = {PTHREAD_MUTEX_INITIALIZER};
 static pthread_cond_t ActionAvailable[1] = {PTHREAD_COND_INITIALIZER};
 
@@ -51,7 +82,7 @@ ra_event_t *ra_event_create(ml_value_t *Function, int Count, ml_value_t **Args,
 	Event->Count = Count;
 	Event->Args = Args;
 	if ((Event->Recur = Recur)) {
-		clock_gettime(CLOCK_REALTIME, Event->Time);
+		ra_clock_now(Event->Time);
 		Event->Time[1] = Time[0];
 	} else {
 		Event->Time[0] = Time[0];
@@ -83,10 +114,10 @@ void ra_event_adjust(ra_event_t *Event, struct timespec *Time) {
 static ml_value_t *ra_event_adjust_callback(void *Data, int Count, ml_value_t **Args) {
 	ra_event_t *Event = (ra_event_t *)Args[0];
 	struct timespec Time[1];
-	clock_gettime(CLOCK_REALTIME, Time);
-	if (Args[1]->Type == MLIntegerT) {
+	ra_clock_now(Time);
+	if (ml_typeof(Args[1]) == MLIntegerT) {
 		Time->tv_sec += ml_integer_value(Args[1]);
-	} else if (Args[1]->Type == MLRealT) {
+	} else if (ml_typeof(Args[1]) == MLRealT) {
 		double Whole, Frac = modf(ml_real_value(Args[1]), &Whole);
 		Time->tv_sec += Whole;
 		Time->tv_nsec += Frac * 1000000000.0;
@@ -124,57 +155,389 @@ void ra_action_enqueue(ml_value_t *Function, int Count, ml_value_t **Args) {
 	pthread_mutex_unlock(EventsLock);
 }
 
+static void ra_error_print(ml_value_t *Error) {
+	printf("\e[31mError: %s\n\e[0m", ml_error_message(Error));
+	const char *Source;
+	int Line;
+	for (int I = 0; ml_error_trace(Error, I, &Source, &Line); ++I) printf("\e[31m\t%s:%d\n\e[0m", Source, Line);
+}
+
+static long HandlerTicks = 0, HandlerTime = 0;
+static unsigned long Timeouts = 0;
+
+static ml_value_t *ra_events_call(ml_value_t *Function, int Count, ml_value_t **Args) {
+	ml_fuel_set(HandlerTicks, HandlerTime);
+	ml_value_t *Result = ml_coroutine_call(Function, Count, Args);
+	ml_fuel_clear();
+	if (ml_typeof(Result) == MLErrorT && !strcmp(ml_error_type(Result), "TimeoutError")) ++Timeouts;
+	return Result;
+}
+
+typedef struct ra_periodic_group_t ra_periodic_group_t;
+typedef struct ra_periodic_link_t ra_periodic_link_t;
+
+// A periodic timer belongs to exactly one group at a time, named by Timer->Group. Groups hold links
+// to their timers rather than the timers themselves so that a timer can move to another group while
+// its old group is firing; the stale link is dropped the next time the old group fires.
+
+struct ra_periodic_t {
+	const ml_type_t *Type;
+	ra_periodic_group_t *Group;
+	ml_value_t *Function;
+	ml_value_t **Args;
+	long Start;
+	int Count, Cancelled;
+	ra_periodic_policy_t Policy;
+};
+
+struct ra_periodic_link_t {
+	ra_periodic_link_t *Next;
+	ra_periodic_t *Timer;
+};
+
+struct ra_periodic_group_t {
+	ra_periodic_group_t *Next;
+	ra_event_t *Event;
+	ra_periodic_link_t *Links;
+	long Period, Phase;
+};
+
+ml_type_t RaPeriodicT[1] = {{
+	MLAnyT, "periodic",
+	ml_default_hash,
+	ml_default_call,
+	ml_default_deref,
+	ml_default_assign,
+	ml_default_next,
+	ml_default_key
+}};
+
+static ra_periodic_group_t *PeriodicGroups = 0;
+static pthread_mutex_t PeriodicLock[1] = {PTHREAD_MUTEX_INITIALIZER};
+
+static ml_value_t *ra_periodic_call(ra_periodic_t *Timer, long Ticks) {
+	ml_value_t *Result = MLNil;
+	switch (Timer->Policy) {
+	case RA_PERIODIC_SKIP:
+		if (Ticks == 1) Result = ra_events_call(Timer->Function, Timer->Count, Timer->Args);
+		break;
+	case RA_PERIODIC_ONCE:
+		Result = ra_events_call(Timer->Function, Timer->Count, Timer->Args);
+		break;
+	case RA_PERIODIC_ALL:
+		while (Result == MLNil && --Ticks >= 0) Result = ra_events_call(Timer->Function, Timer->Count, Timer->Args);
+		break;
+	}
+	if (ml_typeof(Result) == MLErrorT) ra_error_print(Result);
+	if (ml_typeof(Result) == MLSuspensionT) return MLNil;
+	return Result;
+}
+
+static ml_value_t *ra_periodic_group_fire(void *Data, int Count, ml_value_t **Args) {
+	ra_periodic_group_t *Group = (ra_periodic_group_t *)Data;
+	struct timespec Time[1];
+	ra_clock_now(Time);
+	long Scheduled = TIME_NSEC(Group->Event->Time);
+	long Ticks = (TIME_NSEC(Time) - Scheduled) / Group->Period + 1;
+	pthread_mutex_lock(PeriodicLock);
+	ra_periodic_link_t *Link = Group->Links;
+	pthread_mutex_unlock(PeriodicLock);
+	for (; Link; Link = Link->Next) {
+		ra_periodic_t *Timer = Link->Timer;
+		if (Timer->Cancelled || Timer->Group != Group) continue;
+		// Ticks scheduled before the timer joined the group are not its own.
+		long Skipped = Timer->Start > Scheduled ? (Timer->Start - Scheduled + Group->Period - 1) / Group->Period : 0;
+		if (Skipped >= Ticks) continue;
+		if (ra_periodic_call(Timer, Ticks - Skipped) != MLNil) Timer->Cancelled = 1;
+	}
+	pthread_mutex_lock(PeriodicLock);
+	ra_periodic_link_t **Slot = &Group->Links;
+	while (Slot[0]) {
+		ra_periodic_t *Timer = Slot[0]->Timer;
+		if (Timer->Cancelled || Timer->Group != Group) Slot[0] = Slot[0]->Next; else Slot = &Slot[0]->Next;
+	}
+	if (Group->Links) {
+		long Next = Scheduled + Ticks * Group->Period;
+		Time->tv_sec = Next / 1000000000L;
+		Time->tv_nsec = Next % 1000000000L;
+		ra_event_adjust(Group->Event, Time);
+	} else {
+		ra_periodic_group_t **GroupSlot = &PeriodicGroups;
+		while (GroupSlot[0] != Group) GroupSlot = &GroupSlot[0]->Next;
+		GroupSlot[0] = Group->Next;
+	}
+	pthread_mutex_unlock(PeriodicLock);
+	return MLNil;
+}
+
+static ml_value_t *ra_periodic_first(void *Data, int Count, ml_value_t **Args) {
+	ra_periodic_t *Timer = (ra_periodic_t *)Data;
+	if (!Timer->Cancelled && ra_periodic_call(Timer, 1) != MLNil) ra_periodic_cancel(Timer);
+	return MLNil;
+}
+
+static void ra_periodic_join(ra_periodic_t *Timer, ra_periodic_group_t *Group, long First) {
+	// Called with PeriodicLock held. First is the time of the group's first tick if the group is new.
+	ra_periodic_link_t *Link = new(ra_periodic_link_t);
+	Link->Timer = Timer;
+	Link->Next = Group->Links;
+	Group->Links = Link;
+	Timer->Group = Group;
+	if (!Group->Event) {
+		struct timespec Time[1];
+		Time->tv_sec = First / 1000000000L;
+		Time->tv_nsec = First % 1000000000L;
+		Group->Next = PeriodicGroups;
+		PeriodicGroups = Group;
+		Group->Event = ra_event_create(ml_function(Group, ra_periodic_group_fire), 0, 0, Time, 0);
+	}
+}
+
+ra_periodic_t *ra_periodic_create(ml_value_t *Function, int Count, ml_value_t **Args, struct timespec *Period, struct timespec *Phase, ra_periodic_policy_t Policy) {
+	ra_periodic_t *Timer = new(ra_periodic_t);
+	Timer->Type = RaPeriodicT;
+	Timer->Function = Function;
+	Timer->Count = Count;
+	Timer->Args = Args;
+	Timer->Policy = Policy;
+	long PeriodNs = TIME_NSEC(Period);
+	struct timespec Time[1];
+	ra_clock_now(Time);
+	long Now = TIME_NSEC(Time);
+	pthread_mutex_lock(PeriodicLock);
+	ra_periodic_group_t *Group = PeriodicGroups;
+	if (Phase) {
+		long PhaseNs = TIME_NSEC(Phase) % PeriodNs;
+		while (Group && (Group->Period != PeriodNs || Group->Phase != PhaseNs)) Group = Group->Next;
+		if (!Group) {
+			Group = new(ra_periodic_group_t);
+			Group->Period = PeriodNs;
+			Group->Phase = PhaseNs;
+		}
+		Timer->Start = Now;
+	} else {
+		// Unaligned timers share any group with the same period, but skip that group's ticks until a
+		// full period has passed so the first tick after the immediate call is never early.
+		while (Group && Group->Period != PeriodNs) Group = Group->Next;
+		if (!Group) {
+			Group = new(ra_periodic_group_t);
+			Group->Period = PeriodNs;
+			Group->Phase = Now % PeriodNs;
+		}
+		Timer->Start = Now + PeriodNs;
+		ra_event_create(ml_function(Timer, ra_periodic_first), 0, 0, Time, 0);
+	}
+	long Next = Now - (Now - Group->Phase) % PeriodNs + PeriodNs;
+	if (Phase && Next - PeriodNs == Now) Next = Now;
+	ra_periodic_join(Timer, Group, Next);
+	pthread_mutex_unlock(PeriodicLock);
+	return Timer;
+}
+
+void ra_periodic_adjust(ra_periodic_t *Timer, struct timespec *Time) {
+	// Moves the timer's next tick to Time, keeping its period. The timer joins the group with the
+	// matching phase, creating one if needed, and leaves its old group.
+	long First = TIME_NSEC(Time);
+	pthread_mutex_lock(PeriodicLock);
+	long PeriodNs = Timer->Group->Period, PhaseNs = First % PeriodNs;
+	ra_periodic_group_t *Group = PeriodicGroups;
+	while (Group && (Group->Period != PeriodNs || Group->Phase != PhaseNs)) Group = Group->Next;
+	Timer->Start = First;
+	if (Group != Timer->Group) {
+		if (!Group) {
+			Group = new(ra_periodic_group_t);
+			Group->Period = PeriodNs;
+			Group->Phase = PhaseNs;
+		}
+		ra_periodic_join(Timer, Group, First);
+	}
+	pthread_mutex_unlock(PeriodicLock);
+}
+
+static ml_value_t *ra_periodic_adjust_callback(void *Data, int Count, ml_value_t **Args) {
+	ra_periodic_t *Timer = (ra_periodic_t *)Args[0];
+	struct timespec Time[1];
+	ra_clock_now(Time);
+	if (ml_typeof(Args[1]) == MLIntegerT) {
+		Time->tv_sec += ml_integer_value(Args[1]);
+	} else if (ml_typeof(Args[1]) == MLRealT) {
+		double Whole, Frac = modf(ml_real_value(Args[1]), &Whole);
+		Time->tv_sec += Whole;
+		Time->tv_nsec += Frac * 1000000000.0;
+		if (Time->tv_nsec >= 1000000000) {
+			Time->tv_sec += 1;
+			Time->tv_nsec -= 1000000000;
+		}
+	}
+	ra_periodic_adjust(Timer, Time);
+	return Args[0];
+}
+
+void ra_periodic_cancel(ra_periodic_t *Timer) {
+	Timer->Cancelled = 1;
+}
+
+static ml_value_t *ra_periodic_cancel_callback(void *Data, int Count, ml_value_t **Args) {
+	ra_periodic_cancel((ra_periodic_t *)Args[0]);
+	return MLNil;
+}
+
+static ml_value_t *ra_sleep_resume(void *Data, int Count, ml_value_t **Args) {
+	return ml_resume((ml_value_t *)Data, MLNil);
+}
+
+ml_value_t *ra_events_sleep(void *Data, int Count, ml_value_t **Args) {
+	ML_CHECK_ARG_COUNT(1);
+	struct timespec Time[1];
+	ra_clock_now(Time);
+	if (ml_typeof(Args[0]) == MLIntegerT) {
+		Time->tv_sec += ml_integer_value(Args[0]);
+	} else if (ml_typeof(Args[0]) == MLRealT) {
+		double Whole, Frac = modf(ml_real_value(Args[0]), &Whole);
+		Time->tv_sec += Whole;
+		Time->tv_nsec += Frac * 1000000000.0;
+		if (Time->tv_nsec >= 1000000000) {
+			Time->tv_sec += 1;
+			Time->tv_nsec -= 1000000000;
+		}
+	} else {
+		return ml_error("ParamError", "time delay must be a number");
+	}
+	ml_value_t *Suspension = ml_suspend();
+	ra_event_create(ml_function(Suspension, ra_sleep_resume), 0, 0, Time, 0);
+	return Suspension;
+}
+
+void ra_events_set_budget(struct timespec *Budget) {
+	pthread_mutex_lock(EventsLock);
+	SliceBudget[0] = Budget[0];
+	pthread_mutex_unlock(EventsLock);
+}
+
+ml_value_t *ra_events_budget(void *Data, int Count, ml_value_t **Args) {
+	ML_CHECK_ARG_COUNT(1);
+	struct timespec Budget[1];
+	if (ml_typeof(Args[0]) == MLIntegerT) {
+		Budget->tv_sec = ml_integer_value(Args[0]);
+		Budget->tv_nsec = 0;
+	} else if (ml_typeof(Args[0]) == MLRealT) {
+		double Whole, Frac = modf(ml_real_value(Args[0]), &Whole);
+		Budget->tv_sec = Whole;
+		Budget->tv_nsec = Frac * 1000000000.0;
+	} else {
+		return ml_error("ParamError", "time budget must be a number");
+	}
+	if (Budget->tv_sec < 0 || Budget->tv_nsec < 0) return ml_error("ParamError", "time budget must not be negative");
+	ra_events_set_budget(Budget);
+	return MLNil;
+}
+
+static void ra_lateness_record(struct timespec *Scheduled, struct timespec *Actual) {
+	long Micros = (Actual->tv_sec - Scheduled->tv_sec) * 1000000 + (Actual->tv_nsec - Scheduled->tv_nsec) / 1000;
+	int Bucket = Micros > 0 ? 64 - __builtin_clzl(Micros) : 0;
+	if (Bucket >= RA_LATENESS_BUCKETS) Bucket = RA_LATENESS_BUCKETS - 1;
+	++Lateness[Bucket];
+}
+
+ml_value_t *ra_events_lateness(void *Data, int Count, ml_value_t **Args) {
+	ml_value_t *Counts = ml_list();
+	for (int I = 0; I < RA_LATENESS_BUCKETS; ++I) ml_list_append(Counts, ml_integer(Lateness[I]));
+	return Counts;
+}
+
+void ra_events_set_fuel(long Ticks, long Nanoseconds) {
+	pthread_mutex_lock(EventsLock);
+	HandlerTicks = Ticks;
+	HandlerTime = Nanoseconds;
+	pthread_mutex_unlock(EventsLock);
+}
+
+ml_value_t *ra_events_fuel(void *Data, int Count, ml_value_t **Args) {
+	ML_CHECK_ARG_COUNT(1);
+	long Ticks = 0, Nanoseconds = 0;
+	if (ml_typeof(Args[0]) == MLIntegerT) {
+		Ticks = ml_integer_value(Args[0]);
+	} else if (Args[0] != MLNil) {
+		return ml_error("ParamError", "instruction limit must be an integer or nil");
+	}
+	if (Count > 1) {
+		if (ml_typeof(Args[1]) == MLIntegerT) {
+			Nanoseconds = ml_integer_value(Args[1]) * 1000000000;
+		} else if (ml_typeof(Args[1]) == MLRealT) {
+			Nanoseconds = ml_real_value(Args[1]) * 1000000000.0;
+		} else if (Args[1] != MLNil) {
+			return ml_error("ParamError", "time limit must be a number or nil");
+		}
+	}
+	if (Ticks < 0 || Nanoseconds < 0) return ml_error("ParamError", "limits must not be negative");
+	ra_events_set_fuel(Ticks, Nanoseconds);
+	return MLNil;
+}
+
+ml_value_t *ra_events_timeouts(void *Data, int Count, ml_value_t **Args) {
+	return ml_integer(Timeouts);
+}
+
 void ra_events_init() {
 	ml_method_by_name("adjust", 0, ra_event_adjust_callback, RaEventT, MLNumberT, 0);
 	ml_method_by_name("cancel", 0, ra_event_cancel_callback, RaEventT, 0);
+	ml_method_by_name("adjust", 0, ra_periodic_adjust_callback, RaPeriodicT, MLNumberT, 0);
+	ml_method_by_name("cancel", 0, ra_periodic_cancel_callback, RaPeriodicT, 0);
 }
 
 void *ra_events_loop(void *Data) {
 	pthread_mutex_lock(EventsLock);
 	while (Running) {
-		ra_action_t *Action;
-		while ((Action = Actions)) {
-			Actions = 0;
-			ActionSlot = &Actions;
-			while (Action) {
-				ra_action_t *NextAction = Action->Next;
-				pthread_mutex_unlock(EventsLock);
-				ml_value_t *Result = ml_call(Action->Function, Action->Count, Action->Args);
-				if (Result->Type == MLErrorT) {
-					printf("\e[31mError: %s\n\e[0m", ml_error_message(Result));
-					const char *Source;
-					int Line;
-					for (int I = 0; ml_error_trace(Result, I, &Source, &Line); ++I) printf("\e[31m\t%s:%d\n\e[0m", Source, Line);
+		struct timespec Time[1], Deadline[1];
+		ra_clock_now(Time);
+		ra_event_t *Event;
+		while ((Event = Events) && !TIME_GREATER(Event->Time, Time)) {
+			Events = Event->Next;
+			pthread_mutex_unlock(EventsLock);
+			struct timespec Fired[1];
+			ra_clock_now(Fired);
+			ra_lateness_record(Event->Time, Fired);
+			ml_value_t *Result = ra_events_call(Event->Function, Event->Count, Event->Args);
+			if (ml_typeof(Result) == MLErrorT) ra_error_print(Result);
+			pthread_mutex_lock(EventsLock);
+			if (Event->Recur && Result == MLNil) {
+				Event->Time->tv_sec += Event->Time[1].tv_sec;
+				Event->Time->tv_nsec += Event->Time[1].tv_nsec;
+				if (Event->Time->tv_nsec >= 1000000000) {
+					Event->Time->tv_sec += 1;
+					Event->Time->tv_nsec -= 1000000000;
 				}
-				pthread_mutex_lock(EventsLock);
-				Action->Next = ActionCache;
-				ActionCache = Action;
-				Action = NextAction;
+				ra_event_t **Slot = &Events;
+				while (Slot[0] && TIME_GREATER(Event->Time, Slot[0]->Time)) Slot = &Slot[0]->Next;
+				Event->Next = Slot[0];
+				Slot[0] = Event;
 			}
 		}
-		ra_event_t *Event = Events;
-		if (Event) {
-			struct timespec Time[1];
-			clock_gettime(CLOCK_REALTIME, Time);
-			if (TIME_GREATER(Time, Event->Time)) {
-				Events = Event->Next;
-				pthread_mutex_unlock(EventsLock);
-				ml_value_t *Result = ml_call(Event->Function, Event->Count, Event->Args);
-				if (Result->Type == MLErrorT) {
-					printf("\e[31mError: %s\n\e[0m", ml_error_message(Result));
-					const char *Source;
-					int Line;
-					for (int I = 0; ml_error_trace(Result, I, &Source, &Line); ++I) printf("\e[31m\t%s:%d\n\e[0m", Source, Line);
-				}
-				pthread_mutex_lock(EventsLock);
-				if (Event->Recur && Result == MLNil) {
-					Event->Time->tv_sec += Event->Time[1].tv_sec;
-					Event->Time->tv_nsec += Event->Time[1].tv_nsec;
-					ra_event_t **Slot = &Events;
-					while (Slot[0] && TIME_GREATER(Time, Slot[0]->Time)) Slot = &Slot[0]->Next;
-					Event->Next = Slot[0];
-					Slot[0] = Event;
-				}
+		Deadline->tv_sec = Time->tv_sec + SliceBudget->tv_sec;
+		Deadline->tv_nsec = Time->tv_nsec + SliceBudget->tv_nsec;
+		if (Deadline->tv_nsec >= 1000000000) {
+			Deadline->tv_sec += 1;
+			Deadline->tv_nsec -= 1000000000;
+		}
+		ra_action_t *Action;
+		while ((Action = Actions)) {
+			if (!(Actions = Action->Next)) ActionSlot = &Actions;
+			pthread_mutex_unlock(EventsLock);
+			ml_value_t *Result = ra_events_call(Action->Function, Action->Count, Action->Args);
+			if (ml_typeof(Result) == MLErrorT) ra_error_print(Result);
+			pthread_mutex_lock(EventsLock);
+			Action->Function = 0;
+			Action->Args = 0;
+			Action->Next = ActionCache;
+			ActionCache = Action;
+			ra_clock_now(Time);
+			if (!TIME_GREATER(Deadline, Time)) break;
+		}
+		if (Actions) continue;
+		if ((Event = Events)) {
+			if (!TIME_GREATER(Event->Time, Time)) continue;
+			if (VirtualClock) {
+				__atomic_store_n(&VirtualTime, TIME_NSEC(Event->Time), __ATOMIC_RELEASE);
 			} else {
 				pthread_cond_timedwait(ActionAvailable, EventsLock, Event->Time);
 			}
@@ -6,12 +6,34 @@
 
 typedef struct ra_event_t ra_event_t;
 typedef struct ra_action_t ra_action_t;
+typedef struct ra_periodic_t ra_periodic_t;
+
+typedef enum {RA_PERIODIC_SKIP, RA_PERIODIC_ONCE, RA_PERIODIC_ALL} ra_periodic_policy_t;
+
+void ra_clock_now(struct timespec *Time);
+void ra_clock_virtual(struct timespec *Start);
+ml_value_t *ra_clock_value(void *Data, int Count, ml_value_t **Args);
 
 void ra_action_enqueue(ml_value_t *Function, int Count, ml_value_t **Args);
 
 ra_event_t *ra_event_create(ml_value_t *Function, int Count, ml_value_t **Args, struct timespec *Time, int Recur);
 void ra_event_adjust(ra_event_t *Event, struct timespec *Time);
 void ra_event_delete(ra_event_t *Event);
+
+ra_periodic_t *ra_periodic_create(ml_value_t *Function, int Count, ml_value_t **Args, struct timespec *Period, struct timespec *Phase, ra_periodic_policy_t Policy);
+void ra_periodic_adjust(ra_periodic_t *Timer, struct timespec *Time);
+void ra_periodic_cancel(ra_periodic_t *Timer);
+
+ml_value_t *ra_events_sleep(void *Data, int Count, ml_value_t **Args);
+
+void ra_events_set_budget(struct timespec *Budget);
+ml_value_t *ra_events_budget(void *Data, int Count, ml_value_t **Args);
+ml_value_t *ra_events_lateness(void *Data, int Count, ml_value_t **Args);
+
+void ra_events_set_fuel(long Ticks, long Nanoseconds);
+ml_value_t *ra_events_fuel(void *Data, int Count, ml_value_t **Args);
+ml_value_t *ra_events_timeouts(void *Data, int Count, ml_value_t **Args);
+
 void ra_events_init();
 void *ra_events_loop(void *Data);
 
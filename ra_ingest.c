@@ -0,0 +1,457 @@
+#include "ra_ingest.h"
+#include "ra_io.h"
+#include "ra_events.h"
+#include "ra_schema.h"
+#include <gc.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define new(T) ((T *)GC_MALLOC(sizeof(T)))
+#define anew(T, N) ((T *)GC_MALLOC((N) * sizeof(T)))
+#define snew(N) ((char *)GC_MALLOC_ATOMIC(N))
+#define xnew(T, N, U) ((T *)GC_MALLOC(sizeof(T) + (N) * sizeof(U)))
+
+#define RA_INGEST_BUFFER_SIZE 262144
+#define RA_INGEST_MAX_RECORD (16 << 20)
+#define RA_INGEST_MAX_NAMES 256
+#define RA_INGEST_FIELD_CACHE 256
+
+typedef struct ra_ingest_record_t ra_ingest_record_t;
+typedef struct ra_ingest_batch_t ra_ingest_batch_t;
+typedef struct ra_ingest_connection_t ra_ingest_connection_t;
+
+struct ra_ingest_record_t {
+	const char *Schema;
+	const char **Names;
+	ml_value_t **Values;
+	int Op, NumKeys, NumFields;
+};
+
+struct ra_ingest_batch_t {
+	ra_ingest_record_t *Records;
+	int Count, Size;
+};
+
+struct ra_ingest_connection_t {
+	char *Buffer;
+	size_t Size, Pending;
+	int Text, NumNames;
+	const char *Names[RA_INGEST_MAX_NAMES];
+	int NameLengths[RA_INGEST_MAX_NAMES];
+};
+
+static struct {
+	ra_schema_t *Schema;
+	const char *Name;
+	ra_schema_field_t *Field;
+} FieldCache[RA_INGEST_FIELD_CACHE];
+
+static ra_schema_field_t *ra_ingest_field(ra_schema_t *Schema, const char *Name) {
+	int Slot = ((uintptr_t)Name >> 4) % RA_INGEST_FIELD_CACHE;
+	if (FieldCache[Slot].Schema == Schema && FieldCache[Slot].Name == Name) return FieldCache[Slot].Field;
+	ra_schema_field_t *Field = ra_schema_field_by_name(Schema, Name);
+	if (!Field) return 0;
+	FieldCache[Slot].Schema = Schema;
+	FieldCache[Slot].Name = Name;
+	FieldCache[Slot].Field = Field;
+	return Field;
+}
+
+static ml_value_t *ra_ingest_apply(void *Data, int Count, ml_value_t **Args) {
+	ra_ingest_batch_t *Batch = (ra_ingest_batch_t *)Data;
+	ml_value_t *Error = MLNil;
+	const char *SchemaName = 0;
+	ra_schema_t *Schema = 0;
+	ra_schema_index_t *Index = 0;
+	const char **IndexNames = 0;
+	for (ra_ingest_record_t *Record = Batch->Records; Record < Batch->Records + Batch->Count; ++Record) {
+		if (Record->Schema != SchemaName) {
+			SchemaName = Record->Schema;
+			Schema = ra_schema_by_name(SchemaName);
+			Index = 0;
+		}
+		// Records come from other processes, so they may only refer to schemas and fields the script
+		// has declared; adding fields here would overrun the instances that already exist.
+		if (!Schema) {
+			Error = ml_error("IngestError", "unknown schema %s", SchemaName);
+			continue;
+		}
+		int NumFields = Record->NumKeys + Record->NumFields;
+		const char **Names = Record->Names;
+		ml_value_t **Values = Record->Values;
+		if (Record->Op == RA_INGEST_UPDATE || Record->Op == RA_INGEST_DELETE) {
+			if (!Record->NumKeys) {
+				Error = ml_error("IngestError", "%s on %s requires keys", Record->Op == RA_INGEST_UPDATE ? "update" : "delete", SchemaName);
+				continue;
+			}
+			if (Index) for (int I = 0; I <= Record->NumKeys; ++I) if (IndexNames[I] != Names[I]) {
+				Index = 0;
+				break;
+			}
+			if (!Index) {
+				for (int I = 0; I < Record->NumKeys; ++I) if (!ra_ingest_field(Schema, Names[I])) {
+					Error = ml_error("IngestError", "schema %s has no field %s", SchemaName, Names[I]);
+					goto next;
+				}
+				IndexNames = Names;
+				Index = ra_schema_index_by_names(Schema, Names) ?: ra_schema_index_create(Schema, Names);
+			}
+			ra_instance_t *Instance = ra_schema_index_search(Index, Values);
+			if (!Instance) continue;
+			if (Record->Op == RA_INGEST_DELETE) {
+				ra_instance_delete(Instance);
+				continue;
+			}
+			Names += Record->NumKeys + 1;
+			Values += Record->NumKeys;
+			NumFields = Record->NumFields;
+			ra_schema_field_t *Fields[NumFields];
+			for (int I = 0; I < NumFields; ++I) if (!(Fields[I] = ra_ingest_field(Schema, Names[I]))) {
+				Error = ml_error("IngestError", "schema %s has no field %s", SchemaName, Names[I]);
+				goto next;
+			}
+			ml_value_t *Result = (ml_value_t *)ra_instance_update(Instance, NumFields, Fields, Values);
+			if (ml_typeof(Result) == MLErrorT) Error = Result;
+		} else {
+			ra_schema_field_t *Fields[NumFields];
+			for (int I = 0, J = 0; I < NumFields; ++I, ++J) {
+				if (J == Record->NumKeys) ++J;
+				if (!(Fields[I] = ra_ingest_field(Schema, Names[J]))) {
+					Error = ml_error("IngestError", "schema %s has no field %s", SchemaName, Names[J]);
+					goto next;
+				}
+			}
+			ml_value_t *Result = (ml_value_t *)ra_instance_create(Schema, NumFields, Fields, Values, Record->Op == RA_INGEST_SIGNAL);
+			if (ml_typeof(Result) == MLErrorT) Error = Result;
+		}
+	next:;
+	}
+	return Error;
+}
+
+static const char *ra_ingest_name(ra_ingest_connection_t *Connection, const char *Chars, int Length) {
+	for (int I = 0; I < Connection->NumNames; ++I) {
+		if (Connection->NameLengths[I] == Length && !memcmp(Connection->Names[I], Chars, Length)) return Connection->Names[I];
+	}
+	char *Name = snew(Length + 1);
+	memcpy(Name, Chars, Length);
+	Name[Length] = 0;
+	if (Connection->NumNames < RA_INGEST_MAX_NAMES) {
+		Connection->Names[Connection->NumNames] = Name;
+		Connection->NameLengths[Connection->NumNames] = Length;
+		++Connection->NumNames;
+	}
+	return Name;
+}
+
+static ra_ingest_record_t *ra_ingest_record(ra_ingest_batch_t *Batch) {
+	if (Batch->Count == Batch->Size) {
+		Batch->Size = Batch->Size ? 2 * Batch->Size : 256;
+		ra_ingest_record_t *Records = anew(ra_ingest_record_t, Batch->Size);
+		if (Batch->Count) memcpy(Records, Batch->Records, Batch->Count * sizeof(ra_ingest_record_t));
+		Batch->Records = Records;
+	}
+	return Batch->Records + Batch->Count;
+}
+
+static void ra_ingest_record_alloc(ra_ingest_record_t *Record) {
+	int NumFields = Record->NumKeys + Record->NumFields;
+	Record->Names = anew(const char *, NumFields + 1);
+	Record->Values = anew(ml_value_t *, NumFields);
+}
+
+#define READ_U8(P) ((uint8_t)*(P)++)
+
+static inline uint32_t ra_ingest_u32(const char *P) {
+	uint32_t Value;
+	memcpy(&Value, P, 4);
+	return Value;
+}
+
+static int ra_ingest_decode_binary(ra_ingest_connection_t *Connection, ra_ingest_batch_t *Batch, const char *P, const char *End) {
+	ra_ingest_record_t *Record = ra_ingest_record(Batch);
+	if (End - P < 5) return 1;
+	Record->Op = READ_U8(P);
+	if (Record->Op < RA_INGEST_INSERT || Record->Op > RA_INGEST_SIGNAL) return 1;
+	int Length = READ_U8(P);
+	if (End - P < Length + 2) return 1;
+	Record->Schema = ra_ingest_name(Connection, P, Length);
+	P += Length;
+	Record->NumKeys = READ_U8(P);
+	Record->NumFields = READ_U8(P);
+	ra_ingest_record_alloc(Record);
+	int NumFields = Record->NumKeys + Record->NumFields;
+	const char **Names = Record->Names;
+	for (int I = 0; I < NumFields; ++I) {
+		if (I == Record->NumKeys) *Names++ = 0;
+		if (End - P < 1) return 1;
+		Length = READ_U8(P);
+		if (End - P < Length + 1) return 1;
+		*Names++ = ra_ingest_name(Connection, P, Length);
+		P += Length;
+		switch (READ_U8(P)) {
+		case RA_INGEST_NIL:
+			Record->Values[I] = MLNil;
+			break;
+		case RA_INGEST_INTEGER: {
+			if (End - P < 8) return 1;
+			int64_t Value;
+			memcpy(&Value, P, 8);
+			P += 8;
+			Record->Values[I] = ml_integer(Value);
+			break;
+		}
+		case RA_INGEST_REAL: {
+			if (End - P < 8) return 1;
+			double Value;
+			memcpy(&Value, P, 8);
+			P += 8;
+			Record->Values[I] = ml_real(Value);
+			break;
+		}
+		case RA_INGEST_STRING: {
+			if (End - P < 4) return 1;
+			uint32_t StringLength = ra_ingest_u32(P);
+			P += 4;
+			if (End - P < StringLength) return 1;
+			if (StringLength <= ML_STRING_INTERN_LENGTH) {
+				Record->Values[I] = ml_string_intern(P, StringLength);
+			} else {
+				char *Chars = snew(StringLength + 1);
+				memcpy(Chars, P, StringLength);
+				Chars[StringLength] = 0;
+				Record->Values[I] = ml_string(Chars, StringLength);
+			}
+			P += StringLength;
+			break;
+		}
+		default:
+			return 1;
+		}
+	}
+	if (Record->NumKeys == NumFields) *Names = 0;
+	++Batch->Count;
+	return 0;
+}
+
+static ml_value_t *ra_ingest_text_value(const char *P, const char *End) {
+	int Length = End - P;
+	if (Length == 3 && !memcmp(P, "nil", 3)) return MLNil;
+	if (Length >= 2 && P[0] == '"' && End[-1] == '"') {
+		++P;
+		Length -= 2;
+	} else if (Length && Length < 64) {
+		char Number[64], *NumberEnd;
+		memcpy(Number, P, Length);
+		Number[Length] = 0;
+		long long Integer = strtoll(Number, &NumberEnd, 10);
+		if (NumberEnd == Number + Length) return ml_integer(Integer);
+		double Real = strtod(Number, &NumberEnd);
+		if (NumberEnd == Number + Length) return ml_real(Real);
+	}
+	if (Length <= ML_STRING_INTERN_LENGTH) return ml_string_intern(P, Length);
+	char *Chars = snew(Length + 1);
+	memcpy(Chars, P, Length);
+	Chars[Length] = 0;
+	return ml_string(Chars, Length);
+}
+
+static const char *ra_ingest_text_token(const char *P, const char *End) {
+	int Quoted = 0;
+	while (P < End) {
+		if (*P == '"') {
+			Quoted = !Quoted;
+		} else if (*P == ' ' && !Quoted) {
+			break;
+		}
+		++P;
+	}
+	return P;
+}
+
+static int ra_ingest_decode_text(ra_ingest_connection_t *Connection, ra_ingest_batch_t *Batch, const char *P, const char *End) {
+	if (End > P && End[-1] == '\r') --End;
+	while (P < End && *P == ' ') ++P;
+	if (P == End) return 0;
+	ra_ingest_record_t *Record = ra_ingest_record(Batch);
+	const char *Token = ra_ingest_text_token(P, End);
+	int Length = Token - P;
+	if (Length == 6 && !memcmp(P, "insert", 6)) {
+		Record->Op = RA_INGEST_INSERT;
+	} else if (Length == 6 && !memcmp(P, "update", 6)) {
+		Record->Op = RA_INGEST_UPDATE;
+	} else if (Length == 6 && !memcmp(P, "delete", 6)) {
+		Record->Op = RA_INGEST_DELETE;
+	} else if (Length == 6 && !memcmp(P, "signal", 6)) {
+		Record->Op = RA_INGEST_SIGNAL;
+	} else {
+		return 1;
+	}
+	for (P = Token; P < End && *P == ' '; ++P);
+	Token = ra_ingest_text_token(P, End);
+	if (Token == P) return 1;
+	Record->Schema = ra_ingest_name(Connection, P, Token - P);
+	const char *Start = Token;
+	int NumKeys = 0, NumFields = 0, Separator = 0;
+	for (P = Start; P < End;) {
+		while (P < End && *P == ' ') ++P;
+		if (P == End) break;
+		Token = ra_ingest_text_token(P, End);
+		if (Token - P == 1 && *P == ':') {
+			if (Separator) return 1;
+			Separator = 1;
+			NumKeys = NumFields;
+			NumFields = 0;
+		} else {
+			++NumFields;
+		}
+		P = Token;
+	}
+	if (Record->Op == RA_INGEST_DELETE) {
+		if (Separator) return 1;
+		NumKeys = NumFields;
+		NumFields = 0;
+	}
+	Record->NumKeys = NumKeys;
+	Record->NumFields = NumFields;
+	ra_ingest_record_alloc(Record);
+	const char **Names = Record->Names;
+	ml_value_t **Values = Record->Values;
+	if (!NumKeys) *Names++ = 0;
+	for (P = Start; P < End;) {
+		while (P < End && *P == ' ') ++P;
+		if (P == End) break;
+		Token = ra_ingest_text_token(P, End);
+		if (!(Token - P == 1 && *P == ':')) {
+			const char *Equals = memchr(P, '=', Token - P);
+			if (!Equals || Equals == P) return 1;
+			*Names++ = ra_ingest_name(Connection, P, Equals - P);
+			*Values++ = ra_ingest_text_value(Equals + 1, Token);
+			if (Values - Record->Values == NumKeys) *Names++ = 0;
+		}
+		P = Token;
+	}
+	++Batch->Count;
+	return 0;
+}
+
+static void ra_ingest_deliver(ra_ingest_batch_t *Batch) {
+	if (Batch->Count) ra_action_enqueue(ml_function(Batch, ra_ingest_apply), 0, 0);
+}
+
+static size_t ra_ingest_decode(ra_ingest_connection_t *Connection, ra_ingest_batch_t *Batch) {
+	const char *P = Connection->Buffer, *End = P + Connection->Pending;
+	if (Connection->Text) {
+		for (const char *Line; (Line = memchr(P, '\n', End - P)); P = Line + 1) {
+			if (ra_ingest_decode_text(Connection, Batch, P, Line)) {
+				fprintf(stderr, "ingest: malformed record: %.*s\n", (int)(Line - P), P);
+			}
+		}
+	} else {
+		while (End - P >= 4) {
+			uint32_t Length = ra_ingest_u32(P);
+			if (Length > RA_INGEST_MAX_RECORD) return -1;
+			if (End - P < 4 + Length) break;
+			if (ra_ingest_decode_binary(Connection, Batch, P + 4, P + 4 + Length)) {
+				fprintf(stderr, "ingest: malformed record of %u bytes\n", Length);
+			}
+			P += 4 + Length;
+		}
+		if (End - P >= 4) {
+			uint32_t Length = ra_ingest_u32(P);
+			if (Length > RA_INGEST_MAX_RECORD) return -1;
+		}
+	}
+	return P - Connection->Buffer;
+}
+
+static void ra_ingest_read(ra_watch_t *Watch, ra_ingest_connection_t *Connection) {
+	ra_ingest_batch_t *Batch = new(ra_ingest_batch_t);
+	int Fd = ra_watch_fd(Watch);
+	for (;;) {
+		if (Connection->Pending == Connection->Size) {
+			size_t Size = 2 * Connection->Size;
+			if (Size > 2 * RA_INGEST_MAX_RECORD) goto close;
+			char *Buffer = snew(Size);
+			memcpy(Buffer, Connection->Buffer, Connection->Pending);
+			Connection->Buffer = Buffer;
+			Connection->Size = Size;
+		}
+		ssize_t Actual = read(Fd, Connection->Buffer + Connection->Pending, Connection->Size - Connection->Pending);
+		if (Actual < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+		}
+		if (Actual <= 0) goto close;
+		Connection->Pending += Actual;
+		size_t Used = ra_ingest_decode(Connection, Batch);
+		if (Used == (size_t)-1) {
+			fprintf(stderr, "ingest: record too large, closing connection\n");
+			goto close;
+		}
+		Connection->Pending -= Used;
+		if (Connection->Pending && Used) memmove(Connection->Buffer, Connection->Buffer + Used, Connection->Pending);
+	}
+	ra_ingest_deliver(Batch);
+	return;
+close:
+	ra_ingest_deliver(Batch);
+	ra_watch_cancel(Watch);
+	close(Fd);
+}
+
+static void ra_ingest_accept(ra_watch_t *Watch, void *Data) {
+	int Text = (intptr_t)Data;
+	for (;;) {
+		int Fd = accept4(ra_watch_fd(Watch), 0, 0, SOCK_CLOEXEC);
+		if (Fd < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		ra_ingest_connection_t *Connection = new(ra_ingest_connection_t);
+		Connection->Text = Text;
+		Connection->Size = RA_INGEST_BUFFER_SIZE;
+		Connection->Buffer = snew(RA_INGEST_BUFFER_SIZE);
+		ra_watch_t *ConnectionWatch = ra_watch_custom(Fd, (void *)ra_ingest_read, Connection);
+		if (!ConnectionWatch) close(Fd);
+	}
+}
+
+ml_value_t *ra_ingest_listen(void *Data, int Count, ml_value_t **Args) {
+	ML_CHECK_ARG_COUNT(1);
+	ML_CHECK_ARG_TYPE(0, MLStringT);
+	const char *Path = ml_string_value(Args[0]);
+	int Text = 0;
+	if (Count > 1) {
+		ML_CHECK_ARG_TYPE(1, MLStringT);
+		const char *Format = ml_string_value(Args[1]);
+		if (!strcmp(Format, "text")) {
+			Text = 1;
+		} else if (strcmp(Format, "binary")) {
+			return ml_error("ParamError", "unknown ingest format %s", Format);
+		}
+	}
+	struct sockaddr_un Address[1] = {{0,}};
+	Address->sun_family = AF_UNIX;
+	if (strlen(Path) >= sizeof(Address->sun_path)) return ml_error("IOError", "socket path %s is too long", Path);
+	strcpy(Address->sun_path, Path);
+	int Fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (Fd < 0) return ml_error("IOError", "failed to create socket");
+	unlink(Path);
+	if (bind(Fd, (struct sockaddr *)Address, sizeof(Address)) || listen(Fd, 64)) {
+		close(Fd);
+		return ml_error("IOError", "failed to listen on %s", Path);
+	}
+	ra_watch_t *Watch = ra_watch_custom(Fd, ra_ingest_accept, (void *)(intptr_t)Text);
+	if (!Watch) {
+		close(Fd);
+		return ml_error("IOError", "failed to watch %s", Path);
+	}
+	return (ml_value_t *)Watch;
+}
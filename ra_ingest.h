@@ -0,0 +1,38 @@
+#ifndef RA_INGEST_H
+#define RA_INGEST_H
+
+#include "minilang.h"
+
+/*
+ * Binary records are little-endian and length prefixed:
+ *   u32 Length (of everything after this field)
+ *   u8 Op, u8 SchemaLength, Schema[SchemaLength], u8 NumKeys, u8 NumFields
+ *   (NumKeys + NumFields) x { u8 NameLength, Name[NameLength], u8 Kind, Value }
+ * where Value is empty for RA_INGEST_NIL, an int64 for RA_INGEST_INTEGER, a double for
+ * RA_INGEST_REAL and { u32 Length, Chars[Length] } for RA_INGEST_STRING.
+ *
+ * Keys select the instance (through the index on the key names, in order) for update and
+ * delete; for insert and signal, keys and fields are all assigned.
+ *
+ * Text records are one per line: "insert food Id=1 Name=Banana", "update food Id=1 : Name=Apple",
+ * "delete food Id=1" or "signal tick Count=3". Values are nil, integers, reals, "quoted strings"
+ * or bare words.
+ */
+
+typedef enum {
+	RA_INGEST_INSERT = 1,
+	RA_INGEST_UPDATE = 2,
+	RA_INGEST_DELETE = 3,
+	RA_INGEST_SIGNAL = 4
+} ra_ingest_op_t;
+
+typedef enum {
+	RA_INGEST_NIL = 0,
+	RA_INGEST_INTEGER = 1,
+	RA_INGEST_REAL = 2,
+	RA_INGEST_STRING = 3
+} ra_ingest_kind_t;
+
+ml_value_t *ra_ingest_listen(void *Data, int Count, ml_value_t **Args);
+
+#endif
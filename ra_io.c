@@ -0,0 +1,320 @@
+#include "ra_io.h"
+#include "ra_events.h"
+#include "ra_schema.h"
+#include "ml_file.h"
+#include <pthread.h>
+#include <gc.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+
+#define new(T) ((T *)GC_MALLOC(sizeof(T)))
+#define anew(T, N) ((T *)GC_MALLOC((N) * sizeof(T)))
+#define snew(N) ((char *)GC_MALLOC_ATOMIC(N))
+#define xnew(T, N, U) ((T *)GC_MALLOC(sizeof(T) + (N) * sizeof(U)))
+
+#define RA_IO_BUFFER_SIZE 65536
+#define RA_IO_MAX_EVENTS 64
+
+typedef struct ra_inotify_t {
+	const ml_type_t *Type;
+	const char *Path;
+	ra_watch_t *Watch;
+	int Fd;
+} ra_inotify_t;
+
+struct ra_watch_t {
+	const ml_type_t *Type;
+	ra_watch_t *Next;
+	void (*read)(ra_watch_t *Watch, void *Data);
+	void *Data;
+	ml_value_t *Source, *Handler;
+	ra_schema_t *Schema;
+	ra_schema_field_t *Field;
+	char *Buffer;
+	size_t Pending;
+	int Fd, Closed;
+};
+
+ml_type_t RaWatchT[1] = {{
+	MLAnyT, "watch",
+	ml_default_hash,
+	ml_default_call,
+	ml_default_deref,
+	ml_default_assign,
+	ml_default_next,
+	ml_default_key
+}};
+
+ml_type_t RaInotifyT[1] = {{
+	MLAnyT, "inotify",
+	ml_default_hash,
+	ml_default_call,
+	ml_default_deref,
+	ml_default_assign,
+	ml_default_next,
+	ml_default_key
+}};
+
+static ra_watch_t *Watches = 0;
+static int EpollFd = -1;
+static pthread_mutex_t WatchesLock[1] = {PTHREAD_MUTEX_INITIALIZER};
+
+static ml_value_t *ra_watch_signal(void *Data, int Count, ml_value_t **Args) {
+	ra_watch_t *Watch = (ra_watch_t *)Data;
+	if (Args[0] == MLNil) return MLNil;
+	ml_value_t *Lines[ml_list_length(Args[0])];
+	ml_list_to_array(Args[0], Lines);
+	for (int I = 0; I < ml_list_length(Args[0]); ++I) {
+		ml_value_t *Result = (ml_value_t *)ra_instance_create(Watch->Schema, 1, &Watch->Field, Lines + I, 1);
+		if (ml_typeof(Result) == MLErrorT) return Result;
+	}
+	return MLNil;
+}
+
+static void ra_watch_deliver(ra_watch_t *Watch, ml_value_t *Batch) {
+	ml_value_t **Args = anew(ml_value_t *, 1);
+	Args[0] = Batch;
+	ra_action_enqueue(Watch->Handler, 1, Args);
+}
+
+static ml_value_t *ra_watch_line(const char *Start, int Length) {
+	// Lines are copied out since the watch's buffer is reused and not terminated.
+	char *Chars = snew(Length + 1);
+	memcpy(Chars, Start, Length);
+	Chars[Length] = 0;
+	return ml_string(Chars, Length);
+}
+
+static void ra_watch_read_lines(ra_watch_t *Watch, void *Data) {
+	ml_value_t *Batch = 0;
+	for (;;) {
+		ssize_t Actual = read(Watch->Fd, Watch->Buffer + Watch->Pending, RA_IO_BUFFER_SIZE - Watch->Pending);
+		if (Actual < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+		}
+		if (Actual <= 0) {
+			if (Watch->Pending) {
+				Batch = Batch ?: ml_list();
+				ml_list_append(Batch, ra_watch_line(Watch->Buffer, Watch->Pending));
+				Watch->Pending = 0;
+			}
+			if (Batch) ra_watch_deliver(Watch, Batch);
+			ra_watch_cancel(Watch);
+			ra_watch_deliver(Watch, MLNil);
+			return;
+		}
+		char *Start = Watch->Buffer, *End = Watch->Buffer + Watch->Pending + Actual;
+		for (char *Line; (Line = memchr(Start, '\n', End - Start)); Start = Line + 1) {
+			Batch = Batch ?: ml_list();
+			ml_list_append(Batch, ra_watch_line(Start, Line - Start));
+		}
+		Watch->Pending = End - Start;
+		if (Watch->Pending == RA_IO_BUFFER_SIZE) {
+			Batch = Batch ?: ml_list();
+			ml_list_append(Batch, ra_watch_line(Watch->Buffer, RA_IO_BUFFER_SIZE));
+			Watch->Pending = 0;
+		} else if (Start != Watch->Buffer) {
+			memmove(Watch->Buffer, Start, Watch->Pending);
+		}
+	}
+	if (Batch) ra_watch_deliver(Watch, Batch);
+}
+
+static void ra_watch_read_inotify(ra_watch_t *Watch, void *Data) {
+	ra_inotify_t *Inotify = (ra_inotify_t *)Watch->Source;
+	ml_value_t *Batch = 0;
+	for (;;) {
+		ssize_t Actual = read(Watch->Fd, Watch->Buffer, RA_IO_BUFFER_SIZE);
+		if (Actual < 0 && errno == EINTR) continue;
+		if (Actual <= 0) break;
+		for (char *Next = Watch->Buffer; Next < Watch->Buffer + Actual;) {
+			struct inotify_event *Event = (struct inotify_event *)Next;
+			Batch = Batch ?: ml_list();
+			if (Event->len) {
+				int Length = strlen(Inotify->Path) + 1 + strlen(Event->name);
+				char *Chars = snew(Length + 1);
+				sprintf(Chars, "%s/%s", Inotify->Path, Event->name);
+				ml_list_append(Batch, ml_string(Chars, Length));
+			} else {
+				ml_list_append(Batch, ml_string(Inotify->Path, strlen(Inotify->Path)));
+			}
+			Next += sizeof(struct inotify_event) + Event->len;
+		}
+	}
+	if (Batch) ra_watch_deliver(Watch, Batch);
+}
+
+static void *ra_io_loop(void *Data) {
+	struct epoll_event Events[RA_IO_MAX_EVENTS];
+	for (;;) {
+		int Count = epoll_wait(EpollFd, Events, RA_IO_MAX_EVENTS, -1);
+		for (int I = 0; I < Count; ++I) {
+			ra_watch_t *Watch = (ra_watch_t *)Events[I].data.ptr;
+			if (!Watch->Closed) Watch->read(Watch, Watch->Data);
+		}
+	}
+	return 0;
+}
+
+static ra_watch_t *ra_watch_alloc(int Fd, void (*read)(ra_watch_t *Watch, void *Data), void *Data) {
+	ra_watch_t *Watch = new(ra_watch_t);
+	Watch->Type = RaWatchT;
+	Watch->Fd = Fd;
+	Watch->read = read;
+	Watch->Data = Data;
+	return Watch;
+}
+
+static ra_watch_t *ra_watch_start(ra_watch_t *Watch) {
+	// Edge triggered watches may be read as soon as they are added, so Watch must be fully set up.
+	pthread_mutex_lock(WatchesLock);
+	if (EpollFd < 0) {
+		EpollFd = epoll_create1(EPOLL_CLOEXEC);
+		pthread_t Thread[1];
+		GC_pthread_create(Thread, 0, ra_io_loop, 0);
+	}
+	pthread_mutex_unlock(WatchesLock);
+	fcntl(Watch->Fd, F_SETFL, fcntl(Watch->Fd, F_GETFL) | O_NONBLOCK);
+	pthread_mutex_lock(WatchesLock);
+	Watch->Next = Watches;
+	Watches = Watch;
+	pthread_mutex_unlock(WatchesLock);
+	struct epoll_event Event = {EPOLLIN | EPOLLET | EPOLLRDHUP, {.ptr = Watch}};
+	if (epoll_ctl(EpollFd, EPOLL_CTL_ADD, Watch->Fd, &Event)) {
+		ra_watch_cancel(Watch);
+		return 0;
+	}
+	return Watch;
+}
+
+ra_watch_t *ra_watch_custom(int Fd, void (*read)(ra_watch_t *Watch, void *Data), void *Data) {
+	return ra_watch_start(ra_watch_alloc(Fd, read, Data));
+}
+
+static ra_watch_t *ra_watch_prepare(int Fd, ml_value_t *Source, ml_value_t *Handler) {
+	ra_watch_t *Watch;
+	if (Source && ml_typeof(Source) == RaInotifyT) {
+		Watch = ra_watch_alloc(Fd, ra_watch_read_inotify, 0);
+	} else {
+		Watch = ra_watch_alloc(Fd, ra_watch_read_lines, 0);
+	}
+	Watch->Source = Source;
+	Watch->Handler = Handler;
+	Watch->Buffer = snew(RA_IO_BUFFER_SIZE);
+	return Watch;
+}
+
+ra_watch_t *ra_watch_create(int Fd, ml_value_t *Source, ml_value_t *Handler) {
+	return ra_watch_start(ra_watch_prepare(Fd, Source, Handler));
+}
+
+int ra_watch_fd(ra_watch_t *Watch) {
+	return Watch->Fd;
+}
+
+void ra_watch_cancel(ra_watch_t *Watch) {
+	pthread_mutex_lock(WatchesLock);
+	if (!Watch->Closed) {
+		Watch->Closed = 1;
+		epoll_ctl(EpollFd, EPOLL_CTL_DEL, Watch->Fd, 0);
+		ra_watch_t **Slot = &Watches;
+		while (Slot[0] && Slot[0] != Watch) Slot = &Slot[0]->Next;
+		if (Slot[0] == Watch) Slot[0] = Watch->Next;
+	}
+	pthread_mutex_unlock(WatchesLock);
+}
+
+static ml_value_t *ra_watch_cancel_callback(void *Data, int Count, ml_value_t **Args) {
+	ra_watch_cancel((ra_watch_t *)Args[0]);
+	return MLNil;
+}
+
+ml_value_t *ra_io_watch(void *Data, int Count, ml_value_t **Args) {
+	ML_CHECK_ARG_COUNT(2);
+	int Fd;
+	if (ml_typeof(Args[0]) == MLIntegerT) {
+		Fd = ml_integer_value(Args[0]);
+	} else if (ml_typeof(Args[0]) == MLFileT) {
+		FILE *Handle = ml_file_handle(Args[0]);
+		if (!Handle) return ml_error("FileError", "file is closed");
+		Fd = fileno(Handle);
+	} else if (ml_typeof(Args[0]) == RaInotifyT) {
+		Fd = ((ra_inotify_t *)Args[0])->Fd;
+		if (Fd < 0) return ml_error("IOError", "inotify handle is cancelled");
+	} else {
+		return ml_error("TypeError", "watch requires a file, inotify handle or file descriptor");
+	}
+	ml_value_t *Handler = Args[1];
+	ra_watch_t *Watch;
+	if (ml_typeof(Handler) == MLStringT) {
+		const char *Name = ml_string_value(Handler);
+		const char *FieldName = "Line";
+		if (Count > 2) {
+			ML_CHECK_ARG_TYPE(2, MLStringT);
+			FieldName = ml_string_value(Args[2]);
+		}
+		// Fields can not be added to a schema that may already have instances, so an existing schema
+		// must already have the field.
+		ra_schema_t *Schema = ra_schema_by_name(Name);
+		ra_schema_field_t *Field;
+		if (Schema) {
+			Field = ra_schema_field_by_name(Schema, FieldName);
+			if (!Field) return ml_error("SchemaError", "schema %s has no field %s", Name, FieldName);
+		} else {
+			Schema = ra_schema_create(Name, 0);
+			Field = ra_schema_value_field_create(Schema, FieldName);
+		}
+		Watch = ra_watch_prepare(Fd, Args[0], 0);
+		Watch->Schema = Schema;
+		Watch->Field = Field;
+		Watch->Handler = ml_function(Watch, ra_watch_signal);
+		Watch = ra_watch_start(Watch);
+	} else {
+		Watch = ra_watch_create(Fd, Args[0], Handler);
+	}
+	if (!Watch) return ml_error("IOError", "file descriptor %d can not be watched", Fd);
+	if (ml_typeof(Args[0]) == RaInotifyT) ((ra_inotify_t *)Args[0])->Watch = Watch;
+	return (ml_value_t *)Watch;
+}
+
+ml_value_t *ra_io_inotify(void *Data, int Count, ml_value_t **Args) {
+	ML_CHECK_ARG_COUNT(1);
+	ML_CHECK_ARG_TYPE(0, MLStringT);
+	ra_inotify_t *Inotify = new(ra_inotify_t);
+	Inotify->Type = RaInotifyT;
+	Inotify->Path = ml_string_value(Args[0]);
+	Inotify->Fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (Inotify->Fd < 0) return ml_error("IOError", "failed to create inotify handle");
+	uint32_t Mask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE;
+	if (inotify_add_watch(Inotify->Fd, Inotify->Path, Mask) < 0) {
+		close(Inotify->Fd);
+		return ml_error("IOError", "failed to watch %s", Inotify->Path);
+	}
+	return (ml_value_t *)Inotify;
+}
+
+static ml_value_t *ra_inotify_cancel_callback(void *Data, int Count, ml_value_t **Args) {
+	// The handle may be cancelled while its watch is still registered (e.g. the watch was not kept as
+	// a rule), so stop the watch before the descriptor can be closed and reused.
+	ra_inotify_t *Inotify = (ra_inotify_t *)Args[0];
+	if (Inotify->Watch) {
+		ra_watch_cancel(Inotify->Watch);
+		Inotify->Watch = 0;
+	}
+	if (Inotify->Fd >= 0) {
+		close(Inotify->Fd);
+		Inotify->Fd = -1;
+	}
+	return MLNil;
+}
+
+void ra_io_init() {
+	ml_method_by_name("cancel", 0, ra_watch_cancel_callback, RaWatchT, 0);
+	ml_method_by_name("cancel", 0, ra_inotify_cancel_callback, RaInotifyT, 0);
+}
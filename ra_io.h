@@ -0,0 +1,21 @@
+#ifndef RA_IO_H
+#define RA_IO_H
+
+#include "minilang.h"
+
+typedef struct ra_watch_t ra_watch_t;
+
+ra_watch_t *ra_watch_create(int Fd, ml_value_t *Source, ml_value_t *Handler);
+ra_watch_t *ra_watch_custom(int Fd, void (*read)(ra_watch_t *Watch, void *Data), void *Data);
+int ra_watch_fd(ra_watch_t *Watch);
+void ra_watch_cancel(ra_watch_t *Watch);
+
+ml_value_t *ra_io_watch(void *Data, int Count, ml_value_t **Args);
+ml_value_t *ra_io_inotify(void *Data, int Count, ml_value_t **Args);
+
+void ra_io_init();
+
+extern ml_type_t RaWatchT[];
+extern ml_type_t RaInotifyT[];
+
+#endif
@@ -0,0 +1,245 @@
+#include "ra_parallel.h"
+#include "ra_schema.h"
+#include <pthread.h>
+#include <gc.h>
+#include <unistd.h>
+
+#define new(T) ((T *)GC_MALLOC(sizeof(T)))
+#define anew(T, N) ((T *)GC_MALLOC((N) * sizeof(T)))
+
+#define RA_PARALLEL_MAX_WORKERS 64
+#define RA_PARALLEL_CHUNKS_PER_THREAD 4
+
+// A parallel call snapshots its source into an array on the calling thread, then splits the array
+// into chunks that the worker pool and the calling thread claim one at a time. The function is
+// called concurrently from several threads, so it must not modify shared state. Calls made from
+// inside a chunk run sequentially on the current thread instead of waiting on the pool. The workers
+// draw on the caller's remaining fuel and deadline, so a handler's limits cover its parallel calls.
+
+typedef enum {
+	RA_PARALLEL_MAP,
+	RA_PARALLEL_REDUCE,
+	RA_PARALLEL_FOREACH
+} ra_parallel_kind_t;
+
+typedef struct ra_parallel_job_t {
+	ml_value_t *Function;
+	ml_value_t **Values, **Results, **Partials;
+	int Count, NumChunks, NextChunk, Remaining, Failed;
+	ra_parallel_kind_t Kind;
+	ml_fuel_t Fuel[1];
+} ra_parallel_job_t;
+
+typedef struct ra_parallel_values_t {
+	ml_value_t **Values;
+	int Count, Size;
+} ra_parallel_values_t;
+
+static pthread_mutex_t SubmitLock[1] = {PTHREAD_MUTEX_INITIALIZER};
+static pthread_mutex_t PoolLock[1] = {PTHREAD_MUTEX_INITIALIZER};
+static pthread_cond_t PoolWork[1] = {PTHREAD_COND_INITIALIZER};
+static pthread_cond_t PoolDone[1] = {PTHREAD_COND_INITIALIZER};
+static ra_parallel_job_t *Current = 0;
+static int NumWorkers = -1;
+static __thread int Nested = 0;
+
+static void ra_parallel_chunk(ra_parallel_job_t *Job, int Chunk) {
+	int Start = (long)Chunk * Job->Count / Job->NumChunks;
+	int End = (long)(Chunk + 1) * Job->Count / Job->NumChunks;
+	ml_value_t *Function = Job->Function;
+	ml_value_t *Partial = MLNil;
+	switch (Job->Kind) {
+	case RA_PARALLEL_MAP:
+	case RA_PARALLEL_FOREACH:
+		for (int I = Start; I < End; ++I) {
+			if (__atomic_load_n(&Job->Failed, __ATOMIC_RELAXED)) break;
+			ml_value_t *Result = ml_call(Function, 1, Job->Values + I);
+			if (ml_typeof(Result) == MLErrorT) {
+				Partial = Result;
+				__atomic_store_n(&Job->Failed, 1, __ATOMIC_RELAXED);
+				break;
+			}
+			if (Job->Results) Job->Results[I] = Result;
+		}
+		break;
+	case RA_PARALLEL_REDUCE: {
+		ml_value_t *Args[2] = {Job->Values[Start], 0};
+		for (int I = Start + 1; I < End; ++I) {
+			if (__atomic_load_n(&Job->Failed, __ATOMIC_RELAXED)) break;
+			Args[1] = Job->Values[I];
+			Args[0] = ml_call(Function, 2, Args);
+			if (ml_typeof(Args[0]) == MLErrorT) {
+				__atomic_store_n(&Job->Failed, 1, __ATOMIC_RELAXED);
+				break;
+			}
+		}
+		Partial = Args[0];
+		break;
+	}
+	}
+	Job->Partials[Chunk] = Partial;
+}
+
+static void ra_parallel_work(ra_parallel_job_t *Job) {
+	for (;;) {
+		int Chunk = __atomic_fetch_add(&Job->NextChunk, 1, __ATOMIC_ACQ_REL);
+		if (Chunk >= Job->NumChunks) return;
+		ra_parallel_chunk(Job, Chunk);
+		if (!__atomic_sub_fetch(&Job->Remaining, 1, __ATOMIC_ACQ_REL)) {
+			pthread_mutex_lock(PoolLock);
+			pthread_cond_broadcast(PoolDone);
+			pthread_mutex_unlock(PoolLock);
+		}
+	}
+}
+
+static void *ra_parallel_worker(void *Data) {
+	Nested = 1;
+	ra_parallel_job_t *Seen = 0;
+	pthread_mutex_lock(PoolLock);
+	for (;;) {
+		while (!Current || Current == Seen) pthread_cond_wait(PoolWork, PoolLock);
+		ra_parallel_job_t *Job = Seen = Current;
+		pthread_mutex_unlock(PoolLock);
+		ml_fuel_share(Job->Fuel);
+		ra_parallel_work(Job);
+		ml_fuel_clear();
+		pthread_mutex_lock(PoolLock);
+	}
+	return 0;
+}
+
+static void ra_parallel_run(ra_parallel_job_t *Job) {
+	if (Nested) {
+		ra_parallel_work(Job);
+		return;
+	}
+	pthread_mutex_lock(SubmitLock);
+	if (NumWorkers < 0) {
+		long NumCpus = sysconf(_SC_NPROCESSORS_ONLN);
+		NumWorkers = NumCpus > RA_PARALLEL_MAX_WORKERS ? RA_PARALLEL_MAX_WORKERS : NumCpus - 1;
+		for (int I = 0; I < NumWorkers; ++I) {
+			pthread_t Thread[1];
+			if (GC_pthread_create(Thread, 0, ra_parallel_worker, 0)) {
+				NumWorkers = I;
+				break;
+			}
+		}
+	}
+	ml_fuel_save(Job->Fuel);
+	pthread_mutex_lock(PoolLock);
+	Current = Job;
+	pthread_cond_broadcast(PoolWork);
+	pthread_mutex_unlock(PoolLock);
+	Nested = 1;
+	ml_fuel_share(Job->Fuel);
+	ra_parallel_work(Job);
+	Nested = 0;
+	pthread_mutex_lock(PoolLock);
+	while (__atomic_load_n(&Job->Remaining, __ATOMIC_ACQUIRE)) pthread_cond_wait(PoolDone, PoolLock);
+	Current = 0;
+	pthread_mutex_unlock(PoolLock);
+	pthread_mutex_unlock(SubmitLock);
+	ml_fuel_restore(Job->Fuel);
+}
+
+static void ra_parallel_append(ra_parallel_values_t *Values, ml_value_t *Value) {
+	if (Values->Count == Values->Size) {
+		Values->Size = Values->Size ? 2 * Values->Size : 64;
+		ml_value_t **New = anew(ml_value_t *, Values->Size);
+		for (int I = 0; I < Values->Count; ++I) New[I] = Values->Values[I];
+		Values->Values = New;
+	}
+	Values->Values[Values->Count++] = Value;
+}
+
+static int ra_parallel_collect_instance(ra_instance_t *Instance, ra_parallel_values_t *Values) {
+	ra_parallel_append(Values, (ml_value_t *)Instance);
+	return 0;
+}
+
+static ml_value_t *ra_parallel_collect(ml_value_t *Source, ra_parallel_values_t *Values) {
+	static ml_value_t *ValuesMethod = 0;
+	if (ml_typeof(Source) == MLListT) {
+		Values->Count = Values->Size = ml_list_length(Source);
+		Values->Values = anew(ml_value_t *, Values->Count + 1);
+		ml_list_to_array(Source, Values->Values);
+		return MLNil;
+	}
+	if (ml_typeof(Source) == RaSchemaT) {
+		ra_schema_foreach((ra_schema_t *)Source, Values, (void *)ra_parallel_collect_instance);
+		return MLNil;
+	}
+	if (!ValuesMethod) ValuesMethod = ml_method("values");
+	ml_value_t *Iter = ml_call(ValuesMethod, 1, &Source);
+	while (Iter != MLNil) {
+		if (ml_typeof(Iter) == MLErrorT) return Iter;
+		ml_value_t *Value = ml_typeof(Iter)->deref(Iter);
+		if (ml_typeof(Value) == MLErrorT) return Value;
+		ra_parallel_append(Values, Value);
+		Iter = ml_typeof(Iter)->next(Iter);
+	}
+	return MLNil;
+}
+
+static ml_value_t *ra_parallel_job(ra_parallel_kind_t Kind, ml_value_t *Source, ml_value_t *Function, ra_parallel_job_t **Slot) {
+	ra_parallel_values_t Values[1] = {{0, 0, 0}};
+	ml_value_t *Error = ra_parallel_collect(Source, Values);
+	if (Error != MLNil) return Error;
+	ra_parallel_job_t *Job = Slot[0] = new(ra_parallel_job_t);
+	Job->Kind = Kind;
+	Job->Function = Function;
+	Job->Values = Values->Values;
+	Job->Count = Values->Count;
+	if (!Job->Count) return MLNil;
+	int NumThreads = (NumWorkers < 0 ? sysconf(_SC_NPROCESSORS_ONLN) : NumWorkers + 1);
+	Job->NumChunks = NumThreads * RA_PARALLEL_CHUNKS_PER_THREAD;
+	if (Job->NumChunks > Job->Count) Job->NumChunks = Job->Count;
+	Job->Remaining = Job->NumChunks;
+	Job->Partials = anew(ml_value_t *, Job->NumChunks);
+	if (Kind == RA_PARALLEL_MAP) Job->Results = anew(ml_value_t *, Job->Count);
+	ra_parallel_run(Job);
+	for (int I = 0; I < Job->NumChunks; ++I) {
+		if (ml_typeof(Job->Partials[I]) == MLErrorT) return Job->Partials[I];
+	}
+	return MLNil;
+}
+
+ml_value_t *ra_parallel_map(void *Data, int Count, ml_value_t **Args) {
+	ML_CHECK_ARG_COUNT(2);
+	ra_parallel_job_t *Job = 0;
+	ml_value_t *Error = ra_parallel_job(RA_PARALLEL_MAP, Args[0], Args[1], &Job);
+	if (Error != MLNil) return Error;
+	ml_value_t *List = ml_list();
+	for (int I = 0; I < Job->Count; ++I) ml_list_append(List, Job->Results[I]);
+	return List;
+}
+
+ml_value_t *ra_parallel_foreach(void *Data, int Count, ml_value_t **Args) {
+	ML_CHECK_ARG_COUNT(2);
+	ra_parallel_job_t *Job = 0;
+	return ra_parallel_job(RA_PARALLEL_FOREACH, Args[0], Args[1], &Job);
+}
+
+ml_value_t *ra_parallel_reduce(void *Data, int Count, ml_value_t **Args) {
+	ML_CHECK_ARG_COUNT(2);
+	ml_value_t *Function = Args[Count - 1];
+	ra_parallel_job_t *Job = 0;
+	ml_value_t *Error = ra_parallel_job(RA_PARALLEL_REDUCE, Args[0], Function, &Job);
+	if (Error != MLNil) return Error;
+	ml_value_t *Reduce[2];
+	int Start = 0;
+	if (Count > 2) {
+		Reduce[0] = Args[1];
+	} else if (Job->NumChunks) {
+		Reduce[0] = Job->Partials[Start++];
+	} else {
+		return MLNil;
+	}
+	for (int I = Start; I < Job->NumChunks; ++I) {
+		Reduce[1] = Job->Partials[I];
+		Reduce[0] = ml_call(Function, 2, Reduce);
+		if (ml_typeof(Reduce[0]) == MLErrorT) return Reduce[0];
+	}
+	return Reduce[0];
+}
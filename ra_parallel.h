@@ -0,0 +1,10 @@
+#ifndef RA_PARALLEL_H
+#define RA_PARALLEL_H
+
+#include "minilang.h"
+
+ml_value_t *ra_parallel_map(void *Data, int Count, ml_value_t **Args);
+ml_value_t *ra_parallel_reduce(void *Data, int Count, ml_value_t **Args);
+ml_value_t *ra_parallel_foreach(void *Data, int Count, ml_value_t **Args);
+
+#endif
@@ -0,0 +1,260 @@
+#include "ra_ring.h"
+#include "ra_events.h"
+#include "ra_schema.h"
+#include <pthread.h>
+#include <gc.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define new(T) ((T *)GC_MALLOC(sizeof(T)))
+#define anew(T, N) ((T *)GC_MALLOC((N) * sizeof(T)))
+#define snew(N) ((char *)GC_MALLOC_ATOMIC(N))
+#define xnew(T, N, U) ((T *)GC_MALLOC(sizeof(T) + (N) * sizeof(U)))
+
+#define RA_RING_DRAIN_LIMIT 4096
+
+typedef struct ra_ring_t ra_ring_t;
+
+struct ra_ring_t {
+	const ml_type_t *Type;
+	ra_ring_t *Next;
+	ra_ring_header_t *Header;
+	ml_value_t *Drain;
+	ra_schema_t *Schema;
+	ra_schema_index_t *Index;
+	ra_schema_field_t *Fields[RA_RING_MAX_FIELDS];
+	ra_ring_field_t Layout[RA_RING_MAX_FIELDS];
+	size_t Size;
+	uint64_t Mask;
+	uint32_t RecordSize;
+	int Op, NumKeys, NumFields, Pending, Closed;
+};
+
+ml_type_t RaRingT[1] = {{
+	MLAnyT, "ring",
+	ml_default_hash,
+	ml_default_call,
+	ml_default_deref,
+	ml_default_assign,
+	ml_default_next,
+	ml_default_key
+}};
+
+static ra_ring_t *Rings = 0;
+static int Polling = 0;
+static pthread_mutex_t RingsLock[1] = {PTHREAD_MUTEX_INITIALIZER};
+
+static ml_value_t *ra_ring_drain(void *Data, int Count, ml_value_t **Args) {
+	ra_ring_t *Ring = (ra_ring_t *)Data;
+	ra_ring_header_t *Header = Ring->Header;
+	ml_value_t *Error = MLNil;
+	if (!Ring->Closed) {
+		uint64_t Tail = Header->Tail;
+		uint64_t Head = __atomic_load_n(&Header->Head, __ATOMIC_ACQUIRE);
+		if (Head - Tail > RA_RING_DRAIN_LIMIT) Head = Tail + RA_RING_DRAIN_LIMIT;
+		int NumFields = Ring->NumFields;
+		ml_value_t *Values[NumFields];
+		for (; Tail != Head; ++Tail) {
+			const char *Record = Header->Records + (Tail & Ring->Mask) * Ring->RecordSize;
+			for (int I = 0; I < NumFields; ++I) {
+				const char *P = Record + Ring->Layout[I].Offset;
+				switch (Ring->Layout[I].Kind) {
+				case RA_RING_INTEGER: {
+					int64_t Value;
+					memcpy(&Value, P, 8);
+					Values[I] = ml_integer(Value);
+					break;
+				}
+				case RA_RING_REAL: {
+					double Value;
+					memcpy(&Value, P, 8);
+					Values[I] = ml_real(Value);
+					break;
+				}
+				case RA_RING_STRING: {
+					uint16_t Length;
+					memcpy(&Length, P, 2);
+					if (Length > Ring->Layout[I].Size) Length = Ring->Layout[I].Size;
+					if (Length <= ML_STRING_INTERN_LENGTH) {
+						Values[I] = ml_string_intern(P + 2, Length);
+					} else {
+						char *Chars = snew(Length + 1);
+						memcpy(Chars, P + 2, Length);
+						Chars[Length] = 0;
+						Values[I] = ml_string(Chars, Length);
+					}
+					break;
+				}
+				}
+			}
+			ml_value_t *Result;
+			if (Ring->Op == RA_RING_UPDATE) {
+				ra_instance_t *Instance = ra_schema_index_search(Ring->Index, Values);
+				if (!Instance) continue;
+				Result = (ml_value_t *)ra_instance_update(Instance, NumFields - Ring->NumKeys, Ring->Fields + Ring->NumKeys, Values + Ring->NumKeys);
+			} else {
+				Result = (ml_value_t *)ra_instance_create(Ring->Schema, NumFields, Ring->Fields, Values, Ring->Op == RA_RING_SIGNAL);
+			}
+			if (ml_typeof(Result) == MLErrorT) Error = Result;
+		}
+		__atomic_store_n(&Header->Tail, Tail, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_lock(RingsLock);
+	Ring->Pending = 0;
+	if (Ring->Closed) munmap(Ring->Header, Ring->Size);
+	pthread_mutex_unlock(RingsLock);
+	return Error;
+}
+
+static void *ra_ring_poll(void *Data) {
+	int Idle = 0;
+	for (;;) {
+		int Busy = 0;
+		pthread_mutex_lock(RingsLock);
+		for (ra_ring_t *Ring = Rings; Ring; Ring = Ring->Next) {
+			if (Ring->Pending) continue;
+			ra_ring_header_t *Header = Ring->Header;
+			if (__atomic_load_n(&Header->Head, __ATOMIC_ACQUIRE) != Header->Tail) {
+				Ring->Pending = 1;
+				ra_action_enqueue(Ring->Drain, 0, 0);
+				Busy = 1;
+			}
+		}
+		pthread_mutex_unlock(RingsLock);
+		if (Busy) {
+			Idle = 0;
+		} else if (Idle < 1000) {
+			++Idle;
+		}
+		struct timespec Delay[1] = {{0, Idle < 100 ? 20000 : 1000000}};
+		nanosleep(Delay, 0);
+	}
+	return 0;
+}
+
+ml_value_t *ra_ring_attach(void *Data, int Count, ml_value_t **Args) {
+	ML_CHECK_ARG_COUNT(1);
+	ML_CHECK_ARG_TYPE(0, MLStringT);
+	const char *Path = ml_string_value(Args[0]);
+	int Fd = open(Path, O_RDWR | O_CLOEXEC);
+	if (Fd < 0) return ml_error("IOError", "failed to open ring %s", Path);
+	struct stat Stat[1];
+	if (fstat(Fd, Stat) || Stat->st_size < sizeof(ra_ring_header_t)) {
+		close(Fd);
+		return ml_error("RingError", "%s is not a ring", Path);
+	}
+	ra_ring_header_t *Header = mmap(0, Stat->st_size, PROT_READ | PROT_WRITE, MAP_SHARED, Fd, 0);
+	close(Fd);
+	if (Header == MAP_FAILED) return ml_error("IOError", "failed to map ring %s", Path);
+	ra_ring_t *Ring = new(ra_ring_t);
+	Ring->Type = RaRingT;
+	Ring->Header = Header;
+	Ring->Size = Stat->st_size;
+	Ring->Op = Header->Op;
+	Ring->NumKeys = Header->NumKeys;
+	Ring->NumFields = Header->NumFields;
+	Ring->RecordSize = Header->RecordSize;
+	Ring->Mask = Header->Capacity - 1;
+	const char *Error = 0;
+	if (__atomic_load_n(&Header->Magic, __ATOMIC_ACQUIRE) != RA_RING_MAGIC) {
+		Error = "bad magic";
+	} else if (!Header->Capacity || (Header->Capacity & Ring->Mask)) {
+		Error = "capacity is not a power of two";
+	} else if (Ring->NumFields > RA_RING_MAX_FIELDS || Ring->NumKeys > Ring->NumFields) {
+		Error = "bad field count";
+	} else if (Ring->Op < RA_RING_INSERT || Ring->Op > RA_RING_SIGNAL || (Ring->Op == RA_RING_UPDATE && !Ring->NumKeys)) {
+		Error = "bad operation";
+	} else if ((Stat->st_size - sizeof(ra_ring_header_t)) / Header->Capacity < Ring->RecordSize) {
+		Error = "file is too small";
+	} else if (!memchr(Header->Schema, 0, RA_RING_NAME_LENGTH)) {
+		Error = "bad schema name";
+	}
+	memcpy(Ring->Layout, Header->Fields, sizeof(Ring->Layout));
+	for (int I = 0; !Error && I < Ring->NumFields; ++I) {
+		ra_ring_field_t *Field = Ring->Layout + I;
+		// Widened so that a hostile Size or Offset can not wrap past the record bounds check.
+		uint64_t Size = Field->Kind == RA_RING_STRING ? 2 + (uint64_t)Field->Size : 8;
+		if (!memchr(Field->Name, 0, RA_RING_NAME_LENGTH)) {
+			Error = "bad field name";
+		} else if (Field->Kind < RA_RING_INTEGER || Field->Kind > RA_RING_STRING) {
+			Error = "bad field kind";
+		} else if (Field->Kind == RA_RING_STRING && Field->Size > UINT16_MAX) {
+			Error = "bad field size";
+		} else if ((uint64_t)Field->Offset + Size > Ring->RecordSize) {
+			Error = "field outside record";
+		}
+	}
+	if (Error) {
+		munmap(Header, Stat->st_size);
+		return ml_error("RingError", "%s: %s", Path, Error);
+	}
+	// The layout comes from the producer, so it may only name a schema and fields the script has
+	// declared; adding fields here would overrun the instances that already exist.
+	ra_schema_t *Schema = Ring->Schema = ra_schema_by_name(Header->Schema);
+	if (!Schema) {
+		ml_value_t *Result = ml_error("RingError", "%s: unknown schema %s", Path, Header->Schema);
+		munmap(Header, Stat->st_size);
+		return Result;
+	}
+	const char *KeyNames[Ring->NumKeys + 1];
+	for (int I = 0; I < Ring->NumFields; ++I) {
+		Ring->Fields[I] = ra_schema_field_by_name(Schema, Ring->Layout[I].Name);
+		if (!Ring->Fields[I]) {
+			ml_value_t *Result = ml_error("RingError", "%s: schema %s has no field %s", Path, Header->Schema, Ring->Layout[I].Name);
+			munmap(Header, Stat->st_size);
+			return Result;
+		}
+		if (I < Ring->NumKeys) {
+			char *FieldName = snew(RA_RING_NAME_LENGTH);
+			strcpy(FieldName, Ring->Layout[I].Name);
+			KeyNames[I] = FieldName;
+		}
+	}
+	KeyNames[Ring->NumKeys] = 0;
+	if (Ring->Op == RA_RING_UPDATE) {
+		Ring->Index = ra_schema_index_by_names(Schema, KeyNames) ?: ra_schema_index_create(Schema, KeyNames);
+	}
+	Ring->Drain = ml_function(Ring, ra_ring_drain);
+	pthread_mutex_lock(RingsLock);
+	Ring->Next = Rings;
+	Rings = Ring;
+	if (!Polling) {
+		Polling = 1;
+		pthread_t Thread[1];
+		GC_pthread_create(Thread, 0, ra_ring_poll, 0);
+	}
+	pthread_mutex_unlock(RingsLock);
+	__atomic_store_n(&Header->Attached, 1, __ATOMIC_RELEASE);
+	return (ml_value_t *)Ring;
+}
+
+static ml_value_t *ra_ring_cancel(void *Data, int Count, ml_value_t **Args) {
+	ra_ring_t *Ring = (ra_ring_t *)Args[0];
+	pthread_mutex_lock(RingsLock);
+	if (!Ring->Closed) {
+		Ring->Closed = 1;
+		ra_ring_t **Slot = &Rings;
+		while (Slot[0] && Slot[0] != Ring) Slot = &Slot[0]->Next;
+		if (Slot[0] == Ring) Slot[0] = Ring->Next;
+		if (!Ring->Pending) munmap(Ring->Header, Ring->Size);
+	}
+	pthread_mutex_unlock(RingsLock);
+	return MLNil;
+}
+
+static ml_value_t *ra_ring_pending(void *Data, int Count, ml_value_t **Args) {
+	ra_ring_t *Ring = (ra_ring_t *)Args[0];
+	if (Ring->Closed) return ml_integer(0);
+	ra_ring_header_t *Header = Ring->Header;
+	return ml_integer(__atomic_load_n(&Header->Head, __ATOMIC_ACQUIRE) - Header->Tail);
+}
+
+void ra_ring_init() {
+	ml_method_by_name("cancel", 0, ra_ring_cancel, RaRingT, 0);
+	ml_method_by_name("pending", 0, ra_ring_pending, RaRingT, 0);
+}
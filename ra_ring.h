@@ -0,0 +1,13 @@
+#ifndef RA_RING_H
+#define RA_RING_H
+
+#include "minilang.h"
+#include "ra_ring_producer.h"
+
+ml_value_t *ra_ring_attach(void *Data, int Count, ml_value_t **Args);
+
+void ra_ring_init();
+
+extern ml_type_t RaRingT[];
+
+#endif
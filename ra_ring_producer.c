@@ -0,0 +1,113 @@
+#include "ra_ring_producer.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+struct ra_ring_producer_t {
+	ra_ring_header_t *Header;
+	size_t Size;
+	uint64_t Head, Tail, Mask;
+	int Fd;
+};
+
+ra_ring_producer_t *ra_ring_producer_create(const char *Path, const char *Schema, ra_ring_op_t Op, int NumKeys, int NumFields, const char **Names, const ra_ring_kind_t *Kinds, const int *Sizes, uint64_t Capacity) {
+	if (NumFields > RA_RING_MAX_FIELDS || NumKeys > NumFields) return 0;
+	if (!Capacity || (Capacity & (Capacity - 1))) return 0;
+	if (strlen(Schema) >= RA_RING_NAME_LENGTH) return 0;
+	ra_ring_header_t Header[1];
+	memset(Header, 0, sizeof(ra_ring_header_t));
+	Header->Capacity = Capacity;
+	Header->Op = Op;
+	Header->NumKeys = NumKeys;
+	Header->NumFields = NumFields;
+	strcpy(Header->Schema, Schema);
+	uint32_t Offset = 0;
+	for (int I = 0; I < NumFields; ++I) {
+		ra_ring_field_t *Field = Header->Fields + I;
+		if (strlen(Names[I]) >= RA_RING_NAME_LENGTH) return 0;
+		strcpy(Field->Name, Names[I]);
+		Field->Kind = Kinds[I];
+		switch (Kinds[I]) {
+		case RA_RING_INTEGER:
+		case RA_RING_REAL:
+			Field->Size = 8;
+			Offset = (Offset + 7) & ~7;
+			Field->Offset = Offset;
+			Offset += 8;
+			break;
+		case RA_RING_STRING:
+			if (Sizes[I] <= 0 || Sizes[I] > 65535) return 0;
+			Field->Size = Sizes[I];
+			Offset = (Offset + 1) & ~1;
+			Field->Offset = Offset;
+			Offset += 2 + Sizes[I];
+			break;
+		default:
+			return 0;
+		}
+	}
+	Header->RecordSize = (Offset + 7) & ~7;
+	size_t Size = sizeof(ra_ring_header_t) + Capacity * Header->RecordSize;
+	int Fd = open(Path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (Fd < 0) return 0;
+	if (ftruncate(Fd, Size)) {
+		close(Fd);
+		return 0;
+	}
+	ra_ring_header_t *Shared = mmap(0, Size, PROT_READ | PROT_WRITE, MAP_SHARED, Fd, 0);
+	if (Shared == MAP_FAILED) {
+		close(Fd);
+		return 0;
+	}
+	memcpy(Shared, Header, sizeof(ra_ring_header_t));
+	__atomic_store_n(&Shared->Magic, RA_RING_MAGIC, __ATOMIC_RELEASE);
+	ra_ring_producer_t *Producer = malloc(sizeof(ra_ring_producer_t));
+	Producer->Header = Shared;
+	Producer->Size = Size;
+	Producer->Head = Producer->Tail = 0;
+	Producer->Mask = Capacity - 1;
+	Producer->Fd = Fd;
+	return Producer;
+}
+
+ra_ring_header_t *ra_ring_producer_header(ra_ring_producer_t *Producer) {
+	return Producer->Header;
+}
+
+void *ra_ring_producer_reserve(ra_ring_producer_t *Producer) {
+	ra_ring_header_t *Header = Producer->Header;
+	if (Producer->Head - Producer->Tail == Header->Capacity) {
+		Producer->Tail = __atomic_load_n(&Header->Tail, __ATOMIC_ACQUIRE);
+		if (Producer->Head - Producer->Tail == Header->Capacity) return 0;
+	}
+	return Header->Records + (Producer->Head++ & Producer->Mask) * Header->RecordSize;
+}
+
+void ra_ring_producer_commit(ra_ring_producer_t *Producer) {
+	__atomic_store_n(&Producer->Header->Head, Producer->Head, __ATOMIC_RELEASE);
+}
+
+void ra_ring_producer_close(ra_ring_producer_t *Producer) {
+	munmap(Producer->Header, Producer->Size);
+	close(Producer->Fd);
+	free(Producer);
+}
+
+void ra_ring_set_integer(ra_ring_producer_t *Producer, void *Record, int Field, int64_t Value) {
+	memcpy((char *)Record + Producer->Header->Fields[Field].Offset, &Value, 8);
+}
+
+void ra_ring_set_real(ra_ring_producer_t *Producer, void *Record, int Field, double Value) {
+	memcpy((char *)Record + Producer->Header->Fields[Field].Offset, &Value, 8);
+}
+
+void ra_ring_set_string(ra_ring_producer_t *Producer, void *Record, int Field, const char *Chars, int Length) {
+	ra_ring_field_t *Info = Producer->Header->Fields + Field;
+	if (Length > Info->Size) Length = Info->Size;
+	uint16_t Length16 = Length;
+	char *P = (char *)Record + Info->Offset;
+	memcpy(P, &Length16, 2);
+	memcpy(P + 2, Chars, Length);
+}
@@ -0,0 +1,58 @@
+#ifndef RA_RING_PRODUCER_H
+#define RA_RING_PRODUCER_H
+
+#include <stdint.h>
+
+/*
+ * Shared-memory single producer / single consumer ring. The producer creates and sizes the file,
+ * describes a fixed record layout in the header and publishes records by advancing Head; the
+ * engine attaches with ring(Path), consumes records straight from the mapping and advances Tail.
+ * Integers and reals are stored natively, strings as a uint16_t length followed by Size bytes.
+ * For RA_RING_UPDATE, the first NumKeys fields select the instance to update.
+ */
+
+#define RA_RING_MAGIC 0x31474e4952474152UL
+#define RA_RING_NAME_LENGTH 32
+#define RA_RING_MAX_FIELDS 16
+
+typedef enum {
+	RA_RING_INSERT = 1,
+	RA_RING_UPDATE = 2,
+	RA_RING_SIGNAL = 3
+} ra_ring_op_t;
+
+typedef enum {
+	RA_RING_INTEGER = 1,
+	RA_RING_REAL = 2,
+	RA_RING_STRING = 3
+} ra_ring_kind_t;
+
+typedef struct ra_ring_field_t {
+	char Name[RA_RING_NAME_LENGTH];
+	uint32_t Kind, Offset, Size;
+} ra_ring_field_t;
+
+typedef struct ra_ring_header_t {
+	uint64_t Magic, Capacity;
+	uint32_t Op, NumKeys, NumFields, RecordSize;
+	char Schema[RA_RING_NAME_LENGTH];
+	ra_ring_field_t Fields[RA_RING_MAX_FIELDS];
+	volatile uint32_t Attached;
+	volatile uint64_t Head __attribute__((aligned(64)));
+	volatile uint64_t Tail __attribute__((aligned(64)));
+	char Records[] __attribute__((aligned(64)));
+} ra_ring_header_t;
+
+typedef struct ra_ring_producer_t ra_ring_producer_t;
+
+ra_ring_producer_t *ra_ring_producer_create(const char *Path, const char *Schema, ra_ring_op_t Op, int NumKeys, int NumFields, const char **Names, const ra_ring_kind_t *Kinds, const int *Sizes, uint64_t Capacity);
+ra_ring_header_t *ra_ring_producer_header(ra_ring_producer_t *Producer);
+void *ra_ring_producer_reserve(ra_ring_producer_t *Producer);
+void ra_ring_producer_commit(ra_ring_producer_t *Producer);
+void ra_ring_producer_close(ra_ring_producer_t *Producer);
+
+void ra_ring_set_integer(ra_ring_producer_t *Producer, void *Record, int Field, int64_t Value);
+void ra_ring_set_real(ra_ring_producer_t *Producer, void *Record, int Field, double Value);
+void ra_ring_set_string(ra_ring_producer_t *Producer, void *Record, int Field, const char *Chars, int Length);
+
+#endif
@@ -0,0 +1,143 @@
+#include "ra_rules.h"
+#include <gc.h>
+#include <string.h>
+
+#define new(T) ((T *)GC_MALLOC(sizeof(T)))
+
+typedef struct ra_rule_t ra_rule_t;
+
+struct ra_rule_t {
+	ra_rule_t *Next;
+	ml_value_t *Object, *Cancel;
+	unsigned char Key[SHA256_BLOCK_SIZE];
+	int Kept;
+};
+
+// Rules are the listeners, timers, sources and instances created while the top level of a script runs.
+// A reload runs the new top level between ra_rules_begin() and ra_rules_end(); a rule whose key
+// matches one from the previous run is handed back instead of being created again, and the
+// rules left unmatched are cancelled when the reload commits.
+
+static ra_rule_t *Rules = 0, *Previous = 0;
+static int Recording = 0;
+static ml_value_t *CancelMethod;
+
+void ra_rules_begin() {
+	Previous = Rules;
+	Rules = 0;
+	Recording = 1;
+}
+
+static void ra_rule_cancel(ra_rule_t *Rule) {
+	ml_call(Rule->Cancel, 1, &Rule->Object);
+}
+
+void ra_rules_end(int Commit) {
+	Recording = 0;
+	if (Commit) {
+		for (ra_rule_t *Rule = Previous; Rule; Rule = Rule->Next) ra_rule_cancel(Rule);
+	} else {
+		ra_rule_t *Rule = Rules;
+		while (Rule) {
+			ra_rule_t *Next = Rule->Next;
+			if (Rule->Kept) {
+				Rule->Next = Previous;
+				Previous = Rule;
+			} else {
+				ra_rule_cancel(Rule);
+			}
+			Rule = Next;
+		}
+		Rules = Previous;
+	}
+	Previous = 0;
+	for (ra_rule_t *Rule = Rules; Rule; Rule = Rule->Next) Rule->Kept = 0;
+}
+
+int ra_rules_active() {
+	return Recording;
+}
+
+ml_value_t *ra_rule_find(unsigned char Key[SHA256_BLOCK_SIZE]) {
+	if (!Recording) return 0;
+	for (ra_rule_t **Slot = &Previous; Slot[0]; Slot = &Slot[0]->Next) {
+		ra_rule_t *Rule = Slot[0];
+		if (!memcmp(Rule->Key, Key, SHA256_BLOCK_SIZE)) {
+			Slot[0] = Rule->Next;
+			Rule->Kept = 1;
+			Rule->Next = Rules;
+			Rules = Rule;
+			return Rule->Object;
+		}
+	}
+	return 0;
+}
+
+void ra_rule_add(unsigned char Key[SHA256_BLOCK_SIZE], ml_value_t *Object, ml_value_t *Cancel) {
+	if (!Recording) return;
+	ra_rule_t *Rule = new(ra_rule_t);
+	memcpy(Rule->Key, Key, SHA256_BLOCK_SIZE);
+	Rule->Object = Object;
+	Rule->Cancel = Cancel;
+	Rule->Next = Rules;
+	Rules = Rule;
+}
+
+#define RA_RULE_HASH_DEPTH 4
+
+static void ra_rule_hash_value(SHA256_CTX *Context, ml_value_t *Value, int Depth) {
+	// Keys must tell arguments apart, so strings and numbers are hashed by value, closures by their code
+	// and the current values of their upvalues, and anything else (inotify handles, files, watches) by
+	// identity; ml_hash() is not enough since most types hash only their type name. Upvalues are followed
+	// only a few closures deep since recursive functions capture themselves.
+	if (!Value) Value = MLNil;
+	Value = ml_typeof(Value)->deref(Value) ?: MLNil;
+	const ml_type_t *Type = ml_typeof(Value);
+	sha256_update(Context, (BYTE *)&Type, sizeof(Type));
+	if (Type == MLClosureT) {
+		unsigned char Hash[SHA256_BLOCK_SIZE];
+		ml_closure_hash(Value, Hash);
+		sha256_update(Context, Hash, SHA256_BLOCK_SIZE);
+		if (Depth > 0) {
+			int Count;
+			ml_value_t **UpValues = ml_closure_upvalues(Value, &Count);
+			for (int I = 0; I < Count; ++I) ra_rule_hash_value(Context, UpValues[I], Depth - 1);
+		}
+	} else if (Type == MLStringT) {
+		int Length = ml_string_length(Value);
+		sha256_update(Context, (BYTE *)&Length, sizeof(Length));
+		sha256_update(Context, (BYTE *)ml_string_value(Value), Length);
+	} else if (Type == MLIntegerT) {
+		long Integer = ml_integer_value(Value);
+		sha256_update(Context, (BYTE *)&Integer, sizeof(Integer));
+	} else if (Type == MLRealT) {
+		double Real = ml_real_value(Value);
+		sha256_update(Context, (BYTE *)&Real, sizeof(Real));
+	} else {
+		sha256_update(Context, (BYTE *)&Value, sizeof(Value));
+	}
+}
+
+void ra_rule_hash(SHA256_CTX *Context, ml_value_t *Value) {
+	ra_rule_hash_value(Context, Value, RA_RULE_HASH_DEPTH);
+}
+
+static ml_value_t *ra_rule_call(void *Data, int Count, ml_value_t **Args) {
+	ml_value_t *Function = (ml_value_t *)Data;
+	if (!Recording) return ml_call(Function, Count, Args);
+	unsigned char Key[SHA256_BLOCK_SIZE];
+	SHA256_CTX Context[1];
+	sha256_init(Context);
+	sha256_update(Context, (BYTE *)&Function, sizeof(Function));
+	for (int I = 0; I < Count; ++I) ra_rule_hash(Context, Args[I]);
+	sha256_final(Context, Key);
+	ml_value_t *Object = ra_rule_find(Key);
+	if (Object) return Object;
+	Object = ml_call(Function, Count, Args);
+	if (ml_typeof(Object) != MLErrorT) ra_rule_add(Key, Object, CancelMethod ?: (CancelMethod = ml_method("cancel")));
+	return Object;
+}
+
+ml_value_t *ra_rule(ml_value_t *Function) {
+	return ml_function(Function, ra_rule_call);
+}
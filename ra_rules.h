@@ -0,0 +1,17 @@
+#ifndef RA_RULES_H
+#define RA_RULES_H
+
+#include "minilang.h"
+#include "sha256.h"
+
+void ra_rules_begin();
+void ra_rules_end(int Commit);
+int ra_rules_active();
+
+ml_value_t *ra_rule_find(unsigned char Key[SHA256_BLOCK_SIZE]);
+void ra_rule_add(unsigned char Key[SHA256_BLOCK_SIZE], ml_value_t *Object, ml_value_t *Cancel);
+void ra_rule_hash(SHA256_CTX *Context, ml_value_t *Value);
+
+ml_value_t *ra_rule(ml_value_t *Function);
+
+#endif
@@ -1,5 +1,6 @@
 #include "ra_schema.h"
 #include "ra_events.h"
+#include "ra_rules.h"
 #include <gc.h>
 #include <string.h>
 #include <stdio.h>
@@ -34,6 +35,7 @@ struct ra_schema_t {
 	stringmap_t Fields[1];
 	stringmap_t Indices[1];
 	int InstanceSize, NumListeners, MaxListeners;
+	int Sealed;
 };
 
 struct ra_schema_index_node_t {
@@ -45,6 +47,7 @@ struct ra_schema_index_node_t {
 
 struct ra_schema_index_t {
 	const ml_type_t *Type;
+	ra_schema_t *Schema;
 	ra_schema_index_t *Parent;
 	ra_schema_index_node_t *Root;
 	ra_schema_field_t **Fields;
@@ -187,7 +190,7 @@ static ra_instance_t *ra_schema_index_insert_instance_internal(ra_schema_index_t
 			Args[0] = Values[I];
 			Args[1] = ra_instance_field_by_field(Slot[0]->Instance, Index->Fields[I]);
 			ml_value_t *Result = ml_call(CompareMethod, 2, Args);
-			if (Result->Type == MLIntegerT) Compare = ml_integer_value(Result);
+			if (ml_typeof(Result) == MLIntegerT) Compare = ml_integer_value(Result);
 			if (Compare) break;
 		}
 	}
@@ -222,6 +225,7 @@ static int ra_schema_field_copy_callback(const char *Name, ra_schema_field_t *Fi
 static int ra_schema_index_copy_callback(const char *Name, ra_schema_index_t *Parent, ra_schema_t *Schema) {
 	ra_schema_index_t *Index = new(ra_schema_index_t);
 	Index->Type = RaSchemaIndexT;
+	Index->Schema = Schema;
 	Index->Parent = Parent;
 	Index->Fields = Parent->Fields;
 	Index->NumFields = Parent->NumFields;
@@ -249,7 +253,14 @@ ra_schema_t *ra_schema_by_name(const char *Name) {
 	return (ra_schema_t *)stringmap_search(Schemas, Name);
 }
 
+int ra_schema_sealed(ra_schema_t *Schema) {
+	return Schema->Sealed;
+}
+
 ra_schema_field_t *ra_schema_value_field_create(ra_schema_t *Schema, const char *Name) {
+	// Instances are allocated with room for exactly InstanceSize values, so once any exist
+	// (including signals, which listeners may still hold) no more value fields can be added.
+	if (Schema->Sealed) return 0;
 	ra_schema_field_t *Field = new(ra_schema_field_t);
 	Field->Name = Name;
 	Field->Type = VALUE_FIELD;
@@ -287,6 +298,7 @@ ra_schema_field_t *ra_schema_field_by_name(ra_schema_t *Schema, const char *Name
 ra_schema_index_t *ra_schema_index_create(ra_schema_t *Schema, const char **FieldNames) {
 	ra_schema_index_t *Index = new(ra_schema_index_t);
 	Index->Type = RaSchemaIndexT;
+	Index->Schema = Schema;
 	Index->Parent = 0;
 	int NumFields = 0;
 	int IndexNameLength = 0;
@@ -299,6 +311,7 @@ ra_schema_index_t *ra_schema_index_create(ra_schema_t *Schema, const char **Fiel
 	char *IndexName = snew(IndexNameLength), *P = IndexName;
 	for (int I = 0; I < NumFields; ++I) {
 		Fields[I] = ra_schema_field_by_name(Schema, FieldNames[I]) ?: ra_schema_value_field_create(Schema, FieldNames[I]);
+		if (!Fields[I]) return 0;
 		P = stpcpy(P, FieldNames[I]);
 		*P++ = ' ';
 	}
@@ -342,7 +355,7 @@ ra_instance_t *ra_schema_index_search(ra_schema_index_t *Index, ml_value_t **Val
 				Args[0] = Values[I];
 				Args[1] = ra_instance_field_by_field(Node->Instance, Index->Fields[I]);
 				ml_value_t *Result = ml_call(CompareMethod, 2, Args);
-				if (Result->Type == MLIntegerT) Compare = ml_integer_value(Result);
+				if (ml_typeof(Result) == MLIntegerT) Compare = ml_integer_value(Result);
 				if (Compare) break;
 			}
 		}
@@ -389,7 +402,7 @@ static void ra_listener_remove(ra_listener_t *Listener) {
 	for (int I = 0; I < Listener->NumSchemas; ++I) {
 		ra_schema_listener_t *SchemaListener = &Listener->Schemas[I];
 		ra_schema_listener_t **Slot;
-		if (SchemaListener->Target->Type == RaInstanceT) {
+		if (ml_typeof(SchemaListener->Target) == RaInstanceT) {
 			Slot = &((ra_instance_t *)SchemaListener->Target)->Listeners;
 		} else {
 			Slot = &((ra_schema_t *)SchemaListener->Target)->Listeners;
@@ -410,7 +423,7 @@ static int ra_schema_listener_apply(ra_schema_listener_t *Listener, ml_value_t *
 			Args[0] = IndexValues[I];
 			Args[1] = ra_instance_field_by_field(Instance, Index->Fields[I]);
 			ml_value_t *Result = ml_call(CompareMethod, 2, Args);
-			if (Result->Type == MLIntegerT && ml_integer_value(Result) != 0) {
+			if (ml_typeof(Result) == MLIntegerT && ml_integer_value(Result) != 0) {
 				Instance = 0;
 				break;
 			}
@@ -459,10 +472,62 @@ int ra_schema_foreach(ra_schema_t *Schema, void *Data, int (*callback)(ra_instan
 	return 0;
 }
 
+typedef struct ra_schema_iter_t {
+	const ml_type_t *Type;
+	ra_instance_t *Instance;
+	long Index;
+} ra_schema_iter_t;
+
+static ml_value_t *ra_schema_iter_deref(ml_value_t *Ref) {
+	ra_schema_iter_t *Iter = (ra_schema_iter_t *)Ref;
+	return (ml_value_t *)Iter->Instance;
+}
+
+static ml_value_t *ra_schema_iter_next(ml_value_t *Ref) {
+	ra_schema_iter_t *Iter = (ra_schema_iter_t *)Ref;
+	if (!(Iter->Instance = Iter->Instance->Next)) return MLNil;
+	++Iter->Index;
+	return Ref;
+}
+
+static ml_value_t *ra_schema_iter_key(ml_value_t *Ref) {
+	ra_schema_iter_t *Iter = (ra_schema_iter_t *)Ref;
+	return ml_integer(Iter->Index);
+}
+
+ml_type_t RaSchemaIterT[1] = {{
+	MLAnyT, "schema-iter",
+	ml_default_hash,
+	ml_default_call,
+	ra_schema_iter_deref,
+	ml_default_assign,
+	ra_schema_iter_next,
+	ra_schema_iter_key
+}};
+
+static ml_value_t *ra_schema_values(void *Data, int Count, ml_value_t **Args) {
+	ra_schema_t *Schema = (ra_schema_t *)Args[0];
+	if (!Schema->Head) return MLNil;
+	ra_schema_iter_t *Iter = new(ra_schema_iter_t);
+	Iter->Type = RaSchemaIterT;
+	Iter->Instance = Schema->Head;
+	Iter->Index = 1;
+	return (ml_value_t *)Iter;
+}
+
+ml_value_t *ra_schema_instances(void *Data, int Count, ml_value_t **Args) {
+	ML_CHECK_ARG_COUNT(1);
+	ML_CHECK_ARG_TYPE(0, MLStringT);
+	ra_schema_t *Schema = ra_schema_by_name(ml_string_value(Args[0]));
+	if (!Schema) return ml_error("SchemaError", "unknown schema %s", ml_string_value(Args[0]));
+	return (ml_value_t *)Schema;
+}
+
 ra_instance_t *ra_instance_create(ra_schema_t *Schema, int NumFields, ra_schema_field_t **Fields, ml_value_t **Values, int Signal) {
 	ra_instance_t *Instance = xnew(ra_instance_t, Schema->InstanceSize, ml_value_t);
 	Instance->Type = RaInstanceT;
 	Instance->Schema = Schema;
+	for (ra_schema_t *Parent = Schema; Parent && !Parent->Sealed; Parent = Parent->Parent) Parent->Sealed = 1;
 	for (int I = 0; I < Schema->InstanceSize; ++I) Instance->Values[I] = MLNil;
 	for (int I = 0; I < NumFields; ++I) {
 		ra_schema_field_t *Field = Fields[I];
@@ -497,7 +562,7 @@ ra_instance_t *ra_instance_create(ra_schema_t *Schema, int NumFields, ra_schema_
 						Args[0] = SchemaListener->IndexValues[I];
 						Args[1] = ra_instance_field_by_field(Instance, Index->Fields[I]);
 						ml_value_t *Result = ml_call(CompareMethod, 2, Args);
-						if (Result->Type == MLIntegerT && ml_integer_value(Result) != 0) {
+						if (ml_typeof(Result) == MLIntegerT && ml_integer_value(Result) != 0) {
 							SchemaListenerSlot = &SchemaListener->Next;
 							goto next;
 						}
@@ -553,7 +618,7 @@ ra_instance_t *ra_instance_update(ra_instance_t *Instance, int NumFields, ra_sch
 						Args[0] = SchemaListener->IndexValues[I];
 						Args[1] = ra_instance_field_by_field(Instance, Index->Fields[I]);
 						ml_value_t *Result = ml_call(CompareMethod, 2, Args);
-						if (Result->Type == MLIntegerT && ml_integer_value(Result) != 0) {
+						if (ml_typeof(Result) == MLIntegerT && ml_integer_value(Result) != 0) {
 							SchemaListenerSlot = &SchemaListener->Next;
 							goto next;
 						}
@@ -600,7 +665,7 @@ static ra_instance_t *ra_schema_index_remove_instance_internal(ra_schema_index_t
 			Args[0] = Values[I];
 			Args[1] = ra_instance_field_by_field(Slot[0]->Instance, Index->Fields[I]);
 			ml_value_t *Result = ml_call(CompareMethod, 2, Args);
-			if (Result->Type == MLIntegerT) Compare = ml_integer_value(Result);
+			if (ml_typeof(Result) == MLIntegerT) Compare = ml_integer_value(Result);
 			if (Compare) break;
 		}
 	}
@@ -678,7 +743,7 @@ static ra_instance_t *ra_schema_index_remove_instance(ra_schema_index_t *Index,
 						Args[0] = SchemaListener->IndexValues[I];
 						Args[1] = ra_instance_field_by_field(Instance, Index->Fields[I]);
 						ml_value_t *Result = ml_call(CompareMethod, 2, Args);
-						if (Result->Type == MLIntegerT && ml_integer_value(Result) != 0) {
+						if (ml_typeof(Result) == MLIntegerT && ml_integer_value(Result) != 0) {
 							SchemaListenerSlot = &SchemaListener->Next;
 							goto next;
 						}
@@ -740,7 +805,7 @@ void ra_instance_delete(ra_instance_t *Instance) {
 					Args[0] = SchemaListener->IndexValues[I];
 					Args[1] = ra_instance_field_by_field(Instance, Index->Fields[I]);
 					ml_value_t *Result = ml_call(CompareMethod, 2, Args);
-					if (Result->Type == MLIntegerT && ml_integer_value(Result) != 0) {
+					if (ml_typeof(Result) == MLIntegerT && ml_integer_value(Result) != 0) {
 						SchemaListenerSlot = &SchemaListener->Next;
 						goto next;
 					}
@@ -761,7 +826,7 @@ void ra_instance_delete(ra_instance_t *Instance) {
 	}
 }
 
-ml_value_t *ra_listener_create_callback(ra_listener_template_t *Template, int Count, ml_value_t **Args) {
+static ml_value_t *ra_listener_create(ra_listener_template_t *Template, int Count, ml_value_t **Args) {
 	ra_listener_t *Listener = xnew(ra_listener_t, Template->NumSchemas, ra_schema_listener_t);
 	Listener->Type = RaListenerT;
 	ra_schema_listener_t *SchemaListener = &Listener->Schemas[0];
@@ -810,20 +875,70 @@ ml_value_t *ra_listener_create_callback(ra_listener_template_t *Template, int Co
 	return (ml_value_t *)Listener;
 }
 
+static ml_value_t *ListenerDelete;
+
+ml_value_t *ra_listener_create_callback(ra_listener_template_t *Template, int Count, ml_value_t **Args) {
+	if (!ra_rules_active()) return ra_listener_create(Template, Count, Args);
+	unsigned char Key[SHA256_BLOCK_SIZE];
+	SHA256_CTX Context[1];
+	sha256_init(Context);
+	for (int I = 0; I < Template->NumSchemas; ++I) {
+		ra_schema_listener_template_t *SchemaTemplate = &Template->Schemas[I];
+		sha256_update(Context, (BYTE *)&SchemaTemplate->Schema, sizeof(ra_schema_t *));
+		sha256_update(Context, (BYTE *)&SchemaTemplate->Index, sizeof(ra_schema_index_t *));
+		sha256_update(Context, (BYTE *)SchemaTemplate->SelectedFields, SchemaTemplate->NumSelectedFields * sizeof(ra_schema_field_t *));
+		sha256_update(Context, (BYTE *)&SchemaTemplate->Negated, sizeof(int));
+		sha256_update(Context, (BYTE *)&SchemaTemplate->Created, sizeof(int));
+	}
+	for (int I = 0; I < Count; ++I) ra_rule_hash(Context, Args[I]);
+	sha256_final(Context, Key);
+	ml_value_t *Listener = ra_rule_find(Key);
+	if (Listener) return Listener;
+	Listener = ra_listener_create(Template, Count, Args);
+	ra_rule_add(Key, Listener, ListenerDelete);
+	return Listener;
+}
+
 static ml_value_t *ra_listener_delete_callback(void *Data, int Count, ml_value_t **Args) {
 	ra_listener_t *Listener = (ra_listener_t *)Args[0];
 	ra_listener_remove(Listener);
 	return MLNil;
 }
 
+static ml_value_t *InstanceKeep;
+
+static ml_value_t *ra_instance_keep_callback(void *Data, int Count, ml_value_t **Args) {
+	return MLNil;
+}
+
+static ml_value_t *ra_instance_rule_create(ra_instance_template_t *Template, int Count, ml_value_t **Args, int Signal) {
+	// Inserts and signals made while the top level runs are recorded as rules so that a reload hands back
+	// the instance from the previous run instead of inserting it again and firing its listeners.
+	// Dropping one from the script leaves the instance in place.
+	if (!ra_rules_active()) return (ml_value_t *)ra_instance_create(Template->Schema, Template->NumFields, Template->Fields, Args, Signal);
+	unsigned char Key[SHA256_BLOCK_SIZE];
+	SHA256_CTX Context[1];
+	sha256_init(Context);
+	sha256_update(Context, (BYTE *)&Template->Schema, sizeof(ra_schema_t *));
+	sha256_update(Context, (BYTE *)Template->Fields, Template->NumFields * sizeof(ra_schema_field_t *));
+	sha256_update(Context, (BYTE *)&Signal, sizeof(int));
+	for (int I = 0; I < Count; ++I) ra_rule_hash(Context, Args[I]);
+	sha256_final(Context, Key);
+	ml_value_t *Instance = ra_rule_find(Key);
+	if (Instance) return Instance;
+	Instance = (ml_value_t *)ra_instance_create(Template->Schema, Template->NumFields, Template->Fields, Args, Signal);
+	if (ml_typeof(Instance) != MLErrorT) ra_rule_add(Key, Instance, InstanceKeep);
+	return Instance;
+}
+
 ml_value_t *ra_instance_create_callback(ra_instance_template_t *Template, int Count, ml_value_t **Args) {
 	if (Count != Template->NumFields) return ml_error("SchemaError", "expected %d fields but only received %d", Template->NumFields, Count);
-	return (ml_value_t *)ra_instance_create(Template->Schema, Template->NumFields, Template->Fields, Args, 0);
+	return ra_instance_rule_create(Template, Count, Args, 0);
 }
 
 ml_value_t *ra_instance_signal_callback(ra_instance_template_t *Template, int Count, ml_value_t **Args) {
 	if (Count != Template->NumFields) return ml_error("SchemaError", "expected %d fields but only received %d", Template->NumFields, Count);
-	return (ml_value_t *)ra_instance_create(Template->Schema, Template->NumFields, Template->Fields, Args, 1);
+	return ra_instance_rule_create(Template, Count, Args, 1);
 }
 
 ml_value_t *ra_index_instance_exists_callback(ra_schema_index_t *Index, int Count, ml_value_t **Args) {
@@ -831,6 +946,40 @@ ml_value_t *ra_index_instance_exists_callback(ra_schema_index_t *Index, int Coun
 	return (ml_value_t *)ra_schema_index_search(Index, Args) ?: MLNil;
 }
 
+typedef struct ra_wait_t {
+	ra_listener_t *Listener;
+	ml_value_t *Suspension;
+} ra_wait_t;
+
+static ml_value_t *ra_wait_resume(void *Data, int Count, ml_value_t **Args) {
+	ra_wait_t *Wait = (ra_wait_t *)Data;
+	if (!Wait->Listener) return MLNil;
+	ra_listener_remove(Wait->Listener);
+	Wait->Listener = 0;
+	return ml_resume(Wait->Suspension, Args[0]);
+}
+
+static ml_value_t *ra_wait_cancel(void *Data, int Count, ml_value_t **Args) {
+	ra_wait_t *Wait = (ra_wait_t *)Data;
+	if (Wait->Listener) ra_listener_remove(Wait->Listener);
+	Wait->Listener = 0;
+	return MLNil;
+}
+
+ml_value_t *ra_index_instance_wait_callback(ra_listener_template_t *Template, int Count, ml_value_t **Args) {
+	ra_schema_index_t *Index = Template->Schemas[0].Index;
+	if (Count != Index->NumFields) return ml_error("SchemaError", "expected %d fields but only received %d", Index->NumFields, Count);
+	ra_instance_t *Instance = ra_schema_index_search(Index, Args);
+	if (Instance) return (ml_value_t *)Instance;
+	ra_wait_t *Wait = new(ra_wait_t);
+	Wait->Suspension = ml_suspend_cancellable(ml_function(Wait, ra_wait_cancel));
+	ml_value_t **ListenerArgs = anew(ml_value_t *, Count + 1);
+	memcpy(ListenerArgs, Args, Count * sizeof(ml_value_t *));
+	ListenerArgs[Count] = ml_function(Wait, ra_wait_resume);
+	Wait->Listener = (ra_listener_t *)ra_listener_create(Template, Count + 1, ListenerArgs);
+	return Wait->Suspension;
+}
+
 ml_value_t *ra_index_instance_update_callback(ra_schema_field_t **Fields, int Count, ml_value_t **Args) {
 	if (Args[0] == MLNil) return ml_error("SchemaError", "instance not found");
 	ra_instance_t *Instance = (ra_instance_t *)Args[0];
@@ -870,11 +1019,62 @@ static ml_value_t *ra_instance_index_callback(void *Data, int Count, ml_value_t
 	}
 }
 
+static long ra_hash_name(long Hash, const char *Name) {
+	if (Name) for (const char *P = Name; P[0]; ++P) Hash = ((Hash << 5) + Hash) + P[0];
+	return ((Hash << 5) + Hash) + ' ';
+}
+
+static long ra_hash_fields(long Hash, int NumFields, ra_schema_field_t **Fields) {
+	for (int I = 0; I < NumFields; ++I) Hash = ra_hash_name(Hash, Fields[I]->Name);
+	return ((Hash << 5) + Hash) + NumFields;
+}
+
+static long ra_hash_index(long Hash, ra_schema_index_t *Index) {
+	if (!Index) return ((Hash << 5) + Hash) + '-';
+	Hash = ra_hash_name(Hash, Index->Schema->Name);
+	return ra_hash_fields(Hash, Index->NumFields, Index->Fields);
+}
+
+long ra_template_hash(ml_value_t *Value) {
+	ml_function_t *Function = (ml_function_t *)Value;
+	ml_callback_t Callback = Function->Callback;
+	long Hash = 5381;
+	if (Callback == (ml_callback_t)ra_listener_create_callback || Callback == (ml_callback_t)ra_index_instance_wait_callback) {
+		ra_listener_template_t *Template = (ra_listener_template_t *)Function->Data;
+		Hash = ra_hash_name(Hash, Callback == (ml_callback_t)ra_listener_create_callback ? "when" : "wait");
+		for (int I = 0; I < Template->NumSchemas; ++I) {
+			ra_schema_listener_template_t *SchemaTemplate = &Template->Schemas[I];
+			Hash = ra_hash_name(Hash, SchemaTemplate->Schema ? SchemaTemplate->Schema->Name : 0);
+			Hash = ra_hash_index(Hash, SchemaTemplate->Index);
+			Hash = ra_hash_fields(Hash, SchemaTemplate->NumSelectedFields, SchemaTemplate->SelectedFields);
+			Hash = ((Hash << 5) + Hash) + SchemaTemplate->Negated * 2 + SchemaTemplate->Created;
+		}
+	} else if (Callback == (ml_callback_t)ra_instance_create_callback || Callback == (ml_callback_t)ra_instance_signal_callback) {
+		ra_instance_template_t *Template = (ra_instance_template_t *)Function->Data;
+		Hash = ra_hash_name(Hash, Callback == (ml_callback_t)ra_instance_create_callback ? "insert" : "signal");
+		Hash = ra_hash_name(Hash, Template->Schema->Name);
+		Hash = ra_hash_fields(Hash, Template->NumFields, Template->Fields);
+	} else if (Callback == (ml_callback_t)ra_index_instance_exists_callback || Callback == (ml_callback_t)ra_index_instance_delete_callback) {
+		Hash = ra_hash_name(Hash, Callback == (ml_callback_t)ra_index_instance_exists_callback ? "exists" : "delete");
+		Hash = ra_hash_index(Hash, (ra_schema_index_t *)Function->Data);
+	} else if (Callback == (ml_callback_t)ra_index_instance_update_callback) {
+		ra_schema_field_t **Fields = (ra_schema_field_t **)Function->Data;
+		Hash = ra_hash_name(Hash, "update");
+		while (Fields[0]) Hash = ra_hash_name(Hash, (Fields++)[0]->Name);
+	} else {
+		return ml_hash(Value);
+	}
+	return Hash;
+}
+
 void ra_schema_init() {
 	CompareMethod = ml_method("?");
 	ml_method_by_name("delete", 0, ra_listener_delete_callback, RaListenerT, 0);
+	ListenerDelete = ml_function(0, ra_listener_delete_callback);
+	InstanceKeep = ml_function(0, ra_instance_keep_callback);
 	ml_method_by_name("delete", 0, ra_instance_delete_callback, RaInstanceT, 0);
 	ml_method_by_name("[]", 0, ra_instance_index_callback, RaInstanceT, MLStringT, 0);
+	ml_method_by_name("values", 0, ra_schema_values, RaSchemaT, 0);
 	InstanceField = new(ra_schema_field_t);
 	InstanceField->Type = INSTANCE_FIELD;
 }
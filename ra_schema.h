@@ -37,6 +37,7 @@ struct ra_instance_template_t {
 
 ra_schema_t *ra_schema_create(const char *Name, ra_schema_t *Parent);
 ra_schema_t *ra_schema_by_name(const char *Name);
+int ra_schema_sealed(ra_schema_t *Schema);
 ra_schema_field_t *ra_schema_value_field_create(ra_schema_t *Schema, const char *Name);
 ra_schema_field_t *ra_schema_computed_field_create(ra_schema_t *Schema, const char *Name, ml_value_t *Function, const char **FieldNames);
 ra_schema_field_t *ra_schema_constant_field_create(ra_schema_t *Schema, const char *Name, ml_value_t *Constant);
@@ -46,6 +47,7 @@ ra_schema_index_t *ra_schema_index_by_names(ra_schema_t *Schema, const char **Fi
 ra_instance_t *ra_schema_index_search(ra_schema_index_t *Index, ml_value_t **Values);
 
 int ra_schema_foreach(ra_schema_t *Schema, void *Data, int (*callback)(ra_instance_t *Instance, void *Data));
+ml_value_t *ra_schema_instances(void *Data, int Count, ml_value_t **Args);
 
 ra_instance_t *ra_instance_create(ra_schema_t *Schema, int NumFields, ra_schema_field_t **Fields, ml_value_t **Values, int Signal);
 ra_instance_t *ra_instance_update(ra_instance_t *Instance, int NumFields, ra_schema_field_t **Fields, ml_value_t **Values);
@@ -55,11 +57,14 @@ ml_value_t *ra_listener_create_callback(ra_listener_template_t *Template, int Co
 ml_value_t *ra_instance_create_callback(ra_instance_template_t *Schema, int Count, ml_value_t **Args);
 ml_value_t *ra_instance_signal_callback(ra_instance_template_t *Schema, int Count, ml_value_t **Args);
 ml_value_t *ra_index_instance_exists_callback(ra_schema_index_t *Index, int Count, ml_value_t **Args);
+ml_value_t *ra_index_instance_wait_callback(ra_listener_template_t *Template, int Count, ml_value_t **Args);
 ml_value_t *ra_index_instance_update_callback(ra_schema_field_t **Fields, int Count, ml_value_t **Args);
 ml_value_t *ra_index_instance_delete_callback(ra_schema_index_t *Index, int Count, ml_value_t **Args);
 
 ml_value_t *ra_instance_field_by_field(ra_instance_t *Instance, ra_schema_field_t *Field);
 
+long ra_template_hash(ml_value_t *Value);
+
 void ra_schema_init();
 
 extern ml_type_t RaSchemaT[1];
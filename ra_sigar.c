@@ -81,11 +81,8 @@ ml_value_t *ra_update_processes(void *Data, int Count, ml_value_t **Args) {
 		if (sigar_proc_state_get(Sigar, Pid, ProcState) != SIGAR_OK) continue;
 		if (sigar_proc_cpu_get(Sigar, Pid, ProcCpu) != SIGAR_OK) continue;
 		if (sigar_proc_mem_get(Sigar, Pid, ProcMem) != SIGAR_OK) continue;
-		int NameLength = strlen(ProcState->name);
-		char *Name = snew(NameLength + 1);
-		strcpy(Name, ProcState->name);
-		Values[PS_FIELD_NAME] = ml_string(Name, -1);
-		Values[PS_FIELD_STATE] = ml_string(&ProcState->state, 1);
+		Values[PS_FIELD_NAME] = ml_string_intern(ProcState->name, -1);
+		Values[PS_FIELD_STATE] = ml_string_intern(&ProcState->state, 1);
 		Values[PS_FIELD_PARENT] = ml_integer(ProcState->ppid);
 		Values[PS_FIELD_NICE] = ml_integer(ProcState->nice);
 		Values[PS_FIELD_PROCESSOR] = ml_integer(ProcState->processor);
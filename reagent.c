@@ -1,15 +1,24 @@
 #include "reagent.h"
 #include "minilang.h"
 #include "ml_file.h"
+#include "ml_ordered.h"
 #include "stringmap.h"
 #include "ra_schema.h"
 #include "ra_events.h"
+#include "ra_io.h"
+#include "ra_ingest.h"
+#include "ra_ring.h"
+#include "ra_rules.h"
+#include "ra_parallel.h"
 //#include "ra_sigar.h"
 #include <stdio.h>
 #include <gc.h>
 #include <string.h>
 #include <pthread.h>
 #include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 
 #define new(T) ((T *)GC_MALLOC(sizeof(T)))
 #define anew(T, N) ((T *)GC_MALLOC((N) * sizeof(T)))
@@ -26,10 +35,10 @@ static ml_value_t *print(void *Data, int Count, ml_value_t **Args) {
 	ml_value_t *StringMethod = ml_method("string");
 	for (int I = 0; I < Count; ++I) {
 		ml_value_t *Result = Args[I];
-		if (Result->Type != MLStringT) {
+		if (ml_typeof(Result) != MLStringT) {
 			Result = ml_call(StringMethod, 1, &Result);
-			if (Result->Type == MLErrorT) return Result;
-			if (Result->Type != MLStringT) return ml_error("ResultError", "string method did not return string");
+			if (ml_typeof(Result) == MLErrorT) return Result;
+			if (ml_typeof(Result) != MLStringT) return ml_error("ResultError", "string method did not return string");
 		}
 		fputs(ml_string_value(Result), stdout);
 	}
@@ -37,18 +46,30 @@ static ml_value_t *print(void *Data, int Count, ml_value_t **Args) {
 	return MLNil;
 }
 
+static int reagent_seconds(ml_value_t *Value, struct timespec *Time) {
+	if (ml_typeof(Value) == MLIntegerT) {
+		Time->tv_sec = ml_integer_value(Value);
+		Time->tv_nsec = 0;
+	} else if (ml_typeof(Value) == MLRealT) {
+		double Whole, Frac = modf(ml_real_value(Value), &Whole);
+		Time->tv_sec = Whole;
+		Time->tv_nsec = Frac * 1000000000.0;
+	} else {
+		return 1;
+	}
+	return 0;
+}
+
 static ml_value_t *after(void *Data, int Count, ml_value_t **Args) {
 	if (Count < 2) return ml_error("ParamError", "at least one argument required");
-	struct timespec Time[1];
-	clock_gettime(CLOCK_REALTIME, Time);
-	if (Args[0]->Type == MLIntegerT) {
-		Time->tv_sec += ml_integer_value(Args[0]);
-	} else if (Args[0]->Type == MLRealT) {
-		double Whole, Frac = modf(ml_real_value(Args[1]), &Whole);
-		Time->tv_sec += Whole;
-		Time->tv_nsec += Frac * 1000000000.0;
-	} else {
-		return ml_error("ParamError", "time delay must be a number");
+	struct timespec Delay[1], Time[1];
+	if (reagent_seconds(Args[0], Delay)) return ml_error("ParamError", "time delay must be a number");
+	ra_clock_now(Time);
+	Time->tv_sec += Delay->tv_sec;
+	Time->tv_nsec += Delay->tv_nsec;
+	if (Time->tv_nsec >= 1000000000) {
+		Time->tv_sec += 1;
+		Time->tv_nsec -= 1000000000;
 	}
 	ml_value_t **CallbackArgs = 0;
 	if (Count > 2) {
@@ -60,54 +81,166 @@ static ml_value_t *after(void *Data, int Count, ml_value_t **Args) {
 
 static ml_value_t *every(void *Data, int Count, ml_value_t **Args) {
 	if (Count < 2) return ml_error("ParamError", "at least one argument required");
-	struct timespec Time[2];
-	if (Args[0]->Type == MLIntegerT) {
-		Time->tv_sec = ml_integer_value(Args[0]);
-		Time->tv_nsec = 0;
-	} else if (Args[0]->Type == MLRealT) {
-		double Whole, Frac = modf(ml_real_value(Args[1]), &Whole);
-		Time->tv_sec = Whole;
-		Time->tv_nsec = Frac * 1000000000.0;
-	} else {
-		return ml_error("ParamError", "time delay must be a number");
-	}
+	struct timespec Period[1];
+	if (reagent_seconds(Args[0], Period)) return ml_error("ParamError", "time delay must be a number");
+	if (Period->tv_sec <= 0 && Period->tv_nsec <= 0) return ml_error("ParamError", "period must be positive");
 	ml_value_t **CallbackArgs = 0;
 	if (Count > 2) {
 		CallbackArgs = anew(ml_value_t *, Count - 2);
 		memcpy(CallbackArgs, Args + 2, (Count - 2) * sizeof(ml_value_t *));
 	}
-	return (ml_value_t *)ra_event_create(Args[1], Count - 2, CallbackArgs, Time, 1);
+	return (ml_value_t *)ra_periodic_create(Args[1], Count - 2, CallbackArgs, Period, 0, RA_PERIODIC_ONCE);
+}
+
+// periodic(Period, Phase, Policy, Function, Args...) fires on the boundaries Phase + N * Period
+// seconds since the epoch; Policy is "skip", "once" or "all" and controls how missed ticks are handled.
+static ml_value_t *periodic(void *Data, int Count, ml_value_t **Args) {
+	if (Count < 4) return ml_error("ParamError", "at least four arguments required");
+	struct timespec Period[1], Phase[1] = {{0, 0}};
+	if (reagent_seconds(Args[0], Period)) return ml_error("ParamError", "period must be a number");
+	if (Period->tv_sec <= 0 && Period->tv_nsec <= 0) return ml_error("ParamError", "period must be positive");
+	if (Args[1] != MLNil && reagent_seconds(Args[1], Phase)) return ml_error("ParamError", "phase must be a number");
+	if (Phase->tv_sec < 0 || Phase->tv_nsec < 0) return ml_error("ParamError", "phase must not be negative");
+	ra_periodic_policy_t Policy = RA_PERIODIC_ONCE;
+	if (Args[2] != MLNil) {
+		if (ml_typeof(Args[2]) != MLStringT) return ml_error("ParamError", "policy must be a string");
+		const char *Name = ml_string_value(Args[2]);
+		if (!strcmp(Name, "skip")) {
+			Policy = RA_PERIODIC_SKIP;
+		} else if (!strcmp(Name, "once")) {
+			Policy = RA_PERIODIC_ONCE;
+		} else if (!strcmp(Name, "all")) {
+			Policy = RA_PERIODIC_ALL;
+		} else {
+			return ml_error("ParamError", "unknown policy %s", Name);
+		}
+	}
+	ml_value_t **CallbackArgs = 0;
+	if (Count > 4) {
+		CallbackArgs = anew(ml_value_t *, Count - 4);
+		memcpy(CallbackArgs, Args + 4, (Count - 4) * sizeof(ml_value_t *));
+	}
+	return (ml_value_t *)ra_periodic_create(Args[3], Count - 4, CallbackArgs, Period, Phase, Policy);
+}
+
+static ml_value_t *allocated(void *Data, int Count, ml_value_t **Args) {
+	return ml_integer(GC_get_total_bytes());
+}
+
+static const char *ScriptName = 0;
+static int ReloadPipe[2] = {-1, -1};
+
+// Reloading recompiles the script and runs its top level again on the dispatch thread, so the
+// switch happens between action batches. Schemas, instances and indexes are reused by name and
+// rules whose closures and arguments are unchanged keep running, and top level inserts that are
+// unchanged are not repeated; see ra_rules.c.
+static ml_value_t *reagent_reload_action(void *Data, int Count, ml_value_t **Args) {
+	ml_fuel_clear();
+	ml_value_t *Closure = ml_load(reagent_get_global, Globals, ScriptName);
+	if (ml_typeof(Closure) == MLErrorT) return Closure;
+	ra_rules_begin();
+	ml_value_t *Result = ml_call(Closure, 0, 0);
+	ra_rules_end(ml_typeof(Result) != MLErrorT);
+	if (ml_typeof(Result) == MLErrorT) return Result;
+	return MLNil;
+}
+
+static ml_value_t *reload(void *Data, int Count, ml_value_t **Args) {
+	if (!ScriptName) return ml_error("ReloadError", "no script to reload");
+	ra_action_enqueue(ml_function(0, reagent_reload_action), 0, 0);
+	return MLNil;
+}
+
+static void reagent_reload_signal(int Signal) {
+	int Error = errno;
+	char Byte = 0;
+	if (write(ReloadPipe[1], &Byte, 1) < 0) {}
+	errno = Error;
+}
+
+static void reagent_reload_read(ra_watch_t *Watch, void *Data) {
+	char Buffer[64];
+	while (read(ra_watch_fd(Watch), Buffer, sizeof(Buffer)) > 0);
+	ra_action_enqueue(ml_function(0, reagent_reload_action), 0, 0);
 }
 
 int main(int Argc, const char **Argv) {
 	GC_init();
 	ml_init(reagent_get_global);
 	ml_file_init();
+	ml_ordered_init();
 	ra_schema_init();
 	ra_events_init();
+	ra_io_init();
+	ra_ring_init();
 	stringmap_insert(Globals, "print", ml_function(0, print));
-	stringmap_insert(Globals, "after", ml_function(0, after));
-	stringmap_insert(Globals, "every", ml_function(0, every));
+	stringmap_insert(Globals, "after", ra_rule(ml_function(0, after)));
+	stringmap_insert(Globals, "every", ra_rule(ml_function(0, every)));
+	stringmap_insert(Globals, "periodic", ra_rule(ml_function(0, periodic)));
+	stringmap_insert(Globals, "sleep", ml_function(0, ra_events_sleep));
 	stringmap_insert(Globals, "open", ml_function(0, ml_file_open));
+	stringmap_insert(Globals, "watch", ra_rule(ml_function(0, ra_io_watch)));
+	stringmap_insert(Globals, "inotify", ra_rule(ml_function(0, ra_io_inotify)));
+	stringmap_insert(Globals, "ingest", ra_rule(ml_function(0, ra_ingest_listen)));
+	stringmap_insert(Globals, "ring", ra_rule(ml_function(0, ra_ring_attach)));
+	stringmap_insert(Globals, "clock", ml_function(0, ra_clock_value));
+	stringmap_insert(Globals, "timeslice", ml_function(0, ra_events_budget));
+	stringmap_insert(Globals, "lateness", ml_function(0, ra_events_lateness));
+	stringmap_insert(Globals, "fuel", ml_function(0, ra_events_fuel));
+	stringmap_insert(Globals, "timeouts", ml_function(0, ra_events_timeouts));
+	stringmap_insert(Globals, "allocated", ml_function(0, allocated));
+	stringmap_insert(Globals, "reload", ml_function(0, reload));
+	stringmap_insert(Globals, "profile_start", ml_function(0, ml_profile_start));
+	stringmap_insert(Globals, "profile_stop", ml_function(0, ml_profile_stop));
+	stringmap_insert(Globals, "profile_dump", ml_function(0, ml_profile_dump));
+	stringmap_insert(Globals, "profile_top", ml_function(0, ml_profile_top));
+	stringmap_insert(Globals, "range", ml_function(0, ml_range));
+	stringmap_insert(Globals, "ordered", ml_function(0, ml_ordered));
+	stringmap_insert(Globals, "regex", ml_function(0, ml_regex));
+	stringmap_insert(Globals, "instances", ml_function(0, ra_schema_instances));
+	stringmap_insert(Globals, "parallel_map", ml_function(0, ra_parallel_map));
+	stringmap_insert(Globals, "parallel_reduce", ml_function(0, ra_parallel_reduce));
+	stringmap_insert(Globals, "parallel_foreach", ml_function(0, ra_parallel_foreach));
 	//stringmap_insert(Globals, "sigar_init", ml_function(0, ra_sigar_init));
 	//stringmap_insert(Globals, "kill_process", ml_function(0, ra_kill_process));
-	if (Argc > 1) {
-		ml_value_t *Closure = ml_load(reagent_get_global, Globals, Argv[1]);
-		if (Closure->Type == MLErrorT) {
+	const char *FileName = 0;
+	for (int I = 1; I < Argc; ++I) {
+		if (!strcmp(Argv[I], "--virtual")) {
+			struct timespec Start[1];
+			clock_gettime(CLOCK_REALTIME, Start);
+			ra_clock_virtual(Start);
+		} else if (!strcmp(Argv[I], "--no-optimize")) {
+			ml_optimize_set(0);
+		} else if (!strcmp(Argv[I], "--no-cache")) {
+			ml_cache_set(0);
+		} else {
+			FileName = Argv[I];
+		}
+	}
+	if (FileName) {
+		ml_value_t *Closure = ml_load(reagent_get_global, Globals, FileName);
+		if (ml_typeof(Closure) == MLErrorT) {
 			printf("\e[31mError: %s\n\e[0m", ml_error_message(Closure));
 			const char *Source;
 			int Line;
 			for (int I = 0; ml_error_trace(Closure, I, &Source, &Line); ++I) printf("\e[31m\t%s:%d\n\e[0m", Source, Line);
 			exit(1);
 		}
+		ra_rules_begin();
 		ml_value_t *Result = ml_call(Closure, 0, 0);
-		if (Result->Type == MLErrorT) {
+		ra_rules_end(1);
+		if (ml_typeof(Result) == MLErrorT) {
 			printf("\e[31mError: %s\n\e[0m", ml_error_message(Result));
 			const char *Source;
 			int Line;
 			for (int I = 0; ml_error_trace(Result, I, &Source, &Line); ++I) printf("\e[31m\t%s:%d\n\e[0m", Source, Line);
 			exit(1);
 		}
+		ScriptName = FileName;
+		if (!pipe2(ReloadPipe, O_CLOEXEC) && ra_watch_custom(ReloadPipe[0], reagent_reload_read, 0)) {
+			fcntl(ReloadPipe[1], F_SETFL, O_NONBLOCK);
+			signal(SIGHUP, reagent_reload_signal);
+		}
 	}
 	pthread_t DispatchThread[1];
 	GC_pthread_create(DispatchThread, 0, ra_events_loop, 0);